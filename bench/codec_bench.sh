@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# Compare two-pass and adaptive Huffman coding of uploads over loopback. For
+# each payload size, loadgen uploads files encoded by each codec, and the
+# throughput, compression ratio and latency from sending to acknowledgement
+# after decoding are printed side by side.
+#
+# Usage: bench/codec_bench.sh [seconds] [kind] [size ...]
+#
+# Run from repository root after `make`.
+
+DURATION=${1:-5}
+KIND=${2:-text}
+shift 2 2>/dev/null
+SIZES=${*:-"256 1K 4K 64K 1M 8M"}
+
+ROOT=$(pwd)
+WORKDIR=$(mktemp -d)
+SERVER_PID=
+
+cleanup()
+{
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null && wait "$SERVER_PID" 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT INT TERM
+
+if [ ! -x "$ROOT/server" ] || [ ! -x "$ROOT/loadgen" ]; then
+    echo "Build server and loadgen first." >&2
+    exit 1
+fi
+
+mkdir "$WORKDIR/server"
+(cd "$WORKDIR/server" && exec "$ROOT/server" > "$WORKDIR/server.log" 2>&1) &
+SERVER_PID=$!
+sleep 1
+
+if ! kill -0 "$SERVER_PID" 2>/dev/null; then
+    echo "Server failed to start." >&2
+    SERVER_PID=
+    exit 1
+fi
+
+# Print files/s, MB/s original, ratio in % and p50 and p99 latency in ms of
+# loadgen run with codec $1 and files of $2 bytes
+measure()
+{
+    "$ROOT/loadgen" -h ::1 -e "$1" -d "$DURATION" -c 4 -s "$2" -k "$KIND" 2>/dev/null | awk '
+        /^Throughput:/ { files = $2; original = $4; sent = $7 }
+        /^Latency/ { p50 = $4; p99 = $6 }
+        END {
+            if (files == "") exit 1
+            sub(",", "", p50); sub(",", "", p99)
+            printf "%s %s %.2f %s %s\n", files, original, (original > 0) ? sent * 100 / original : 0, p50, p99
+        }'
+}
+
+echo "$KIND payloads, $DURATION seconds per run"
+printf "%-6s %-8s %10s %10s %8s %9s %9s\n" "size" "codec" "files/s" "MB/s" "ratio%" "p50 ms" "p99 ms"
+
+for S in $SIZES; do
+    for CODEC in huffman adaptive; do
+        RESULT=$(measure "$CODEC" "$S")
+        if [ -z "$RESULT" ]; then
+            echo "Run of $CODEC with size $S failed." >&2
+            continue
+        fi
+        set -- $RESULT
+        printf "%-6s %-8s %10s %10s %8s %9s %9s\n" "$S" "$CODEC" "$1" "$2" "$3" "$4" "$5"
+    done
+done
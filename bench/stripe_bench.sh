@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Measure striped upload throughput versus number of stripes over loopback,
+# with WAN latency emulated by netem. Needs root to change qdisc of `lo`.
+#
+# Usage: bench/stripe_bench.sh [delay_ms] [size_mb] [stripes ...]
+#
+# Run from repository root after `make`.
+
+DELAY=${1:-50}
+SIZE=${2:-64}
+shift 2 2>/dev/null
+STRIPES=${*:-"1 2 4 8 16"}
+
+ROOT=$(pwd)
+WORKDIR=$(mktemp -d)
+SERVER_PID=
+
+cleanup()
+{
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null
+    tc qdisc del dev lo root 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT INT TERM
+
+if [ ! -x "$ROOT/server" ] || [ ! -x "$ROOT/client" ]; then
+    echo "Build server and client first." >&2
+    exit 1
+fi
+
+# Base64 of random bytes, so the payload still compresses a bit
+head -c $((SIZE * 1048576 * 3 / 4)) /dev/urandom | base64 > "$WORKDIR/payload"
+BYTES=$(wc -c < "$WORKDIR/payload")
+
+if ! tc qdisc add dev lo root netem delay "${DELAY}ms"; then
+    echo "Failed to set up netem on lo." >&2
+    exit 1
+fi
+
+mkdir "$WORKDIR/server"
+(cd "$WORKDIR/server" && exec "$ROOT/server" > "$WORKDIR/server.log" 2>&1) &
+SERVER_PID=$!
+sleep 1
+
+echo "Payload: $BYTES bytes, RTT: $((DELAY * 2)) ms"
+echo "stripes  seconds  MB/s"
+
+for N in $STRIPES; do
+    SECONDS_USED=$(printf "login ::1 1732\nset stripes %s\nssend %s\nlogout\n" "$N" "$WORKDIR/payload" |
+        "$ROOT/client" | sed -n 's/.*bytes sent in [0-9]* stripes, \([0-9.]*\) seconds.*/\1/p')
+    if [ -z "$SECONDS_USED" ]; then
+        echo "Transfer with $N stripes failed." >&2
+        continue
+    fi
+    echo "$N $SECONDS_USED $BYTES" | awk '{ printf "%7d  %7.2f  %6.2f\n", $1, $2, $3 / $2 / 1048576 }'
+done
@@ -0,0 +1,100 @@
+#!/bin/sh
+#
+# Sweep socket tuning over loopback and recommend a profile. Each tuning is
+# set on both server (-t) and load generator (-t), which measures bulk
+# uploads in MB/s and small uploads in files/s. With a delay, WAN latency is
+# emulated by netem, which needs root to change qdisc of `lo`.
+#
+# Usage: bench/tune_bench.sh [delay_ms] [seconds] [tuning ...]
+#
+# Run from repository root after `make`.
+
+DELAY=${1:-0}
+DURATION=${2:-5}
+shift 2 2>/dev/null
+TUNINGS=${*:-"default lan wan nodelay=1 cork=1 rcvbuf=4M,sndbuf=4M lowat=128K chunk=256K recv=256K busy_poll=50"}
+
+ROOT=$(pwd)
+WORKDIR=$(mktemp -d)
+SERVER_PID=
+
+stop_server()
+{
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null && wait "$SERVER_PID" 2>/dev/null
+    SERVER_PID=
+}
+
+cleanup()
+{
+    stop_server
+    [ "$DELAY" -gt 0 ] && tc qdisc del dev lo root 2>/dev/null
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT INT TERM
+
+if [ ! -x "$ROOT/server" ] || [ ! -x "$ROOT/loadgen" ]; then
+    echo "Build server and loadgen first." >&2
+    exit 1
+fi
+
+if [ "$DELAY" -gt 0 ] && ! tc qdisc add dev lo root netem delay "${DELAY}ms"; then
+    echo "Failed to set up netem on lo." >&2
+    exit 1
+fi
+
+# Print files/s and MB/s of loadgen run with tuning $1, $2 connections and
+# files of $3 bytes
+measure()
+{
+    "$ROOT/loadgen" -h ::1 -t "$1" -d "$DURATION" -c "$2" -s "$3" -k random 2>/dev/null |
+        sed -n "s/^Throughput: \([0-9.]*\) files\/s, \([0-9.]*\) MB\/s original.*/\1 \2/p"
+}
+
+echo "RTT: $((DELAY * 2)) ms, $DURATION seconds per run"
+printf "%-28s %10s %10s\n" "tuning" "bulk MB/s" "small/s"
+
+BEST_BULK=
+BEST_BULK_VALUE=0
+BEST_SMALL=
+BEST_SMALL_VALUE=0
+
+for T in $TUNINGS; do
+    rm -rf "$WORKDIR/server"
+    mkdir "$WORKDIR/server"
+    (cd "$WORKDIR/server" && exec "$ROOT/server" -t "$T" > "$WORKDIR/server.log" 2>&1) &
+    SERVER_PID=$!
+    sleep 1
+
+    if ! kill -0 "$SERVER_PID" 2>/dev/null; then
+        echo "Server refused tuning $T." >&2
+        SERVER_PID=
+        continue
+    fi
+
+    # Bulk: few connections of large files. Small: many of small files.
+    BULK=$(measure "$T" 4 8M | cut -d ' ' -f 2)
+    SMALL=$(measure "$T" 16 4K | cut -d ' ' -f 1)
+    stop_server
+
+    if [ -z "$BULK" ] || [ -z "$SMALL" ]; then
+        echo "Run with tuning $T failed." >&2
+        continue
+    fi
+    printf "%-28s %10s %10s\n" "$T" "$BULK" "$SMALL"
+
+    if awk "BEGIN { exit !($BULK > $BEST_BULK_VALUE) }"; then
+        BEST_BULK=$T
+        BEST_BULK_VALUE=$BULK
+    fi
+    if awk "BEGIN { exit !($SMALL > $BEST_SMALL_VALUE) }"; then
+        BEST_SMALL=$T
+        BEST_SMALL_VALUE=$SMALL
+    fi
+done
+
+[ -z "$BEST_BULK" ] && exit 1
+
+echo
+echo "Recommended for bulk uploads: -t $BEST_BULK ($BEST_BULK_VALUE MB/s)"
+echo "Recommended for small uploads: -t $BEST_SMALL ($BEST_SMALL_VALUE files/s)"
+echo "Set the same tuning on clients with \`set tune <tuning>\`."
@@ -2,16 +2,33 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <iomanip>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include "commons.hpp"
 #include "my_huffman.hpp"
+#include "my_delta.hpp"
+#include "my_trace.hpp"
+#include "my_storage.hpp"
+#include "my_cache.hpp"
+#include "my_archive.hpp"
+#include "my_sockopt.hpp"
+#include "my_bwt.hpp"
+#include "my_sampled.hpp"
+#include "my_adaptive.hpp"
+#include "my_resume.hpp"
 
 extern "C" {
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -21,15 +38,96 @@ extern "C" {
 #include <libgen.h>
 
 #include "my_send_recv.h"
+#include "my_frame.h"
 }
 
+#define MAX_STRIPES 64
+/** Stripes smaller than this are not worth their own connection */
+#define MIN_STRIPE_SIZE 1048576
+/** Names the encoding in keys of cached files, change it when encoding changes */
+#define CODEC_ID "huffman-3"
+/** Default max total size of cached encoded files */
+#define CACHE_MB 512
+/** Most threads of a parallel decode */
+#define DECODE_THREADS 4
+/** Files smaller than this gain less from block sorting than its headers cost */
+#define MIN_BWT_SIZE 65536
+/** Payloads smaller than this are sent again whole rather than resumed */
+#define RESUME_MIN_SIZE 1048576
+/** Reconnects of a resumable upload, waiting 1, 2, 4... seconds before each */
+#define RESUME_RETRIES 3
+/**
+ * Largest upload: codec headers keep original size in 32 bits, and payloads
+ * are sent with int lengths, though frames could carry more
+ */
+#define MAX_ORIGINAL_SIZE 4294967295LL
+#define MAX_PAYLOAD_SIZE 2147483647LL
+
 int sockfd = 0;
+/** Protocol version of logged in server, 1 for text commands or FRAME_VERSION for frames */
+int protocol_version = 1;
+/** Max number of pipelined send commands waiting for acknowledgement */
+int pipeline_window = 8;
+/** Request ID of next pipelined send command */
+unsigned int next_request_id = 0;
+/** Number of connections used by striped send */
+int stripe_count = 4;
+/** Time limit of connecting to server, over all of its addresses */
+int connect_timeout_ms = CONNECT_TIMEOUT_MS;
+/** Encoded files of earlier uploads, NULL if disabled */
+my_cache::disk_cache *encoded_cache = NULL;
+/** Threads of each parallel decode or block-sorted encode, at most DECODE_THREADS */
+unsigned int decode_threads = 1;
+/** Largest context order of encoded uploads, 0 or 1 */
+unsigned int codec_order = 1;
+/** Encode uploads of MIN_BWT_SIZE bytes or more by block sorting */
+bool block_sorting = false;
+/** Encode uploads by adaptive Huffman coding, with no code table */
+bool adaptive_coding = false;
+/** Encode uploads in one pass, by code tables of a sample */
+bool fast_encoding = false;
+/** Rate of all uploads together, NULL if not capped */
+my_shaper::token_bucket *upload_limit = NULL;
+/** Options of sockets connected to server */
+my_sockopt::socket_tuning client_tuning = my_sockopt::default_tuning();
+/** Host and port of logged in server, for opening more connections */
+std::string server_host;
+std::string server_port;
+/** Logged in server keeps partial uploads, so broken ones can be resumed */
+bool server_resumes = false;
+
+/** Result of sending one stripe */
+struct stripe_result
+{
+    int status;
+    int sent;
+};
 
 /**
  * Descrption: Clean exit when SIGINT received.
  */
 static void sigint_safe_exit(int sig);
 
+/**
+ * Descrption: Switch to binary frames if server supports them, as told by
+ *             `welcome` message.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int negotiate_protocol(const std::string &welcome);
+
+/**
+ * Descrption: Send text command `line` (without newline) to server, wrapped
+ *             in a frame if binary frames are used.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int send_command(const std::string &line);
+
+/**
+ * Descrption: Receive a response frame, and copy its name (message) to `msg`.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int receive_frame(struct my_frame &frame, std::string &msg);
+
 /**
  * Descrption: Connect and login to server.
  * Return: 0 if succeed, or -1 if fail.
@@ -48,7 +146,177 @@ static int run_login(std::vector<std::string> &cmd);
  */
 static int run_send(std::vector<std::string> &cmd, std::string &orig_cmd);
 
-int main()
+/**
+ * Descrption: Set up cache of encoded files of `megabytes` in size, at
+ *             $HW2_CACHE_DIR, or hw2 in $XDG_CACHE_HOME or ~/.cache. 0
+ *             disables the cache.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int setup_cache(long long megabytes);
+
+/**
+ * Descrption: Cap uploads at `rate` bytes per second, over all connections
+ *             together, or lift the cap if `rate` is 0.
+ */
+static void set_upload_rate(long long rate);
+
+/**
+ * Descrption: Huffman-encode file at `pathname` into `payload`, or read it
+ *             from cache if file has not changed since. `original_size` is
+ *             set to size of file, and `cached` tells if cache was used.
+ *             Pathname "-" reads standard input, in one pass, not cached.
+ * Return: 0 if succeed, -1 if file cannot be read, or -2 if it is too large
+ *         to send, see MAX_ORIGINAL_SIZE and MAX_PAYLOAD_SIZE.
+ */
+static int encode_file(const std::string &pathname, std::string &payload, long long &original_size, bool &cached);
+
+/**
+ * Descrption: Print why file at `pathname` failed to encode, by `status` of
+ *             encode_file().
+ */
+static void print_encode_error(const std::string &pathname, int status);
+
+/**
+ * Descrption: Print what one-pass encoding has cost against two passes.
+ */
+static void print_report(const my_sampled::encode_report &report);
+
+/**
+ * Descrption: Name of encoding of `size` bytes with current settings, which
+ *             keys cached encoded files.
+ */
+static std::string codec_name(long long size);
+
+/**
+ * Descrption: Encode and send file at `pathname` to server.
+ * Return: 0 if succeed, 1 if file cannot be read, or -1 if connection failed.
+ */
+static int send_file(const std::string &pathname);
+
+/**
+ * Descrption: Send `payload` of file `filename` as a resumable upload. If
+ *             connection fails, login again and continue from what server
+ *             has kept, up to RESUME_RETRIES times.
+ * Return: Bytes sent, or -1 if connection failed.
+ */
+static long long send_resumable(const std::string &filename, const std::string &payload);
+
+/**
+ * Descrption: Ask server where resumable upload `id` of `payload` of file
+ *             `filename` stands, and send the rest of it.
+ * Return: 0 if succeed, or -1 if connection failed.
+ */
+static int resume_upload(const std::string &id, const std::string &filename, const std::string &payload);
+
+/**
+ * Descrption: Send file at `pathname`, or files of a directory or glob
+ *             pattern as one archive.
+ * Return: 0 if succeed, 1 if files cannot be read, or -1 if connection failed.
+ */
+static int send_path(const std::string &pathname);
+
+/**
+ * Descrption: Pack files of directory or glob `pattern` into an archive,
+ *             encode it with one code table and send it to server.
+ * Return: 0 if succeed, 1 if files cannot be read, or -1 if connection failed.
+ */
+static int send_archive(const std::string &pattern);
+
+/**
+ * Descrption: Check and parse user input and send only the difference of
+ *             file against the server copy of it. Send the whole file if
+ *             server does not have a copy.
+ * Return: 0 if succeed, 1 if command is invalid, or -1 if connection failed.
+ */
+static int run_dsend(std::vector<std::string> &cmd, std::string &orig_cmd);
+
+/**
+ * Descrption: Get and print metrics of server.
+ * Return: 0 if succeed, 1 if not logged in, or -1 if connection failed.
+ */
+static int run_stats();
+
+/**
+ * Descrption: Check and parse user input, download file from server and
+ *             decode it into current directory.
+ * Return: 0 if succeed, 1 if command is invalid or file cannot be
+ *         downloaded, or -1 if connection failed.
+ */
+static int run_get(std::vector<std::string> &cmd, std::string &orig_cmd);
+
+/**
+ * Descrption: Check and parse user input, download the part of encoded file
+ *             covering a byte range, and decode the range into
+ *             `<filename>.<start>-<end>` in current directory.
+ * Return: 0 if succeed, 1 if command is invalid or range cannot be
+ *         downloaded, or -1 if connection failed.
+ */
+static int run_rget(std::vector<std::string> &cmd, std::string &orig_cmd);
+
+/**
+ * Descrption: Receive `length` bytes from server into `filename`. All bytes
+ *             are read even if file cannot be written, to keep in sync.
+ * Return: 0 if succeed, 1 if file cannot be written, or -1 if connection
+ *         failed.
+ */
+static int receive_to_file(const std::string &filename, long long length);
+
+/**
+ * Descrption: Check and parse user input and save trace spans of client, or
+ *             of server with `trace server <file>`, as Chrome trace JSON.
+ * Return: 0 if succeed, 1 if command is invalid, or -1 if connection failed.
+ */
+static int run_trace(std::vector<std::string> &cmd);
+
+/**
+ * Descrption: Receive a `<tag> <length>` response followed by `length` bytes
+ *             of body into `body`.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int receive_sized(const std::string &tag, std::string &body);
+
+/**
+ * Descrption: Check and parse user input and change client settings.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int run_set(std::vector<std::string> &cmd);
+
+/**
+ * Descrption: Send files to server with pipelined send commands, keeping at
+ *             most `pipeline_window` commands waiting for acknowledgement.
+ * Return: 0 if succeed, 1 if command is invalid, or -1 if connection failed.
+ */
+static int run_psend(std::vector<std::string> &cmd);
+
+/**
+ * Descrption: Wait for acknowledgement of one of `pending` requests and
+ *             remove it from `pending`.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int receive_ack(std::map<unsigned int, std::string> &pending);
+
+/**
+ * Descrption: Check and parse user input and send file to server, split into
+ *             `stripe_count` stripes sent over their own connections.
+ * Return: 0 if succeed, or 1 if fail.
+ */
+static int run_ssend(std::vector<std::string> &cmd, std::string &orig_cmd);
+
+/**
+ * Descrption: Encode `length` bytes of `pathname` starting at `offset`, and
+ *             send it as stripe `index` of transfer `xfer_id` over a new
+ *             connection. Runs in its own thread.
+ */
+static void send_stripe(const std::string &pathname, const std::string &xfer_id, int count, int index,
+    long long offset, long long length, long long total, stripe_result *result);
+
+/**
+ * Descrption: Get filename part of `pathname`.
+ * Return: Filename.
+ */
+static std::string get_basename(const std::string &pathname);
+
+int main(int argc, char *argv[])
 {
     // Handle SIGINT
     struct sigaction sa;
@@ -58,13 +326,75 @@ int main()
 
     sigaction(SIGINT, &sa, NULL);
 
+    // Link broken while sending must fail the send, so it can be resumed
+    signal(SIGPIPE, SIG_IGN);
+
     using namespace std;
 
-    // Prompt for user command
+    setup_cache(CACHE_MB);
+
+    decode_threads = thread::hardware_concurrency();
+    if (decode_threads < 1 || decode_threads > DECODE_THREADS) {
+        decode_threads = (decode_threads < 1) ? 1 : DECODE_THREADS;
+    }
+
+    // Codec of uploads without prompting, as `set codec` picks it
+    if (getenv("HW2_CODEC") != NULL) {
+        string codec = getenv("HW2_CODEC");
+        block_sorting = (codec == "bwt");
+        adaptive_coding = (codec == "adaptive");
+    }
+
+    // Options come before host, as file `-` after it is standard input
+    const char *prog = argv[0];
+    if (argc >= 3 && strcmp(argv[1], "--rate") == 0) {
+        long long rate = my_shaper::parse_rate(argv[2]);
+        if (rate < 0) {
+            cerr << "Invalid rate " << argv[2] << "." << endl;
+            exit(1);
+        }
+        set_upload_rate(rate);
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (argc == 2 || (argc >= 2 && argv[1][0] == '-')) {
+        cerr << "Usage: " << prog << " [--rate <bytes_per_second>] [<host> <port> [<file> ...]], file - is standard input" << endl;
+        exit(1);
+    }
+
+    // Login from command line, and upload files without prompting if given
+    if (argc >= 3) {
+        if (login(argv[1], argv[2]) < 0) {
+            cerr << "Failed to login." << endl;
+            exit(1);
+        }
+
+        if (argc > 3) {
+            int failed = 0;
+            for (int i = 3; i < argc; ++i) {
+                int status = send_path(argv[i]);
+                if (status < 0) {
+                    failed += argc - i;
+                    break;
+                }
+                failed += (status != 0) ? 1 : 0;
+            }
+
+            if (sockfd > 2) {
+                close(sockfd);
+            }
+            return (failed > 0) ? 1 : 0;
+        }
+    }
+
+    // Prompt for user command, or read commands piped to stdin until EOF
     while (true) {
         cout << "> " << flush;
         string orig_cmd;
-        getline(cin, orig_cmd);
+        if (!getline(cin, orig_cmd)) {
+            break;
+        }
         vector<string> cmd = parse_command(orig_cmd);
         if (cmd.size() == 0) {
             continue;
@@ -79,6 +409,42 @@ int main()
                 break;
             }
         }
+        else if (cmd[0] == "psend") {
+            if (run_psend(cmd) < 0) {
+                break;
+            }
+        }
+        else if (cmd[0] == "dsend") {
+            if (run_dsend(cmd, orig_cmd) < 0) {
+                break;
+            }
+        }
+        else if (cmd[0] == "ssend") {
+            run_ssend(cmd, orig_cmd);
+        }
+        else if (cmd[0] == "stats") {
+            if (run_stats() < 0) {
+                break;
+            }
+        }
+        else if (cmd[0] == "get") {
+            if (run_get(cmd, orig_cmd) < 0) {
+                break;
+            }
+        }
+        else if (cmd[0] == "rget") {
+            if (run_rget(cmd, orig_cmd) < 0) {
+                break;
+            }
+        }
+        else if (cmd[0] == "trace") {
+            if (run_trace(cmd) < 0) {
+                break;
+            }
+        }
+        else if (cmd[0] == "set") {
+            run_set(cmd);
+        }
         else if (cmd[0] == "logout" || cmd[0] == "exit") {
             break;
         }
@@ -108,73 +474,107 @@ static void sigint_safe_exit(int sig)
 
 static int login(const char *addr, const char *port)
 {
-    // Resolve hostname and connect
-    struct addrinfo hints = {};
-    struct addrinfo *res;
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    int status = getaddrinfo(addr, port, &hints, &res);
-    if (status != 0) {
-        std::cerr << gai_strerror(status) << std::endl;
+    std::string welcome;
+    std::string peer;
+    int fd = connect_server(addr, port, welcome, connect_timeout_ms, &peer, &client_tuning);
+    if (fd < 0) {
         return -1;
     }
 
-    struct addrinfo *p;
-    for (p = res; p != NULL; p = p->ai_next) {
-        sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (sockfd > 0) {
-            if (connect(sockfd, p->ai_addr, p->ai_addrlen) == 0) {
-                break;
-            }
-
-            perror("connect");
-            close(sockfd);
-            sockfd = 0;
-            continue;
-        }
+    sockfd = fd;
+    server_host = addr;
+    server_port = port;
+    server_resumes = (welcome.find("[resume]") != std::string::npos);
+    std::cout << "Connected to " << peer << "." << std::endl;
+    std::cout << welcome << std::endl;
 
-        perror("socket");
+    if (negotiate_protocol(welcome) < 0) {
+        close(sockfd);
+        sockfd = 0;
+        return -1;
     }
 
-    freeaddrinfo(res);
+    return 0;
+}
+
+static int negotiate_protocol(const std::string &welcome)
+{
+    using namespace std;
+
+    protocol_version = 1;
+
+    // Old servers do not advertise, and keep talking text commands
+    if (welcome.find("[proto " + to_string(FRAME_VERSION) + "]") == string::npos) {
+        return 0;
+    }
 
-    if (p == NULL) {
+    string proto_cmd = "proto " + to_string(FRAME_VERSION) + "\n";
+    int sendlen = static_cast<int>(proto_cmd.size());
+    if (my_send(sockfd, proto_cmd.c_str(), &sendlen) < 0) {
+        perror("my_send");
         return -1;
     }
 
-    // Read welcome message
-    char welcome_msg[64] = {};
-    int msglen = (int) sizeof (welcome_msg);
-    status = my_recv_cmd(sockfd, welcome_msg, &msglen);
-    if (status < 0) {
-        perror("my_recv_cmd");
+    char msg[MAX_CMD];
+    int msglen = MAX_CMD - 1;
+    if (my_recv_cmd(sockfd, msg, &msglen) != 0) {
+        cout << "Invalid response." << endl;
         return -1;
     }
-    else if (status > 0) {
-        std::cout << "Invalid command received." << std::endl;
+    msg[msglen - 1] = '\0';
+
+    vector<string> res = parse_command(msg);
+    if (res.size() < 3 || res[0] != "OK" || res[2] != to_string(FRAME_VERSION)) {
+        cout << "Invalid response." << endl;
         return -1;
     }
 
-    welcome_msg[msglen - 1] = '\0';
-    std::cout << welcome_msg << std::endl;
+    protocol_version = FRAME_VERSION;
+    return 0;
+}
+
+static int send_command(const std::string &line)
+{
+    if (protocol_version == FRAME_VERSION) {
+        return my_send_frame(sockfd, FRAME_TEXT, 0, 0, line.c_str(), line.size());
+    }
+
+    std::string text = line + "\n";
+    int sendlen = static_cast<int>(text.size());
+    return my_send(sockfd, text.c_str(), &sendlen);
+}
+
+static int receive_frame(struct my_frame &frame, std::string &msg)
+{
+    int status = my_recv_frame(sockfd, &frame);
+    if (status != 0) {
+        return -1;
+    }
 
+    msg.assign(frame.name, frame.name_len);
+    my_frame_done(&frame);
     return 0;
 }
 
 
 static int run_login(std::vector<std::string> &cmd)
 {
-    if (cmd.size() < 3) {
+    // Unix socket of a server on the same host needs no port
+    bool local = (cmd.size() >= 2 && cmd[1].compare(0, strlen(LOCAL_PREFIX), LOCAL_PREFIX) == 0);
+    if (cmd.size() < 3 && !local) {
         std::cout << "Invalid command.";
         return -1;
     }
+    if (cmd.size() < 3) {
+        cmd.push_back("");
+    }
 
     if (sockfd > 2) {
         std::cout << "The connection has been established already." << std::endl;
         return -1;
     }
 
-    std::cout << "Connecting to " << cmd[1] << ":" << cmd[2] << std::endl;
+    std::cout << "Connecting to " << cmd[1] << (local ? "" : ":" + cmd[2]) << std::endl;
     if (login(cmd[1].c_str(), cmd[2].c_str()) < 0) {
         std::cout << "Fail to login." << std::endl;
         return -1;
@@ -198,94 +598,1516 @@ static int run_send(std::vector<std::string> &cmd, std::string &orig_cmd)
     }
 
     // Get file path
-    string::size_type n = orig_cmd.find(cmd[1]);
-    if (n == string::npos) {
-        cout << "Command error." << endl;
+    string pathname = command_tail(orig_cmd, 1);
+
+    // Standard input holds commands here
+    if (pathname == "-") {
+        cout << "Standard input can only be sent as a file given on command line." << endl;
         return 1;
     }
 
-    string pathname(orig_cmd.begin() + n, orig_cmd.end());
+    return send_path(pathname);
+}
 
-    ifstream file(pathname, fstream::in | fstream::binary);
-    if (!file.is_open()) {
-        cout << "Failed to open file." << endl;
-        return 1;
+static int setup_cache(long long megabytes)
+{
+    using namespace std;
+
+    delete encoded_cache;
+    encoded_cache = NULL;
+    if (megabytes <= 0) {
+        return 0;
     }
 
-    // Get filename
-    // Both dirname() and basename() may modify the contents of path, so it
-    // may be desirable to pass a copy when calling one of these functions.
-    char *pathname_c_str = new char[pathname.size() + 1];
-    memcpy(pathname_c_str, pathname.c_str(), pathname.size() + 1);
+    string dir;
+    if (getenv("HW2_CACHE_DIR") != NULL) {
+        dir = getenv("HW2_CACHE_DIR");
+    }
+    else if (getenv("XDG_CACHE_HOME") != NULL) {
+        dir = string(getenv("XDG_CACHE_HOME")) + "/hw2";
+    }
+    else if (getenv("HOME") != NULL) {
+        dir = string(getenv("HOME")) + "/.cache/hw2";
+    }
+    else {
+        return -1;
+    }
+
+    encoded_cache = new my_cache::disk_cache(dir, static_cast<uint64_t>(megabytes) << 20);
+    if (encoded_cache->init() < 0) {
+        delete encoded_cache;
+        encoded_cache = NULL;
+        return -1;
+    }
 
-    string filename = basename(pathname_c_str);
+    return 0;
+}
 
-    delete pathname_c_str;
+static void set_upload_rate(long long rate)
+{
+    delete upload_limit;
+    upload_limit = (rate > 0) ? new my_shaper::token_bucket(static_cast<uint64_t>(rate)) : NULL;
+}
 
-    // Encode with Huffman Coding
-    my_huffman::huffman_encode encoded_file(file);
+static int encode_file(const std::string &pathname, std::string &payload, long long &original_size, bool &cached)
+{
+    using namespace std;
 
-    uint8_t *buf;
-    int buflen;
+    cached = false;
 
-    file.seekg(0);
-    encoded_file.write(file, &buf, &buflen);
+    // Standard input is read once, so it is sampled, or kept to learn its
+    // length for the adaptive header
+    if (pathname == "-" && adaptive_coding) {
+        vector<uint8_t> input;
+        my_io::fd_source source(STDIN_FILENO);
+        uint8_t block[my_huffman::BLOCK_SIZE];
+        size_t n;
+        while ((n = source.read(block, sizeof (block))) > 0) {
+            input.insert(input.end(), block, block + n);
+        }
 
-    // Send command to server
-    string send_cmd = "send " + to_string(buflen) + " " + filename + "\n";
-    int sendlen = static_cast<int>(send_cmd.size());
-    int status = my_send(sockfd, send_cmd.c_str(), &sendlen);
-    if (status < 0) {
-        perror("my_send");
-        cout << "Send failed. Terminate conneciton." << endl;
-        return -1;
+        vector<uint8_t> encoded;
+        my_io::buffer_sink sink(encoded);
+        my_io::span_source input_source(input.data(), input.size());
+        if (source.failed()) {
+            return -1;
+        }
+        if (input.size() > MAX_ORIGINAL_SIZE) {
+            return -2;
+        }
+        if (my_adaptive::encode(input_source, input.size(), sink) < 0) {
+            return -1;
+        }
+        if (encoded.size() > MAX_PAYLOAD_SIZE) {
+            return -2;
+        }
+        original_size = static_cast<long long>(input.size());
+        payload.assign(encoded.begin(), encoded.end());
+        return 0;
+    }
+    if (pathname == "-") {
+        my_io::fd_source source(STDIN_FILENO);
+        vector<uint8_t> encoded;
+        my_sampled::encode_report report;
+        if (my_sampled::encode(source, codec_order, encoded, report) < 0 || source.failed()) {
+            return -1;
+        }
+        if (encoded.size() > MAX_PAYLOAD_SIZE) {
+            return -2;
+        }
+        print_report(report);
+        original_size = static_cast<long long>(report.original_size);
+        payload.assign(encoded.begin(), encoded.end());
+        return 0;
     }
 
-    // Send file to server
-    status = my_send(sockfd, buf, &buflen);
-    if (status < 0) {
-        perror("my_send");
-        cout << "Send failed. Terminate conneciton." << endl;
+    struct stat st;
+    if (stat(pathname.c_str(), &st) < 0) {
         return -1;
     }
+    original_size = static_cast<long long>(st.st_size);
+    if (original_size > MAX_ORIGINAL_SIZE) {
+        return -2;
+    }
 
-    file.clear();
-    file.seekg(0, file.end);
-
-    cout << "Original file size: " << file.tellg() << "bytes, compressed size: " << buflen << " bytes." << endl;
-    cout.precision(2);
-    cout.setf(ios::fixed);
-    cout << "Compression ratio: " << static_cast<double>(buflen)*100.0 / static_cast<double>(file.tellg()) << "%." << endl;
+    string key;
+    if (encoded_cache != NULL) {
+        key = my_cache::disk_cache::make_key(pathname, st, codec_name(original_size));
+        if (!key.empty() && encoded_cache->lookup(key, payload) == 0) {
+            cached = true;
+            return 0;
+        }
+    }
 
-    // Get response
-    char msg[MAX_CMD];
-    int msglen = MAX_CMD - 1;
-    status = my_recv_cmd(sockfd, msg, &msglen);
-    if (status > 0) {
-        cout << "Invalid response. Terminate conneciton." << endl;
+    int fd = open(pathname.c_str(), O_RDONLY);
+    if (fd < 0) {
         return -1;
     }
-    else if (status < 0) {
-        perror("my_recv_cmd");
-        cout << "Invalid response. Terminate conneciton." << endl;
-        return -1;
+
+    // Both passes read the file by blocks straight from its descriptor.
+    // Indexed, so server can decode it in parallel.
+    my_io::fd_source source(fd);
+    vector<uint8_t> encoded;
+    encoded.reserve(static_cast<size_t>(original_size / 2 + 1024));
+    my_io::buffer_sink sink(encoded);
+
+    int status = -1;
+    if (block_sorting && original_size >= MIN_BWT_SIZE) {
+        // Blocks are read once and sorted on several threads
+        status = my_bwt::encode(source, static_cast<uint64_t>(original_size), sink, decode_threads);
     }
+    else if (adaptive_coding) {
+        // Read once, each block coded as it comes
+        status = my_adaptive::encode(source, static_cast<uint64_t>(original_size), sink);
+    }
+    else if (fast_encoding) {
+        my_sampled::encode_report report;
+        status = my_sampled::encode(source, codec_order, encoded, report);
+        if (status == 0) {
+            print_report(report);
+        }
+    }
+    else {
+        my_huffman::huffman_encode encoded_file;
+        encoded_file.set_checkpoint_interval(my_huffman::CHECKPOINT_INTERVAL);
+        encoded_file.set_order(codec_order);
+        encoded_file.count(source);
 
-    vector<string> res = parse_command(msg);
-    if (res.size() < 2 || res[0] != "OK") {
-        cout << "Invalid response. Terminate conneciton." << endl;
+        if (!source.failed() && lseek(fd, 0, SEEK_SET) == 0) {
+            status = encoded_file.encode(source, sink);
+        }
+    }
+    close(fd);
+    if (status < 0 || source.failed()) {
         return -1;
     }
-    
-    int sent;
-    try {
-        sent = stoi(res[1]);
+    if (encoded.size() > MAX_PAYLOAD_SIZE) {
+        return -2;
     }
-    catch (exception &e) {
-        cout << "Invalid response. Terminate conneciton." << endl;
-        return -1;
+    payload.assign(encoded.begin(), encoded.end());
+
+    // File changed while being read must not be cached under its old key
+    struct stat st_after;
+    if (!key.empty() && stat(pathname.c_str(), &st_after) == 0 &&
+        my_cache::disk_cache::make_key(pathname, st_after, codec_name(original_size)) == key) {
+        encoded_cache->store(key, &encoded.front(), encoded.size());
     }
 
-    cout << "OK " << sent << " bytes sent." << endl;
     return 0;
 }
+
+static void print_encode_error(const std::string &pathname, int status)
+{
+    using namespace std;
+
+    if (status == -2) {
+        cout << "File " << pathname << " is too large to send: at most " << MAX_ORIGINAL_SIZE <<
+        " bytes, encoded into at most " << MAX_PAYLOAD_SIZE << " bytes." << endl;
+        return;
+    }
+    cout << "Failed to open file " << pathname << "." << endl;
+}
+
+static void print_report(const my_sampled::encode_report &report)
+{
+    using namespace std;
+
+    // Sizes of an empty input are only headers
+    double lost = (report.two_pass_size > 0) ?
+        (static_cast<double>(report.payload_size) / static_cast<double>(report.two_pass_size) - 1.0) * 100.0 : 0.0;
+    ostringstream line;
+    line.precision(2);
+    line.setf(ios::fixed);
+    line << "Encoded in one pass: " << report.segments << " segment" << (report.segments == 1 ? "" : "s") <<
+    ", " << lost << "% larger than two passes (" << report.two_pass_size << " bytes).";
+    cout << line.str() << endl;
+}
+
+static std::string codec_name(long long size)
+{
+    if (block_sorting && size >= MIN_BWT_SIZE) {
+        return CODEC_ID "-bwt";
+    }
+    if (adaptive_coding) {
+        return CODEC_ID "-adaptive";
+    }
+    if (fast_encoding) {
+        return CODEC_ID "-fast-o" + std::to_string(codec_order);
+    }
+    return CODEC_ID "-o" + std::to_string(codec_order);
+}
+
+static int send_file(const std::string &pathname)
+{
+    using namespace std;
+
+    // Encode with Huffman Coding
+    string payload;
+    long long original_size;
+    bool cached;
+    int encoded = encode_file(pathname, payload, original_size, cached);
+    if (encoded < 0) {
+        print_encode_error(pathname, encoded);
+        return 1;
+    }
+
+    // Get filename, standard input is uploaded as "stdin"
+    string filename = (pathname == "-") ? "stdin" : get_basename(pathname);
+
+    // Large uploads over a network are continued if the link breaks
+    if (server_resumes && payload.size() >= RESUME_MIN_SIZE && !is_local_socket(sockfd)) {
+        long long sent = send_resumable(filename, payload);
+        if (sent < 0) {
+            cout << "Send failed. Terminate conneciton." << endl;
+            return -1;
+        }
+
+        cout << "Original file size: " << original_size << "bytes, compressed size: " << sent << " bytes" <<
+        (cached ? " (cached)." : ".") << endl;
+        cout.precision(2);
+        cout.setf(ios::fixed);
+        cout << "Compression ratio: " << static_cast<double>(sent)*100.0 / static_cast<double>(original_size) << "%." << endl;
+        cout << "OK " << sent << " bytes sent." << endl;
+        return 0;
+    }
+
+    const char *buf = payload.data();
+    int buflen = static_cast<int>(payload.size());
+
+    // Send command to server
+    int status;
+    {
+        my_sockopt::cork_guard cork(sockfd, client_tuning);
+
+        if (protocol_version == FRAME_VERSION) {
+            status = my_send_frame(sockfd, FRAME_SEND, 0, static_cast<uint64_t>(buflen), filename.c_str(), filename.size());
+        }
+        else {
+            string send_cmd = "send " + to_string(buflen) + " " + filename + "\n";
+            int sendlen = static_cast<int>(send_cmd.size());
+            status = my_send(sockfd, send_cmd.c_str(), &sendlen);
+        }
+
+        // Send file to server
+        if (status == 0) {
+            TRACE_SPAN("send");
+            status = send_payload(sockfd, buf, &buflen, upload_limit);
+        }
+    }
+    if (status < 0) {
+        perror("my_send");
+        cout << "Send failed. Terminate conneciton." << endl;
+        return -1;
+    }
+
+    cout << "Original file size: " << original_size << "bytes, compressed size: " << buflen << " bytes" <<
+    (cached ? " (cached)." : ".") << endl;
+    cout.precision(2);
+    cout.setf(ios::fixed);
+    cout << "Compression ratio: " << static_cast<double>(buflen)*100.0 / static_cast<double>(original_size) << "%." << endl;
+
+    // Get response
+    if (protocol_version == FRAME_VERSION) {
+        struct my_frame frame;
+        string res_msg;
+        if (receive_frame(frame, res_msg) < 0 || frame.type != FRAME_OK) {
+            cout << "Invalid response. Terminate conneciton." << endl;
+            return -1;
+        }
+
+        cout << "OK " << frame.length << " bytes sent." << endl;
+        return 0;
+    }
+
+    char msg[MAX_CMD];
+    int msglen = MAX_CMD - 1;
+    status = my_recv_cmd(sockfd, msg, &msglen);
+    if (status > 0) {
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+    else if (status < 0) {
+        perror("my_recv_cmd");
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+
+    vector<string> res = parse_command(msg);
+    if (res.size() < 2 || res[0] != "OK") {
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+    
+    long long sent;
+    try {
+        sent = stoll(res[1]);
+    }
+    catch (exception &e) {
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+
+    cout << "OK " << sent << " bytes sent." << endl;
+    return 0;
+}
+
+static long long send_resumable(const std::string &filename, const std::string &payload)
+{
+    using namespace std;
+
+    string id = my_resume::make_id(payload);
+
+    // Copied, as login sets them
+    string host = server_host;
+    string port = server_port;
+
+    for (int attempt = 0; ; ++attempt) {
+        if (sockfd > 2 && resume_upload(id, filename, payload) == 0) {
+            return static_cast<long long>(payload.size());
+        }
+        if (attempt == RESUME_RETRIES) {
+            return -1;
+        }
+
+        if (sockfd > 2) {
+            close(sockfd);
+            sockfd = 0;
+        }
+        cout << "Connection failed, reconnecting in " << (1 << attempt) << " s ..." << endl;
+        sleep(1 << attempt);
+        login(host.c_str(), port.c_str());
+    }
+}
+
+static int resume_upload(const std::string &id, const std::string &filename, const std::string &payload)
+{
+    using namespace std;
+
+    string total = to_string(payload.size());
+    if (send_command("resume " + id + " " + total + " " + filename) < 0) {
+        perror("my_send");
+        return -1;
+    }
+
+    char msg[MAX_CMD];
+    int msglen = MAX_CMD - 1;
+    if (my_recv_cmd(sockfd, msg, &msglen) != 0) {
+        cout << "Invalid response." << endl;
+        return -1;
+    }
+    msg[msglen - 1] = '\0';
+
+    vector<string> res = parse_command(msg);
+    long long offset = -1;
+    if (res.size() >= 2 && res[0] == "OFFSET") {
+        offset = atoll(res[1].c_str());
+    }
+    if (offset < 0 || offset > static_cast<long long>(payload.size())) {
+        cout << msg << endl;
+        return -1;
+    }
+    if (offset > 0) {
+        cout << "Resuming " << filename << " from " << offset << " of " << total << " bytes." << endl;
+    }
+
+    // Send the rest, server has the bytes before offset on disk
+    int status;
+    int buflen = static_cast<int>(payload.size() - static_cast<size_t>(offset));
+    {
+        my_sockopt::cork_guard cork(sockfd, client_tuning);
+
+        status = send_command("usend " + id + " " + to_string(offset) + " " + total + " " + filename);
+        if (status == 0) {
+            TRACE_SPAN("send");
+            status = send_payload(sockfd, payload.data() + offset, &buflen, upload_limit);
+        }
+    }
+    if (status < 0) {
+        perror("my_send");
+        return -1;
+    }
+
+    msglen = MAX_CMD - 1;
+    if (my_recv_cmd(sockfd, msg, &msglen) != 0) {
+        cout << "Invalid response." << endl;
+        return -1;
+    }
+    msg[msglen - 1] = '\0';
+
+    res = parse_command(msg);
+    if (res.size() < 2 || res[0] != "OK") {
+        cout << "Invalid response." << endl;
+        return -1;
+    }
+    return 0;
+}
+
+static int send_path(const std::string &pathname)
+{
+    struct stat st;
+    if (stat(pathname.c_str(), &st) == 0) {
+        return S_ISDIR(st.st_mode) ? send_archive(pathname) : send_file(pathname);
+    }
+
+    if (pathname.find_first_of("*?[") != std::string::npos) {
+        return send_archive(pathname);
+    }
+    return send_file(pathname);
+}
+
+static int send_archive(const std::string &pattern)
+{
+    using namespace std;
+
+    vector<my_archive::archive_entry> entries;
+    if (my_archive::collect(pattern, entries) < 0) {
+        cout << "No files to send." << endl;
+        return 1;
+    }
+
+    // Encoded as a whole, so small files share one code table
+    my_archive::archive_reader reader(entries);
+    if (reader.size() > MAX_ORIGINAL_SIZE) {
+        cout << "Too many bytes to send in one archive." << endl;
+        return 1;
+    }
+    istream input(&reader);
+
+    my_io::stream_source source(input);
+    my_huffman::huffman_encode encoded_archive;
+    vector<uint8_t> encoded;
+
+    uint8_t *buf = NULL;
+    int buflen = 0;
+
+    bool failed;
+    if (block_sorting && reader.size() >= MIN_BWT_SIZE) {
+        my_io::buffer_sink sink(encoded);
+        failed = my_bwt::encode(source, reader.size(), sink, decode_threads) < 0 || reader.failed();
+        if (!failed) {
+            buf = &encoded.front();
+            buflen = static_cast<int>(encoded.size());
+        }
+    }
+    else if (adaptive_coding) {
+        my_io::buffer_sink sink(encoded);
+        failed = my_adaptive::encode(source, reader.size(), sink) < 0 || reader.failed();
+        if (!failed) {
+            buf = &encoded.front();
+            buflen = static_cast<int>(encoded.size());
+        }
+    }
+    else {
+        encoded_archive.set_checkpoint_interval(my_huffman::CHECKPOINT_INTERVAL);
+        encoded_archive.set_order(codec_order);
+        encoded_archive.count(source);
+
+        failed = reader.failed();
+        input.clear();
+        input.seekg(0);
+        failed = failed || encoded_archive.write(input, &buf, &buflen) < 0 || reader.failed();
+    }
+    if (failed) {
+        cout << "Failed to read files." << endl;
+        return 1;
+    }
+    if (encoded.size() > MAX_PAYLOAD_SIZE) {
+        cout << "Too many bytes to send in one archive." << endl;
+        return 1;
+    }
+
+    // Archive name only names its code table on server
+    string name = get_basename(pattern);
+    if (!my_archive::is_safe_path(name) || name.find_first_of("*?[") != string::npos) {
+        name = "archive";
+    }
+
+    int status;
+    {
+        my_sockopt::cork_guard cork(sockfd, client_tuning);
+
+        status = send_command("archive " + to_string(buflen) + " " + name);
+        if (status == 0) {
+            TRACE_SPAN("send");
+            status = send_payload(sockfd, buf, &buflen, upload_limit);
+        }
+    }
+    if (status < 0) {
+        perror("my_send");
+        cout << "Send failed. Terminate conneciton." << endl;
+        return -1;
+    }
+
+    // Bytes of files, as server tells them, not counting the index
+    uint64_t original_size = 0;
+    for (auto &entry : entries) {
+        original_size += entry.size;
+    }
+
+    cout << "Packed " << entries.size() << " files, original size: " << original_size << " bytes, compressed size: " <<
+    buflen << " bytes." << endl;
+    cout.precision(2);
+    cout.setf(ios::fixed);
+    cout << "Compression ratio: " << static_cast<double>(buflen) * 100.0 /
+    static_cast<double>(original_size ? original_size : 1) << "%." << endl;
+
+    // Get response
+    char msg[MAX_CMD];
+    int msglen = MAX_CMD - 1;
+    status = my_recv_cmd(sockfd, msg, &msglen);
+    if (status != 0) {
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+    msg[msglen - 1] = '\0';
+
+    vector<string> res = parse_command(msg);
+    if (res.size() >= 2 && res[0] == "OK") {
+        cout << "OK " << res[1] << " bytes sent." << endl;
+        return 0;
+    }
+    if (res.size() >= 1 && res[0] == "ERR") {
+        cout << "Server failed to unpack archive." << endl;
+        return 1;
+    }
+
+    cout << "Invalid response. Terminate conneciton." << endl;
+    return -1;
+}
+
+static int run_dsend(std::vector<std::string> &cmd, std::string &orig_cmd)
+{
+    using namespace std;
+
+    if (sockfd <= 2) {
+        cout << "You are not logged in yet." << endl;
+        return 1;
+    }
+
+    if (cmd.size() < 2) {
+        cout << "Please provide file name." << endl;
+        return 1;
+    }
+
+    // Get file path
+    string pathname = command_tail(orig_cmd, 1);
+
+    ifstream file(pathname, fstream::in | fstream::binary);
+    if (!file.is_open()) {
+        cout << "Failed to open file." << endl;
+        return 1;
+    }
+
+    // Checked before the whole file is read into memory
+    file.seekg(0, file.end);
+    if (static_cast<long long>(file.tellg()) > MAX_ORIGINAL_SIZE) {
+        print_encode_error(pathname, -2);
+        return 1;
+    }
+    file.seekg(0);
+
+    string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    file.close();
+
+    string filename = get_basename(pathname);
+
+    // Ask for signatures of server copy
+    int status = send_command("sig " + filename);
+    if (status < 0) {
+        perror("my_send");
+        cout << "Send failed. Terminate conneciton." << endl;
+        return -1;
+    }
+
+    // SIG <block size> <count>
+    char msg[MAX_CMD];
+    int msglen = MAX_CMD - 1;
+    status = my_recv_cmd(sockfd, msg, &msglen);
+    if (status != 0) {
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+    msg[msglen - 1] = '\0';
+
+    vector<string> res = parse_command(msg);
+    uint32_t block_size;
+    size_t count;
+    try {
+        if (res.size() < 3 || res[0] != "SIG") {
+            throw invalid_argument(msg);
+        }
+        block_size = static_cast<uint32_t>(stoul(res[1]));
+        count = static_cast<size_t>(stoul(res[2]));
+    }
+    catch (exception &e) {
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+
+    vector<uint8_t> sig_buf(count * my_delta::SIGNATURE_SIZE);
+    if (count > 0) {
+        int sig_len = static_cast<int>(sig_buf.size());
+        status = my_recv_data(sockfd, &sig_buf.front(), &sig_len);
+        if (status < 0 || sig_len != static_cast<int>(sig_buf.size())) {
+            cout << "Invalid response. Terminate conneciton." << endl;
+            return -1;
+        }
+    }
+
+    if (count == 0) {
+        cout << "Server has no copy of " << filename << ". Sending whole file." << endl;
+        return send_file(pathname);
+    }
+
+    vector<my_delta::block_signature> sigs;
+    my_delta::unpack_signatures(&sig_buf.front(), count, sigs);
+
+    // Find blocks server already has
+    vector<my_delta::delta_op> ops;
+    string literals;
+    my_delta::make_delta(reinterpret_cast<const uint8_t *>(data.data()), data.size(), block_size, sigs, ops, literals);
+
+    my_delta::delta_header header;
+    header.block_size = block_size;
+    header.file_size = data.size();
+    my_delta::strong_hasher hasher;
+    hasher.update(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+    header.file_hash = hasher.digest();
+
+    string payload;
+    my_delta::pack_delta(header, ops, payload);
+
+    // Literals are Huffman coded after delta operations
+    if (!literals.empty()) {
+        istringstream input(literals);
+        my_huffman::huffman_encode encoded_literals(input);
+
+        uint8_t *buf;
+        int buflen;
+
+        input.seekg(0);
+        if (encoded_literals.write(input, &buf, &buflen) < 0) {
+            cout << "Failed to encode file." << endl;
+            return 1;
+        }
+        payload.append(reinterpret_cast<const char *>(buf), buflen);
+    }
+    if (payload.size() > MAX_PAYLOAD_SIZE) {
+        print_encode_error(pathname, -2);
+        return 1;
+    }
+
+    {
+        my_sockopt::cork_guard cork(sockfd, client_tuning);
+
+        status = send_command("delta " + to_string(payload.size()) + " " + filename);
+        if (status == 0) {
+            int buflen = static_cast<int>(payload.size());
+            status = send_payload(sockfd, payload.data(), &buflen, upload_limit);
+        }
+    }
+    if (status < 0) {
+        perror("my_send");
+        cout << "Send failed. Terminate conneciton." << endl;
+        return -1;
+    }
+
+    cout << "Original file size: " << data.size() << "bytes, " << (data.size() - literals.size()) <<
+    " bytes found on server, delta size: " << payload.size() << " bytes." << endl;
+    cout.precision(2);
+    cout.setf(ios::fixed);
+    cout << "Transfer ratio: " << static_cast<double>(payload.size()) * 100.0 / static_cast<double>(data.empty() ? 1 : data.size()) << "%." << endl;
+
+    // Get response
+    msglen = MAX_CMD - 1;
+    status = my_recv_cmd(sockfd, msg, &msglen);
+    if (status != 0) {
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+    msg[msglen - 1] = '\0';
+
+    res = parse_command(msg);
+    if (res.size() >= 2 && res[0] == "OK") {
+        cout << "OK " << res[1] << " bytes sent." << endl;
+        return 0;
+    }
+    if (res.size() >= 1 && res[0] == "ERR") {
+        cout << "Server failed to apply delta. Sending whole file." << endl;
+        return send_file(pathname);
+    }
+
+    cout << "Invalid response. Terminate conneciton." << endl;
+    return -1;
+}
+
+static int run_stats()
+{
+    using namespace std;
+
+    if (sockfd <= 2) {
+        cout << "You are not logged in yet." << endl;
+        return 1;
+    }
+
+    if (send_command("stats") < 0) {
+        perror("my_send");
+        cout << "Send failed. Terminate conneciton." << endl;
+        return -1;
+    }
+
+    string metrics;
+    if (receive_sized("STATS", metrics) < 0) {
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+
+    cout << metrics << flush;
+    return 0;
+}
+
+static int run_get(std::vector<std::string> &cmd, std::string &orig_cmd)
+{
+    using namespace std;
+
+    if (cmd.size() < 2) {
+        cout << "Usage: get <filename>" << endl;
+        return 1;
+    }
+
+    if (sockfd <= 2) {
+        cout << "You are not logged in yet." << endl;
+        return 1;
+    }
+
+    // Filename is the rest of command, and is saved without its directory
+    string filename = command_tail(orig_cmd.c_str(), 1);
+    string savename = get_basename(filename);
+    string codefilename = savename + ".huf";
+
+    if (send_command("get " + filename) < 0) {
+        perror("my_send");
+        cout << "Send failed. Terminate conneciton." << endl;
+        return -1;
+    }
+
+    // GET <length>, followed by encoded file, or ERR <message>
+    char msg[MAX_CMD];
+    int msglen = MAX_CMD - 1;
+    if (my_recv_cmd(sockfd, msg, &msglen) != 0) {
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+    msg[msglen - 1] = '\0';
+
+    vector<string> res = parse_command(msg);
+    if (res.size() >= 1 && res[0] == "ERR") {
+        cout << command_tail(msg, 1) << endl;
+        return 1;
+    }
+
+    long long length = -1;
+    if (res.size() >= 2 && res[0] == "GET") {
+        try {
+            length = stoll(res[1]);
+        }
+        catch (exception &e) {
+            length = -1;
+        }
+    }
+    if (length < 0) {
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+
+    int status = receive_to_file(codefilename, length);
+    if (status < 0) {
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+
+    uint64_t original_size = 0;
+    int fd = (status == 0) ? open(codefilename.c_str(), O_RDONLY) : -1;
+    status = -1;
+    if (fd >= 0) {
+        my_storage::storage_writer writer(savename);
+        ostream output(&writer);
+        my_io::fd_source source(fd);
+        my_io::stream_sink sink(output);
+
+        // Split across threads at checkpoints if file has an index
+        my_huffman::huffman_decode decode;
+        if (writer.is_open() && decode.read_header(source) == 0 && writer.reserve(decode.original_size()) == 0) {
+            decode.read_index(fd, static_cast<uint64_t>(length));
+            if (decode.decode_parallel(fd, sink, decode_threads) == 0 && writer.commit() == 0) {
+                original_size = writer.size();
+                status = 0;
+            }
+        }
+        close(fd);
+    }
+    remove(codefilename.c_str());
+
+    if (status < 0) {
+        cout << "Failed to save file " << savename << "." << endl;
+        return 1;
+    }
+
+    cout << "Downloaded " << length << " bytes, original file size: " << original_size << " bytes." << endl;
+    cout << "File is saved in " << savename << " ." << endl;
+    return 0;
+}
+
+static int run_rget(std::vector<std::string> &cmd, std::string &orig_cmd)
+{
+    using namespace std;
+
+    long long offset = -1, length = -1;
+    if (cmd.size() >= 4) {
+        try {
+            offset = stoll(cmd[1]);
+            length = stoll(cmd[2]);
+        }
+        catch (exception &e) {
+            offset = -1;
+        }
+    }
+    if (offset < 0 || length < 0) {
+        cout << "Usage: rget <offset> <length> <filename>" << endl;
+        return 1;
+    }
+
+    if (sockfd <= 2) {
+        cout << "You are not logged in yet." << endl;
+        return 1;
+    }
+
+    string filename = command_tail(orig_cmd.c_str(), 3);
+
+    if (send_command("range " + to_string(offset) + " " + to_string(length) + " " + filename) < 0) {
+        perror("my_send");
+        cout << "Send failed. Terminate conneciton." << endl;
+        return -1;
+    }
+
+    // RANGE <offset> <length> <skip bits> <skip chars> <bytes> [<context>],
+    // followed by header and encoded data from a checkpoint, or ERR <message>
+    char msg[MAX_CMD];
+    int msglen = MAX_CMD - 1;
+    if (my_recv_cmd(sockfd, msg, &msglen) != 0) {
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+    msg[msglen - 1] = '\0';
+
+    vector<string> res = parse_command(msg);
+    if (res.size() >= 1 && res[0] == "ERR") {
+        cout << command_tail(msg, 1) << endl;
+        return 1;
+    }
+
+    long long skip_bits = -1, skip = -1, bytes = -1, context = 0;
+    if (res.size() >= 6 && res[0] == "RANGE") {
+        try {
+            offset = stoll(res[1]);
+            length = stoll(res[2]);
+            skip_bits = stoll(res[3]);
+            skip = stoll(res[4]);
+            bytes = stoll(res[5]);
+            // Only sent for order 1, where it picks the first code table
+            if (res.size() >= 7) {
+                context = stoll(res[6]);
+            }
+        }
+        catch (exception &e) {
+            bytes = -1;
+        }
+    }
+    if (bytes < 0 || length < 0 || skip < 0 || skip_bits < 0 || skip_bits > 7 || context < 0 || context > 255) {
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+
+    string savename = get_basename(filename) + "." + to_string(offset) + "-" + to_string(offset + length);
+    string codefilename = savename + ".huf";
+
+    int status = receive_to_file(codefilename, bytes);
+    if (status < 0) {
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+
+    int fd = (status == 0) ? open(codefilename.c_str(), O_RDONLY) : -1;
+    status = -1;
+    if (fd >= 0) {
+        my_storage::storage_writer writer(savename);
+        ostream output(&writer);
+        my_io::fd_source source(fd);
+        my_io::stream_sink sink(output);
+
+        // Encoded data follows header, starting `skip_bits` before a code
+        my_huffman::huffman_decode decode;
+        if (writer.is_open() && decode.read_header(source) == 0 && writer.reserve(static_cast<uint64_t>(length)) == 0 &&
+            decode.decode_from(source, sink, static_cast<unsigned int>(skip_bits), static_cast<uint8_t>(context),
+                static_cast<uint64_t>(skip), static_cast<uint64_t>(length)) == 0 && writer.commit() == 0) {
+            status = 0;
+        }
+        close(fd);
+    }
+    remove(codefilename.c_str());
+
+    if (status < 0) {
+        cout << "Failed to save file " << savename << "." << endl;
+        return 1;
+    }
+
+    cout << "Downloaded " << bytes << " bytes for " << length << " bytes from " << offset << "." << endl;
+    cout << "File is saved in " << savename << " ." << endl;
+    return 0;
+}
+
+static int receive_to_file(const std::string &filename, long long length)
+{
+    using namespace std;
+
+    fstream file(filename, fstream::out | fstream::binary | fstream::trunc);
+    long long received = 0;
+    vector<char> buf(static_cast<size_t>(client_tuning.chunk));
+    while (received < length) {
+        int chunk = client_tuning.chunk;
+        int buflen = (length - received < chunk) ? static_cast<int>(length - received) : chunk;
+        if (my_recv_data(sockfd, buf.data(), &buflen) < 0 || buflen == 0) {
+            file.close();
+            remove(filename.c_str());
+            return -1;
+        }
+        file.write(buf.data(), buflen);
+        received += buflen;
+    }
+    file.close();
+
+    return file.fail() ? 1 : 0;
+}
+
+static int run_trace(std::vector<std::string> &cmd)
+{
+    using namespace std;
+
+    bool from_server = (cmd.size() >= 3 && cmd[1] == "server");
+    if (cmd.size() != (from_server ? 3u : 2u)) {
+        cout << "Usage: trace [server] <file>" << endl;
+        return 1;
+    }
+
+    string trace;
+    if (from_server) {
+        if (sockfd <= 2) {
+            cout << "You are not logged in yet." << endl;
+            return 1;
+        }
+
+        if (send_command("trace") < 0) {
+            perror("my_send");
+            cout << "Send failed. Terminate conneciton." << endl;
+            return -1;
+        }
+
+        if (receive_sized("TRACE", trace) < 0) {
+            cout << "Invalid response. Terminate conneciton." << endl;
+            return -1;
+        }
+    }
+    else {
+        ostringstream output;
+        my_trace::dump(output);
+        trace = output.str();
+    }
+
+    ofstream file(cmd.back(), ofstream::out | ofstream::binary | ofstream::trunc);
+    if (!file.is_open() || !file.write(trace.data(), static_cast<streamsize>(trace.size()))) {
+        cout << "Failed to write file " << cmd.back() << "." << endl;
+        return 1;
+    }
+
+    cout << "Trace saved in " << cmd.back() << " ." << endl;
+    return 0;
+}
+
+static int receive_sized(const std::string &tag, std::string &body)
+{
+    using namespace std;
+
+    char msg[MAX_CMD];
+    int msglen = MAX_CMD - 1;
+    if (my_recv_cmd(sockfd, msg, &msglen) != 0) {
+        return -1;
+    }
+    msg[msglen - 1] = '\0';
+
+    vector<string> res = parse_command(msg);
+    int length = (res.size() >= 2 && res[0] == tag) ? atoi(res[1].c_str()) : -1;
+    if (length < 0) {
+        return -1;
+    }
+
+    body.assign(static_cast<size_t>(length), '\0');
+    int buflen = length;
+    if (length > 0 && (my_recv_data(sockfd, &body[0], &buflen) < 0 || buflen != length)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int run_set(std::vector<std::string> &cmd)
+{
+    using namespace std;
+
+    if (cmd.size() < 3) {
+        cout << "Usage: set <option> <value>" << endl;
+        return -1;
+    }
+
+    if (cmd[1] == "window") {
+        int window;
+        try {
+            window = stoi(cmd[2]);
+        }
+        catch (exception &e) {
+            window = 0;
+        }
+        if (window <= 0) {
+            cout << "Window must be a positive number." << endl;
+            return -1;
+        }
+        pipeline_window = window;
+        cout << "Pipeline window is set to " << pipeline_window << "." << endl;
+        return 0;
+    }
+
+    if (cmd[1] == "stripes") {
+        int stripes;
+        try {
+            stripes = stoi(cmd[2]);
+        }
+        catch (exception &e) {
+            stripes = 0;
+        }
+        if (stripes <= 0 || stripes > MAX_STRIPES) {
+            cout << "Stripes must be between 1 and " << MAX_STRIPES << "." << endl;
+            return -1;
+        }
+        stripe_count = stripes;
+        cout << "Stripes is set to " << stripe_count << "." << endl;
+        return 0;
+    }
+
+    if (cmd[1] == "codec") {
+        if (cmd[2] != "huffman" && cmd[2] != "bwt" && cmd[2] != "adaptive") {
+            cout << "Codec must be huffman, bwt or adaptive." << endl;
+            return -1;
+        }
+        block_sorting = (cmd[2] == "bwt");
+        adaptive_coding = (cmd[2] == "adaptive");
+        cout << "Codec is set to " << cmd[2] << "." << endl;
+        return 0;
+    }
+
+    if (cmd[1] == "fast") {
+        if (cmd[2] != "on" && cmd[2] != "off") {
+            cout << "Fast encoding must be on or off." << endl;
+            return -1;
+        }
+        fast_encoding = (cmd[2] == "on");
+        cout << "Fast encoding is " << cmd[2] << "." << endl;
+        return 0;
+    }
+
+    if (cmd[1] == "order") {
+        if (cmd[2] != "0" && cmd[2] != "1") {
+            cout << "Order must be 0 or 1." << endl;
+            return -1;
+        }
+        codec_order = (cmd[2] == "1") ? 1 : 0;
+        cout << "Order is set to " << codec_order << "." << endl;
+        return 0;
+    }
+
+    if (cmd[1] == "cache") {
+        long long megabytes;
+        try {
+            megabytes = stoll(cmd[2]);
+        }
+        catch (exception &e) {
+            megabytes = -1;
+        }
+        if (megabytes < 0) {
+            cout << "Cache size must not be negative." << endl;
+            return -1;
+        }
+        if (setup_cache(megabytes) < 0) {
+            cout << "Failed to set up cache." << endl;
+            return -1;
+        }
+        cout << "Cache size is set to " << megabytes << " MB." << endl;
+        return 0;
+    }
+
+    if (cmd[1] == "timeout") {
+        double seconds;
+        try {
+            seconds = stod(cmd[2]);
+        }
+        catch (exception &e) {
+            seconds = 0;
+        }
+        if (seconds <= 0 || seconds > 3600) {
+            cout << "Timeout must be between 0 and 3600 seconds." << endl;
+            return -1;
+        }
+        connect_timeout_ms = static_cast<int>(seconds * 1000);
+        cout << "Connect timeout is set to " << seconds << " seconds." << endl;
+        return 0;
+    }
+
+    if (cmd[1] == "rate") {
+        long long rate = my_shaper::parse_rate(cmd[2]);
+        if (rate < 0) {
+            cout << "Rate must be bytes per second, with optional K, M or G, or 0 for no limit." << endl;
+            return -1;
+        }
+        set_upload_rate(rate);
+        cout << "Upload rate is " << ((rate > 0) ? "set to " + cmd[2] + "/s" : "not limited") << "." << endl;
+        return 0;
+    }
+
+    if (cmd[1] == "tune") {
+        if (my_sockopt::parse_tuning(cmd[2], client_tuning) < 0) {
+            cout << "Tuning must be a profile (";
+            for (size_t i = 0; i < my_sockopt::profile_names().size(); ++i) {
+                cout << (i > 0 ? ", " : "") << my_sockopt::profile_names()[i];
+            }
+            cout << ") and/or option=value pairs, separated by commas." << endl;
+            return -1;
+        }
+        my_set_recv_size(client_tuning.recv);
+
+        // Current connection takes new options, though its window scale is fixed already
+        if (sockfd > 2 && my_sockopt::apply(sockfd, client_tuning) < 0) {
+            perror("setsockopt");
+        }
+        cout << "Socket tuning is set to " << my_sockopt::format_tuning(client_tuning) << "." << endl;
+        return 0;
+    }
+
+    cout << "Unknown option " << cmd[1] << "." << endl;
+    return -1;
+}
+
+static int run_psend(std::vector<std::string> &cmd)
+{
+    using namespace std;
+
+    if (sockfd <= 2) {
+        cout << "You are not logged in yet." << endl;
+        return 1;
+    }
+
+    if (cmd.size() < 2) {
+        cout << "Please provide file name." << endl;
+        return 1;
+    }
+
+    /** Request ID to pathname of requests waiting for acknowledgement */
+    map<unsigned int, string> pending;
+
+    for (size_t i = 1; i < cmd.size(); ++i) {
+        // Wait until the window has room
+        while (pending.size() >= static_cast<size_t>(pipeline_window)) {
+            if (receive_ack(pending) < 0) {
+                return -1;
+            }
+        }
+
+        string &pathname = cmd[i];
+
+        // Encode with Huffman Coding
+        string payload;
+        long long original_size;
+        bool cached;
+        int encoded = encode_file(pathname, payload, original_size, cached);
+        if (encoded < 0) {
+            print_encode_error(pathname, encoded);
+            continue;
+        }
+
+        const char *buf = payload.data();
+        int buflen = static_cast<int>(payload.size());
+
+        // Send command and file to server without waiting for response
+        unsigned int id = next_request_id++;
+        string filename = get_basename(pathname);
+        int status;
+        {
+            my_sockopt::cork_guard cork(sockfd, client_tuning);
+
+            if (protocol_version == FRAME_VERSION) {
+                status = my_send_frame(sockfd, FRAME_PSEND, id, static_cast<uint64_t>(buflen), filename.c_str(), filename.size());
+            }
+            else {
+                string send_cmd = "psend " + to_string(id) + " " + to_string(buflen) + " " + filename + "\n";
+                int sendlen = static_cast<int>(send_cmd.size());
+                status = my_send(sockfd, send_cmd.c_str(), &sendlen);
+            }
+            if (status == 0) {
+                status = send_payload(sockfd, buf, &buflen, upload_limit);
+            }
+        }
+        if (status < 0) {
+            perror("my_send");
+            cout << "Send failed. Terminate conneciton." << endl;
+            return -1;
+        }
+
+        pending[id] = pathname;
+
+        cout << "Request " << id << ": " << pathname << ", original file size: " << original_size << " bytes, compressed size: " <<
+        buflen << " bytes" << (cached ? " (cached)." : ".") << endl;
+    }
+
+    // Drain remaining acknowledgements
+    while (!pending.empty()) {
+        if (receive_ack(pending) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int receive_ack(std::map<unsigned int, std::string> &pending)
+{
+    using namespace std;
+
+    if (protocol_version == FRAME_VERSION) {
+        struct my_frame frame;
+        string res_msg;
+        if (receive_frame(frame, res_msg) < 0 || (frame.type != FRAME_ACK && frame.type != FRAME_ERR)) {
+            cout << "Invalid response. Terminate conneciton." << endl;
+            return -1;
+        }
+
+        auto it = pending.find(frame.id);
+        if (it == pending.end()) {
+            cout << "Invalid response. Terminate conneciton." << endl;
+            return -1;
+        }
+
+        if (frame.type == FRAME_ACK) {
+            cout << "OK " << frame.length << " bytes sent (request " << frame.id << ": " << it->second << ")." << endl;
+        }
+        else {
+            cout << "Server failed request " << frame.id << ": " << it->second << ". " << res_msg << endl;
+        }
+
+        pending.erase(it);
+        return 0;
+    }
+
+    char msg[MAX_CMD];
+    int msglen = MAX_CMD - 1;
+    int status = my_recv_cmd(sockfd, msg, &msglen);
+    if (status > 0) {
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+    else if (status < 0) {
+        perror("my_recv_cmd");
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+    msg[msglen - 1] = '\0';
+
+    // ACK <id> <length> bytes received.
+    // ERR <id> <message>
+    vector<string> res = parse_command(msg);
+    if (res.size() < 3 || (res[0] != "ACK" && res[0] != "ERR")) {
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+
+    unsigned int id;
+    try {
+        id = static_cast<unsigned int>(stoul(res[1]));
+    }
+    catch (exception &e) {
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+
+    auto it = pending.find(id);
+    if (it == pending.end()) {
+        cout << "Invalid response. Terminate conneciton." << endl;
+        return -1;
+    }
+
+    if (res[0] == "ACK") {
+        cout << "OK " << res[2] << " bytes sent (request " << id << ": " << it->second << ")." << endl;
+    }
+    else {
+        cout << "Server failed request " << id << ": " << it->second << "." << endl;
+    }
+
+    pending.erase(it);
+    return 0;
+}
+
+static int run_ssend(std::vector<std::string> &cmd, std::string &orig_cmd)
+{
+    using namespace std;
+
+    if (sockfd <= 2) {
+        cout << "You are not logged in yet." << endl;
+        return 1;
+    }
+
+    if (cmd.size() < 2) {
+        cout << "Please provide file name." << endl;
+        return 1;
+    }
+
+    // Get file path
+    string pathname = command_tail(orig_cmd, 1);
+
+    ifstream file(pathname, fstream::in | fstream::binary);
+    if (!file.is_open()) {
+        cout << "Failed to open file." << endl;
+        return 1;
+    }
+
+    file.seekg(0, file.end);
+    long long total = static_cast<long long>(file.tellg());
+    file.close();
+
+    if (total == 0) {
+        cout << "File is empty." << endl;
+        return 1;
+    }
+
+    // Do not split small files into tiny stripes
+    int count = stripe_count;
+    if (total / count < MIN_STRIPE_SIZE) {
+        count = static_cast<int>(total / MIN_STRIPE_SIZE);
+        if (count < 1) {
+            count = 1;
+        }
+    }
+
+    // Each stripe is one payload, the last one the largest
+    if (total - (total / count) * (count - 1) > MAX_PAYLOAD_SIZE) {
+        cout << "File is too large to send in " << count << " stripes, each is at most " << MAX_PAYLOAD_SIZE <<
+        " bytes." << endl;
+        return 1;
+    }
+
+    // Random transfer ID to tell stripes of different transfers apart
+    random_device rd;
+    ostringstream id_stream;
+    id_stream << hex << setfill('0') << setw(8) << rd() << setw(8) << rd();
+    string xfer_id = id_stream.str();
+
+    auto start = chrono::steady_clock::now();
+
+    vector<stripe_result> results(count);
+    vector<thread> threads;
+    long long stripe_size = total / count;
+    for (int i = 0; i < count; ++i) {
+        long long offset = stripe_size * i;
+        long long length = (i == count - 1) ? (total - offset) : stripe_size;
+        threads.push_back(thread(send_stripe, pathname, xfer_id, count, i, offset, length, total, &results[i]));
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    long long sent = 0;
+    for (int i = 0; i < count; ++i) {
+        if (results[i].status < 0) {
+            cout << "Failed to send stripe " << i << "." << endl;
+            return 1;
+        }
+        sent += results[i].sent;
+    }
+
+    cout << "Original file size: " << total << "bytes, compressed size: " << sent << " bytes." << endl;
+    cout.precision(2);
+    cout.setf(ios::fixed);
+    cout << "Compression ratio: " << static_cast<double>(sent)*100.0 / static_cast<double>(total) << "%." << endl;
+    cout << "OK " << sent << " bytes sent in " << count << " stripes, " << elapsed.count() << " seconds." << endl;
+    return 0;
+}
+
+static void send_stripe(const std::string &pathname, const std::string &xfer_id, int count, int index,
+    long long offset, long long length, long long total, stripe_result *result)
+{
+    using namespace std;
+
+    result->status = -1;
+    result->sent = 0;
+
+    // Read and encode the range of this stripe only
+    ifstream file(pathname, fstream::in | fstream::binary);
+    if (!file.is_open()) {
+        return;
+    }
+    string data(static_cast<size_t>(length), '\0');
+    file.seekg(offset);
+    file.read(&data[0], static_cast<streamsize>(length));
+    if (file.gcount() != static_cast<streamsize>(length)) {
+        return;
+    }
+    file.close();
+
+    istringstream input(data);
+    my_huffman::huffman_encode encoded_stripe(input);
+
+    uint8_t *buf;
+    int buflen;
+
+    input.seekg(0);
+    if (encoded_stripe.write(input, &buf, &buflen) < 0) {
+        return;
+    }
+
+    string welcome;
+    int fd = connect_server(server_host.c_str(), server_port.c_str(), welcome, connect_timeout_ms, NULL, &client_tuning);
+    if (fd < 0) {
+        return;
+    }
+
+    string send_cmd = "stripe " + xfer_id + " " + to_string(count) + " " + to_string(index) + " " +
+        to_string(offset) + " " + to_string(total) + " " + to_string(buflen) + " " + get_basename(pathname) + "\n";
+    int sendlen = static_cast<int>(send_cmd.size());
+    int status;
+    {
+        my_sockopt::cork_guard cork(fd, client_tuning);
+
+        status = my_send(fd, send_cmd.c_str(), &sendlen);
+        if (status == 0) {
+            status = send_payload(fd, buf, &buflen, upload_limit);
+        }
+    }
+
+    // Get response
+    if (status == 0) {
+        char msg[MAX_CMD];
+        int msglen = MAX_CMD - 1;
+        status = my_recv_cmd(fd, msg, &msglen);
+        if (status == 0) {
+            msg[msglen - 1] = '\0';
+            vector<string> res = parse_command(msg);
+            status = (res.size() >= 2 && res[0] == "OK") ? 0 : -1;
+        }
+    }
+
+    close(fd);
+    my_clean_buf(); // See my_send_recv.h
+
+    if (status == 0) {
+        result->status = 0;
+        result->sent = buflen;
+    }
+}
+
+static std::string get_basename(const std::string &pathname)
+{
+    // Both dirname() and basename() may modify the contents of path, so it
+    // may be desirable to pass a copy when calling one of these functions.
+    std::vector<char> pathname_c_str(pathname.begin(), pathname.end());
+    pathname_c_str.push_back('\0');
+
+    return basename(&pathname_c_str.front());
+}
\ No newline at end of file
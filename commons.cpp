@@ -1,8 +1,26 @@
 #include <sstream>
 #include <iterator>
+#include <iostream>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
 
 #include "commons.hpp"
 
+extern "C" {
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+
+#include "my_send_recv.h"
+}
+
 std::vector<std::string> parse_command(std::string cmd_str)
 {
     using namespace std;
@@ -10,3 +28,354 @@ std::vector<std::string> parse_command(std::string cmd_str)
     stringstream ss(cmd_str);
     return vector<string>(istream_iterator<string>(ss), istream_iterator<string>{});
 }
+
+std::string command_tail(const std::string &cmd_str, size_t n)
+{
+    using namespace std;
+
+    const char *spaces = " \t\r\n\v\f";
+
+    string::size_type pos = cmd_str.find_first_not_of(spaces);
+    for (size_t i = 0; i < n && pos != string::npos; ++i) {
+        pos = cmd_str.find_first_of(spaces, pos);
+        if (pos != string::npos) {
+            pos = cmd_str.find_first_not_of(spaces, pos);
+        }
+    }
+
+    if (pos == string::npos) {
+        return "";
+    }
+    return cmd_str.substr(pos);
+}
+
+std::string format_address(const struct sockaddr *sa, socklen_t salen)
+{
+    char host[NI_MAXHOST];
+    char serv[NI_MAXSERV];
+    if (getnameinfo(sa, salen, host, sizeof (host), serv, sizeof (serv), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+        return "unknown address";
+    }
+
+    return std::string(host) + " port " + serv;
+}
+
+bool is_local_socket(int fd)
+{
+    int domain = 0;
+    socklen_t len = sizeof (domain);
+    return getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == 0 && domain == AF_UNIX;
+}
+
+int send_payload(int fd, const void *buf, int *buflen, my_shaper::token_bucket *pace)
+{
+    if (!is_local_socket(fd)) {
+        if (pace == NULL) {
+            return my_send(fd, buf, buflen);
+        }
+
+        // Paced by quanta, so a rate holds from the first bytes on
+        const char *p = static_cast<const char *>(buf);
+        int sent = 0;
+        while (sent < *buflen) {
+            int len = *buflen - sent;
+            len = (len > static_cast<int>(my_shaper::TRANSFER_QUANTUM)) ? static_cast<int>(my_shaper::TRANSFER_QUANTUM) : len;
+            int status = my_send(fd, p + sent, &len);
+            sent += len;
+            if (status < 0) {
+                *buflen = sent;
+                return -1;
+            }
+            pace->consume(static_cast<uint64_t>(len));
+        }
+        return 0;
+    }
+
+    int memfd = memfd_create("hw2-payload", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) {
+        *buflen = 0;
+        return -1;
+    }
+
+    const char *p = static_cast<const char *>(buf);
+    int written = 0;
+    while (written < *buflen) {
+        ssize_t len = write(memfd, p + written, static_cast<size_t>(*buflen - written));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            close(memfd);
+            *buflen = 0;
+            return -1;
+        }
+        written += static_cast<int>(len);
+    }
+
+    // Server reads it while we go on, so it must not change any more
+    fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+
+    int status = my_send_fd(fd, memfd);
+    close(memfd);
+    if (status < 0) {
+        *buflen = 0;
+    }
+    return status;
+}
+
+/**
+ * Connect to Unix socket at `path`. Its connect() is done or refused at
+ * once, so there is nothing to race.
+ */
+static int connect_local(const char *path)
+{
+    struct sockaddr_un sun = {};
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof (sun.sun_path)) {
+        std::cerr << "Socket path " << path << " is too long." << std::endl;
+        return -1;
+    }
+    strcpy(sun.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&sun), sizeof (sun)) < 0) {
+        std::cerr << "connect " << path << ": " << strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Read welcome message of server from `fd`.
+ * Return 0 if succeed, or -1 if fail.
+ */
+static int read_welcome(int fd, std::string &welcome)
+{
+    char welcome_msg[64] = {};
+    int msglen = (int) sizeof (welcome_msg);
+    int status = my_recv_cmd(fd, welcome_msg, &msglen);
+    if (status < 0) {
+        perror("my_recv_cmd");
+        return -1;
+    }
+    else if (status > 0) {
+        std::cout << "Invalid command received." << std::endl;
+        return -1;
+    }
+
+    welcome_msg[msglen - 1] = '\0';
+    welcome = welcome_msg;
+    return 0;
+}
+
+/**
+ * Order addresses alternating between families, starting with the family of
+ * the first one, as RFC 8305 section 4 suggests.
+ */
+static std::vector<struct addrinfo *> interleave_families(struct addrinfo *res)
+{
+    using namespace std;
+
+    vector<struct addrinfo *> first;
+    vector<struct addrinfo *> other;
+    for (struct addrinfo *p = res; p != NULL; p = p->ai_next) {
+        if (p->ai_family == res->ai_family) {
+            first.push_back(p);
+        }
+        else {
+            other.push_back(p);
+        }
+    }
+
+    vector<struct addrinfo *> ordered;
+    for (size_t i = 0; i < first.size() || i < other.size(); ++i) {
+        if (i < first.size()) {
+            ordered.push_back(first[i]);
+        }
+        if (i < other.size()) {
+            ordered.push_back(other[i]);
+        }
+    }
+    return ordered;
+}
+
+int connect_server(const char *addr, const char *port, std::string &welcome, int timeout_ms, std::string *peer,
+    const my_sockopt::socket_tuning *tuning)
+{
+    using namespace std;
+    using namespace std::chrono;
+
+    if (strncmp(addr, LOCAL_PREFIX, strlen(LOCAL_PREFIX)) == 0) {
+        const char *path = addr + strlen(LOCAL_PREFIX);
+        int fd = connect_local(path);
+        if (fd < 0) {
+            return -1;
+        }
+        if (read_welcome(fd, welcome) < 0) {
+            close(fd);
+            return -1;
+        }
+        if (peer != NULL) {
+            *peer = string("local socket ") + path;
+        }
+        return fd;
+    }
+
+    // Resolve hostname and connect
+    struct addrinfo hints = {};
+    struct addrinfo *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int status = getaddrinfo(addr, port, &hints, &res);
+    if (status != 0) {
+        cerr << gai_strerror(status) << endl;
+        return -1;
+    }
+
+    vector<struct addrinfo *> candidates = interleave_families(res);
+
+    steady_clock::time_point deadline = steady_clock::now() + milliseconds(timeout_ms);
+    steady_clock::time_point next_attempt = steady_clock::now();
+
+    /** Pending attempts, and the address each one is connecting to */
+    vector<struct pollfd> pending;
+    vector<struct addrinfo *> pending_addrs;
+    size_t next = 0;
+    int fd = -1;
+    struct addrinfo *winner = NULL;
+
+    while (fd < 0) {
+        steady_clock::time_point now = steady_clock::now();
+        if (now >= deadline) {
+            cerr << "Connecting to " << addr << " timed out." << endl;
+            break;
+        }
+
+        // Start next attempt when its turn comes, or at once if none pending
+        if (next < candidates.size() && (now >= next_attempt || pending.empty())) {
+            struct addrinfo *p = candidates[next++];
+            next_attempt = now + milliseconds(CONNECT_STAGGER_MS);
+
+            int sock = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol);
+            if (sock < 0) {
+                perror("socket");
+                next_attempt = now;
+                continue;
+            }
+
+            // Window scale is settled by SYN, so buffers are sized before it
+            if (tuning != NULL && my_sockopt::apply_buffers(sock, *tuning) < 0) {
+                perror("setsockopt");
+            }
+
+            if (connect(sock, p->ai_addr, p->ai_addrlen) == 0) {
+                fd = sock;
+                winner = p;
+                break;
+            }
+            if (errno != EINPROGRESS) {
+                cerr << "connect " << format_address(p->ai_addr, p->ai_addrlen) << ": " << strerror(errno) << endl;
+                close(sock);
+                next_attempt = now;
+                continue;
+            }
+
+            struct pollfd pfd = {};
+            pfd.fd = sock;
+            pfd.events = POLLOUT;
+            pending.push_back(pfd);
+            pending_addrs.push_back(p);
+        }
+
+        if (pending.empty()) {
+            if (next >= candidates.size()) {
+                break;
+            }
+            continue;
+        }
+
+        // Wait for an attempt to finish, or for the next one to be due
+        steady_clock::time_point wake = deadline;
+        if (next < candidates.size() && next_attempt < wake) {
+            wake = next_attempt;
+        }
+        int wait_ms = static_cast<int>(duration_cast<milliseconds>(wake - steady_clock::now()).count());
+        int ready = poll(&pending[0], pending.size(), wait_ms > 0 ? wait_ms : 0);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        for (size_t i = 0; i < pending.size() && ready > 0; ) {
+            if (pending[i].revents == 0) {
+                i += 1;
+                continue;
+            }
+
+            int err = 0;
+            socklen_t errlen = sizeof (err);
+            if (getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) {
+                err = errno;
+            }
+
+            if (err == 0) {
+                fd = pending[i].fd;
+                winner = pending_addrs[i];
+            }
+            else {
+                cerr << "connect " << format_address(pending_addrs[i]->ai_addr, pending_addrs[i]->ai_addrlen) <<
+                ": " << strerror(err) << endl;
+                close(pending[i].fd);
+                // A failed attempt lets the next one start at once
+                next_attempt = steady_clock::now();
+            }
+
+            pending.erase(pending.begin() + i);
+            pending_addrs.erase(pending_addrs.begin() + i);
+            ready -= 1;
+            if (fd >= 0) {
+                break;
+            }
+        }
+    }
+
+    // Cancel attempts that lost the race
+    for (auto &pfd : pending) {
+        close(pfd.fd);
+    }
+
+    if (fd < 0) {
+        freeaddrinfo(res);
+        return -1;
+    }
+
+    if (peer != NULL) {
+        *peer = format_address(winner->ai_addr, winner->ai_addrlen);
+    }
+    freeaddrinfo(res);
+
+    // Rest of the connection uses blocking I/O
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+
+    if (tuning != NULL && my_sockopt::apply(fd, *tuning) < 0) {
+        perror("setsockopt");
+    }
+
+    // Read welcome message
+    if (read_welcome(fd, welcome) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
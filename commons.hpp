@@ -3,9 +3,59 @@
 
 #include <string>
 #include <vector>
+#include <sys/socket.h>
+
+#include "my_sockopt.hpp"
+#include "my_shaper.hpp"
 
 #define MAX_CMD 512
+/** Delay before racing the next address while earlier attempts are pending */
+#define CONNECT_STAGGER_MS 250
+/** Default time limit of connecting to server over all addresses */
+#define CONNECT_TIMEOUT_MS 10000
+/** Prefix of a server address naming its Unix socket, e.g. "unix:/tmp/hw2.sock" */
+#define LOCAL_PREFIX "unix:"
 
 std::vector<std::string> parse_command(std::string cmd_str);
 
+/**
+ * Return the rest of `cmd_str` after skipping `n` whitespace separated
+ * tokens and the whitespace following them. Used for the last argument
+ * (usually a filename) which may contain spaces.
+ */
+std::string command_tail(const std::string &cmd_str, size_t n);
+
+/**
+ * Connect to server at `addr`:`port` and read welcome message into
+ * `welcome`. Addresses are tried as RFC 8305 (Happy Eyeballs) describes:
+ * families interleaved, a new attempt every CONNECT_STAGGER_MS while earlier
+ * ones are pending, and the first connected socket wins. Gives up after
+ * `timeout_ms`. Address connected is written to `peer` if given, and socket
+ * options of `tuning` are set if given. An `addr` of LOCAL_PREFIX and a path
+ * connects to the Unix socket of a server on the same host, and `port` and
+ * `tuning` are ignored.
+ * Return socket if succeed, or -1 if fail.
+ */
+int connect_server(const char *addr, const char *port, std::string &welcome,
+    int timeout_ms = CONNECT_TIMEOUT_MS, std::string *peer = NULL, const my_sockopt::socket_tuning *tuning = NULL);
+
+/**
+ * Check if `fd` is a Unix socket, whose payloads are passed as memfd.
+ */
+bool is_local_socket(int fd);
+
+/**
+ * Send payload of `buflen` bytes of `buf` to server. Over a Unix socket it
+ * is copied once into a sealed memfd which is passed in its place, so the
+ * server reads it without going through the socket. Otherwise, with `pace`
+ * given, it is sent a quantum at a time within rate of `pace`.
+ * Return 0 if succeed, or -1 if fail.
+ */
+int send_payload(int fd, const void *buf, int *buflen, my_shaper::token_bucket *pace = NULL);
+
+/**
+ * Format `sa` as "<address> port <port>".
+ */
+std::string format_address(const struct sockaddr *sa, socklen_t salen);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,455 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "commons.hpp"
+#include "my_huffman.hpp"
+#include "my_adaptive.hpp"
+
+extern "C" {
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+
+#include "my_send_recv.h"
+}
+
+/** Distinct payloads generated by each connection, sent in turn */
+#define POOL_SIZE 8
+/** Largest payload generated */
+#define MAX_PAYLOAD_SIZE (64 << 20)
+
+typedef std::chrono::steady_clock clock_type;
+
+/** Kind of synthetic payload */
+enum payload_kind
+{
+    /** Uniformly random bytes, incompressible */
+    PAYLOAD_RANDOM,
+    /** Words separated by spaces and newlines */
+    PAYLOAD_TEXT,
+    /** Few byte values dominate, highly compressible */
+    PAYLOAD_SKEWED
+};
+
+/** Distribution of payload sizes */
+enum size_dist
+{
+    SIZE_FIXED,
+    /** Uniform in [1, 2 * mean] */
+    SIZE_UNIFORM,
+    /** Exponential of mean */
+    SIZE_EXP
+};
+
+/** Load settings, from command line */
+struct load_options
+{
+    std::string host = "127.0.0.1";
+    std::string port = "1732";
+    int connections = 4;
+    long long files = 1000;
+    double duration = 0;
+    double rate = 0;
+    long long size = 65536;
+    size_dist dist = SIZE_FIXED;
+    payload_kind kind = PAYLOAD_TEXT;
+    /** Encode payloads by adaptive Huffman coding instead of two passes */
+    bool adaptive = false;
+    my_sockopt::socket_tuning tuning = my_sockopt::default_tuning();
+};
+
+/** A payload ready to be sent */
+struct encoded_payload
+{
+    std::string data;
+    size_t original_size;
+};
+
+/** Results of one connection */
+struct conn_result
+{
+    long long files = 0;
+    long long errors = 0;
+    unsigned long long original_bytes = 0;
+    unsigned long long sent_bytes = 0;
+    /** Latency of each file in seconds */
+    std::vector<double> latencies;
+};
+
+/**
+ * Descrption: Parse size with optional K or M suffix.
+ * Return: Size in bytes, or -1 if invalid.
+ */
+static long long parse_size(const char *str);
+
+/**
+ * Descrption: Generate a payload of `size` bytes, Huffman-encoded in two
+ *             passes, or adaptively if `adaptive`.
+ */
+static encoded_payload make_payload(payload_kind kind, bool adaptive, size_t size, std::mt19937_64 &rng);
+
+/**
+ * Descrption: Generate POOL_SIZE payloads of connection `index`, with sizes
+ *             drawn from distribution of `options`.
+ */
+static void make_pool(int index, const load_options &options, std::vector<encoded_payload> &pool);
+
+/**
+ * Descrption: Upload payloads of `pool` in turn over one connection as
+ *             `options` tells, until `count` files are sent or `deadline`
+ *             passes.
+ */
+static void run_connection(int index, const load_options &options, const std::vector<encoded_payload> &pool,
+    long long count, clock_type::time_point start, clock_type::time_point deadline, conn_result &result);
+
+/**
+ * Descrption: Print usage and exit.
+ */
+static void usage(const char *prog);
+
+int main(int argc, char *argv[])
+{
+    // Writing to a connection closed by server must not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    using namespace std;
+
+    load_options options;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:n:d:r:s:S:k:e:t:")) != -1) {
+        switch (opt) {
+        case 'h':
+            options.host = optarg;
+            break;
+        case 'p':
+            options.port = optarg;
+            break;
+        case 'c':
+            options.connections = atoi(optarg);
+            break;
+        case 'n':
+            options.files = atoll(optarg);
+            break;
+        case 'd':
+            options.duration = atof(optarg);
+            break;
+        case 'r':
+            options.rate = atof(optarg);
+            break;
+        case 's':
+            options.size = parse_size(optarg);
+            break;
+        case 'S':
+            if (strcmp(optarg, "fixed") == 0) {
+                options.dist = SIZE_FIXED;
+            }
+            else if (strcmp(optarg, "uniform") == 0) {
+                options.dist = SIZE_UNIFORM;
+            }
+            else if (strcmp(optarg, "exp") == 0) {
+                options.dist = SIZE_EXP;
+            }
+            else {
+                usage(argv[0]);
+            }
+            break;
+        case 'k':
+            if (strcmp(optarg, "random") == 0) {
+                options.kind = PAYLOAD_RANDOM;
+            }
+            else if (strcmp(optarg, "text") == 0) {
+                options.kind = PAYLOAD_TEXT;
+            }
+            else if (strcmp(optarg, "skewed") == 0) {
+                options.kind = PAYLOAD_SKEWED;
+            }
+            else {
+                usage(argv[0]);
+            }
+            break;
+        case 'e':
+            if (strcmp(optarg, "huffman") == 0) {
+                options.adaptive = false;
+            }
+            else if (strcmp(optarg, "adaptive") == 0) {
+                options.adaptive = true;
+            }
+            else {
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+            if (my_sockopt::parse_tuning(optarg, options.tuning) < 0) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (options.connections <= 0 || options.files < 0 || options.duration < 0 || options.rate < 0 ||
+        options.size <= 0 || options.size > MAX_PAYLOAD_SIZE || (options.files == 0 && options.duration == 0)) {
+        usage(argv[0]);
+    }
+
+    my_set_recv_size(options.tuning.recv);
+
+    // Payloads are encoded before timing starts, so only server is measured
+    vector< vector<encoded_payload> > pools(static_cast<size_t>(options.connections));
+    vector<thread> threads;
+    for (int i = 0; i < options.connections; ++i) {
+        threads.push_back(thread(make_pool, i, cref(options), ref(pools[i])));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    threads.clear();
+
+    bool local = (options.host.compare(0, strlen(LOCAL_PREFIX), LOCAL_PREFIX) == 0);
+    cout << "Uploading to " << options.host << (local ? "" : ":" + options.port) << " over " << options.connections <<
+    " connections..." << endl;
+
+    clock_type::time_point start = clock_type::now();
+    clock_type::time_point deadline = (options.duration > 0) ?
+        start + chrono::duration_cast<clock_type::duration>(chrono::duration<double>(options.duration)) :
+        clock_type::time_point::max();
+
+    // Without a file count, connections run until deadline
+    vector<conn_result> results(static_cast<size_t>(options.connections));
+    for (int i = 0; i < options.connections; ++i) {
+        long long count = (options.files > 0) ?
+            options.files / options.connections + (i < options.files % options.connections ? 1 : 0) : -1;
+        threads.push_back(thread(run_connection, i, cref(options), cref(pools[i]), count, start, deadline, ref(results[i])));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    double elapsed = chrono::duration<double>(clock_type::now() - start).count();
+
+    conn_result total;
+    for (auto &result : results) {
+        total.files += result.files;
+        total.errors += result.errors;
+        total.original_bytes += result.original_bytes;
+        total.sent_bytes += result.sent_bytes;
+        total.latencies.insert(total.latencies.end(), result.latencies.begin(), result.latencies.end());
+    }
+    sort(total.latencies.begin(), total.latencies.end());
+
+    auto percentile = [&total](double p) {
+        if (total.latencies.empty()) {
+            return 0.0;
+        }
+        size_t rank = static_cast<size_t>(p * static_cast<double>(total.latencies.size()));
+        return total.latencies[min(rank, total.latencies.size() - 1)] * 1000.0;
+    };
+
+    cout.precision(2);
+    cout.setf(ios::fixed);
+    cout << "Files: " << total.files << ", errors: " << total.errors << ", elapsed: " << elapsed << " seconds." << endl;
+    cout << "Throughput: " << total.files / elapsed << " files/s, " <<
+    total.original_bytes / elapsed / 1e6 << " MB/s original, " <<
+    total.sent_bytes / elapsed / 1e6 << " MB/s sent." << endl;
+    cout << "Latency (ms): p50 " << percentile(0.5) << ", p99 " << percentile(0.99) << ", p999 " <<
+    percentile(0.999) << ", max " << percentile(1.0) << "." << endl;
+
+    return (total.errors > 0) ? 1 : 0;
+}
+
+static long long parse_size(const char *str)
+{
+    char *end;
+    long long size = strtoll(str, &end, 10);
+    if (end == str) {
+        return -1;
+    }
+
+    if (*end == 'K' || *end == 'k') {
+        size <<= 10;
+        end += 1;
+    }
+    else if (*end == 'M' || *end == 'm') {
+        size <<= 20;
+        end += 1;
+    }
+
+    return (*end == '\0') ? size : -1;
+}
+
+static encoded_payload make_payload(payload_kind kind, bool adaptive, size_t size, std::mt19937_64 &rng)
+{
+    using namespace std;
+
+    static const char *words[] = {
+        "the", "of", "and", "to", "in", "a", "is", "that", "for", "it", "as", "was", "with", "be", "by",
+        "on", "not", "he", "this", "are", "or", "his", "from", "at", "which", "but", "have", "an", "had",
+        "they", "you", "were", "their", "one", "all", "we", "can", "her", "has", "there", "been", "if",
+        "more", "when", "will", "would", "who", "so", "no", "server", "client", "huffman", "connection"
+    };
+    const size_t word_count = sizeof (words) / sizeof (words[0]);
+
+    string data;
+    data.reserve(size);
+
+    if (kind == PAYLOAD_RANDOM) {
+        uniform_int_distribution<int> byte(0, 255);
+        while (data.size() < size) {
+            data.push_back(static_cast<char>(byte(rng)));
+        }
+    }
+    else if (kind == PAYLOAD_TEXT) {
+        // Zipf-like: earlier words are more frequent
+        geometric_distribution<size_t> word(0.08);
+        uniform_int_distribution<int> line(0, 11);
+        while (data.size() < size) {
+            data += words[word(rng) % word_count];
+            data.push_back(line(rng) == 0 ? '\n' : ' ');
+        }
+        data.resize(size);
+    }
+    else {
+        geometric_distribution<int> byte(0.3);
+        while (data.size() < size) {
+            data.push_back(static_cast<char>('a' + min(byte(rng), 25)));
+        }
+    }
+
+    encoded_payload payload;
+    payload.original_size = size;
+
+    if (adaptive) {
+        vector<uint8_t> encoded;
+        my_io::buffer_sink sink(encoded);
+        my_io::span_source source(data.data(), data.size());
+        my_adaptive::encode(source, data.size(), sink);
+        payload.data.assign(encoded.begin(), encoded.end());
+        return payload;
+    }
+
+    istringstream input(data);
+    my_huffman::huffman_encode encoded(input);
+
+    uint8_t *buf;
+    int buflen;
+
+    input.clear();
+    input.seekg(0);
+    encoded.write(input, &buf, &buflen);
+
+    payload.data.assign(reinterpret_cast<const char *>(buf), static_cast<size_t>(buflen));
+    return payload;
+}
+
+static void make_pool(int index, const load_options &options, std::vector<encoded_payload> &pool)
+{
+    using namespace std;
+
+    mt19937_64 rng(static_cast<uint64_t>(index) * 7919 + 1);
+
+    for (int i = 0; i < POOL_SIZE; ++i) {
+        double size = static_cast<double>(options.size);
+        if (options.dist == SIZE_UNIFORM) {
+            size = uniform_real_distribution<double>(1.0, 2.0 * size)(rng);
+        }
+        else if (options.dist == SIZE_EXP) {
+            size = exponential_distribution<double>(1.0 / size)(rng);
+        }
+        size = max(1.0, min(size, static_cast<double>(MAX_PAYLOAD_SIZE)));
+        pool.push_back(make_payload(options.kind, options.adaptive, static_cast<size_t>(size), rng));
+    }
+}
+
+static void run_connection(int index, const load_options &options, const std::vector<encoded_payload> &pool,
+    long long count, clock_type::time_point start, clock_type::time_point deadline, conn_result &result)
+{
+    using namespace std;
+
+    string welcome;
+    int fd = connect_server(options.host.c_str(), options.port.c_str(), welcome, CONNECT_TIMEOUT_MS, NULL, &options.tuning);
+    if (fd < 0) {
+        result.errors += 1;
+        return;
+    }
+
+    bool local = is_local_socket(fd);
+
+    // Each connection keeps overwriting its own file on server
+    string filename = "loadgen-" + to_string(index) + ".bin";
+
+    // Open loop at target rate: latency counts from when a file was due, so a
+    // slow server is not hidden by sending less
+    clock_type::duration interval = (options.rate > 0) ?
+        chrono::duration_cast<clock_type::duration>(chrono::duration<double>(options.connections / options.rate)) :
+        clock_type::duration::zero();
+
+    for (long long k = 0; count < 0 || k < count; ++k) {
+        clock_type::time_point due = clock_type::now();
+        if (options.rate > 0) {
+            due = start + interval * k;
+            if (due >= deadline) {
+                break;
+            }
+            this_thread::sleep_until(due);
+        }
+        if (clock_type::now() >= deadline) {
+            break;
+        }
+
+        const encoded_payload &payload = pool[k % POOL_SIZE];
+
+        // Pipelined send is acknowledged after decoding, so latency covers it.
+        // Over TCP command and payload go in one write; over a Unix socket
+        // payload is passed as memfd after the command.
+        string send_cmd = "psend " + to_string(k) + " " + to_string(payload.data.size()) + " " + filename + "\n";
+        if (!local) {
+            send_cmd += payload.data;
+        }
+        int sendlen = static_cast<int>(send_cmd.size());
+        int paylen = static_cast<int>(payload.data.size());
+        if (my_send(fd, send_cmd.c_str(), &sendlen) < 0 || (local && send_payload(fd, payload.data.data(), &paylen) < 0)) {
+            perror("my_send");
+            result.errors += 1;
+            break;
+        }
+
+        char msg[MAX_CMD];
+        int msglen = MAX_CMD - 1;
+        int status = my_recv_cmd(fd, msg, &msglen);
+        if (status != 0 || msglen == 0 || strncmp(msg, "ACK", 3) != 0) {
+            msg[(status == 0 && msglen > 0) ? msglen - 1 : 0] = '\0';
+            cerr << "Connection " << index << ": invalid response \"" << msg << "\"." << endl;
+            result.errors += 1;
+            break;
+        }
+
+        result.files += 1;
+        result.original_bytes += payload.original_size;
+        result.sent_bytes += payload.data.size();
+        result.latencies.push_back(chrono::duration<double>(clock_type::now() - due).count());
+    }
+
+    close(fd);
+}
+
+static void usage(const char *prog)
+{
+    using namespace std;
+
+    cerr << "Usage: " << prog << " [-h host] [-p port] [-c connections] [-n files] [-d seconds]" << endl;
+    cerr << "       [-r files_per_second] [-s size[K|M]] [-S fixed|uniform|exp] [-k random|text|skewed]" << endl;
+    cerr << "       [-e huffman|adaptive] [-t socket_tuning]" << endl;
+    exit(1);
+}
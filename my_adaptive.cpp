@@ -0,0 +1,188 @@
+#include <endian.h>
+
+#include "my_adaptive.hpp"
+
+using namespace my_adaptive;
+
+/** Read 8 bytes of little-endian bits */
+static inline uint64_t load_bits(const uint8_t *p)
+{
+    uint64_t bits;
+    memcpy(&bits, p, sizeof (bits));
+    return le64toh(bits);
+}
+
+adaptive_tree::adaptive_tree()
+: _nyt(ROOT)
+{
+    memset(_weight, 0, sizeof (_weight));
+    for (int i = 0; i < NODES; ++i) {
+        _parent[i] = -1;
+        _left[i] = -1;
+        _right[i] = -1;
+        _symbol[i] = INNER;
+    }
+    for (int c = 0; c < 256; ++c) {
+        _leaf[c] = -1;
+    }
+    _symbol[ROOT] = NYT;
+}
+
+void adaptive_tree::_swap(int a, int b)
+{
+    std::swap(_left[a], _left[b]);
+    std::swap(_right[a], _right[b]);
+    std::swap(_symbol[a], _symbol[b]);
+
+    // Nodes stay where they are in tree, with their parents; what hangs
+    // below them is told where it is now
+    int nodes[2] = { a, b };
+    for (int i = 0; i < 2; ++i) {
+        int n = nodes[i];
+        if (_symbol[n] == INNER) {
+            _parent[_left[n]] = static_cast<int16_t>(n);
+            _parent[_right[n]] = static_cast<int16_t>(n);
+        }
+        else if (_symbol[n] == NYT) {
+            _nyt = n;
+        }
+        else {
+            _leaf[_symbol[n]] = static_cast<int16_t>(n);
+        }
+    }
+}
+
+void adaptive_tree::code(unsigned int c, uint64_t &bits, unsigned int &length) const
+{
+    int node = (_leaf[c] >= 0) ? _leaf[c] : _nyt;
+
+    // Walking up from leaf, each bit goes below those of nodes above
+    uint64_t path = 0;
+    unsigned int depth = 0;
+    while (node != ROOT) {
+        int parent = _parent[node];
+        path = (path << 1) | ((_right[parent] == node) ? 1 : 0);
+        depth += 1;
+        node = parent;
+    }
+
+    if (_leaf[c] < 0) {
+        path |= static_cast<uint64_t>(c) << depth;
+        depth += 8;
+    }
+
+    bits = path;
+    length = depth;
+}
+
+void adaptive_tree::update(unsigned int c)
+{
+    int q = _leaf[c];
+    if (q < 0) {
+        // NYT gives birth to a new NYT and a leaf of c, both of weight 0
+        int old = _nyt;
+        _symbol[old] = INNER;
+        _left[old] = static_cast<int16_t>(old - 2);
+        _right[old] = static_cast<int16_t>(old - 1);
+
+        _symbol[old - 2] = NYT;
+        _parent[old - 2] = static_cast<int16_t>(old);
+        _symbol[old - 1] = static_cast<int16_t>(c);
+        _parent[old - 1] = static_cast<int16_t>(old);
+        _leaf[c] = static_cast<int16_t>(old - 1);
+        _nyt = old - 2;
+        q = old - 1;
+    }
+
+    while (true) {
+        // Highest node of same weight takes place of q before it gains,
+        // unless it is q's parent
+        int leader = q;
+        while (leader < ROOT && _weight[leader + 1] == _weight[q]) {
+            leader += 1;
+        }
+        if (leader != q && leader != _parent[q]) {
+            _swap(q, leader);
+            q = leader;
+        }
+
+        _weight[q] += 1;
+        if (q == ROOT) {
+            break;
+        }
+        q = _parent[q];
+    }
+}
+
+unsigned int adaptive_tree::decode(const uint8_t *in, uint64_t &bit) const
+{
+    // 57 bits at least, enough for any path, as depth follows from counts
+    // alone, whatever the payload
+    uint64_t window = load_bits(in + (bit >> 3)) >> (bit & 7);
+
+    int node = ROOT;
+    while (_symbol[node] == INNER) {
+        node = (window & 1) ? _right[node] : _left[node];
+        window >>= 1;
+        bit += 1;
+    }
+
+    if (_symbol[node] != NYT) {
+        return static_cast<unsigned int>(_symbol[node]);
+    }
+
+    unsigned int c = static_cast<unsigned int>(load_bits(in + (bit >> 3)) >> (bit & 7)) & 0xff;
+    bit += 8;
+    return c;
+}
+
+adaptive_encode::adaptive_encode()
+: _bits(0), _bit_count(0)
+{
+
+}
+
+void adaptive_encode::_put(uint64_t bits, unsigned int length, std::vector<uint8_t> &out)
+{
+    // At most 7 bits are pending and codes are 56 bits at most, so all fit
+    _bits |= bits << _bit_count;
+    _bit_count += length;
+    while (_bit_count >= 8) {
+        out.push_back(static_cast<uint8_t>(_bits));
+        _bits >>= 8;
+        _bit_count -= 8;
+    }
+}
+
+void adaptive_encode::encode(const uint8_t *data, size_t length, std::vector<uint8_t> &out)
+{
+    for (size_t i = 0; i < length; ++i) {
+        uint64_t bits;
+        unsigned int code_length;
+        _tree.code(data[i], bits, code_length);
+        _put(bits, code_length, out);
+        _tree.update(data[i]);
+    }
+}
+
+void adaptive_encode::finish(std::vector<uint8_t> &out)
+{
+    if (_bit_count > 0) {
+        out.push_back(static_cast<uint8_t>(_bits));
+    }
+    _bits = 0;
+    _bit_count = 0;
+}
+
+adaptive_decode::adaptive_decode()
+: _original_size(0)
+{
+
+}
+
+bool my_adaptive::is_adaptive(int fd)
+{
+    uint32_t header[2];
+    my_io::pread_source source(fd, 0, sizeof (header));
+    return source.read(header, sizeof (header)) == sizeof (header) && ntohl(header[1]) == ADAPTIVE_MARK;
+}
@@ -0,0 +1,253 @@
+#ifndef __MY_ADAPTIVE_HPP__
+#define __MY_ADAPTIVE_HPP__
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <arpa/inet.h>
+
+#include "my_huffman.hpp"
+#include "my_io.hpp"
+
+/**
+ * Adaptive Huffman coding (FGK): encoder and decoder start from the same
+ * empty tree and update it alike after each char, so no code table is sent
+ * and each block is coded as soon as it is read. A char not seen before is
+ * sent as the code of a not-yet-transmitted (NYT) leaf and its 8 bits.
+ *
+ * Payload (integers in network byte order):
+ *     u32 original size, u32 ADAPTIVE_MARK, coded bits with first bit lowest
+ *
+ * ADAPTIVE_MARK stands where a Huffman payload has its tree, so a
+ * huffman_decode refuses it as a broken header.
+ */
+namespace my_adaptive
+{
+    /** Marks payload as adaptive */
+    const uint32_t ADAPTIVE_MARK = 259;
+
+    /** Bytes beyond a code read at once by decoder, more than the longest code */
+    const size_t CODE_BYTES = 16;
+
+    /**
+     * Tree kept with the sibling property: nodes are numbered in order of
+     * weight, parents above children, so a node is moved only by swapping
+     * with the highest numbered node of its weight before it gains one.
+     */
+    class adaptive_tree
+    {
+    private:
+        /** Leaves of 256 chars and NYT, and their inner nodes */
+        static const int NODES = 2 * 257 - 1;
+        static const int ROOT = NODES - 1;
+        /** Symbol of inner nodes, and of NYT */
+        static const int16_t INNER = -1;
+        static const int16_t NYT = -2;
+
+        uint32_t _weight[NODES];
+        int16_t _parent[NODES];
+        int16_t _left[NODES];
+        int16_t _right[NODES];
+        int16_t _symbol[NODES];
+        /** Node of each char, or -1 if not seen */
+        int16_t _leaf[256];
+        int _nyt;
+
+        /** Exchange subtrees at nodes `a` and `b` */
+        void _swap(int a, int b);
+
+    public:
+        adaptive_tree();
+
+        /**
+         * Description: Code of `c`, with first bit lowest, and its length.
+         *              Codes of unseen chars end with the char itself. A
+         *              path of 48 bits takes more weight than 32 bits hold,
+         *              so codes are 56 bits at most.
+         */
+        void code(unsigned int c, uint64_t &bits, unsigned int &length) const;
+
+        /**
+         * Description: Count one more `c`, moving nodes to keep tree a
+         *              Huffman tree of all counted chars.
+         */
+        void update(unsigned int c);
+
+        /**
+         * Description: Decode a char from `in` at `bit`, advancing `bit`.
+         *              At least CODE_BYTES bytes from that bit are readable.
+         * Return: The char, not yet counted.
+         */
+        unsigned int decode(const uint8_t *in, uint64_t &bit) const;
+    };
+
+    /** Encoder keeping tree and bits not yet written between blocks */
+    class adaptive_encode
+    {
+    private:
+        adaptive_tree _tree;
+        uint64_t _bits;
+        unsigned int _bit_count;
+
+        /** Append `length` bits of `bits` to `out` */
+        void _put(uint64_t bits, unsigned int length, std::vector<uint8_t> &out);
+
+    public:
+        adaptive_encode();
+
+        /**
+         * Description: Append codes of `length` chars of `data` to `out`.
+         */
+        void encode(const uint8_t *data, size_t length, std::vector<uint8_t> &out);
+
+        /**
+         * Description: Append bits left, padded to a byte, to `out`.
+         */
+        void finish(std::vector<uint8_t> &out);
+    };
+
+    /**
+     * Description: Encode `size` bytes of `source` into `sink`. Codes of each
+     *              block are written as soon as it is read.
+     * Return: 0 if succeed, or -1 if fail or source is not of `size`.
+     */
+    template <typename Source, typename Sink>
+    int encode(Source &source, uint64_t size, Sink &sink)
+    {
+        TRACE_SPAN("my_adaptive::encode");
+
+        if (size > UINT32_MAX) {
+            return -1;
+        }
+
+        uint32_t header[2] = { htonl(static_cast<uint32_t>(size)), htonl(ADAPTIVE_MARK) };
+        if (!sink.write(header, sizeof (header))) {
+            return -1;
+        }
+
+        adaptive_encode encoded;
+        std::vector<uint8_t> out;
+        uint8_t block[my_huffman::BLOCK_SIZE];
+        uint64_t total = 0;
+        while (true) {
+            size_t n = source.read(block, sizeof (block));
+            if (n == 0) {
+                break;
+            }
+            total += n;
+
+            out.clear();
+            encoded.encode(block, n, out);
+            if (!out.empty() && !sink.write(&out.front(), out.size())) {
+                return -1;
+            }
+        }
+
+        out.clear();
+        encoded.finish(out);
+        if (!out.empty() && !sink.write(&out.front(), out.size())) {
+            return -1;
+        }
+        return (total == size) ? 0 : -1;
+    }
+
+    /**
+     * Description: Check if payload at start of `fd` is adaptive.
+     */
+    bool is_adaptive(int fd);
+
+    /**
+     * adaptive decode of payload from a source
+     *
+     * Usage:
+     *     adaptive_decode decode;
+     *     decode.read_header(source);
+     *     decode.decode(source, sink);
+     */
+    class adaptive_decode
+    {
+    private:
+        uint32_t _original_size;
+
+    public:
+        adaptive_decode();
+
+        /**
+         * Description: Read header of payload from `source`.
+         * Return: 0 if succeed, or -1 if it is not adaptive.
+         */
+        template <typename Source>
+        int read_header(Source &source)
+        {
+            uint32_t header[2];
+            if (source.read(header, sizeof (header)) != sizeof (header) || ntohl(header[1]) != ADAPTIVE_MARK) {
+                return -1;
+            }
+            _original_size = ntohl(header[0]);
+            return 0;
+        }
+
+        /** Size of original data, known once header is read */
+        uint32_t original_size() const
+        {
+            return _original_size;
+        }
+
+        /**
+         * Description: Decode rest of `source` into `sink`.
+         * Return: 0 if succeed, or -1 if data is broken or sink fails.
+         */
+        template <typename Source, typename Sink>
+        int decode(Source &source, Sink &sink) const
+        {
+            TRACE_SPAN("my_adaptive::decode");
+
+            adaptive_tree tree;
+            // Bytes not decoded yet are moved to front before each refill,
+            // and zeros past the end keep the last code readable
+            std::vector<uint8_t> in(my_huffman::BLOCK_SIZE + CODE_BYTES, 0);
+            size_t avail = 0;
+            bool ended = false;
+            uint64_t bit = 0;
+
+            uint8_t out[my_huffman::BLOCK_SIZE];
+            uint64_t left = _original_size;
+            while (left > 0) {
+                size_t pos = static_cast<size_t>(bit >> 3);
+                if (!ended && avail - pos <= CODE_BYTES) {
+                    memmove(&in[0], &in[pos], avail - pos);
+                    avail -= pos;
+                    bit &= 7;
+                    pos = 0;
+                    while (!ended && avail < my_huffman::BLOCK_SIZE) {
+                        size_t n = source.read(&in[avail], my_huffman::BLOCK_SIZE - avail);
+                        ended = (n == 0);
+                        avail += n;
+                    }
+                    memset(&in[avail], 0, in.size() - avail);
+                }
+
+                // Whole codes are there until CODE_BYTES from end, or to end of data
+                uint64_t limit = ended ? avail * 8 : (avail - CODE_BYTES) * 8;
+                size_t count = 0;
+                while (count < sizeof (out) && count < left && bit < limit) {
+                    unsigned int c = tree.decode(&in[0], bit);
+                    tree.update(c);
+                    out[count++] = static_cast<uint8_t>(c);
+                }
+                if (bit > avail * 8 || (count == 0 && ended)) {
+                    return -1;
+                }
+
+                if (!sink.write(out, count)) {
+                    return -1;
+                }
+                left -= count;
+            }
+
+            return 0;
+        }
+    };
+};
+
+#endif
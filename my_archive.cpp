@@ -0,0 +1,547 @@
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <glob.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "my_archive.hpp"
+
+using namespace my_archive;
+
+/** Magic bytes starting an archive */
+static const char MAGIC[] = "HWAR";
+
+/** Size of magic bytes and entry count */
+static const size_t HEADER_SIZE = 8;
+
+/** Size of read buffer of archive_reader */
+static const size_t READ_BUFFER_SIZE = 65536;
+
+/**
+ * Description: Drop "." components and repeated slashes of `path`.
+ * Return: Normalized path, without leading or trailing slash.
+ */
+static std::string normalize(const std::string &path)
+{
+    std::string result;
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+
+        std::string component = path.substr(start, end - start);
+        if (!component.empty() && component != ".") {
+            if (!result.empty()) {
+                result += '/';
+            }
+            result += component;
+        }
+        start = end + 1;
+    }
+
+    return result;
+}
+
+/**
+ * Description: Name of file or directory at `path` inside archive. Path is
+ *              kept if it is relative and safe, e.g. `src/main.c`, otherwise
+ *              only its last component is used.
+ * Return: Name, or empty string for root directory.
+ */
+static std::string archive_name(const std::string &path)
+{
+    std::string name = normalize(path);
+    if (is_safe_path(name)) {
+        return name;
+    }
+
+    char *real = realpath(path.c_str(), NULL);
+    if (real == NULL) {
+        return "";
+    }
+    std::string base = basename(real);
+    free(real);
+
+    return (base == "/") ? "" : base;
+}
+
+/**
+ * Description: Append regular files under directory `dir` to `entries`,
+ *              named under `prefix`, in order of name.
+ * Return: 0 if succeed, or -1 if directory cannot be read.
+ */
+static int walk(const std::string &dir, const std::string &prefix, std::vector<archive_entry> &entries)
+{
+    using namespace std;
+
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL) {
+        perror("opendir");
+        return -1;
+    }
+
+    vector<string> names;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+            names.push_back(ent->d_name);
+        }
+    }
+    closedir(d);
+
+    // Fixed order, so the same tree makes the same archive
+    sort(names.begin(), names.end());
+
+    for (auto &name : names) {
+        string path = dir + "/" + name;
+        string entry_path = prefix.empty() ? name : prefix + "/" + name;
+
+        struct stat st;
+        if (lstat(path.c_str(), &st) < 0) {
+            continue;
+        }
+
+        // Links to files are followed, links to directories may loop
+        bool link = S_ISLNK(st.st_mode);
+        if (link && stat(path.c_str(), &st) < 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            if (!link && walk(path, entry_path, entries) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (S_ISREG(st.st_mode)) {
+            entries.push_back(archive_entry { entry_path, static_cast<uint64_t>(st.st_size), path });
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Description: Append file at `path`, or files under it if a directory, to
+ *              `entries`.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int add_path(const std::string &path, std::vector<archive_entry> &entries)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0) {
+        return -1;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        return walk(path, archive_name(path), entries);
+    }
+    // Devices, sockets and the like are skipped
+    if (!S_ISREG(st.st_mode)) {
+        return 0;
+    }
+
+    std::string name = archive_name(path);
+    if (name.empty()) {
+        return -1;
+    }
+    entries.push_back(archive_entry { name, static_cast<uint64_t>(st.st_size), path });
+    return 0;
+}
+
+/**
+ * Description: Create missing parent directories of `path`, refusing to pass
+ *              through anything but a real directory, such as a symbolic
+ *              link planted to lead out of the current directory.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int make_parents(const std::string &path)
+{
+    for (size_t pos = path.find('/'); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+        std::string dir = path.substr(0, pos);
+
+        struct stat st;
+        if (lstat(dir.c_str(), &st) == 0) {
+            if (!S_ISDIR(st.st_mode)) {
+                return -1;
+            }
+            continue;
+        }
+        if (errno != ENOENT || (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/** Append `value` to `out` in network byte order */
+static void put_u64(std::string &out, uint64_t value)
+{
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        out += static_cast<char>((value >> shift) & 0xff);
+    }
+}
+
+/** Read `size` bytes of `in` at `pos` as big-endian integer */
+static uint64_t get_be(const std::string &in, size_t pos, size_t size)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i) {
+        value = (value << 8) | static_cast<uint8_t>(in[pos + i]);
+    }
+    return value;
+}
+
+bool my_archive::is_safe_path(const std::string &path)
+{
+    if (path.empty() || path.size() > MAX_PATH_LENGTH || path[0] == '/' || path.find('\0') != std::string::npos) {
+        return false;
+    }
+
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+
+        std::string component = path.substr(start, end - start);
+        if (component.empty() || component == "." || component == "..") {
+            return false;
+        }
+        start = end + 1;
+    }
+
+    return true;
+}
+
+int my_archive::collect(const std::string &pattern, std::vector<archive_entry> &entries)
+{
+    size_t count = entries.size();
+
+    // An existing path is taken as is, even if it has glob characters
+    struct stat st;
+    if (stat(pattern.c_str(), &st) == 0) {
+        if (add_path(pattern, entries) < 0) {
+            return -1;
+        }
+        return (entries.size() > count) ? 0 : -1;
+    }
+
+    glob_t matches;
+    if (glob(pattern.c_str(), 0, NULL, &matches) != 0) {
+        globfree(&matches);
+        return -1;
+    }
+
+    int status = 0;
+    for (size_t i = 0; i < matches.gl_pathc; ++i) {
+        if (add_path(matches.gl_pathv[i], entries) < 0) {
+            status = -1;
+            break;
+        }
+    }
+    globfree(&matches);
+
+    return (status == 0 && entries.size() > count) ? 0 : -1;
+}
+
+archive_reader::archive_reader(const std::vector<archive_entry> &entries)
+: _entries(entries), _buffer(READ_BUFFER_SIZE), _current(-1), _remaining(0), _offset(0), _failed(false)
+{
+    _index.append(MAGIC, 4);
+    uint32_t count = htonl(static_cast<uint32_t>(_entries.size()));
+    _index.append(reinterpret_cast<const char *>(&count), sizeof (count));
+
+    for (auto &entry : _entries) {
+        uint16_t len = htons(static_cast<uint16_t>(entry.path.size()));
+        _index.append(reinterpret_cast<const char *>(&len), sizeof (len));
+        _index += entry.path;
+        put_u64(_index, entry.size);
+    }
+
+    seekpos(0, std::ios_base::in);
+}
+
+uint64_t archive_reader::size() const
+{
+    uint64_t total = _index.size();
+    for (auto &entry : _entries) {
+        total += entry.size;
+    }
+    return total;
+}
+
+bool archive_reader::failed() const
+{
+    return _failed;
+}
+
+archive_reader::int_type archive_reader::underflow()
+{
+    _offset += static_cast<uint64_t>(egptr() - eback());
+    setg(&_buffer.front(), &_buffer.front(), &_buffer.front());
+
+    while (!_failed) {
+        if (_remaining == 0) {
+            if (_current + 1 >= static_cast<long>(_entries.size())) {
+                _current = static_cast<long>(_entries.size());
+                return traits_type::eof();
+            }
+
+            ++_current;
+            _file.close();
+            _file.clear();
+            _file.open(_entries[_current].source, std::ifstream::in | std::ifstream::binary);
+            if (!_file.is_open()) {
+                _failed = true;
+                break;
+            }
+            _remaining = _entries[_current].size;
+            continue;
+        }
+
+        size_t len = (_remaining < _buffer.size()) ? static_cast<size_t>(_remaining) : _buffer.size();
+        _file.read(&_buffer.front(), static_cast<std::streamsize>(len));
+        size_t n = static_cast<size_t>(_file.gcount());
+
+        // Exactly the size in index is read, a shrunk file breaks the archive
+        if (n == 0) {
+            _failed = true;
+            break;
+        }
+
+        _remaining -= n;
+        setg(&_buffer.front(), &_buffer.front(), &_buffer.front() + n);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    return traits_type::eof();
+}
+
+archive_reader::pos_type archive_reader::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+{
+    if (dir == std::ios_base::cur && off == 0) {
+        return pos_type(static_cast<off_type>(_offset + static_cast<uint64_t>(gptr() - eback())));
+    }
+    if (dir == std::ios_base::beg) {
+        return seekpos(pos_type(off), which);
+    }
+
+    return pos_type(off_type(-1));
+}
+
+archive_reader::pos_type archive_reader::seekpos(pos_type pos, std::ios_base::openmode which)
+{
+    (void) which;
+
+    if (pos != pos_type(0)) {
+        return pos_type(off_type(-1));
+    }
+
+    _file.close();
+    _current = -1;
+    _remaining = 0;
+    _offset = 0;
+    _failed = false;
+
+    // Index is served straight from memory before any file
+    char *index = const_cast<char *>(_index.data());
+    setg(index, index, index + _index.size());
+    return pos;
+}
+
+archive_writer::archive_writer(my_storage::write_mode mode)
+: _mode(mode), _index_done(false), _count(0), _parse_pos(0), _current(0), _remaining(0), _bytes(0)
+{
+
+}
+
+int archive_writer::_parse_index()
+{
+    if (_parse_pos == 0) {
+        if (_index.size() < HEADER_SIZE) {
+            return 0;
+        }
+        if (_index.compare(0, 4, MAGIC) != 0) {
+            _error = "Not an archive.";
+            return -1;
+        }
+
+        _count = static_cast<uint32_t>(get_be(_index, 4, 4));
+        if (_count > MAX_ENTRIES) {
+            _error = "Too many files in archive.";
+            return -1;
+        }
+        _parse_pos = HEADER_SIZE;
+    }
+
+    while (_entries.size() < _count) {
+        if (_index.size() < _parse_pos + 2) {
+            return 0;
+        }
+
+        size_t len = static_cast<size_t>(get_be(_index, _parse_pos, 2));
+        if (_index.size() < _parse_pos + 2 + len + 8) {
+            return 0;
+        }
+
+        archive_entry entry;
+        entry.path = _index.substr(_parse_pos + 2, len);
+        entry.size = get_be(_index, _parse_pos + 2 + len, 8);
+        if (!is_safe_path(entry.path)) {
+            _error = "Unsafe path " + entry.path + " in archive.";
+            return -1;
+        }
+
+        _entries.push_back(entry);
+        _parse_pos += 2 + len + 8;
+    }
+
+    _index_done = true;
+    return 0;
+}
+
+int archive_writer::_open_current()
+{
+    // Empty files have no data to wait for
+    while (_current < _entries.size()) {
+        const archive_entry &entry = _entries[_current];
+
+        if (make_parents(entry.path) < 0) {
+            _error = "Failed to create directory of " + entry.path + ".";
+            return -1;
+        }
+
+        _file.reset(new my_storage::storage_writer(entry.path, _mode));
+        if (!_file->is_open() || _file->reserve(entry.size) < 0) {
+            _error = "Failed to open file " + entry.path + ".";
+            return -1;
+        }
+
+        _remaining = entry.size;
+        if (_remaining > 0) {
+            return 0;
+        }
+
+        if (_file->commit() < 0) {
+            _error = "Failed to write file " + entry.path + ".";
+            return -1;
+        }
+        _file.reset();
+        ++_current;
+    }
+
+    return 0;
+}
+
+int archive_writer::_close_current()
+{
+    if (_file->commit() < 0) {
+        _error = "Failed to write file " + _entries[_current].path + ".";
+        return -1;
+    }
+
+    _file.reset();
+    ++_current;
+    return _open_current();
+}
+
+int archive_writer::_write_data(const char *s, size_t n)
+{
+    while (n > 0) {
+        if (_current >= _entries.size()) {
+            _error = "Data beyond last file of archive.";
+            return -1;
+        }
+
+        size_t len = (_remaining < n) ? static_cast<size_t>(_remaining) : n;
+        if (_file->sputn(s, static_cast<std::streamsize>(len)) != static_cast<std::streamsize>(len)) {
+            _error = "Failed to write file " + _entries[_current].path + ".";
+            return -1;
+        }
+
+        s += len;
+        n -= len;
+        _remaining -= len;
+        _bytes += len;
+
+        if (_remaining == 0 && _close_current() < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+archive_writer::int_type archive_writer::overflow(int_type c)
+{
+    if (traits_type::eq_int_type(c, traits_type::eof())) {
+        return traits_type::not_eof(c);
+    }
+
+    char ch = traits_type::to_char_type(c);
+    return (xsputn(&ch, 1) == 1) ? c : traits_type::eof();
+}
+
+std::streamsize archive_writer::xsputn(const char *s, std::streamsize n)
+{
+    if (!_error.empty()) {
+        return 0;
+    }
+
+    if (_index_done) {
+        return (_write_data(s, static_cast<size_t>(n)) < 0) ? 0 : n;
+    }
+
+    // Whole index is checked before the first file is created
+    _index.append(s, static_cast<size_t>(n));
+    if (_parse_index() < 0) {
+        return 0;
+    }
+    if (!_index_done) {
+        return n;
+    }
+
+    std::string rest = _index.substr(_parse_pos);
+    _index.clear();
+    _index.shrink_to_fit();
+
+    if (_open_current() < 0 || _write_data(rest.data(), rest.size()) < 0) {
+        return 0;
+    }
+    return n;
+}
+
+int archive_writer::finish()
+{
+    if (_error.empty() && (!_index_done || _current < _entries.size())) {
+        _error = "Archive is truncated.";
+    }
+
+    return _error.empty() ? 0 : -1;
+}
+
+size_t archive_writer::count() const
+{
+    return _current;
+}
+
+uint64_t archive_writer::bytes() const
+{
+    return _bytes;
+}
+
+const std::string &archive_writer::error() const
+{
+    return _error;
+}
@@ -0,0 +1,170 @@
+#ifndef __MY_ARCHIVE_HPP__
+#define __MY_ARCHIVE_HPP__
+
+#include <streambuf>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "my_storage.hpp"
+
+/**
+ * Archive of several files, sent as one Huffman-coded payload so they share
+ * one code table and one round trip.
+ *
+ * Wire format (integers in network byte order):
+ *     "HWAR", u32 entry count
+ *     per entry: u16 path length, path, u64 file size
+ *     contents of each file in index order
+ */
+namespace my_archive
+{
+    /** Longest path of an entry */
+    const size_t MAX_PATH_LENGTH = 4096;
+
+    /** Most entries of an archive */
+    const uint32_t MAX_ENTRIES = 1 << 20;
+
+    /** One file of archive */
+    struct archive_entry
+    {
+        /** Relative path the file is unpacked to */
+        std::string path;
+        /** Size of file when index was built */
+        uint64_t size;
+        /** Path the file is read from, client only */
+        std::string source;
+    };
+
+    /**
+     * Description: Check if `path` is a relative path without empty, "." or
+     *              ".." components, which cannot escape directory it is
+     *              unpacked into.
+     * Return: true if safe.
+     */
+    bool is_safe_path(const std::string &path);
+
+    /**
+     * Description: Append regular files named by `pattern` to `entries`. A
+     *              directory is walked recursively, otherwise `pattern` is
+     *              expanded as a glob. Symbolic links to directories are not
+     *              followed.
+     * Return: 0 if succeed, or -1 if nothing matches or a file cannot be read.
+     */
+    int collect(const std::string &pattern, std::vector<archive_entry> &entries);
+
+    /**
+     * Input stream buffer reading archive of `entries`, made of index and
+     * file contents, without copying files aside. Only rewinding to start is
+     * supported, which is all an encoder needs for its second pass.
+     */
+    class archive_reader : public std::streambuf
+    {
+    private:
+        const std::vector<archive_entry> &_entries;
+        std::string _index;
+        std::vector<char> _buffer;
+
+        /** Entry being read, or -1 while reading index */
+        long _current;
+        std::ifstream _file;
+        uint64_t _remaining;
+        /** Bytes consumed before current buffer */
+        uint64_t _offset;
+        /** Set when a file could not be read or has shrunk */
+        bool _failed;
+
+    protected:
+        virtual int_type underflow();
+        virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which);
+        virtual pos_type seekpos(pos_type pos, std::ios_base::openmode which);
+
+    public:
+        archive_reader(const std::vector<archive_entry> &entries);
+
+        /**
+         * Description: Total size of archive.
+         */
+        uint64_t size() const;
+
+        /**
+         * Description: Check if every file was read in full.
+         * Return: true if a file could not be read or has shrunk.
+         */
+        bool failed() const;
+    };
+
+    /**
+     * Output stream buffer unpacking an archive as it is written, each file
+     * committed once complete. Index is checked before any file is created,
+     * so an archive with an unsafe path writes nothing.
+     *
+     * Usage:
+     *     archive_writer writer(mode);
+     *     std::ostream output(&writer);
+     *     output << ...;
+     *     writer.finish();
+     */
+    class archive_writer : public std::streambuf
+    {
+    private:
+        my_storage::write_mode _mode;
+        std::vector<archive_entry> _entries;
+        /** Bytes of index received so far */
+        std::string _index;
+        bool _index_done;
+        /** Number of entries, and bytes of index parsed so far */
+        uint32_t _count;
+        size_t _parse_pos;
+
+        size_t _current;
+        std::unique_ptr<my_storage::storage_writer> _file;
+        uint64_t _remaining;
+        uint64_t _bytes;
+        std::string _error;
+
+        /** Parse index once all of it is received */
+        int _parse_index();
+
+        /** Create file of current entry, or commit it right away if empty */
+        int _open_current();
+
+        /** Commit file of current entry and move to the next */
+        int _close_current();
+
+        /** Write file contents, moving on to next file as each completes */
+        int _write_data(const char *s, size_t n);
+
+    protected:
+        virtual int_type overflow(int_type c);
+        virtual std::streamsize xsputn(const char *s, std::streamsize n);
+
+    public:
+        archive_writer(my_storage::write_mode mode = my_storage::WRITE_BUFFERED);
+
+        /**
+         * Description: Check that archive ended after its last file.
+         * Return: 0 if succeed, or -1 if archive is truncated or broken.
+         */
+        int finish();
+
+        /**
+         * Description: Number of files unpacked.
+         */
+        size_t count() const;
+
+        /**
+         * Description: Bytes of files unpacked.
+         */
+        uint64_t bytes() const;
+
+        /**
+         * Description: Reason of failure, empty if none.
+         */
+        const std::string &error() const;
+    };
+};
+
+#endif
@@ -0,0 +1,155 @@
+#include "my_budget.hpp"
+#include "my_stats.hpp"
+
+using namespace my_budget;
+
+budget::budget(uint64_t limit)
+: _limit(limit), _used(0)
+{
+
+}
+
+int budget::acquire(uint64_t bytes, bool &waited)
+{
+    if (bytes > _limit) {
+        return -1;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_used + bytes > _limit) {
+        waited = true;
+        _cond.wait(lock, [this, bytes]() { return _used + bytes <= _limit; });
+    }
+
+    _used += bytes;
+    my_stats::set_memory(_used);
+    return 0;
+}
+
+bool budget::try_acquire(uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_used + bytes > _limit) {
+        return false;
+    }
+
+    _used += bytes;
+    my_stats::set_memory(_used);
+    return true;
+}
+
+void budget::release(uint64_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _used -= bytes;
+        my_stats::set_memory(_used);
+    }
+    _cond.notify_all();
+}
+
+uint64_t budget::used()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _used;
+}
+
+quota::quota(budget &global, uint64_t limit, uint64_t fixed, uint64_t reserve)
+: _global(global), _admitted(false), _limit(limit), _fixed(fixed), _base(0), _used(fixed), _base_free(0)
+{
+    bool waited = false;
+    if (_global.acquire(fixed + reserve, waited) == 0) {
+        _admitted = true;
+        _base = fixed + reserve;
+        _base_free = reserve;
+    }
+
+    if (waited) {
+        my_stats::add(my_stats::BUDGET_WAITS);
+    }
+}
+
+quota::~quota()
+{
+    if (_admitted) {
+        _global.release(_base);
+    }
+}
+
+bool quota::is_admitted() const
+{
+    return _admitted;
+}
+
+int quota::acquire(uint64_t bytes, uint64_t &from_base, uint64_t &from_global, bool &waited)
+{
+    // Anything else fits once all other charges are released
+    if (!_admitted || bytes > _limit - _fixed) {
+        return -1;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_used + bytes > _limit) {
+            waited = true;
+            _cond.wait(lock, [this, bytes]() { return _used + bytes <= _limit; });
+        }
+
+        _used += bytes;
+        from_base = (bytes < _base_free) ? bytes : _base_free;
+        _base_free -= from_base;
+    }
+
+    // Quota is not held while waiting, so releases of this connection go on
+    from_global = 0;
+    if (bytes > from_base) {
+        if (_global.acquire(bytes - from_base, waited) < 0) {
+            release(bytes, from_base, 0);
+            return -1;
+        }
+        from_global = bytes - from_base;
+    }
+
+    return 0;
+}
+
+void quota::release(uint64_t bytes, uint64_t from_base, uint64_t from_global)
+{
+    if (from_global > 0) {
+        _global.release(from_global);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _used -= bytes;
+        _base_free += from_base;
+    }
+    _cond.notify_all();
+}
+
+charge::charge(quota &q, uint64_t bytes)
+: _quota(q), _charged(false), _bytes(bytes), _from_base(0), _from_global(0), _waited(false)
+{
+    _charged = (_quota.acquire(bytes, _from_base, _from_global, _waited) == 0);
+
+    if (_waited) {
+        my_stats::add(my_stats::BUDGET_WAITS);
+    }
+}
+
+charge::~charge()
+{
+    if (_charged) {
+        _quota.release(_bytes, _from_base, _from_global);
+    }
+}
+
+bool charge::is_charged() const
+{
+    return _charged;
+}
+
+bool charge::waited() const
+{
+    return _waited;
+}
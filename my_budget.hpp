@@ -0,0 +1,144 @@
+#ifndef __MY_BUDGET_HPP__
+#define __MY_BUDGET_HPP__
+
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+namespace my_budget
+{
+    /**
+     * Memory shared by all connections. Bytes are charged before buffers are
+     * allocated and released when they are freed. A charge waits while it
+     * would exceed the limit.
+     */
+    class budget
+    {
+    private:
+        uint64_t _limit;
+        uint64_t _used;
+        std::mutex _mutex;
+        std::condition_variable _cond;
+
+    public:
+        budget(uint64_t limit);
+
+        /**
+         * Description: Wait until `bytes` fit, and charge them.
+         * Return: 0 if charged, to be given back to release(), or -1 if
+         *         `bytes` are beyond limit and would never fit.
+         */
+        int acquire(uint64_t bytes, bool &waited);
+
+        /**
+         * Description: Charge `bytes` only if they fit now.
+         * Return: true if charged, to be given back to release().
+         */
+        bool try_acquire(uint64_t bytes);
+
+        /**
+         * Description: Give back `bytes` charged by acquire().
+         */
+        void release(uint64_t bytes);
+
+        /**
+         * Description: Bytes charged now.
+         */
+        uint64_t used();
+    };
+
+    /**
+     * Memory of one connection, at most `limit` bytes. Its `fixed` buffers
+     * and a `reserve` for charges are taken from the shared budget when the
+     * connection is admitted and kept until it closes, so every connection can
+     * always make progress within its reserve and no two connections wait for
+     * each other. Charges beyond reserve are taken from the shared budget as
+     * they come.
+     */
+    class quota
+    {
+    private:
+        budget &_global;
+        /** Fixed buffers and reserve fit into shared budget */
+        bool _admitted;
+        uint64_t _limit;
+        uint64_t _fixed;
+        /** Fixed buffers and reserve, taken from shared budget */
+        uint64_t _base;
+        uint64_t _used;
+        /** Part of reserve not charged yet */
+        uint64_t _base_free;
+        std::mutex _mutex;
+        std::condition_variable _cond;
+
+    public:
+        /** Waits until fixed buffers and reserve fit into shared budget */
+        quota(budget &global, uint64_t limit, uint64_t fixed, uint64_t reserve);
+
+        ~quota();
+
+        /**
+         * Description: Check if fixed buffers and reserve are charged to
+         *              shared budget, false if they are beyond its limit.
+         */
+        bool is_admitted() const;
+
+        /**
+         * Description: Wait until `bytes` fit into quota and shared budget,
+         *              and charge them. `from_base` and `from_global` are set
+         *              to the parts taken from reserve and shared budget.
+         * Return: 0 if charged, to be given back to release(), or -1 if
+         *         `bytes` are beyond what fixed buffers leave of limit and
+         *         would never fit.
+         */
+        int acquire(uint64_t bytes, uint64_t &from_base, uint64_t &from_global, bool &waited);
+
+        /**
+         * Description: Give back what acquire() has charged.
+         */
+        void release(uint64_t bytes, uint64_t from_base, uint64_t from_global);
+    };
+
+    /**
+     * Bytes charged to a quota for as long as the charge exists.
+     *
+     * Usage:
+     *     charge buffers(quota, size);  // Waits if over budget
+     *     if (!buffers.is_charged()) {  // Never fits into quota
+     *         return -1;
+     *     }
+     *     ...                           // Allocate and use buffers
+     *                                   // Released when out of scope
+     */
+    class charge
+    {
+    private:
+        quota &_quota;
+        bool _charged;
+        uint64_t _bytes;
+        uint64_t _from_base;
+        uint64_t _from_global;
+        bool _waited;
+
+    public:
+        charge(quota &q, uint64_t bytes);
+
+        ~charge();
+
+        charge(const charge &) = delete;
+        charge &operator=(const charge &) = delete;
+
+        /**
+         * Description: Check if bytes are charged, false if they are beyond
+         *              quota and nothing is.
+         */
+        bool is_charged() const;
+
+        /**
+         * Description: Check if charge had to wait for memory to be released.
+         */
+        bool waited() const;
+    };
+};
+
+#endif
@@ -0,0 +1,302 @@
+#include <algorithm>
+
+#include "my_bwt.hpp"
+
+using namespace my_bwt;
+
+/** Symbols of zero runs, as digits 1 and 2 of a bijective base-2 length */
+static const uint8_t RUN_A = 0;
+static const uint8_t RUN_B = 1;
+/** Followed by a byte, rank - 254, for ranks too large to take rank + 1 */
+static const uint8_t ESCAPE = 255;
+
+/**
+ * Sort all rotations of `data`, by doubling length of sorted prefix with
+ * counting sorts, until every rotation has its own rank or all are compared.
+ * Return: start of each rotation in sorted order.
+ */
+static std::vector<uint32_t> sort_rotations(const uint8_t *data, size_t length)
+{
+    using namespace std;
+
+    vector<uint32_t> order(length), rank(length), next_order(length), next_rank(length);
+    vector<uint32_t> count(max(length, static_cast<size_t>(256)), 0);
+
+    for (size_t i = 0; i < length; ++i) {
+        count[data[i]] += 1;
+    }
+    for (size_t c = 1; c < 256; ++c) {
+        count[c] += count[c - 1];
+    }
+    for (size_t i = length; i-- > 0; ) {
+        order[--count[data[i]]] = static_cast<uint32_t>(i);
+    }
+
+    uint32_t classes = 1;
+    rank[order[0]] = 0;
+    for (size_t i = 1; i < length; ++i) {
+        if (data[order[i]] != data[order[i - 1]]) {
+            classes += 1;
+        }
+        rank[order[i]] = classes - 1;
+    }
+
+    for (size_t half = 1; half < length && classes < length; half *= 2) {
+        // Rotations sorted by their second half are sorted by the first
+        for (size_t i = 0; i < length; ++i) {
+            next_order[i] = static_cast<uint32_t>((order[i] >= half) ? order[i] - half : order[i] + length - half);
+        }
+        fill(count.begin(), count.begin() + classes, 0);
+        for (size_t i = 0; i < length; ++i) {
+            count[rank[next_order[i]]] += 1;
+        }
+        for (size_t c = 1; c < classes; ++c) {
+            count[c] += count[c - 1];
+        }
+        for (size_t i = length; i-- > 0; ) {
+            order[--count[rank[next_order[i]]]] = next_order[i];
+        }
+
+        classes = 1;
+        next_rank[order[0]] = 0;
+        uint32_t prev_second = rank[(order[0] + half < length) ? order[0] + half : order[0] + half - length];
+        for (size_t i = 1; i < length; ++i) {
+            uint32_t cur = order[i];
+            uint32_t second = rank[(cur + half < length) ? cur + half : cur + half - length];
+            if (rank[cur] != rank[order[i - 1]] || second != prev_second) {
+                classes += 1;
+            }
+            next_rank[cur] = classes - 1;
+            prev_second = second;
+        }
+        rank.swap(next_rank);
+    }
+
+    return order;
+}
+
+/** Append symbols of a run of `run` zero ranks */
+static void put_run(std::vector<uint8_t> &symbols, uint64_t run)
+{
+    while (run > 0) {
+        if (run & 1) {
+            symbols.push_back(RUN_A);
+            run = (run - 1) / 2;
+        }
+        else {
+            symbols.push_back(RUN_B);
+            run = (run - 2) / 2;
+        }
+    }
+}
+
+int my_bwt::encode_block(const uint8_t *data, size_t length, std::vector<uint8_t> &block)
+{
+    using namespace std;
+
+    TRACE_SPAN("my_bwt::encode_block");
+
+    if (length == 0 || length > MAX_BLOCK_SIZE) {
+        return -1;
+    }
+
+    // Last column of sorted rotations, and row of the data itself
+    vector<uint32_t> order = sort_rotations(data, length);
+    vector<uint8_t> last(length);
+    uint32_t primary = 0;
+    for (size_t i = 0; i < length; ++i) {
+        last[i] = data[(order[i] + length - 1) % length];
+        if (order[i] == 0) {
+            primary = static_cast<uint32_t>(i);
+        }
+    }
+    vector<uint32_t>().swap(order);
+
+    // Move to front, with runs of rank 0 coded by their length
+    vector<uint8_t> symbols;
+    symbols.reserve(length + length / 8);
+    uint8_t recent[256];
+    for (int i = 0; i < 256; ++i) {
+        recent[i] = static_cast<uint8_t>(i);
+    }
+    uint64_t run = 0;
+    for (size_t i = 0; i < length; ++i) {
+        uint8_t c = last[i];
+        if (recent[0] == c) {
+            run += 1;
+            continue;
+        }
+        put_run(symbols, run);
+        run = 0;
+
+        unsigned int r = 1;
+        while (recent[r] != c) {
+            r += 1;
+        }
+        memmove(recent + 1, recent, r);
+        recent[0] = c;
+
+        if (r < 254) {
+            symbols.push_back(static_cast<uint8_t>(r + 1));
+        }
+        else {
+            symbols.push_back(ESCAPE);
+            symbols.push_back(static_cast<uint8_t>(r - 254));
+        }
+    }
+    put_run(symbols, run);
+
+    // Symbols are Huffman coded as any other data
+    my_huffman::huffman_encode encoded;
+    encoded.set_order(1);
+    my_io::span_source count_source(&symbols.front(), symbols.size());
+    encoded.count(count_source);
+
+    block.clear();
+    block.reserve(sizeof (primary) + symbols.size() + 4096);
+    primary = htonl(primary);
+    block.resize(sizeof (primary));
+    memcpy(&block.front(), &primary, sizeof (primary));
+
+    my_io::span_source source(&symbols.front(), symbols.size());
+    my_io::buffer_sink sink(block);
+    return encoded.encode(source, sink);
+}
+
+int my_bwt::decode_block(const uint8_t *block, size_t length, size_t expected, std::vector<uint8_t> &output)
+{
+    using namespace std;
+
+    TRACE_SPAN("my_bwt::decode_block");
+
+    uint32_t primary;
+    if (length < sizeof (primary) || expected == 0 || expected > MAX_BLOCK_SIZE) {
+        return -1;
+    }
+    memcpy(&primary, block, sizeof (primary));
+    primary = ntohl(primary);
+    if (primary >= expected) {
+        return -1;
+    }
+
+    my_io::span_source source(block + sizeof (primary), length - sizeof (primary));
+    my_huffman::huffman_decode decode;
+    if (decode.read_header(source) < 0 || decode.original_size() > MAX_SYMBOLS) {
+        return -1;
+    }
+    vector<uint8_t> symbols(decode.original_size());
+    my_io::span_sink symbol_sink(symbols.empty() ? NULL : &symbols.front(), symbols.size());
+    if (decode.decode(source, symbol_sink) < 0) {
+        return -1;
+    }
+
+    // Undo runs and move to front into last column
+    vector<uint8_t> last;
+    last.reserve(expected);
+    uint8_t recent[256];
+    for (int i = 0; i < 256; ++i) {
+        recent[i] = static_cast<uint8_t>(i);
+    }
+    uint64_t run = 0, weight = 1;
+    for (size_t i = 0; i < symbols.size(); ++i) {
+        uint8_t symbol = symbols[i];
+        if (symbol == RUN_A || symbol == RUN_B) {
+            run += weight * (symbol + 1);
+            weight *= 2;
+            if (run > expected) {
+                return -1;
+            }
+            continue;
+        }
+        if (run > expected - last.size()) {
+            return -1;
+        }
+        last.insert(last.end(), static_cast<size_t>(run), recent[0]);
+        run = 0;
+        weight = 1;
+
+        unsigned int r = symbol - 1;
+        if (symbol == ESCAPE) {
+            if (++i == symbols.size() || symbols[i] > 1) {
+                return -1;
+            }
+            r = 254 + symbols[i];
+        }
+        if (last.size() == expected) {
+            return -1;
+        }
+        uint8_t c = recent[r];
+        memmove(recent + 1, recent, r);
+        recent[0] = c;
+        last.push_back(c);
+    }
+    if (run > expected - last.size()) {
+        return -1;
+    }
+    last.insert(last.end(), static_cast<size_t>(run), recent[0]);
+    if (last.size() != expected) {
+        return -1;
+    }
+    vector<uint8_t>().swap(symbols);
+
+    // Row of each char of last column in first column, then walk back from
+    // the row of data
+    size_t first[256] = { 0 };
+    for (size_t i = 0; i < expected; ++i) {
+        first[last[i]] += 1;
+    }
+    size_t sum = 0;
+    for (int c = 0; c < 256; ++c) {
+        size_t n = first[c];
+        first[c] = sum;
+        sum += n;
+    }
+    vector<uint32_t> links(expected);
+    for (size_t i = 0; i < expected; ++i) {
+        links[i] = static_cast<uint32_t>(first[last[i]]++);
+    }
+
+    output.resize(expected);
+    uint32_t row = primary;
+    for (size_t i = expected; i-- > 0; ) {
+        output[i] = last[row];
+        row = links[row];
+    }
+
+    return 0;
+}
+
+bool my_bwt::is_block_sorted(int fd)
+{
+    uint32_t header[2];
+    my_io::pread_source source(fd, 0, sizeof (header));
+    return source.read(header, sizeof (header)) == sizeof (header) && ntohl(header[1]) == BWT_MARK;
+}
+
+bwt_decode::bwt_decode()
+: _payload_size(0), _original_size(0), _block_size(0)
+{
+
+}
+
+int bwt_decode::read_header(int fd, uint64_t payload_size)
+{
+    _payload_size = payload_size;
+    _original_size = 0;
+    _block_size = 0;
+
+    uint32_t header[3];
+    my_io::pread_source source(fd, 0, payload_size);
+    if (source.read(header, sizeof (header)) != sizeof (header) || ntohl(header[1]) != BWT_MARK) {
+        return -1;
+    }
+
+    uint32_t block_size = ntohl(header[2]);
+    if (block_size == 0 || block_size > MAX_BLOCK_SIZE) {
+        return -1;
+    }
+
+    _original_size = ntohl(header[0]);
+    _block_size = block_size;
+    return 0;
+}
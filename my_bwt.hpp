@@ -0,0 +1,248 @@
+#ifndef __MY_BWT_HPP__
+#define __MY_BWT_HPP__
+
+#include <vector>
+#include <thread>
+#include <cstdint>
+#include <cstring>
+#include <arpa/inet.h>
+
+#include "my_huffman.hpp"
+#include "my_io.hpp"
+
+/**
+ * Block-sorting compression: each block of data is turned by Burrows-Wheeler
+ * transform, move-to-front and coding of zero runs into symbols of few
+ * values, which are Huffman coded on their own. Blocks are independent, so
+ * they are encoded and decoded on several threads.
+ *
+ * Payload (integers in network byte order):
+ *     u32 original size, u32 BWT_MARK, u32 block size
+ *     per block: u32 length of the rest of block, u32 primary index,
+ *                Huffman payload of symbols
+ *
+ * BWT_MARK stands where a Huffman payload has its tree, so a huffman_decode
+ * refuses it as a broken header.
+ */
+namespace my_bwt
+{
+    /** Marks payload as block-sorted */
+    const uint32_t BWT_MARK = 257;
+
+    /** Bytes of original data of a block, as bzip2 -9 */
+    const size_t MAX_BLOCK_SIZE = 900000;
+
+    /** Symbols of a block, two for a byte at most */
+    const size_t MAX_SYMBOLS = 2 * MAX_BLOCK_SIZE;
+
+    /** Bytes of a block after its length: primary index, Huffman header and codes of 8 bits at most on average */
+    const size_t MAX_BLOCK_LENGTH = sizeof (uint32_t) + 65536 + MAX_SYMBOLS;
+
+    /** Memory of decoding one block: block, symbols, last column, links and output */
+    const size_t BLOCK_MEMORY = MAX_BLOCK_LENGTH + MAX_SYMBOLS + 2 * MAX_BLOCK_SIZE + MAX_BLOCK_SIZE * sizeof (uint32_t);
+
+    /**
+     * Description: Encode `length` bytes of `data` as one block into `block`,
+     *              from its length on.
+     * Return: 0 if succeed, or -1 if fail.
+     */
+    int encode_block(const uint8_t *data, size_t length, std::vector<uint8_t> &block);
+
+    /**
+     * Description: Decode a block of `length` bytes, after its length, into
+     *              `output`, which must take `expected` bytes.
+     * Return: 0 if succeed, or -1 if block is broken.
+     */
+    int decode_block(const uint8_t *block, size_t length, size_t expected, std::vector<uint8_t> &output);
+
+    /**
+     * Description: Check if payload at start of `fd` is block-sorted.
+     */
+    bool is_block_sorted(int fd);
+
+    /**
+     * Description: Encode `size` bytes of `source` into `sink`, each round of
+     *              `threads` blocks encoded at once.
+     * Return: 0 if succeed, or -1 if fail or source is not of `size`.
+     */
+    template <typename Source, typename Sink>
+    int encode(Source &source, uint64_t size, Sink &sink, unsigned int threads)
+    {
+        using namespace std;
+
+        TRACE_SPAN("my_bwt::encode");
+
+        if (size > UINT32_MAX) {
+            return -1;
+        }
+        if (threads < 1) {
+            threads = 1;
+        }
+
+        uint32_t header[3] = { htonl(static_cast<uint32_t>(size)), htonl(BWT_MARK),
+            htonl(static_cast<uint32_t>(MAX_BLOCK_SIZE)) };
+        if (!sink.write(header, sizeof (header))) {
+            return -1;
+        }
+
+        vector< vector<uint8_t> > data(threads);
+        vector< vector<uint8_t> > blocks(threads);
+        vector<int> results(threads);
+
+        uint64_t done = 0;
+        while (done < size) {
+            unsigned int count = 0;
+            for (; count < threads && done < size; ++count) {
+                size_t length = (size - done < MAX_BLOCK_SIZE) ? static_cast<size_t>(size - done) : MAX_BLOCK_SIZE;
+                data[count].resize(length);
+                if (source.read(&data[count].front(), length) != length) {
+                    return -1;
+                }
+                done += length;
+            }
+
+            // Calling thread takes the last block of each round
+            vector<thread> workers;
+            for (unsigned int i = 0; i < count; ++i) {
+                auto work = [&data, &blocks, &results, i]() {
+                    results[i] = encode_block(&data[i].front(), data[i].size(), blocks[i]);
+                };
+                if (i + 1 < count) {
+                    workers.push_back(thread(work));
+                }
+                else {
+                    work();
+                }
+            }
+            for (auto &worker : workers) {
+                worker.join();
+            }
+
+            for (unsigned int i = 0; i < count; ++i) {
+                uint32_t length = htonl(static_cast<uint32_t>(blocks[i].size()));
+                if (results[i] < 0 || !sink.write(&length, sizeof (length)) ||
+                    !sink.write(&blocks[i].front(), blocks[i].size())) {
+                    return -1;
+                }
+            }
+        }
+
+        return 0;
+    }
+
+    /**
+     * block-sorted decode of payload in a file
+     *
+     * Usage:
+     *     bwt_decode decode;
+     *     decode.read_header(fd, payload_size);
+     *     decode.decode(fd, sink, threads);
+     */
+    class bwt_decode
+    {
+    private:
+        uint64_t _payload_size;
+        uint32_t _original_size;
+        uint32_t _block_size;
+
+    public:
+        bwt_decode();
+
+        /**
+         * Description: Read header of payload of `payload_size` bytes at
+         *              start of `fd`.
+         * Return: 0 if succeed, or -1 if it is not block-sorted or broken.
+         */
+        int read_header(int fd, uint64_t payload_size);
+
+        /** Size of original data, known once header is read */
+        uint32_t original_size() const
+        {
+            return _original_size;
+        }
+
+        /** Bytes of original data of each block but the last, known once header is read */
+        uint32_t block_size() const
+        {
+            return _block_size;
+        }
+
+        /**
+         * Description: Decode payload into `sink`, each round of `threads`
+         *              blocks decoded at once and written out in order.
+         * Return: 0 if succeed, or -1 if data is broken or sink fails.
+         */
+        template <typename Sink>
+        int decode(int fd, Sink &sink, unsigned int threads) const
+        {
+            using namespace std;
+
+            TRACE_SPAN("my_bwt::decode");
+
+            if (_block_size == 0) {
+                return -1;
+            }
+            if (threads < 1) {
+                threads = 1;
+            }
+
+            vector< vector<uint8_t> > blocks(threads);
+            vector< vector<uint8_t> > outputs(threads);
+            vector<int> results(threads);
+
+            // Blocks are found by their lengths, one after another
+            uint64_t offset = 3 * sizeof (uint32_t);
+            uint64_t done = 0;
+            while (done < _original_size) {
+                unsigned int count = 0;
+                vector<size_t> expected;
+                for (; count < threads && done < _original_size; ++count) {
+                    uint32_t length;
+                    my_io::pread_source source(fd, offset, _payload_size - offset);
+                    if (source.read(&length, sizeof (length)) != sizeof (length)) {
+                        return -1;
+                    }
+                    length = ntohl(length);
+                    if (length < sizeof (uint32_t) || length > MAX_BLOCK_LENGTH || length > _payload_size - offset - sizeof (length)) {
+                        return -1;
+                    }
+                    blocks[count].resize(length);
+                    if (source.read(&blocks[count].front(), length) != length) {
+                        return -1;
+                    }
+                    offset += sizeof (length) + length;
+
+                    size_t block = (_original_size - done < _block_size) ? _original_size - done : _block_size;
+                    expected.push_back(block);
+                    done += block;
+                }
+
+                vector<thread> workers;
+                for (unsigned int i = 0; i < count; ++i) {
+                    auto work = [&blocks, &outputs, &results, &expected, i]() {
+                        results[i] = decode_block(&blocks[i].front(), blocks[i].size(), expected[i], outputs[i]);
+                    };
+                    if (i + 1 < count) {
+                        workers.push_back(thread(work));
+                    }
+                    else {
+                        work();
+                    }
+                }
+                for (auto &worker : workers) {
+                    worker.join();
+                }
+
+                for (unsigned int i = 0; i < count; ++i) {
+                    if (results[i] < 0 || !sink.write(&outputs[i].front(), outputs[i].size())) {
+                        return -1;
+                    }
+                }
+            }
+
+            return (offset == _payload_size) ? 0 : -1;
+        }
+    };
+};
+
+#endif
@@ -0,0 +1,348 @@
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+
+#include "my_cache.hpp"
+#include "my_huffman.hpp"
+
+using namespace my_cache;
+
+/** Suffix of encoded files in cache directory */
+static const char OBJECT_SUFFIX[] = ".huf";
+
+/**
+ * Description: Check if `name` ends with OBJECT_SUFFIX.
+ */
+static bool is_object_file(const char *name)
+{
+    size_t len = strlen(name);
+    size_t suffix_len = strlen(OBJECT_SUFFIX);
+    return len > suffix_len && strcmp(name + len - suffix_len, OBJECT_SUFFIX) == 0;
+}
+
+cache_object::~cache_object()
+{
+    unlink(path.c_str());
+}
+
+bool cache_object::matches(const struct stat &st) const
+{
+    return dev == st.st_dev && ino == st.st_ino && source_size == st.st_size &&
+    mtime.tv_sec == st.st_mtim.tv_sec && mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+object_cache::object_cache(const std::string &dir, uint64_t max_bytes)
+: _dir(dir), _max_bytes(max_bytes), _bytes(0), _next_id(0)
+{
+
+}
+
+int object_cache::init()
+{
+    if (mkdir(_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
+
+    DIR *dir = opendir(_dir.c_str());
+    if (dir == NULL) {
+        perror("opendir");
+        return -1;
+    }
+
+    // Index is not persisted, so files of a previous run are unreachable
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (is_object_file(ent->d_name)) {
+            unlink((_dir + "/" + ent->d_name).c_str());
+        }
+    }
+    closedir(dir);
+
+    return 0;
+}
+
+void object_cache::_erase(const std::string &filename)
+{
+    auto it = _index.find(filename);
+    if (it == _index.end()) {
+        return;
+    }
+
+    _bytes -= it->second.object->size;
+    _lru.erase(it->second.lru_pos);
+    _index.erase(it);
+}
+
+std::shared_ptr<cache_object> object_cache::_encode(const std::string &filename, const struct stat &st)
+{
+    using namespace std;
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    // Indexed, so ranges of it can be sent without the rest
+    my_io::fd_source source(fd);
+    my_huffman::huffman_encode encoded_file;
+    encoded_file.set_checkpoint_interval(my_huffman::CHECKPOINT_INTERVAL);
+    encoded_file.set_order(1);
+    encoded_file.count(source);
+    if (source.failed() || lseek(fd, 0, SEEK_SET) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    shared_ptr<cache_object> object(new cache_object());
+    {
+        lock_guard<mutex> lock(_mutex);
+        object->path = _dir + "/" + to_string(_next_id++) + OBJECT_SUFFIX;
+    }
+    object->dev = st.st_dev;
+    object->ino = st.st_ino;
+    object->source_size = st.st_size;
+    object->mtime = st.st_mtim;
+
+    // Encoded straight into cache file, without holding it in memory
+    int out = open(object->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(fd);
+        return NULL;
+    }
+    my_io::fd_sink sink(out);
+    int status = encoded_file.encode(source, sink);
+
+    struct stat out_st;
+    if (status == 0 && (source.failed() || fstat(out, &out_st) < 0)) {
+        status = -1;
+    }
+    close(out);
+    close(fd);
+    if (status < 0) {
+        return NULL;
+    }
+    object->size = static_cast<uint64_t>(out_st.st_size);
+
+    return object;
+}
+
+std::shared_ptr<cache_object> object_cache::get(const std::string &filename, bool &hit)
+{
+    using namespace std;
+
+    hit = false;
+
+    struct stat st;
+    if (stat(filename.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+        return NULL;
+    }
+
+    {
+        lock_guard<mutex> lock(_mutex);
+        auto it = _index.find(filename);
+        if (it != _index.end()) {
+            if (it->second.object->matches(st)) {
+                _lru.splice(_lru.begin(), _lru, it->second.lru_pos);
+                hit = true;
+                return it->second.object;
+            }
+            _erase(filename);
+        }
+    }
+
+    // Encode without holding lock, so hits of other files go on
+    shared_ptr<cache_object> object = _encode(filename, st);
+    if (object == NULL) {
+        return NULL;
+    }
+
+    // Do not cache if file was replaced while being encoded
+    struct stat st_after;
+    if (stat(filename.c_str(), &st_after) < 0 || !object->matches(st_after) || object->size > _max_bytes) {
+        return object;
+    }
+
+    lock_guard<mutex> lock(_mutex);
+    _erase(filename);
+    while (_bytes + object->size > _max_bytes && !_lru.empty()) {
+        string victim = _lru.back();
+        _erase(victim);
+    }
+
+    _lru.push_front(filename);
+    _index[filename] = entry { object, _lru.begin() };
+    _bytes += object->size;
+
+    return object;
+}
+
+disk_cache::disk_cache(const std::string &dir, uint64_t max_bytes)
+: _dir(dir), _max_bytes(max_bytes)
+{
+
+}
+
+int disk_cache::init()
+{
+    // Create parent directories as well
+    for (size_t pos = _dir.find('/', 1); ; pos = _dir.find('/', pos + 1)) {
+        std::string path = _dir.substr(0, pos);
+        if (mkdir(path.c_str(), 0755) < 0 && errno != EEXIST) {
+            perror("mkdir");
+            return -1;
+        }
+        if (pos == std::string::npos) {
+            break;
+        }
+    }
+
+    // Limit may be lower than last time
+    _evict(0);
+    return 0;
+}
+
+std::string disk_cache::make_key(const std::string &pathname, const struct stat &st, const std::string &codec)
+{
+    char *real = realpath(pathname.c_str(), NULL);
+    if (real == NULL) {
+        return "";
+    }
+
+    std::ostringstream key;
+    key << real << "|" << st.st_dev << "|" << st.st_ino << "|" << st.st_size << "|" <<
+    st.st_mtim.tv_sec << "." << st.st_mtim.tv_nsec << "|" << codec;
+    free(real);
+
+    return key.str();
+}
+
+std::string disk_cache::_entry_path(const std::string &key) const
+{
+    // FNV-1a, the key itself is kept in entry to rule out collisions
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : key) {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+
+    char name[32];
+    snprintf(name, sizeof (name), "%016llx", static_cast<unsigned long long>(hash));
+    return _dir + "/" + name + OBJECT_SUFFIX;
+}
+
+int disk_cache::lookup(const std::string &key, std::string &data)
+{
+    using namespace std;
+
+    string path = _entry_path(key);
+    ifstream entry(path, fstream::in | fstream::binary);
+    if (!entry.is_open()) {
+        return -1;
+    }
+
+    // Entry is the key on its own line, followed by encoded data
+    string entry_key;
+    if (!getline(entry, entry_key) || entry_key != key) {
+        return -1;
+    }
+
+    streampos start = entry.tellg();
+    entry.seekg(0, entry.end);
+    streampos end = entry.tellg();
+    entry.seekg(start);
+
+    data.resize(static_cast<size_t>(end - start));
+    if (!data.empty() && !entry.read(&data[0], static_cast<streamsize>(data.size()))) {
+        return -1;
+    }
+
+    // Modification time of entry tells when it was last used
+    utimensat(AT_FDCWD, path.c_str(), NULL, 0);
+    return 0;
+}
+
+int disk_cache::store(const std::string &key, const void *data, size_t len)
+{
+    using namespace std;
+
+    uint64_t size = key.size() + 1 + len;
+    if (size > _max_bytes) {
+        return -1;
+    }
+
+    _evict(size);
+
+    // Written aside and renamed, so other processes never see a partial entry
+    string path = _entry_path(key);
+    string tmp_path = path + "." + to_string(getpid()) + ".tmp";
+    {
+        ofstream entry(tmp_path, fstream::out | fstream::binary | fstream::trunc);
+        entry << key << '\n';
+        entry.write(static_cast<const char *>(data), static_cast<streamsize>(len));
+        if (!entry.flush()) {
+            entry.close();
+            unlink(tmp_path.c_str());
+            return -1;
+        }
+    }
+
+    if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+        perror("rename");
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+
+    return 0;
+}
+
+void disk_cache::_evict(uint64_t incoming)
+{
+    using namespace std;
+
+    DIR *dir = opendir(_dir.c_str());
+    if (dir == NULL) {
+        return;
+    }
+
+    /** Last used time and path of each entry */
+    vector< pair<struct timespec, string> > entries;
+    uint64_t total = 0;
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (!is_object_file(ent->d_name)) {
+            continue;
+        }
+
+        string path = _dir + "/" + ent->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0) {
+            entries.push_back(make_pair(st.st_mtim, path));
+            total += static_cast<uint64_t>(st.st_size);
+        }
+    }
+    closedir(dir);
+
+    sort(entries.begin(), entries.end(), [](const pair<struct timespec, string> &a, const pair<struct timespec, string> &b) {
+        return a.first.tv_sec < b.first.tv_sec || (a.first.tv_sec == b.first.tv_sec && a.first.tv_nsec < b.first.tv_nsec);
+    });
+
+    for (auto &entry : entries) {
+        if (total + incoming <= _max_bytes) {
+            break;
+        }
+
+        struct stat st;
+        if (stat(entry.second.c_str(), &st) == 0 && unlink(entry.second.c_str()) == 0) {
+            total -= static_cast<uint64_t>(st.st_size);
+        }
+    }
+}
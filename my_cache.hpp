@@ -0,0 +1,137 @@
+#ifndef __MY_CACHE_HPP__
+#define __MY_CACHE_HPP__
+
+#include <string>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+namespace my_cache
+{
+    /** Huffman-encoded form of a file, kept in a file of cache directory */
+    struct cache_object
+    {
+        /** Path of encoded file */
+        std::string path;
+        /** Size of encoded file */
+        uint64_t size;
+
+        /** Source file the object was encoded from */
+        dev_t dev;
+        ino_t ino;
+        off_t source_size;
+        struct timespec mtime;
+
+        /** Encoded file is removed when neither cache nor any sender uses it */
+        ~cache_object();
+
+        /**
+         * Description: Check if object still matches source file of `st`.
+         * Return: true if up to date.
+         */
+        bool matches(const struct stat &st) const;
+    };
+
+    /**
+     * LRU cache of encoded files, bounded by total size of encoded files.
+     * Index is in memory, encoded data is on disk to be sent by sendfile().
+     * An object is invalidated when its source file changes in inode, size or
+     * mtime.
+     */
+    class object_cache
+    {
+    private:
+        struct entry
+        {
+            std::shared_ptr<cache_object> object;
+            std::list<std::string>::iterator lru_pos;
+        };
+
+        std::string _dir;
+        uint64_t _max_bytes;
+        uint64_t _bytes;
+        unsigned long _next_id;
+
+        std::mutex _mutex;
+        /** Filenames, most recently used first */
+        std::list<std::string> _lru;
+        std::map<std::string, entry> _index;
+
+        /** Remove `filename` from index. Caller holds _mutex */
+        void _erase(const std::string &filename);
+
+        /** Encode `filename` into a new file of cache directory */
+        std::shared_ptr<cache_object> _encode(const std::string &filename, const struct stat &st);
+
+    public:
+        object_cache(const std::string &dir, uint64_t max_bytes);
+
+        /**
+         * Description: Create cache directory, and remove encoded files left
+         *              by a previous run.
+         * Return: 0 if succeed, or -1 if fail.
+         */
+        int init();
+
+        /**
+         * Description: Get encoded form of `filename`, encoding it if not
+         *              cached or out of date. `hit` tells if it was cached.
+         * Return: Cached object, or NULL if file cannot be read.
+         */
+        std::shared_ptr<cache_object> get(const std::string &filename, bool &hit);
+    };
+
+    /**
+     * Cache of encoded files kept across runs, for uploading unchanged files
+     * again. Entry is found by a key naming the source file and the way it
+     * was encoded, so a changed file simply misses and its old entry ages
+     * out. Least recently used entries are removed beyond `max_bytes`.
+     * Several processes may share a directory.
+     */
+    class disk_cache
+    {
+    private:
+        std::string _dir;
+        uint64_t _max_bytes;
+
+        /** Path of entry of `key` */
+        std::string _entry_path(const std::string &key) const;
+
+        /** Remove least recently used entries until `incoming` more bytes fit */
+        void _evict(uint64_t incoming);
+
+    public:
+        disk_cache(const std::string &dir, uint64_t max_bytes);
+
+        /**
+         * Description: Create cache directory.
+         * Return: 0 if succeed, or -1 if fail.
+         */
+        int init();
+
+        /**
+         * Description: Make key of file at `pathname` with status `st`,
+         *              encoded by `codec`.
+         * Return: Key, or empty string if path cannot be resolved.
+         */
+        static std::string make_key(const std::string &pathname, const struct stat &st, const std::string &codec);
+
+        /**
+         * Description: Read entry of `key` into `data`, and mark it used.
+         * Return: 0 if found, or -1 if not.
+         */
+        int lookup(const std::string &key, std::string &data);
+
+        /**
+         * Description: Save `len` bytes of `data` as entry of `key`.
+         * Return: 0 if succeed, or -1 if fail.
+         */
+        int store(const std::string &key, const void *data, size_t len);
+    };
+};
+
+#endif
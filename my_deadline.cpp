@@ -0,0 +1,245 @@
+#include <sstream>
+#include <cstdlib>
+
+#include <sys/socket.h>
+
+#include "my_deadline.hpp"
+#include "my_stats.hpp"
+
+using namespace my_deadline;
+
+/** Ticks of a second */
+static const uint64_t TICKS_PER_SECOND = 1000 / my_timer::TICK_MS;
+
+limits my_deadline::default_limits()
+{
+    limits l;
+    l.handshake = 10;
+    l.idle = 300;
+    l.command = 30;
+    l.transfer = 30;
+    l.min_rate = 1024;
+    return l;
+}
+
+/** Parse a number with optional K or M suffix, -1 if invalid */
+static long long parse_value(const std::string &str)
+{
+    char *end;
+    long long value = strtoll(str.c_str(), &end, 10);
+    if (end == str.c_str() || value < 0) {
+        return -1;
+    }
+
+    if (*end == 'K' || *end == 'k') {
+        value <<= 10;
+        end += 1;
+    }
+    else if (*end == 'M' || *end == 'm') {
+        value <<= 20;
+        end += 1;
+    }
+
+    return (*end == '\0' && value <= UINT32_MAX) ? value : -1;
+}
+
+int my_deadline::parse_limits(const std::string &spec, limits &parsed)
+{
+    using namespace std;
+
+    limits l = default_limits();
+
+    stringstream ss(spec);
+    string item;
+    while (getline(ss, item, ',')) {
+        size_t eq = item.find('=');
+        if (eq == string::npos) {
+            return -1;
+        }
+
+        string key = item.substr(0, eq);
+        long long value = parse_value(item.substr(eq + 1));
+        if (value < 0) {
+            return -1;
+        }
+
+        if (key == "handshake") {
+            l.handshake = static_cast<unsigned int>(value);
+        }
+        else if (key == "idle") {
+            l.idle = static_cast<unsigned int>(value);
+        }
+        else if (key == "command") {
+            l.command = static_cast<unsigned int>(value);
+        }
+        else if (key == "transfer") {
+            l.transfer = static_cast<unsigned int>(value);
+        }
+        else if (key == "rate") {
+            l.min_rate = static_cast<uint64_t>(value);
+        }
+        else {
+            return -1;
+        }
+    }
+
+    parsed = l;
+    return 0;
+}
+
+const char *my_deadline::phase_name(phase p)
+{
+    switch (p) {
+    case PHASE_HANDSHAKE:
+        return "handshake";
+    case PHASE_IDLE:
+        return "idle";
+    case PHASE_COMMAND:
+        return "command";
+    case PHASE_TRANSFER:
+        return "transfer";
+    default:
+        return "busy";
+    }
+}
+
+void my_deadline::progress_hook(void *arg, int bytes)
+{
+    static_cast<connection_deadline *>(arg)->progress(bytes);
+}
+
+connection_deadline::connection_deadline(reaper &r, int fd)
+: _reaper(r), _fd(fd), _phase(PHASE_HANDSHAKE), _deadline(0), _scheduled(0), _moved(0), _window_start(0),
+  _expired(false)
+{
+    _timer.data = this;
+}
+
+void connection_deadline::enter(phase p)
+{
+    // Phase it expired in is kept to tell
+    if (_expired.load()) {
+        return;
+    }
+
+    unsigned int seconds;
+    switch (p) {
+    case PHASE_HANDSHAKE:
+        seconds = _reaper._limits.handshake;
+        break;
+    case PHASE_IDLE:
+        seconds = _reaper._limits.idle;
+        break;
+    case PHASE_COMMAND:
+        seconds = _reaper._limits.command;
+        break;
+    case PHASE_TRANSFER:
+        seconds = _reaper._limits.transfer;
+        break;
+    default:
+        seconds = 0;
+        break;
+    }
+
+    uint64_t deadline = _reaper._deadline_after(my_timer::current_tick(), seconds);
+    _window_start.store(_moved.load());
+    _phase.store(p);
+    _deadline.store(deadline);
+
+    // Only a deadline earlier than the tick scheduled has to move the timer
+    if (deadline != 0 && deadline < _scheduled.load()) {
+        std::lock_guard<std::mutex> lock(_reaper._mutex);
+        _reaper._schedule(*this, deadline);
+    }
+}
+
+void connection_deadline::progress(int bytes)
+{
+    _moved.fetch_add(static_cast<uint64_t>(bytes), std::memory_order_relaxed);
+    if (_phase.load(std::memory_order_relaxed) == PHASE_IDLE) {
+        enter(PHASE_COMMAND);
+    }
+}
+
+reaper::reaper(const limits &l)
+: _limits(l), _wheel(my_timer::current_tick())
+{
+
+}
+
+uint64_t reaper::_deadline_after(uint64_t now, unsigned int seconds) const
+{
+    return (seconds == 0) ? 0 : now + seconds * TICKS_PER_SECOND;
+}
+
+void reaper::_schedule(connection_deadline &d, uint64_t tick)
+{
+    // Timers disarmed or expired stay so
+    if (!d._timer.armed() || tick >= d._timer.expires) {
+        return;
+    }
+
+    _wheel.schedule(d._timer, tick);
+    d._scheduled.store(tick);
+}
+
+void reaper::_due(connection_deadline &d, uint64_t now)
+{
+    uint64_t deadline = d._deadline.load();
+
+    if (deadline != 0 && deadline <= now && d.current() == PHASE_TRANSFER) {
+        // A window moving enough bytes opens the next one
+        uint64_t moved = d._moved.load();
+        uint64_t needed = _limits.min_rate * _limits.transfer;
+        if (moved - d._window_start.load() >= ((needed > 0) ? needed : 1)) {
+            d._window_start.store(moved);
+            uint64_t next = _deadline_after(now, _limits.transfer);
+            // Phase changed meanwhile keeps its own deadline
+            deadline = d._deadline.compare_exchange_strong(deadline, next) ? next : deadline;
+        }
+    }
+
+    if (deadline != 0 && deadline <= now) {
+        d._expired.store(true);
+        shutdown(d._fd, SHUT_RDWR);
+        my_stats::add(my_stats::CONNECTIONS_TIMED_OUT);
+        return;
+    }
+
+    // Phases without deadline wait as far as wheel reaches, until one comes
+    uint64_t tick = (deadline != 0) ? deadline : now + my_timer::MAX_AHEAD;
+    _wheel.schedule(d._timer, tick);
+    d._scheduled.store(tick);
+}
+
+void reaper::arm(connection_deadline &d)
+{
+    uint64_t now = my_timer::current_tick();
+    uint64_t deadline = _deadline_after(now, _limits.handshake);
+    uint64_t tick = (deadline != 0) ? deadline : now + my_timer::MAX_AHEAD;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    d._deadline.store(deadline);
+    _wheel.schedule(d._timer, tick);
+    d._scheduled.store(tick);
+}
+
+void reaper::disarm(connection_deadline &d)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _wheel.cancel(d._timer);
+}
+
+int reaper::run()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    uint64_t now = my_timer::current_tick();
+    _expired.clear();
+    _wheel.advance(now, _expired);
+    for (size_t i = 0; i < _expired.size(); ++i) {
+        _due(*static_cast<connection_deadline *>(_expired[i]->data), now);
+    }
+
+    return (_wheel.size() > 0) ? static_cast<int>(my_timer::TICK_MS) : -1;
+}
@@ -0,0 +1,205 @@
+#ifndef __MY_DEADLINE_HPP__
+#define __MY_DEADLINE_HPP__
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "my_timer.hpp"
+
+/**
+ * Deadlines of connections. Each connection is in one phase at a time, and
+ * a phase may give it a deadline; past it, the reaper shuts its socket down,
+ * which wakes its thread from a blocking send or receive to close it.
+ *
+ * Bytes moved only bump a counter, and deadlines that move later are left
+ * in the wheel until their old tick, where they are put forward, so a busy
+ * connection costs no lock on its way.
+ */
+namespace my_deadline
+{
+    /** Phases of a connection */
+    enum phase
+    {
+        /** From accepting to first command */
+        PHASE_HANDSHAKE,
+        /** Waiting for a command */
+        PHASE_IDLE,
+        /** Receiving rest of a command once it starts */
+        PHASE_COMMAND,
+        /** Moving a payload, which must keep a minimum rate */
+        PHASE_TRANSFER,
+        /** Working on its own, no deadline */
+        PHASE_BUSY,
+        PHASE_COUNT
+    };
+
+    /** Seconds each phase may take, 0 for no limit */
+    struct limits
+    {
+        unsigned int handshake;
+        unsigned int idle;
+        unsigned int command;
+        /** Seconds of each window of a transfer, which must move min_rate per second */
+        unsigned int transfer;
+        uint64_t min_rate;
+    };
+
+    /**
+     * Description: Default limits: handshake 10, idle 300, command 30,
+     *              transfer 30 seconds, at 1 KB/s at least.
+     */
+    limits default_limits();
+
+    /**
+     * Description: Parse `spec` like "idle=60,transfer=10,rate=4K" into
+     *              `parsed`, starting from default limits.
+     * Return: 0 if succeed, or -1 if a key or value is invalid.
+     */
+    int parse_limits(const std::string &spec, limits &parsed);
+
+    /**
+     * Description: Name of phase `p`.
+     */
+    const char *phase_name(phase p);
+
+    class reaper;
+
+    /** Deadline of one connection, armed in a reaper while connection lives */
+    class connection_deadline
+    {
+        friend class reaper;
+
+    private:
+        reaper &_reaper;
+        my_timer::timer _timer;
+        int _fd;
+        std::atomic<int> _phase;
+        /** Tick of deadline, or 0 for none */
+        std::atomic<uint64_t> _deadline;
+        /** Tick timer is scheduled at, changed under lock of reaper */
+        std::atomic<uint64_t> _scheduled;
+        /** Bytes moved, and bytes moved when current window started */
+        std::atomic<uint64_t> _moved;
+        std::atomic<uint64_t> _window_start;
+        std::atomic<bool> _expired;
+
+    public:
+        connection_deadline(reaper &r, int fd);
+
+        connection_deadline(const connection_deadline &) = delete;
+        connection_deadline &operator=(const connection_deadline &) = delete;
+
+        /**
+         * Description: Enter phase `p`, with its deadline from now.
+         */
+        void enter(phase p);
+
+        /**
+         * Description: Count `bytes` moved. First bytes of a command start
+         *              its deadline.
+         */
+        void progress(int bytes);
+
+        /**
+         * Description: Check if connection was shut down for passing a
+         *              deadline.
+         */
+        bool expired() const
+        {
+            return _expired.load();
+        }
+
+        /**
+         * Description: Phase connection is in, or was in when it expired.
+         */
+        phase current() const
+        {
+            return static_cast<phase>(_phase.load());
+        }
+    };
+
+    /**
+     * Keep a connection in a phase while in scope, and busy afterwards.
+     *
+     * Usage:
+     *     phase_scope transfer(deadline, PHASE_TRANSFER);
+     *     ...                                          // Send or receive payload
+     */
+    class phase_scope
+    {
+    private:
+        connection_deadline &_deadline;
+
+    public:
+        phase_scope(connection_deadline &deadline, phase p)
+        : _deadline(deadline)
+        {
+            _deadline.enter(p);
+        }
+
+        ~phase_scope()
+        {
+            _deadline.enter(PHASE_BUSY);
+        }
+
+        phase_scope(const phase_scope &) = delete;
+        phase_scope &operator=(const phase_scope &) = delete;
+    };
+
+    /**
+     * Description: Hook for my_set_progress_hook(), `arg` is a
+     *              connection_deadline.
+     */
+    void progress_hook(void *arg, int bytes);
+
+    /**
+     * Wheel of deadlines of all connections, advanced by the thread that
+     * accepts them. Connections are armed on accepting, so wheel is empty,
+     * and the thread may sleep, only while no connection is open.
+     */
+    class reaper
+    {
+        friend class connection_deadline;
+
+    private:
+        limits _limits;
+        std::mutex _mutex;
+        my_timer::timer_wheel _wheel;
+        std::vector<my_timer::timer *> _expired;
+
+        /** Ticks of `seconds` from `now`, or 0 if seconds is 0 */
+        uint64_t _deadline_after(uint64_t now, unsigned int seconds) const;
+
+        /** Schedule `d` at `tick` if earlier than it is scheduled, with lock held */
+        void _schedule(connection_deadline &d, uint64_t tick);
+
+        /** Handle timer of `d` come due at `now`, with lock held */
+        void _due(connection_deadline &d, uint64_t now);
+
+    public:
+        explicit reaper(const limits &l);
+
+        /**
+         * Description: Arm `d` of a connection just accepted, in handshake.
+         */
+        void arm(connection_deadline &d);
+
+        /**
+         * Description: Disarm `d` before its socket is closed, as its
+         *              descriptor may be reused afterwards.
+         */
+        void disarm(connection_deadline &d);
+
+        /**
+         * Description: Shut down connections past their deadlines.
+         * Return: Milliseconds to wait before next run, or -1 if no
+         *         connection is armed.
+         */
+        int run();
+    };
+};
+
+#endif
@@ -0,0 +1,290 @@
+#include <unordered_map>
+#include <cstring>
+#include <arpa/inet.h>
+
+#include "my_delta.hpp"
+
+using namespace my_delta;
+
+/** Smallest and largest block size */
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 131072
+
+static void put_u32(std::string &dst, uint32_t value)
+{
+    value = htonl(value);
+    dst.append(reinterpret_cast<const char *>(&value), sizeof (value));
+}
+
+static void put_u64(std::string &dst, uint64_t value)
+{
+    put_u32(dst, static_cast<uint32_t>(value >> 32));
+    put_u32(dst, static_cast<uint32_t>(value));
+}
+
+static uint32_t get_u32(const uint8_t *src)
+{
+    uint32_t value;
+    memcpy(&value, src, sizeof (value));
+    return ntohl(value);
+}
+
+static uint64_t get_u64(const uint8_t *src)
+{
+    return (static_cast<uint64_t>(get_u32(src)) << 32) | get_u32(src + 4);
+}
+
+strong_hasher::strong_hasher()
+: _hash(14695981039346656037ULL)
+{
+
+}
+
+void strong_hasher::update(const uint8_t *data, size_t len)
+{
+    uint64_t hash = _hash;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    _hash = hash;
+}
+
+uint64_t strong_hasher::digest() const
+{
+    return _hash;
+}
+
+rolling_checksum::rolling_checksum(const uint8_t *data, size_t len)
+: _a(0), _b(0), _len(len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        _a += data[i];
+        _b += static_cast<uint32_t>(len - i) * data[i];
+    }
+    _a &= 0xffff;
+    _b &= 0xffff;
+}
+
+uint32_t my_delta::choose_block_size(uint64_t file_size)
+{
+    // About square root of file size, as rsync does
+    uint32_t block_size = MIN_BLOCK_SIZE;
+    while (block_size < MAX_BLOCK_SIZE && static_cast<uint64_t>(block_size) * block_size < file_size) {
+        block_size *= 2;
+    }
+    return block_size;
+}
+
+int my_delta::make_signatures(std::istream &input, uint32_t block_size, std::vector<block_signature> &sigs)
+{
+    std::vector<uint8_t> buf(block_size);
+
+    sigs.clear();
+    while (true) {
+        input.read(reinterpret_cast<char *>(&buf.front()), block_size);
+        if (input.gcount() != static_cast<std::streamsize>(block_size)) {
+            // Last partial block is always sent as literals
+            break;
+        }
+
+        block_signature sig;
+        sig.weak = rolling_checksum(&buf.front(), block_size).value();
+        strong_hasher hasher;
+        hasher.update(&buf.front(), block_size);
+        sig.strong = hasher.digest();
+        sigs.push_back(sig);
+    }
+
+    return input.bad() ? -1 : 0;
+}
+
+void my_delta::make_delta(const uint8_t *data, size_t len, uint32_t block_size,
+    const std::vector<block_signature> &sigs, std::vector<delta_op> &ops, std::string &literals)
+{
+    using namespace std;
+
+    ops.clear();
+
+    /** Rolling checksum to blocks of old copy */
+    unordered_map< uint32_t, vector<uint32_t> > table;
+    for (uint32_t i = 0; i < sigs.size(); ++i) {
+        table[sigs[i].weak].push_back(i);
+    }
+
+    size_t pos = 0;
+    size_t literal_start = 0;
+
+    auto flush_literal = [&](size_t end) {
+        if (end > literal_start) {
+            literals.append(reinterpret_cast<const char *>(data + literal_start), end - literal_start);
+            delta_op op = { OP_LITERAL, static_cast<uint32_t>(end - literal_start), 0 };
+            ops.push_back(op);
+        }
+    };
+
+    if (!table.empty() && len >= block_size) {
+        rolling_checksum checksum(data, block_size);
+
+        while (pos + block_size <= len) {
+            bool matched = false;
+            auto it = table.find(checksum.value());
+            if (it != table.end()) {
+                strong_hasher hasher;
+                hasher.update(data + pos, block_size);
+                uint64_t strong = hasher.digest();
+
+                for (uint32_t block : it->second) {
+                    if (sigs[block].strong != strong) {
+                        continue;
+                    }
+
+                    flush_literal(pos);
+
+                    // Merge with previous copy if blocks are contiguous
+                    if (!ops.empty() && ops.back().type == OP_COPY && ops.back().a + ops.back().b == block) {
+                        ops.back().b += 1;
+                    }
+                    else {
+                        delta_op op = { OP_COPY, block, 1 };
+                        ops.push_back(op);
+                    }
+
+                    pos += block_size;
+                    literal_start = pos;
+                    matched = true;
+                    break;
+                }
+            }
+
+            if (matched) {
+                if (pos + block_size <= len) {
+                    checksum = rolling_checksum(data + pos, block_size);
+                }
+                continue;
+            }
+
+            if (pos + block_size < len) {
+                checksum.roll(data[pos], data[pos + block_size]);
+            }
+            pos += 1;
+        }
+    }
+
+    flush_literal(len);
+}
+
+int64_t my_delta::apply_delta(std::istream &old_file, uint32_t block_count, uint32_t block_size,
+    const std::vector<delta_op> &ops, std::istream &literals, std::ostream &output, uint64_t &file_hash)
+{
+    std::vector<uint8_t> buf(block_size);
+    strong_hasher hasher;
+    int64_t written = 0;
+
+    for (auto &op : ops) {
+        if (op.type == OP_LITERAL) {
+            // Copied through block buffer, literals are never held whole
+            for (uint32_t left = op.a; left > 0; ) {
+                uint32_t len = (left < block_size) ? left : block_size;
+                literals.read(reinterpret_cast<char *>(&buf.front()), len);
+                if (literals.gcount() != static_cast<std::streamsize>(len)) {
+                    return -1;
+                }
+                output.write(reinterpret_cast<const char *>(&buf.front()), len);
+                hasher.update(&buf.front(), len);
+                left -= len;
+            }
+            written += op.a;
+        }
+        else if (op.type == OP_COPY) {
+            if (op.a >= block_count || op.b > block_count - op.a) {
+                return -1;
+            }
+            old_file.clear();
+            old_file.seekg(static_cast<std::streamoff>(op.a) * block_size);
+            for (uint32_t i = 0; i < op.b; ++i) {
+                old_file.read(reinterpret_cast<char *>(&buf.front()), block_size);
+                if (old_file.gcount() != static_cast<std::streamsize>(block_size)) {
+                    return -1;
+                }
+                output.write(reinterpret_cast<const char *>(&buf.front()), block_size);
+                hasher.update(&buf.front(), block_size);
+            }
+            written += static_cast<int64_t>(op.b) * block_size;
+        }
+        else {
+            return -1;
+        }
+    }
+
+    if (!output.good()) {
+        return -1;
+    }
+
+    file_hash = hasher.digest();
+    return written;
+}
+
+void my_delta::pack_signatures(const std::vector<block_signature> &sigs, std::string &dst)
+{
+    dst.reserve(dst.size() + sigs.size() * SIGNATURE_SIZE);
+    for (auto &sig : sigs) {
+        put_u32(dst, sig.weak);
+        put_u64(dst, sig.strong);
+    }
+}
+
+void my_delta::unpack_signatures(const uint8_t *src, size_t count, std::vector<block_signature> &sigs)
+{
+    sigs.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        sigs[i].weak = get_u32(src + i * SIGNATURE_SIZE);
+        sigs[i].strong = get_u64(src + i * SIGNATURE_SIZE + 4);
+    }
+}
+
+void my_delta::pack_delta(const delta_header &header, const std::vector<delta_op> &ops, std::string &dst)
+{
+    put_u32(dst, header.block_size);
+    put_u32(dst, static_cast<uint32_t>(ops.size()));
+    put_u64(dst, header.file_size);
+    put_u64(dst, header.file_hash);
+
+    for (auto &op : ops) {
+        dst.push_back(static_cast<char>(op.type));
+        put_u32(dst, op.a);
+        put_u32(dst, op.b);
+    }
+}
+
+int my_delta::unpack_delta(std::istream &input, delta_header &header, std::vector<delta_op> &ops)
+{
+    uint8_t buf[DELTA_HEADER_SIZE];
+    input.read(reinterpret_cast<char *>(buf), sizeof (buf));
+    if (input.gcount() != static_cast<std::streamsize>(sizeof (buf))) {
+        return -1;
+    }
+
+    header.block_size = get_u32(buf);
+    header.op_count = get_u32(buf + 4);
+    header.file_size = get_u64(buf + 8);
+    header.file_hash = get_u64(buf + 16);
+
+    if (header.block_size == 0 || header.block_size > MAX_BLOCK_SIZE) {
+        return -1;
+    }
+
+    ops.clear();
+    for (uint32_t i = 0; i < header.op_count; ++i) {
+        uint8_t op_buf[OP_SIZE];
+        input.read(reinterpret_cast<char *>(op_buf), sizeof (op_buf));
+        if (input.gcount() != static_cast<std::streamsize>(sizeof (op_buf))) {
+            return -1;
+        }
+
+        delta_op op = { op_buf[0], get_u32(op_buf + 1), get_u32(op_buf + 5) };
+        ops.push_back(op);
+    }
+
+    return 0;
+}
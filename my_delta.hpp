@@ -0,0 +1,144 @@
+#ifndef __MY_DELTA_HPP__
+#define __MY_DELTA_HPP__
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace my_delta
+{
+    /** Signature of one block of the old copy */
+    struct block_signature
+    {
+        /** Rolling checksum, cheap to slide by one byte */
+        uint32_t weak;
+        /** Strong hash, to confirm a rolling checksum match */
+        uint64_t strong;
+    };
+
+    /** Size of a signature in wire format */
+    const size_t SIGNATURE_SIZE = 12;
+
+    /** Delta operation types */
+    enum op_type
+    {
+        /** Take next `length` bytes from literals */
+        OP_LITERAL = 0,
+        /** Copy `count` blocks from old copy starting at block `block` */
+        OP_COPY = 1,
+    };
+
+    /** One instruction to rebuild the new file */
+    struct delta_op
+    {
+        uint8_t type;
+        /** Literal length, or first block to copy */
+        uint32_t a;
+        /** Number of blocks to copy (copy only) */
+        uint32_t b;
+    };
+
+    /** Size of a delta operation in wire format */
+    const size_t OP_SIZE = 9;
+
+    /** Size of delta header in wire format */
+    const size_t DELTA_HEADER_SIZE = 24;
+
+    /** Header of delta payload */
+    struct delta_header
+    {
+        uint32_t block_size;
+        uint32_t op_count;
+        /** Size of rebuilt file */
+        uint64_t file_size;
+        /** Strong hash of rebuilt file */
+        uint64_t file_hash;
+    };
+
+    /** 64-bit FNV-1a hash. Not cryptographic, only for detecting changes */
+    class strong_hasher
+    {
+    private:
+        uint64_t _hash;
+
+    public:
+        strong_hasher();
+
+        void update(const uint8_t *data, size_t len);
+
+        uint64_t digest() const;
+    };
+
+    /** Rolling checksum of rsync */
+    class rolling_checksum
+    {
+    private:
+        uint32_t _a;
+        uint32_t _b;
+        size_t _len;
+
+    public:
+        /** Checksum of `len` bytes of `data` */
+        rolling_checksum(const uint8_t *data, size_t len);
+
+        /** Slide window by one byte, `out` leaves and `in` enters */
+        void roll(uint8_t out, uint8_t in)
+        {
+            _a = (_a - out + in) & 0xffff;
+            _b = (_b - static_cast<uint32_t>(_len) * out + _a) & 0xffff;
+        }
+
+        uint32_t value() const
+        {
+            return _a | (_b << 16);
+        }
+    };
+
+    /**
+     * Description: Choose block size for a file of `file_size` bytes.
+     * Return: Block size.
+     */
+    uint32_t choose_block_size(uint64_t file_size);
+
+    /**
+     * Description: Calculate signatures of every full block of `input`.
+     * Return: 0 if succeed, or -1 if fail.
+     */
+    int make_signatures(std::istream &input, uint32_t block_size, std::vector<block_signature> &sigs);
+
+    /**
+     * Description: Compare `len` bytes of `data` against signatures of old
+     *              copy, and produce operations to rebuild `data` from old
+     *              copy. Bytes not found in old copy are appended to
+     *              `literals`.
+     */
+    void make_delta(const uint8_t *data, size_t len, uint32_t block_size,
+        const std::vector<block_signature> &sigs, std::vector<delta_op> &ops, std::string &literals);
+
+    /**
+     * Description: Rebuild file into `output` from `old_file` (which has
+     *              `block_count` full blocks), `ops` and `literals`, read a
+     *              block at a time. Strong hash of rebuilt file is stored in
+     *              `file_hash`.
+     * Return: Bytes written if succeed, or -1 if operations are invalid.
+     */
+    int64_t apply_delta(std::istream &old_file, uint32_t block_count, uint32_t block_size,
+        const std::vector<delta_op> &ops, std::istream &literals, std::ostream &output, uint64_t &file_hash);
+
+    /** Wire format helpers, all integers are in network byte order */
+    void pack_signatures(const std::vector<block_signature> &sigs, std::string &dst);
+
+    void unpack_signatures(const uint8_t *src, size_t count, std::vector<block_signature> &sigs);
+
+    void pack_delta(const delta_header &header, const std::vector<delta_op> &ops, std::string &dst);
+
+    /**
+     * Description: Read delta header and operations from `input`.
+     * Return: 0 if succeed, or -1 if fail.
+     */
+    int unpack_delta(std::istream &input, delta_header &header, std::vector<delta_op> &ops);
+};
+
+#endif
@@ -0,0 +1,140 @@
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <string.h>
+
+#include "my_frame.h"
+#include "my_send_recv.h"
+
+static uint16_t get_u16(const uint8_t *p)
+{
+    uint16_t value;
+    memcpy(&value, p, sizeof (value));
+    return ntohs(value);
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof (value));
+    return ntohl(value);
+}
+
+static uint64_t get_u64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof (value));
+    return be64toh(value);
+}
+
+static void put_u16(uint8_t *p, uint16_t value)
+{
+    value = htons(value);
+    memcpy(p, &value, sizeof (value));
+}
+
+static void put_u32(uint8_t *p, uint32_t value)
+{
+    value = htonl(value);
+    memcpy(p, &value, sizeof (value));
+}
+
+static void put_u64(uint8_t *p, uint64_t value)
+{
+    value = htobe64(value);
+    memcpy(p, &value, sizeof (value));
+}
+
+int my_frame_parse(const void *buf, size_t buflen, struct my_frame *frame, size_t *needed)
+{
+    const uint8_t *p = (const uint8_t *) buf;
+
+    if (buflen < FRAME_HEADER_SIZE) {
+        *needed = FRAME_HEADER_SIZE;
+        return 0;
+    }
+
+    if (get_u16(p) != FRAME_MAGIC || p[2] != FRAME_VERSION) {
+        return -1;
+    }
+
+    frame->type = p[3];
+    frame->id = get_u32(p + 4);
+    frame->length = get_u64(p + 8);
+    frame->name_len = get_u16(p + 16);
+    frame->flags = get_u16(p + 18);
+
+    if (frame->name_len > FRAME_MAX_NAME) {
+        return -1;
+    }
+
+    *needed = FRAME_HEADER_SIZE + frame->name_len;
+    if (buflen < *needed) {
+        return 0;
+    }
+
+    frame->name = (const char *) (p + FRAME_HEADER_SIZE);
+    return (int) *needed;
+}
+
+int my_frame_pack(void *buf, size_t buflen, uint8_t type, uint32_t id, uint64_t length,
+    const char *name, size_t name_len)
+{
+    uint8_t *p = (uint8_t *) buf;
+
+    if (name_len > FRAME_MAX_NAME || buflen < FRAME_HEADER_SIZE + name_len) {
+        return -1;
+    }
+
+    put_u16(p, FRAME_MAGIC);
+    p[2] = FRAME_VERSION;
+    p[3] = type;
+    put_u32(p + 4, id);
+    put_u64(p + 8, length);
+    put_u16(p + 16, (uint16_t) name_len);
+    put_u16(p + 18, 0);
+    put_u32(p + 20, 0);
+    if (name_len > 0) {
+        memcpy(p + FRAME_HEADER_SIZE, name, name_len);
+    }
+
+    return (int) (FRAME_HEADER_SIZE + name_len);
+}
+
+int my_recv_frame(int fd, struct my_frame *frame)
+{
+    const void *data;
+    size_t needed = FRAME_HEADER_SIZE;
+
+    while (1) {
+        int status = my_peek_data(fd, (int) needed, &data);
+        if (status != 0) {
+            return status;
+        }
+
+        int parsed = my_frame_parse(data, needed, frame, &needed);
+        if (parsed < 0) {
+            return -1;
+        }
+        if (parsed > 0) {
+            return 0;
+        }
+    }
+}
+
+void my_frame_done(const struct my_frame *frame)
+{
+    my_consume(FRAME_HEADER_SIZE + frame->name_len);
+}
+
+int my_send_frame(int fd, uint8_t type, uint32_t id, uint64_t length, const char *name, size_t name_len)
+{
+    uint8_t buf[FRAME_HEADER_SIZE + FRAME_MAX_NAME];
+
+    int buflen = my_frame_pack(buf, sizeof (buf), type, id, length, name, name_len);
+    if (buflen < 0) {
+        return -1;
+    }
+
+    return my_send(fd, buf, &buflen);
+}
@@ -0,0 +1,92 @@
+#ifndef __MY_FRAME_H__
+#define __MY_FRAME_H__
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/*
+ * Binary frame of protocol version 2. All integers are in network byte order.
+ *
+ *   0      2        3     4            8             16          18      20          24
+ *   +------+--------+-----+------------+-------------+-----------+-------+-----------+------+---------+
+ *   |magic |version |type |request id  |length       |name length|flags  |reserved   |name  |payload  |
+ *   +------+--------+-----+------------+-------------+-----------+-------+-----------+------+---------+
+ *
+ * `length` is the length of payload following the name.
+ */
+
+#define FRAME_MAGIC 0x4846
+#define FRAME_VERSION 2
+#define FRAME_HEADER_SIZE 24
+#define FRAME_MAX_NAME 4096
+
+/* Frame types */
+enum my_frame_type
+{
+    /* Upload file `name`, server replies FRAME_OK after payload received */
+    FRAME_SEND = 1,
+    /* Pipelined upload, server replies FRAME_ACK when decoded */
+    FRAME_PSEND = 2,
+    /* Legacy text command in `name`, without trailing newline */
+    FRAME_TEXT = 3,
+    /* Success, `length` is bytes received */
+    FRAME_OK = 4,
+    /* Pipelined upload of `request id` is done, `length` is bytes received */
+    FRAME_ACK = 5,
+    /* Failure, `name` is error message */
+    FRAME_ERR = 6,
+};
+
+/* Parsed frame. `name` points into receive buffer, and is not terminated. */
+struct my_frame
+{
+    uint8_t type;
+    uint16_t flags;
+    uint32_t id;
+    uint64_t length;
+    const char *name;
+    uint16_t name_len;
+};
+
+/**
+ * Description: Parse frame header and name in `buf` of `buflen` bytes
+ *              in place.
+ * Return: -1 if frame is invalid.
+ *         0 if more bytes are needed, and `*needed` is set to total size of
+ *         header and name.
+ *         Size of header and name if succeed.
+ */
+int my_frame_parse(const void *buf, size_t buflen, struct my_frame *frame, size_t *needed);
+
+/**
+ * Description: Write frame header and name to `buf` of `buflen` bytes.
+ * Return: -1 if `buf` is too small or name too long.
+ *         Size of header and name if succeed.
+ */
+int my_frame_pack(void *buf, size_t buflen, uint8_t type, uint32_t id, uint64_t length,
+    const char *name, size_t name_len);
+
+/**
+ * Description: Receive frame header and name from `fd`, parsed in place in
+ *              receive buffer of my_send_recv. Call my_frame_done() after
+ *              `frame->name` is no longer used, before reading payload.
+ * Return: -1 if fail or frame invalid.
+ *         0 if succeed.
+ *         1 if connection closed.
+ */
+int my_recv_frame(int fd, struct my_frame *frame);
+
+/**
+ * Description: Release header and name of `frame` from receive buffer.
+ */
+void my_frame_done(const struct my_frame *frame);
+
+/**
+ * Description: Send frame header and name to `fd`. Payload, if any, is sent
+ *              by caller after it.
+ * Return: -1 if fail, and errno set to appropriate value.
+ *         0 if succeed.
+ */
+int my_send_frame(int fd, uint8_t type, uint32_t id, uint64_t length, const char *name, size_t name_len);
+
+#endif
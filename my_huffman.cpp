@@ -1,4 +1,7 @@
-﻿#include "my_huffman.hpp"
+﻿#include <algorithm>
+#include <cmath>
+
+#include "my_huffman.hpp"
 
 using namespace my_huffman;
 
@@ -49,31 +52,37 @@ void huffman::_build_char_table()
 {
     using namespace std;
 
-    // If root is leaf node (i.e. only one kind of char in input file)
-    if (_root->data > 0) {
-        char_table.at(_root->data).push_back(0);
+    char_table.assign(256 * _roots.size(), vector<uint8_t>());
 
-        return;
-    }
-    /** Left child huffman code */
-    vector<uint8_t> l_code;
-    /** Right child huffman code */
-    vector<uint8_t> r_code;
+    for (size_t table = 0; table < _roots.size(); ++table) {
+        shared_ptr<huffman_node> &root = _roots[table];
 
-    l_code.push_back(0);
-    r_code.push_back(1);
+        // If root is leaf node (i.e. only one kind of char in input file)
+        if (root->data >= 0) {
+            char_table.at(256 * table + root->data).push_back(0);
 
-    _build_char_table(_root->left, l_code);
-    _build_char_table(_root->right, r_code);
+            continue;
+        }
+        /** Left child huffman code */
+        vector<uint8_t> l_code;
+        /** Right child huffman code */
+        vector<uint8_t> r_code;
+
+        l_code.push_back(0);
+        r_code.push_back(1);
+
+        _build_char_table(root->left, l_code, table);
+        _build_char_table(root->right, r_code, table);
+    }
 }
 
 /** Turn huffman tree to char table, with recursion */
-void huffman::_build_char_table(std::shared_ptr<huffman_node> &current, std::vector<uint8_t> &code)
+void huffman::_build_char_table(std::shared_ptr<huffman_node> &current, std::vector<uint8_t> &code, size_t table)
 {
     using namespace std;
 
     if (current->data >= 0) {
-        char_table.at(current->data) = code;
+        char_table.at(256 * table + current->data) = code;
 
         return;
     }
@@ -86,8 +95,17 @@ void huffman::_build_char_table(std::shared_ptr<huffman_node> &current, std::vec
     l_code.push_back(0);
     r_code.push_back(1);
 
-    _build_char_table(current->left, l_code);
-    _build_char_table(current->right, r_code);
+    _build_char_table(current->left, l_code, table);
+    _build_char_table(current->right, r_code, table);
+}
+
+/** Constructor */
+huffman::huffman()
+: _input(NULL)
+{
+    // for each char (0~255)
+    char_table.resize(256);
+    memset(_context_map, 0, sizeof (_context_map));
 }
 
 /** Constructor */
@@ -96,56 +114,571 @@ huffman::huffman(std::istream &input)
 {
     // for each char (0~255)
     char_table.resize(256);
+    memset(_context_map, 0, sizeof (_context_map));
 }
 
 std::vector<uint32_t> huffman::get_header()
 {
     using namespace std;
-    
-    stack< shared_ptr<huffman_node> > huff_tree;
-    huff_tree.push(_root);
+
     vector<uint32_t> tree;
 
-    while (!huff_tree.empty()) {
-        /** next node in post order to write to output stream */
-        shared_ptr<huffman_node> current = huff_tree.top();
-        huff_tree.pop();
+    // Order 1 leads with its tables and the table of each context
+    if (_roots.size() > 1) {
+        tree.push_back(htonl(CONTEXT_MARK));
+        tree.push_back(htonl(static_cast<uint32_t>(_roots.size())));
+        size_t map_begin = tree.size();
+        tree.resize(map_begin + sizeof (_context_map) / sizeof (uint32_t));
+        memcpy(&tree[map_begin], _context_map, sizeof (_context_map));
+    }
 
-        tree.push_back( htonl( *(reinterpret_cast<uint32_t *>(&current->data)) ) );
+    for (auto &root : _roots) {
+        stack< shared_ptr<huffman_node> > huff_tree;
+        huff_tree.push(root);
 
-        if (current->right != NULL) {
-            huff_tree.push(current->right);
-        }
-        if (current->left != NULL) {
-            huff_tree.push(current->left);
+        while (!huff_tree.empty()) {
+            /** next node in post order to write to output stream */
+            shared_ptr<huffman_node> current = huff_tree.top();
+            huff_tree.pop();
+
+            tree.push_back( htonl( *(reinterpret_cast<uint32_t *>(&current->data)) ) );
+
+            if (current->right != NULL) {
+                huff_tree.push(current->right);
+            }
+            if (current->left != NULL) {
+                huff_tree.push(current->left);
+            }
         }
     }
 
     return tree;
 }
 
+/**
+ * Build huffman tree of chars counted in `freq`. With `two_leaves`, a
+ * tree of one char gets a sibling, so every char takes a bit.
+ */
+static std::shared_ptr<huffman_node> make_tree(const uint64_t freq[256], bool two_leaves)
+{
+    using namespace std;
+
+    /** A min heap queue */
+    priority_queue< huffman_node, vector<huffman_node>, greater<huffman_node> > table;
+
+    for (int i = 0; i < 256; ++i) {
+        if (freq[i] != 0) {
+            table.push(huffman_node(i, static_cast<int>(freq[i])));
+        }
+    }
+
+    // Empty input still needs a tree to build header
+    if (table.empty()) {
+        table.push(huffman_node(0, 0));
+    }
+    if (two_leaves && table.size() == 1) {
+        table.push(huffman_node((table.top().data + 1) % 256, 0));
+    }
+
+    // Priority queue guarantees that the top is the least
+    // Pop the least two and merge them
+    while (table.size() > 1) {
+        huffman_node *n1 = new huffman_node(table.top());
+        table.pop();
+
+        huffman_node *n2 = new huffman_node(table.top());
+        table.pop();
+
+        // Only leaf node have positive data value
+        table.push(
+            huffman_node(
+                n1->data < 0 ? n1->data : -(n1->data) - 1,
+                n1->weight + n2->weight,
+                n1,
+                n2
+            )
+        );
+    }
+
+    return shared_ptr<huffman_node>(new huffman_node(table.top()));
+}
+
+/** Bits of chars of `freq` coded by tree of `root`, and words of tree in header */
+static uint64_t tree_cost(const std::shared_ptr<huffman_node> &root, const uint64_t freq[256], uint64_t &words)
+{
+    using namespace std;
+
+    uint64_t bits = 0;
+    words = 0;
+
+    stack< pair<shared_ptr<huffman_node>, unsigned int> > nodes;
+    nodes.push(make_pair(root, 0u));
+    while (!nodes.empty()) {
+        shared_ptr<huffman_node> node = nodes.top().first;
+        unsigned int depth = nodes.top().second;
+        nodes.pop();
+
+        words += 1;
+        if (node->data >= 0) {
+            // A lone root still takes a bit per char
+            bits += freq[node->data] * (depth > 0 ? depth : 1);
+            continue;
+        }
+        nodes.push(make_pair(node->left, depth + 1));
+        nodes.push(make_pair(node->right, depth + 1));
+    }
+
+    return bits;
+}
+
+/**
+ * Group contexts of `freq` (256 rows of counts of chars after each char)
+ * into `k` clusters of like distribution, by k-means on cost in bits of
+ * coding each context by the counts of its cluster.
+ */
+static void cluster_contexts(const std::vector<uint32_t> &freq, const std::vector<int> &contexts, size_t k,
+    uint8_t context_map[256])
+{
+    using namespace std;
+
+    // Counts of each context as (char, count) of chars seen after it
+    vector< vector< pair<uint8_t, uint32_t> > > rows(contexts.size());
+    for (size_t i = 0; i < contexts.size(); ++i) {
+        for (int c = 0; c < 256; ++c) {
+            uint32_t n = freq[(contexts[i] << 8) | c];
+            if (n > 0) {
+                rows[i].push_back(make_pair(static_cast<uint8_t>(c), n));
+            }
+        }
+    }
+
+    // Contexts are in order of weight, so heaviest ones seed clusters
+    vector<size_t> cluster(contexts.size(), SIZE_MAX);
+    for (size_t i = 0; i < k; ++i) {
+        cluster[i] = i;
+    }
+
+    vector<double> sums(k * 256);
+    vector<double> costs(k * 256);
+    for (int round = 0; round < 8; ++round) {
+        fill(sums.begin(), sums.end(), 0.0);
+        for (size_t i = 0; i < contexts.size(); ++i) {
+            if (cluster[i] == SIZE_MAX) {
+                continue;
+            }
+            for (auto &entry : rows[i]) {
+                sums[cluster[i] * 256 + entry.first] += entry.second;
+            }
+        }
+
+        // Bits of each char in each cluster, chars not seen yet cost more
+        for (size_t j = 0; j < k; ++j) {
+            double total = 0;
+            for (int c = 0; c < 256; ++c) {
+                total += sums[j * 256 + c];
+            }
+            for (int c = 0; c < 256; ++c) {
+                costs[j * 256 + c] = -log2((sums[j * 256 + c] + 0.5) / (total + 128.0));
+            }
+        }
+
+        bool changed = false;
+        for (size_t i = 0; i < contexts.size(); ++i) {
+            size_t best = 0;
+            double best_cost = HUGE_VAL;
+            for (size_t j = 0; j < k; ++j) {
+                double cost = 0;
+                for (auto &entry : rows[i]) {
+                    cost += entry.second * costs[j * 256 + entry.first];
+                }
+                if (cost < best_cost) {
+                    best = j;
+                    best_cost = cost;
+                }
+            }
+            if (cluster[i] != best) {
+                cluster[i] = best;
+                changed = true;
+            }
+        }
+        if (!changed) {
+            break;
+        }
+    }
+
+    // Contexts never seen take the first table, as the first char does
+    memset(context_map, 0, 256);
+    for (size_t i = 0; i < contexts.size(); ++i) {
+        context_map[contexts[i]] = static_cast<uint8_t>(cluster[i]);
+    }
+}
+
 /** huffman encode */
 huffman_encode::huffman_encode(std::istream &input)
-: huffman(input), _result(NULL), _result_size(0)
+: huffman(input), _encoded(false), _file_size(0), _checkpoint_interval(0), _order(0), _sampled(false)
 {
-    build_huffman_tree();
-    _build_char_table();
+    my_io::stream_source source(input);
+    count(source);
+
+    // Clean flags (such as 'eofbit') for caller to rewind input
+    input.clear();
+}
+
+huffman_encode::huffman_encode()
+: _encoded(false), _file_size(0), _checkpoint_interval(0), _order(0), _sampled(false)
+{
+    memset(_context_rows, 0, sizeof (_context_rows));
 }
 
 huffman_encode::~huffman_encode()
 {
-    free(_result);
+
+}
+
+void huffman_encode::_build_tree(const uint64_t freq[256])
+{
+    // Chars a sample has missed may still come
+    uint64_t counts[256];
+    for (int c = 0; c < 256; ++c) {
+        counts[c] = freq[c] + (_sampled ? 1 : 0);
+    }
+
+    _roots.assign(1, make_tree(counts, false));
+    memset(_context_map, 0, sizeof (_context_map));
+    _build_codes();
+}
+
+void huffman_encode::_build_model(const std::vector<uint32_t> &freq)
+{
+    using namespace std;
+
+    // Order 0 counts are sums over contexts
+    uint64_t total[256] = { 0 };
+    vector<uint64_t> weight(256, 0);
+    for (int prev = 0; prev < 256; ++prev) {
+        for (int c = 0; c < 256; ++c) {
+            total[c] += freq[(prev << 8) | c];
+            weight[prev] += freq[(prev << 8) | c];
+        }
+    }
+
+    uint64_t words;
+    uint64_t best_bits = tree_cost(make_tree(total, false), total, words) + 32 * (1 + words);
+    size_t best_k = 1;
+    uint8_t best_map[256] = { 0 };
+
+    vector<int> contexts;
+    for (int prev = 0; prev < 256; ++prev) {
+        if (weight[prev] > 0) {
+            contexts.push_back(prev);
+        }
+    }
+    stable_sort(contexts.begin(), contexts.end(), [&weight](int a, int b) { return weight[a] > weight[b]; });
+
+    // Try more tables while they pay for their headers
+    uint8_t context_map[256];
+    for (size_t k = 2; k <= MAX_TABLES && k <= contexts.size(); k *= 2) {
+        cluster_contexts(freq, contexts, k, context_map);
+
+        vector<uint64_t> sums(k * 256, 0);
+        for (int prev : contexts) {
+            for (int c = 0; c < 256; ++c) {
+                sums[context_map[prev] * 256 + c] += freq[(prev << 8) | c];
+            }
+        }
+
+        uint64_t bits = 32 * (3 + sizeof (context_map) / sizeof (uint32_t));
+        for (size_t j = 0; j < k; ++j) {
+            bits += tree_cost(make_tree(&sums[j * 256], true), &sums[j * 256], words) + 32 * words;
+        }
+
+        if (bits >= best_bits) {
+            break;
+        }
+        best_bits = bits;
+        best_k = k;
+        memcpy(best_map, context_map, sizeof (best_map));
+    }
+
+    if (best_k == 1) {
+        _build_tree(total);
+        return;
+    }
+
+    // Clusters left empty are dropped, tables are renumbered in order of use
+    vector<int> renumber(best_k, -1);
+    size_t tables = 0;
+    for (int prev = 0; prev < 256; ++prev) {
+        if (renumber[best_map[prev]] < 0 && (weight[prev] > 0 || prev == 0)) {
+            renumber[best_map[prev]] = static_cast<int>(tables++);
+        }
+    }
+    vector<uint64_t> sums(tables * 256, 0);
+    for (int prev = 0; prev < 256; ++prev) {
+        int table = renumber[best_map[prev]];
+        _context_map[prev] = static_cast<uint8_t>((table >= 0) ? table : 0);
+        for (int c = 0; c < 256; ++c) {
+            sums[_context_map[prev] * 256 + c] += freq[(prev << 8) | c];
+        }
+    }
+
+    if (tables < 2) {
+        _build_tree(total);
+        return;
+    }
+    if (_sampled) {
+        for (auto &sum : sums) {
+            sum += 1;
+        }
+    }
+
+    _roots.clear();
+    for (size_t j = 0; j < tables; ++j) {
+        _roots.push_back(make_tree(&sums[j * 256], true));
+    }
+    _build_codes();
+}
+
+void huffman_encode::count_table(const std::vector<uint32_t> &freq, uint32_t size)
+{
+    _file_size = size;
+    if (_order > 0) {
+        _build_model(freq);
+        return;
+    }
+
+    uint64_t total[256] = { 0 };
+    for (int prev = 0; prev < 256; ++prev) {
+        for (int c = 0; c < 256; ++c) {
+            total[c] += freq[(prev << 8) | c];
+        }
+    }
+    _build_tree(total);
+}
+
+uint64_t huffman_encode::code_bits(const uint8_t *data, size_t length, uint8_t prev) const
+{
+    const uint8_t *code_lengths = &_code_lengths.front();
+    size_t row = _context_rows[prev];
+
+    uint64_t bits = 0;
+    for (size_t i = 0; i < length; ++i) {
+        bits += code_lengths[row + data[i]];
+        row = _context_rows[data[i]];
+    }
+    return bits;
+}
+
+uint64_t huffman_encode::estimate_size(const std::vector<uint32_t> &freq)
+{
+    uint64_t bits = 0;
+    for (int prev = 0; prev < 256; ++prev) {
+        for (int c = 0; c < 256; ++c) {
+            bits += static_cast<uint64_t>(freq[(prev << 8) | c]) * _code_lengths[_context_rows[prev] + c];
+        }
+    }
+
+    // Original size, header and codes
+    return sizeof (uint32_t) * (1 + get_header().size()) + (bits + 7) / 8;
+}
+
+void huffman_encode::_build_codes()
+{
+    _build_char_table();
+
+    // Pack codes into integers for the encoding loop
+    _codes.assign(char_table.size(), 0);
+    _code_lengths.assign(char_table.size(), 0);
+    for (size_t i = 0; i < char_table.size(); ++i) {
+        _code_lengths[i] = static_cast<uint8_t>(char_table[i].size());
+        for (size_t bit = 0; bit < char_table[i].size(); ++bit) {
+            _codes[i] |= static_cast<uint64_t>(char_table[i][bit]) << bit;
+        }
+    }
+
+    for (int prev = 0; prev < 256; ++prev) {
+        _context_rows[prev] = static_cast<uint16_t>(256 * _context_map[prev]);
+    }
 }
 
 /** huffman decode */
 huffman_decode::huffman_decode(std::istream &input)
-: huffman(input)
+: huffman(input), _original_size(0), _bad(true), _header_size(0), _checkpoint_interval(0), _data_end(UINT64_MAX)
 {
-    build_huffman_tree();
-    _build_char_table();
+    my_io::stream_source source(input);
+    read_header(source);
+}
+
+huffman_decode::huffman_decode()
+: _original_size(0), _bad(true), _header_size(0), _checkpoint_interval(0), _data_end(UINT64_MAX)
+{
+
 }
 
 huffman_decode::~huffman_decode()
 {
     
 }
+
+void huffman_decode::_build_nodes()
+{
+    using namespace std;
+
+    _nodes.clear();
+    _lookup.clear();
+    memset(_context_nodes, 0, sizeof (_context_nodes));
+    memset(_context_lookup, 0, sizeof (_context_lookup));
+    if (_roots[0]->data >= 0) {
+        return;
+    }
+
+    /** Inner nodes and their indexes, numbered in order of visit */
+    vector< shared_ptr<huffman_node> > inner;
+    /** Index of root of each tree */
+    vector<int32_t> bases;
+
+    size_t i = 0;
+    for (auto &root : _roots) {
+        bases.push_back(static_cast<int32_t>(inner.size()));
+        inner.push_back(root);
+
+        for (; i < inner.size(); ++i) {
+            shared_ptr<huffman_node> children[2] = { inner[i]->left, inner[i]->right };
+            for (auto &child : children) {
+                if (child->data >= 0) {
+                    _nodes.push_back(-1 - child->data);
+                }
+                else {
+                    _nodes.push_back(static_cast<int32_t>(inner.size()));
+                    inner.push_back(child);
+                }
+            }
+        }
+    }
+
+    // Walk each tree by every value of the next LOOKUP_BITS bits, lowest bit
+    // first, to the char they end in or the inner node they reach
+    _lookup.resize(bases.size() * my_kernels::LOOKUP_SIZE);
+    for (size_t table = 0; table < bases.size(); ++table) {
+        for (uint32_t bits = 0; bits < my_kernels::LOOKUP_SIZE; ++bits) {
+            int32_t node = bases[table];
+            uint32_t length = 0;
+            while (length < my_kernels::LOOKUP_BITS && node >= 0) {
+                node = _nodes[2 * node + ((bits >> length) & 1)];
+                length += 1;
+            }
+            _lookup[table * my_kernels::LOOKUP_SIZE + bits] = (node < 0) ?
+                ((length << 24) | static_cast<uint32_t>(-1 - node)) : static_cast<uint32_t>(node);
+        }
+    }
+
+    for (int prev = 0; prev < 256; ++prev) {
+        _context_nodes[prev] = bases[_context_map[prev]];
+        _context_lookup[prev] = static_cast<uint32_t>(_context_map[prev] * my_kernels::LOOKUP_SIZE);
+    }
+}
+
+int huffman_decode::read_index(int fd, uint64_t payload_size)
+{
+    using namespace std;
+
+    _checkpoint_interval = 0;
+    _checkpoints.clear();
+    _checkpoint_contexts.clear();
+    _data_end = payload_size;
+
+    // u32 interval, u32 count, magic
+    const uint64_t footer_size = 2 * sizeof (uint32_t) + sizeof (INDEX_MAGIC);
+    if (_bad || payload_size < _header_size + footer_size) {
+        return -1;
+    }
+
+    uint8_t footer[footer_size];
+    my_io::pread_source footer_source(fd, payload_size - footer_size, footer_size);
+    if (footer_source.read(footer, footer_size) != footer_size ||
+        memcmp(footer + 2 * sizeof (uint32_t), INDEX_MAGIC, sizeof (INDEX_MAGIC)) != 0) {
+        return -1;
+    }
+
+    uint32_t interval, count;
+    memcpy(&interval, footer, sizeof (interval));
+    memcpy(&count, footer + sizeof (interval), sizeof (count));
+    interval = ntohl(interval);
+    count = ntohl(count);
+
+    // A checkpoint at every multiple of interval before the end, no more
+    if (interval == 0 || count != ((_original_size > 0) ? (_original_size - 1) / interval : 0)) {
+        return -1;
+    }
+    uint64_t trailer_size = footer_size + static_cast<uint64_t>(count) * sizeof (uint64_t);
+    if (payload_size - _header_size < trailer_size) {
+        return -1;
+    }
+    uint64_t data_end = payload_size - trailer_size;
+
+    vector<uint64_t> checkpoints(count);
+    my_io::pread_source source(fd, data_end, static_cast<uint64_t>(count) * sizeof (uint64_t));
+    if (count > 0 && source.read(&checkpoints.front(), count * sizeof (uint64_t)) != count * sizeof (uint64_t)) {
+        return -1;
+    }
+
+    // Every code takes a bit at least, and all lie within encoded data
+    vector<uint8_t> contexts(count);
+    uint64_t last = 0;
+    for (size_t i = 0; i < checkpoints.size(); ++i) {
+        uint64_t checkpoint = be64toh(checkpoints[i]);
+        contexts[i] = static_cast<uint8_t>(checkpoint >> CHECKPOINT_OFFSET_BITS);
+        checkpoint &= (static_cast<uint64_t>(1) << CHECKPOINT_OFFSET_BITS) - 1;
+        if (checkpoint <= last || checkpoint >= (data_end - _header_size) * 8) {
+            return -1;
+        }
+        checkpoints[i] = last = checkpoint;
+    }
+
+    _checkpoint_interval = interval;
+    _checkpoints.swap(checkpoints);
+    _checkpoint_contexts.swap(contexts);
+    _data_end = data_end;
+    return 0;
+}
+
+int huffman_decode::locate(uint64_t offset, uint64_t length, range_location &location) const
+{
+    if (_bad || offset > _original_size || length > _original_size - offset) {
+        return -1;
+    }
+
+    location.begin = _header_size;
+    location.end = _data_end;
+    location.skip_bits = 0;
+    location.skip = offset;
+    location.context = 0;
+
+    if (!has_index()) {
+        return 0;
+    }
+
+    // Start at last checkpoint at or before offset
+    uint64_t first = offset / _checkpoint_interval;
+    if (first > _checkpoints.size()) {
+        first = _checkpoints.size();
+    }
+    if (first > 0) {
+        uint64_t bit = _checkpoints[first - 1];
+        location.begin = _header_size + bit / 8;
+        location.skip_bits = static_cast<unsigned int>(bit % 8);
+        location.skip = offset - first * _checkpoint_interval;
+        location.context = _checkpoint_contexts[first - 1];
+    }
+
+    // End at the byte holding first checkpoint at or after end of range
+    uint64_t last = (offset + length + _checkpoint_interval - 1) / _checkpoint_interval;
+    if (length == 0) {
+        location.end = location.begin;
+    }
+    else if (last >= 1 && last <= _checkpoints.size()) {
+        location.end = _header_size + (_checkpoints[last - 1] + 7) / 8;
+    }
+
+    return 0;
+}
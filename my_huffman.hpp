@@ -6,12 +6,54 @@
 #include <stack>
 #include <vector>
 #include <memory>
+#include <thread>
 #include <cstdint>
 #include <cstring>
+#include <climits>
 #include <arpa/inet.h>
+#include <endian.h>
+
+#include "my_trace.hpp"
+#include "my_io.hpp"
+#include "my_kernels.hpp"
 
 namespace my_huffman
 {
+    /** Bytes read or written at a time by codec loops */
+    const size_t BLOCK_SIZE = 65536;
+
+    /** Default bytes of original data between checkpoints of index */
+    const uint32_t CHECKPOINT_INTERVAL = 65536;
+
+    /** Bytes of original data each thread of a parallel decode takes at a time */
+    const size_t PARTITION_SIZE = 1048576;
+
+    /** Ends the trailer of a payload with checkpoint index */
+    const char INDEX_MAGIC[4] = { 'H', 'W', 'I', 'X' };
+
+    /** Stands for root of a tree in header of order 0, and marks header of order 1 */
+    const uint32_t CONTEXT_MARK = 256;
+
+    /** Most code tables shared by contexts of order 1 */
+    const size_t MAX_TABLES = 16;
+
+    /** Bits of a checkpoint of index holding bit offset, the rest holds its context */
+    const unsigned int CHECKPOINT_OFFSET_BITS = 56;
+
+    /** Bytes of payload to read for a range of original data, see huffman_decode::locate() */
+    struct range_location
+    {
+        /** First and past the last byte of encoded data, as offsets in payload */
+        uint64_t begin;
+        uint64_t end;
+        /** Bits of first byte before the first char */
+        unsigned int skip_bits;
+        /** Chars decoded before the range starts */
+        uint64_t skip;
+        /** Char before first decoded char, which picks its code table */
+        uint8_t context;
+    };
+
     /** huffman Tree Node */
     struct huffman_node
     {
@@ -37,310 +79,755 @@ namespace my_huffman
         inline bool is_data_bigger_then(const huffman_node &rhs) const;
     };
 
-    /** Base class for huffman Encode and Decode */
+    /**
+     * Base class for huffman Encode and Decode
+     *
+     * Order 0 codes every char with one tree. Order 1 picks a tree by the
+     * char before, out of up to MAX_TABLES trees shared by contexts alike,
+     * and its header is:
+     *     u32 CONTEXT_MARK, u32 tree count
+     *     256 bytes of tree of each previous char (first char follows 0)
+     *     each tree in post order, as a header of order 0 has one
+     */
     class huffman
     {
     protected:
-        /** huffman tree root */
-        std::shared_ptr<huffman_node> _root;
-        /** Input stream */
+        /** huffman tree root of each code table, one for order 0 */
+        std::vector< std::shared_ptr<huffman_node> > _roots;
+        /** Code table of each previous char, all 0 for order 0 */
+        uint8_t _context_map[256];
+        /** Input stream, NULL if built from another kind of source */
         std::istream *_input;
 
-        /** Turn huffman tree to char table */
+        /** Turn huffman trees to char table */
         void _build_char_table();
 
         /** Turn huffman tree to char table, with recursion */
-        void _build_char_table(std::shared_ptr<huffman_node> &current, std::vector<uint8_t> &code);
+        void _build_char_table(std::shared_ptr<huffman_node> &current, std::vector<uint8_t> &code, size_t table);
 
     public:
-        /** Char to huffman code */
+        /** Char to huffman code, 256 of each code table in order */
         std::vector< std::vector<uint8_t> > char_table;
 
+        /** Constructor */
+        huffman();
+
         /** Constructor */
         huffman(std::istream &input);
 
-        /** Dummy function for derived classes */
-        void virtual build_huffman_tree() = 0;
+        /** Number of code tables, more than one for order 1 */
+        size_t table_count() const
+        {
+            return _roots.size();
+        }
 
         std::vector<uint32_t> get_header();
     };
 
-    /** huffman encode */
+    /**
+     * huffman encode
+     *
+     * Usage with a source other than a stream:
+     *     huffman_encode encode;
+     *     encode.set_order(1);
+     *     encode.count(source);
+     *     // Rewind source
+     *     encode.encode(source, sink);
+     *
+     * With a checkpoint interval set, payload ends with a trailer indexing
+     * the bit offset of every `interval` bytes of original data, so it can
+     * be decoded from the middle or in parallel:
+     *     u64 of each checkpoint, bit offset from start of encoded data in
+     *         lower CHECKPOINT_OFFSET_BITS bits, char before it (order 1
+     *         only, else 0) in the rest
+     *     u32 interval, u32 checkpoint count, "HWIX"
+     * Decoders stop after original size, so those without index support
+     * ignore the trailer.
+     */
     class huffman_encode : public huffman
     {
     private:
-        uint8_t *_result;
-        size_t _result_size;
+        std::vector<uint8_t> _result;
+        bool _encoded;
         uint32_t _file_size;
+        uint32_t _checkpoint_interval;
+        /** Largest order tried by count() */
+        unsigned int _order;
+        /** Codes are built from a sample, see set_sampled() */
+        bool _sampled;
+
+        /**
+         * Code of each char with first bit lowest, and its length in bits,
+         * 256 of each code table in order
+         */
+        std::vector<uint64_t> _codes;
+        std::vector<uint8_t> _code_lengths;
+        /** Index in _codes of code table of each previous char */
+        uint16_t _context_rows[256];
+
+        /** Build huffman tree and codes from count of every char */
+        void _build_tree(const uint64_t freq[256]);
+
+        /**
+         * Build huffman trees and codes from count of every char after every
+         * char, as order 1 if its smaller output pays for its larger header
+         */
+        void _build_model(const std::vector<uint32_t> &freq);
+
+        /** Pack char table into _codes and _code_lengths */
+        void _build_codes();
 
     public:
-        /** Constructor */
+        /** Constructor, building tree from chars of input stream */
         huffman_encode(std::istream &input);
 
+        /** Constructor, tree is built by count() */
+        huffman_encode();
+
         ~huffman_encode();
 
-        /** Build huffman tree from input stream */
-        void virtual build_huffman_tree()
+        /**
+         * Write checkpoint index every `interval` bytes of original data, or
+         * none if 0 (default).
+         */
+        void set_checkpoint_interval(uint32_t interval)
         {
-            using namespace std;
-
-            std::istream &input = *_input;
+            _checkpoint_interval = interval;
+        }
 
-            /** Count occurrence of every char in input stream */
-            int freq[256] = { 0 };
+        /**
+         * Model chars by the char before them if `order` is 1, when it pays
+         * off, or by none if 0 (default). Must be set before count().
+         */
+        void set_order(unsigned int order)
+        {
+            _order = order;
+        }
 
-            /** Get char from input stream */
-            int c = input.get();
-            while (!input.eof()) {
-                freq[c] += 1;
-                c = input.get();
-            }
+        /**
+         * Count only a sample of data: every char gets a code even if it is
+         * not counted, and encode() takes a source of any size, whose header
+         * tells the size counted for caller to correct. Must be set before
+         * count().
+         */
+        void set_sampled(bool sampled)
+        {
+            _sampled = sampled;
+        }
 
-            // Clean flags (such as 'eofbit') for 'tellg()' to function
-            input.clear();
-            // Since the stream has reached the end, the position is file size
-            _file_size = static_cast<uint32_t>(input.tellg());
+        /**
+         * Build huffman trees from `size` chars counted in `freq`, as 256
+         * rows of 256 by previous char (first char follows 0), as count()
+         * does from data.
+         */
+        void count_table(const std::vector<uint32_t> &freq, uint32_t size);
+
+        /** Bits of codes of `length` chars of `data`, the first following `prev` */
+        uint64_t code_bits(const uint8_t *data, size_t length, uint8_t prev) const;
+
+        /**
+         * Bytes of payload, without index, of chars counted in `freq` as
+         * count_table() takes them.
+         */
+        uint64_t estimate_size(const std::vector<uint32_t> &freq);
+
+        /** Count every char of `source` to its end, and build huffman tree */
+        template <typename Source>
+        void count(Source &source)
+        {
+            TRACE_SPAN("huffman_encode::build_tree");
 
-            /** A min heap queue */
-            priority_queue< huffman_node, vector<huffman_node>, greater<huffman_node> > table;
+            uint64_t size = 0;
+            uint8_t buf[BLOCK_SIZE];
+            size_t buflen;
 
-            for (int i = 0; i < 256; ++i) {
-                if (freq[i] != 0) {
-                    table.push(huffman_node(i, freq[i]));
+            if (_order == 0) {
+                uint64_t freq[256] = { 0 };
+                while ((buflen = source.read(buf, sizeof (buf))) > 0) {
+                    for (size_t i = 0; i < buflen; ++i) {
+                        freq[buf[i]] += 1;
+                    }
+                    size += buflen;
                 }
+
+                _file_size = static_cast<uint32_t>(size);
+                _build_tree(freq);
+                return;
             }
 
-            // Priority queue guarantees that the top is the least
-            // Pop the least two and merge them
-            while (table.size() > 1) {
-                huffman_node *n1 = new huffman_node(table.top());
-                table.pop();
-
-                huffman_node *n2 = new huffman_node(table.top());
-                table.pop();
-
-                // Only leaf node have positive data value
-                table.push(
-                    huffman_node(
-                        n1->data < 0 ? n1->data : -(n1->data) - 1,
-                        n1->weight + n2->weight,
-                        n1,
-                        n2
-                    )
-                );
+            // Count of each char after each char, as 256 rows of previous char
+            std::vector<uint32_t> freq(256 * 256, 0);
+            unsigned int prev = 0;
+            while ((buflen = source.read(buf, sizeof (buf))) > 0) {
+                for (size_t i = 0; i < buflen; ++i) {
+                    freq[(prev << 8) | buf[i]] += 1;
+                    prev = buf[i];
+                }
+                size += buflen;
             }
 
-            _root.reset(new huffman_node(table.top()));
-            table.pop();
+            _file_size = static_cast<uint32_t>(size);
+            _build_model(freq);
         }
 
-        /** Write encoded huffman code and header to output stream */
-        int write(std::istream &input, uint8_t **dst, int *dstlen)
+        /**
+         * Write header and encoded chars of `source` to `sink`. Source must be
+         * the same data count() has read.
+         * Return: 0 if succeed, or -1 if fail or source has changed in size.
+         */
+        template <typename Source, typename Sink>
+        int encode(Source &source, Sink &sink)
         {
             using namespace std;
 
-            if (_result != NULL) {
-                *dst = _result;
-                *dstlen = static_cast<int>(_result_size);
-                return 0;
-            }
+            TRACE_SPAN("huffman_encode::encode");
 
             vector<uint32_t> header = get_header();
             header.insert(header.begin(), htonl(_file_size));
-            
-            size_t header_size = header.size() * sizeof (uint32_t);
-
-            _result = (uint8_t *) malloc(_file_size / 2 + header_size);
-            if (_result == NULL) {
-                *dst = NULL;
-                *dstlen = 0;
+            if (!sink.write(&header.front(), header.size() * sizeof (uint32_t))) {
                 return -1;
             }
-            _result_size = _file_size / 2 + header_size;
-            memcpy(_result, &header.front(), header_size);
-            memset(_result + header_size, 0, _result_size - header_size);
-
-            unsigned int result_bytes = header_size;
-            unsigned int result_bit_offset = 0;
-
-            int c = input.get();
-            while (!input.eof()) {
-                auto code = char_table.at(c);
-
-                for (auto bit : code) {
-                    _result[result_bytes] |= ( bit << (result_bit_offset) );
-                    result_bit_offset += 1;
-                    if (result_bit_offset >= 8) {
-                        result_bytes += 1;
-                        result_bit_offset = 0;
-                    }
-                }
 
-                if (result_bytes + 256 >= _result_size) {
-                    uint8_t *new_result = (uint8_t *) realloc(_result, _result_size + 65536);
-                    if (new_result == NULL) {
-                        free(_result);
-                        _result_size = 0;
-                        _result = NULL;
-                        *dst = NULL;
-                        *dstlen = 0;
-                        return -1;
+            uint8_t in[BLOCK_SIZE];
+            size_t inlen;
+            // Room for the bytes of one more code beyond a full block
+            uint8_t out[BLOCK_SIZE + my_kernels::ENCODE_SLACK];
+            size_t outlen = 0;
+
+            /** Bits not yet written, and code table of char before */
+            my_kernels::encode_tables tables = { &_codes.front(), &_code_lengths.front(), _context_rows };
+            my_kernels::encode_state state = { 0, 0, _context_rows[0] };
+            uint64_t total = 0;
+            /** Bytes of encoded data written to sink */
+            uint64_t written = 0;
+
+            /** Bit offset and context of each checkpoint, in big endian */
+            vector<uint64_t> checkpoints;
+            uint64_t next_checkpoint = (_checkpoint_interval > 0) ? _checkpoint_interval : UINT64_MAX;
+
+            uint8_t last = 0;
+
+            while ((inlen = source.read(in, sizeof (in))) > 0) {
+                size_t i = 0;
+                while (i < inlen) {
+                    // Encode up to next checkpoint, then record where it starts
+                    uint64_t pos = total + i;
+                    if (pos == next_checkpoint) {
+                        uint64_t context = (table_count() > 1) ? ((i > 0) ? in[i - 1] : last) : 0;
+                        checkpoints.push_back(htobe64((context << CHECKPOINT_OFFSET_BITS) |
+                            ((written + outlen) * 8 + state.bit_count)));
+                        next_checkpoint += _checkpoint_interval;
+                    }
+                    size_t stop = (next_checkpoint - pos < inlen - i) ? i + static_cast<size_t>(next_checkpoint - pos) : inlen;
+
+                    while (i < stop) {
+                        // Kernel stops once a block is full
+                        i += my_kernels::encode(tables, in + i, stop - i, out, sizeof (out), outlen, state);
+                        if (outlen >= BLOCK_SIZE) {
+                            if (!sink.write(out, outlen)) {
+                                return -1;
+                            }
+                            written += outlen;
+                            outlen = 0;
+                        }
                     }
-                    memset(new_result + _result_size , 0, 65536);
-                    _result = new_result;
-                    _result_size += 65536;
                 }
+                last = in[inlen - 1];
+                total += inlen;
+            }
+
+            if (total != _file_size && !_sampled) {
+                return -1;
+            }
+
+            if (state.bit_count > 0) {
+                out[outlen++] = static_cast<uint8_t>(state.bits);
+            }
+            if (outlen > 0 && !sink.write(out, outlen)) {
+                return -1;
+            }
 
-                c = input.get();
+            if (_checkpoint_interval > 0) {
+                uint32_t footer[2] = { htonl(_checkpoint_interval), htonl(static_cast<uint32_t>(checkpoints.size())) };
+                if ((!checkpoints.empty() && !sink.write(&checkpoints.front(), checkpoints.size() * sizeof (uint64_t))) ||
+                    !sink.write(footer, sizeof (footer)) || !sink.write(INDEX_MAGIC, sizeof (INDEX_MAGIC))) {
+                    return -1;
+                }
             }
 
-            _result_size = (result_bit_offset > 0) ? result_bytes + 1 : result_bytes;
-            uint8_t *new_result = (uint8_t *) realloc(_result, _result_size);
-            if (new_result == NULL) {
-                free(_result);
-                _result_size = 0;
-                _result = NULL;
+            return 0;
+        }
+
+        /**
+         * Write encoded huffman code and header to output stream. Fails if
+         * result is larger than `dstlen` can tell, over 2 GB.
+         */
+        int write(std::istream &input, uint8_t **dst, int *dstlen)
+        {
+            if (!_encoded) {
+                _result.clear();
+                _result.reserve(_file_size / 2 + 1024);
+
+                my_io::stream_source source(input);
+                my_io::buffer_sink sink(_result);
+                if (encode(source, sink) < 0) {
+                    _result.clear();
+                    *dst = NULL;
+                    *dstlen = 0;
+                    return -1;
+                }
+                _encoded = true;
+            }
+            if (_result.size() > static_cast<size_t>(INT_MAX)) {
                 *dst = NULL;
                 *dstlen = 0;
                 return -1;
             }
 
-            _result = new_result;
-            *dst = _result;
-            *dstlen = static_cast<int>(_result_size);
-
+            *dst = &_result.front();
+            *dstlen = static_cast<int>(_result.size());
             return 0;
         }
 
     };
 
-    /** huffman decode */
+    /**
+     * huffman decode
+     *
+     * Usage with a source other than a stream:
+     *     huffman_decode decode;
+     *     decode.read_header(source);
+     *     decode.decode(source, sink);
+     *
+     * Usage of checkpoint index of a payload in file `fd`:
+     *     decode.read_header(source);
+     *     decode.read_index(fd, payload_size);
+     *     decode.decode_range(fd, offset, length, sink);
+     *     decode.decode_parallel(fd, sink, threads);
+     */
     class huffman_decode : public huffman
     {
     private:
-        std::streampos data_start;
         uint32_t _original_size;
+        /** Set until a valid header is read */
+        bool _bad;
+        /** Bytes of header */
+        uint64_t _header_size;
+
+        /** Bytes of original data between checkpoints, 0 if no index */
+        uint32_t _checkpoint_interval;
+        /** Bit offset of each checkpoint, from start of encoded data */
+        std::vector<uint64_t> _checkpoints;
+        /** Char before each checkpoint, 0 for order 0 */
+        std::vector<uint8_t> _checkpoint_contexts;
+        /** Past the last byte of encoded data, as offset in payload */
+        uint64_t _data_end;
+
+        /**
+         * Tree in a flat array for decoding. Children of inner node `i` are at
+         * 2i (left) and 2i+1 (right), each the index of an inner node, or
+         * -1 - char for a leaf. Trees follow one another, root of the first
+         * is inner node 0.
+         */
+        std::vector<int32_t> _nodes;
+        /** Root in _nodes of code table of each previous char */
+        int32_t _context_nodes[256];
+        /** Lookup tables of my_kernels::decode(), one for each tree in order */
+        std::vector<uint32_t> _lookup;
+        /** Index in _lookup of code table of each previous char */
+        uint32_t _context_lookup[256];
+
+        /** Flatten trees into _nodes, and build their lookup tables */
+        void _build_nodes();
+
+        /**
+         * Read rest of a tree from `source`, whose root `node_data` is read.
+         * Return: words of tree, or -1 if it is broken.
+         */
+        template <typename Source>
+        int _read_tree(Source &source, int32_t node_data, std::shared_ptr<huffman_node> &root)
+        {
+            using namespace std;
+
+            root.reset(new huffman_node(node_data, 0));
+
+            // In case the root might not have children (i.e. root is leaf node)
+            if (node_data >= 0) {
+                return 1;
+            }
+
+            /** For restore tree from post order, without recursion */
+            stack< shared_ptr<huffman_node> > huff_tree;
+            huff_tree.push(root);
+
+            // A tree of 256 leaves has 511 nodes, more means a broken header
+            int node_count = 1;
+
+            while (!huff_tree.empty()) {
+                /** Current tree node */
+                shared_ptr<huffman_node> current = huff_tree.top();
+
+                uint32_t u_node_data;
+                if (++node_count > 511 || source.read(&u_node_data, sizeof (u_node_data)) != sizeof (u_node_data)) {
+                    return -1;
+                }
+                u_node_data = ntohl(u_node_data);
+                node_data = *(reinterpret_cast<int32_t *>(&u_node_data));
+                if (node_data > 255) {
+                    return -1;
+                }
+
+                shared_ptr<huffman_node> new_node(new huffman_node(node_data, 0));
+
+                // Left child first (post order)
+                if (current->left == NULL) {
+                    current->left = new_node;
+                }
+                else {
+                    current->right = new_node;
+                    // Both children are fulfilled, remove this node
+                    huff_tree.pop();
+                }
+
+                // Not leaf node
+                if (node_data < 0) {
+                    huff_tree.push(new_node);
+                }
+            }
+
+            return node_count;
+        }
+
+        /** Write decoded chars to sink, dropping first `drop` of them */
+        template <typename Sink>
+        static bool _write_out(Sink &sink, const uint8_t *out, size_t outlen, uint64_t &drop)
+        {
+            size_t dropped = (drop < outlen) ? static_cast<size_t>(drop) : outlen;
+            drop -= dropped;
+            return dropped == outlen || sink.write(out + dropped, outlen - dropped);
+        }
 
     public:
-        /** Constructor */
+        /** Constructor, reading header from input stream */
         huffman_decode(std::istream &input);
 
+        /** Constructor, header is read by read_header() */
+        huffman_decode();
+
         ~huffman_decode();
 
-        /** Build huffman tree from input stream */
-        void virtual build_huffman_tree()
+        /** Size of original data, known once tree is built */
+        uint32_t original_size() const
         {
-            using namespace std;
+            return _original_size;
+        }
 
-            std::istream &input = *_input;
+        /** Bytes of header, known once it is read */
+        uint64_t header_size() const
+        {
+            return _header_size;
+        }
 
-            input.read(reinterpret_cast<char *>(&_original_size), sizeof (_original_size));
-            _original_size = ntohl(_original_size);
+        /** Check if read_index() has found an index */
+        bool has_index() const
+        {
+            return _checkpoint_interval > 0;
+        }
 
-            /** Read the tree saved in input stream */
-            uint32_t u_node_data;
-            input.read(reinterpret_cast<char *>(&u_node_data), sizeof (u_node_data));
-            u_node_data = ntohl(u_node_data);
-            int32_t node_data = *(reinterpret_cast<int32_t *>(&u_node_data));
+        /**
+         * Read checkpoint index from trailer of payload of `payload_size`
+         * bytes at start of `fd`, once header is read. A payload without
+         * index can still be decoded, only from its start.
+         * Return: 0 if index is found, or -1 if none or it is broken.
+         */
+        int read_index(int fd, uint64_t payload_size);
+
+        /**
+         * Find bytes of payload to decode for `length` bytes of original
+         * data from `offset`, starting at the nearest checkpoint before it.
+         * Without index, encoded data is read from its start.
+         * Return: 0 if succeed, or -1 if range is beyond original data.
+         */
+        int locate(uint64_t offset, uint64_t length, range_location &location) const;
+
+        /**
+         * Read header from `source` and rebuild huffman trees. Source is left
+         * at start of encoded data.
+         * Return: 0 if succeed, or -1 if header is broken.
+         */
+        template <typename Source>
+        int read_header(Source &source)
+        {
+            using namespace std;
 
-            _root.reset(new huffman_node(node_data, 0));
+            TRACE_SPAN("huffman_decode::rebuild_tree");
 
-            // In case the root might not have children (i.e. root is leaf node)
-            if (node_data < 0) {
-                /** For restore tree from post order, without recursion */
-                stack< shared_ptr<huffman_node> > huff_tree;
-                huff_tree.push(_root);
+            _bad = true;
 
-                while (!huff_tree.empty()) {
-                    /** Current tree node */
-                    shared_ptr<huffman_node> current = huff_tree.top();
+            uint32_t u_node_data;
+            if (source.read(&u_node_data, sizeof (u_node_data)) != sizeof (u_node_data)) {
+                return -1;
+            }
+            _original_size = ntohl(u_node_data);
 
-                    input.read(reinterpret_cast<char *>(&u_node_data), sizeof (u_node_data));
-                    u_node_data = ntohl(u_node_data);
-                    node_data = *(reinterpret_cast<int32_t *>(&u_node_data));
+            /** Read the tree saved in input stream, or mark of order 1 */
+            if (source.read(&u_node_data, sizeof (u_node_data)) != sizeof (u_node_data)) {
+                return -1;
+            }
+            u_node_data = ntohl(u_node_data);
 
-                    shared_ptr<huffman_node> new_node(new huffman_node(node_data, 0));
+            _roots.clear();
+            if (u_node_data != CONTEXT_MARK) {
+                int32_t node_data = *(reinterpret_cast<int32_t *>(&u_node_data));
+                if (node_data > 255) {
+                    return -1;
+                }
 
-                    // Left child first (post order)
-                    if (current->left == NULL) {
-                        current->left = new_node;
-                    }
-                    else {
-                        current->right = new_node;
-                        // Both children are fulfilled, remove this node
-                        huff_tree.pop();
+                _roots.resize(1);
+                int words = _read_tree(source, node_data, _roots[0]);
+                if (words < 0) {
+                    return -1;
+                }
+                memset(_context_map, 0, sizeof (_context_map));
+                _header_size = sizeof (uint32_t) * (1 + static_cast<uint64_t>(words));
+            }
+            else {
+                uint32_t table_count;
+                if (source.read(&table_count, sizeof (table_count)) != sizeof (table_count)) {
+                    return -1;
+                }
+                table_count = ntohl(table_count);
+                if (table_count < 2 || table_count > MAX_TABLES ||
+                    source.read(_context_map, sizeof (_context_map)) != sizeof (_context_map)) {
+                    return -1;
+                }
+                for (int i = 0; i < 256; ++i) {
+                    if (_context_map[i] >= table_count) {
+                        return -1;
                     }
+                }
 
-                    // Not leaf node
-                    if (node_data < 0) {
-                        huff_tree.push(new_node);
+                _header_size = sizeof (uint32_t) * 3 + sizeof (_context_map);
+                _roots.resize(table_count);
+                for (auto &root : _roots) {
+                    // Every tree has two chars at least, so each char takes a bit
+                    if (source.read(&u_node_data, sizeof (u_node_data)) != sizeof (u_node_data)) {
+                        return -1;
+                    }
+                    u_node_data = ntohl(u_node_data);
+                    int32_t node_data = *(reinterpret_cast<int32_t *>(&u_node_data));
+                    int words = (node_data < 0) ? _read_tree(source, node_data, root) : -1;
+                    if (words < 0) {
+                        return -1;
                     }
+                    _header_size += sizeof (uint32_t) * static_cast<uint64_t>(words);
                 }
             }
 
-            data_start = input.tellg();
             _build_char_table();
+            _build_nodes();
+            _checkpoint_interval = 0;
+            _checkpoints.clear();
+            _checkpoint_contexts.clear();
+            _data_end = UINT64_MAX;
+            _bad = false;
+            return 0;
         }
 
-        int write(std::ostream &output)
+        /**
+         * Decode chars from `source`, which read_header() has read, into `sink`.
+         * Return: 0 if succeed, or -1 if data is broken or sink fails.
+         */
+        template <typename Source, typename Sink>
+        int decode(Source &source, Sink &sink)
         {
-            using namespace std;
+            TRACE_SPAN("huffman_decode::decode");
+
+            return decode_from(source, sink, 0, 0, 0, _original_size);
+        }
 
-            std::istream &input = *_input;
-
-            input.clear();
-            input.seekg(data_start);
-            
-            shared_ptr<huffman_node> current = _root;
-            unsigned int result_bytes = 0;
-            unsigned int input_bit_offset = 0;
-            uint8_t buf[1024];
-            streamsize buflen;
-            streamsize pos = 0;
-
-            input.read(reinterpret_cast<char *>(&buf), sizeof (buf));
-            buflen = input.gcount();
-
-            while (result_bytes < _original_size) {
-                // If current bit is 1, go right
-                // Magic, don't touch
-                if ( buf[pos] & (1 << input_bit_offset) ) {
-                    current = current->right;
+        /**
+         * Decode `skip` + `length` chars from `source`, which starts
+         * `skip_bits` bits before a code of a char following `context`, and
+         * write the last `length` of them into `sink`. Safe to be called by
+         * several threads at once.
+         * Return: 0 if succeed, or -1 if data is broken or sink fails.
+         */
+        template <typename Source, typename Sink>
+        int decode_from(Source &source, Sink &sink, unsigned int skip_bits, uint8_t context, uint64_t skip,
+            uint64_t length) const
+        {
+            if (_bad) {
+                return -1;
+            }
+            if (length == 0) {
+                return 0;
+            }
+
+            /** Encoded data not decoded yet, and 8 bytes of padding after it */
+            uint8_t in[BLOCK_SIZE + 8];
+            size_t inlen = 0;
+            bool eof = false;
+            /** Decoded chars, written out in blocks instead of one by one */
+            uint8_t out[BLOCK_SIZE];
+            size_t outlen = 0;
+            uint64_t remaining = skip + length;
+            /** Chars before range, dropped when written out */
+            uint64_t drop = skip;
+
+            // If root is leaf node (i.e. only one kind of char), every bit
+            // stands for that char
+            if (_roots[0]->data >= 0) {
+                memset(out, _roots[0]->data, sizeof (out));
+                while (length > 0) {
+                    size_t len = (length < sizeof (out)) ? static_cast<size_t>(length) : sizeof (out);
+                    if (!sink.write(out, len)) {
+                        return -1;
+                    }
+                    length -= len;
                 }
-                else {
-                    current = current->left;
+                return 0;
+            }
+
+            my_kernels::decode_tables tables = { &_lookup.front(), &_nodes.front(), _context_lookup };
+            my_kernels::decode_state state = { skip_bits, _context_lookup[context] };
+
+            while (remaining > 0) {
+                // Keep bytes of codes not decoded yet, and fill up the block
+                size_t used = static_cast<size_t>(state.bit >> 3);
+                memmove(in, in + used, inlen - used);
+                inlen -= used;
+                state.bit -= static_cast<uint64_t>(used) * 8;
+                while (!eof && inlen < BLOCK_SIZE) {
+                    size_t len = source.read(in + inlen, BLOCK_SIZE - inlen);
+                    eof = (len == 0);
+                    inlen += len;
                 }
+                memset(in + inlen, 0, 8);
 
-                if (current == NULL) {
+                // Before end of data every code must be whole in the block
+                uint64_t limit = static_cast<uint64_t>(inlen) * 8;
+                if (!eof) {
+                    limit -= my_kernels::MAX_CODE_LENGTH;
+                }
+                size_t count = sizeof (out) - outlen;
+                if (remaining < count) {
+                    count = static_cast<size_t>(remaining);
+                }
+
+                size_t decoded = my_kernels::decode(tables, in, limit, out + outlen, count, state);
+                if (state.bit > static_cast<uint64_t>(inlen) * 8 || (decoded == 0 && eof)) {
                     return -1;
                 }
+                outlen += decoded;
+                remaining -= decoded;
 
-                // Write char if reached leaf node
-                if (current->data >= 0) {
-                    output.put(static_cast<char>(current->data));
-                    current = _root;
-                    result_bytes += 1;
+                if (outlen == sizeof (out)) {
+                    if (!_write_out(sink, out, outlen, drop)) {
+                        return -1;
+                    }
+                    outlen = 0;
                 }
+            }
 
-                input_bit_offset += 1;
-                if (input_bit_offset >= 8) {
-                    input_bit_offset = 0;
-                    pos += 1;
+            if (outlen > 0 && !_write_out(sink, out, outlen, drop)) {
+                return -1;
+            }
+            return 0;
+        }
+
+        /**
+         * Decode `length` bytes of original data from `offset` out of payload
+         * at start of `fd`, reading only from the checkpoint before `offset`.
+         * Return: 0 if succeed, or -1 if range is invalid, data is broken or
+         *         sink fails.
+         */
+        template <typename Sink>
+        int decode_range(int fd, uint64_t offset, uint64_t length, Sink &sink) const
+        {
+            TRACE_SPAN("huffman_decode::decode_range");
+
+            range_location location;
+            if (locate(offset, length, location) < 0) {
+                return -1;
+            }
+
+            my_io::pread_source source(fd, location.begin, location.end - location.begin);
+            return decode_from(source, sink, location.skip_bits, location.context, location.skip, length);
+        }
+
+        /**
+         * Decode payload at start of `fd` into `sink`, by up to `threads`
+         * threads each decoding PARTITION_SIZE bytes from a checkpoint into
+         * memory, written out in order. Without index, or if too small to
+         * split, it is decoded by the calling thread alone.
+         * Return: 0 if succeed, or -1 if data is broken or sink fails.
+         */
+        template <typename Sink>
+        int decode_parallel(int fd, Sink &sink, unsigned int threads) const
+        {
+            using namespace std;
+
+            TRACE_SPAN("huffman_decode::decode_parallel");
+
+            // Partitions start at checkpoints
+            uint64_t partition = 0;
+            if (has_index()) {
+                partition = (PARTITION_SIZE + _checkpoint_interval - 1) / _checkpoint_interval * _checkpoint_interval;
+            }
+            if (threads <= 1 || partition == 0 || _original_size < 2 * partition) {
+                return decode_range(fd, 0, _original_size, sink);
+            }
+
+            vector< vector<uint8_t> > buffers(threads, vector<uint8_t>(static_cast<size_t>(partition)));
+            vector<int> results(threads);
+
+            for (uint64_t start = 0; start < _original_size; start += partition * threads) {
+                vector<thread> workers;
+                unsigned int count = 0;
+                for (; count < threads && start + partition * count < _original_size; ++count) {
+                    uint64_t offset = start + partition * count;
+                    uint64_t length = (_original_size - offset < partition) ? _original_size - offset : partition;
+
+                    auto work = [this, fd, offset, length, &buffers, &results, count]() {
+                        my_io::span_sink part(&buffers[count].front(), static_cast<size_t>(length));
+                        results[count] = decode_range(fd, offset, length, part);
+                    };
+                    // Calling thread takes the last partition of each round
+                    if (count + 1 < threads && start + partition * (count + 1) < _original_size) {
+                        workers.push_back(thread(work));
+                    }
+                    else {
+                        work();
+                    }
+                }
+                for (auto &worker : workers) {
+                    worker.join();
                 }
 
-                if (pos == buflen) {
-                    if (input.eof()) {
+                for (unsigned int i = 0; i < count; ++i) {
+                    uint64_t offset = start + partition * i;
+                    uint64_t length = (_original_size - offset < partition) ? _original_size - offset : partition;
+                    if (results[i] < 0 || !sink.write(&buffers[i].front(), static_cast<size_t>(length))) {
                         return -1;
                     }
-                    input.read(reinterpret_cast<char *>(&buf), sizeof (buf));
-                    buflen = input.gcount();
-                    pos = 0;
                 }
             }
 
             return 0;
         }
 
+        int write(std::ostream &output)
+        {
+            if (_input == NULL) {
+                return -1;
+            }
+
+            my_io::stream_source source(*_input);
+            my_io::stream_sink sink(output);
+            return decode(source, sink);
+        }
+
     };
 };
 
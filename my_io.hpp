@@ -0,0 +1,253 @@
+#ifndef __MY_IO_HPP__
+#define __MY_IO_HPP__
+
+#include <iostream>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+
+/**
+ * Sources and sinks of bytes for codec loops, which are templates over them
+ * so every pair gets its own loop with no virtual call per byte. They move
+ * blocks of bytes only.
+ *
+ * A source has `size_t read(void *dst, size_t len)`, which returns fewer than
+ * `len` bytes only at end of data or on error.
+ * A sink has `bool write(const void *src, size_t len)`, which returns false on
+ * error.
+ */
+namespace my_io
+{
+    /** Reads bytes of memory */
+    class span_source
+    {
+    private:
+        const uint8_t *_data;
+        size_t _size;
+        size_t _pos;
+
+    public:
+        span_source(const void *data, size_t size)
+        : _data(static_cast<const uint8_t *>(data)), _size(size), _pos(0)
+        {
+
+        }
+
+        size_t read(void *dst, size_t len)
+        {
+            if (len > _size - _pos) {
+                len = _size - _pos;
+            }
+            memcpy(dst, _data + _pos, len);
+            _pos += len;
+            return len;
+        }
+    };
+
+    /** Reads a file descriptor from its current offset */
+    class fd_source
+    {
+    private:
+        int _fd;
+        bool _failed;
+
+    public:
+        explicit fd_source(int fd)
+        : _fd(fd), _failed(false)
+        {
+
+        }
+
+        size_t read(void *dst, size_t len)
+        {
+            size_t done = 0;
+            while (done < len) {
+                ssize_t n = ::read(_fd, static_cast<uint8_t *>(dst) + done, len - done);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    _failed = _failed || n < 0;
+                    break;
+                }
+                done += static_cast<size_t>(n);
+            }
+            return done;
+        }
+
+        /** Check if a read failed, rather than reached end of file */
+        bool failed() const
+        {
+            return _failed;
+        }
+    };
+
+    /**
+     * Reads `length` bytes of a file descriptor from `offset`, without moving
+     * its file offset, so threads can read parts of one file at once
+     */
+    class pread_source
+    {
+    private:
+        int _fd;
+        uint64_t _offset;
+        uint64_t _remaining;
+
+    public:
+        pread_source(int fd, uint64_t offset, uint64_t length)
+        : _fd(fd), _offset(offset), _remaining(length)
+        {
+
+        }
+
+        size_t read(void *dst, size_t len)
+        {
+            if (len > _remaining) {
+                len = static_cast<size_t>(_remaining);
+            }
+
+            size_t done = 0;
+            while (done < len) {
+                ssize_t n = ::pread(_fd, static_cast<uint8_t *>(dst) + done, len - done,
+                    static_cast<off_t>(_offset + done));
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+                done += static_cast<size_t>(n);
+            }
+            _offset += done;
+            _remaining -= done;
+            return done;
+        }
+    };
+
+    /** Adapter of an input stream */
+    class stream_source
+    {
+    private:
+        std::istream &_input;
+
+    public:
+        explicit stream_source(std::istream &input)
+        : _input(input)
+        {
+
+        }
+
+        size_t read(void *dst, size_t len)
+        {
+            _input.read(static_cast<char *>(dst), static_cast<std::streamsize>(len));
+            return static_cast<size_t>(_input.gcount());
+        }
+    };
+
+    /** Writes into memory of fixed capacity */
+    class span_sink
+    {
+    private:
+        uint8_t *_data;
+        size_t _capacity;
+        size_t _size;
+
+    public:
+        span_sink(void *data, size_t capacity)
+        : _data(static_cast<uint8_t *>(data)), _capacity(capacity), _size(0)
+        {
+
+        }
+
+        bool write(const void *src, size_t len)
+        {
+            if (len > _capacity - _size) {
+                return false;
+            }
+            memcpy(_data + _size, src, len);
+            _size += len;
+            return true;
+        }
+
+        /** Bytes written so far */
+        size_t size() const
+        {
+            return _size;
+        }
+    };
+
+    /** Writes to a file descriptor, e.g. a file or socket */
+    class fd_sink
+    {
+    private:
+        int _fd;
+
+    public:
+        explicit fd_sink(int fd)
+        : _fd(fd)
+        {
+
+        }
+
+        bool write(const void *src, size_t len)
+        {
+            size_t done = 0;
+            while (done < len) {
+                ssize_t n = ::write(_fd, static_cast<const uint8_t *>(src) + done, len - done);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0) {
+                    return false;
+                }
+                done += static_cast<size_t>(n);
+            }
+            return true;
+        }
+    };
+
+    /** Appends to a growable buffer */
+    class buffer_sink
+    {
+    private:
+        std::vector<uint8_t> &_buffer;
+
+    public:
+        explicit buffer_sink(std::vector<uint8_t> &buffer)
+        : _buffer(buffer)
+        {
+
+        }
+
+        bool write(const void *src, size_t len)
+        {
+            const uint8_t *bytes = static_cast<const uint8_t *>(src);
+            _buffer.insert(_buffer.end(), bytes, bytes + len);
+            return true;
+        }
+    };
+
+    /** Adapter of an output stream */
+    class stream_sink
+    {
+    private:
+        std::ostream &_output;
+
+    public:
+        explicit stream_sink(std::ostream &output)
+        : _output(output)
+        {
+
+        }
+
+        bool write(const void *src, size_t len)
+        {
+            return !_output.write(static_cast<const char *>(src), static_cast<std::streamsize>(len)).fail();
+        }
+    };
+};
+
+#endif
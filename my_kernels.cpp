@@ -0,0 +1,105 @@
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <endian.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "my_kernels.hpp"
+
+using namespace my_kernels;
+
+namespace
+{
+    namespace baseline
+    {
+#include "my_kernels_impl.hpp"
+    }
+
+#if defined(__x86_64__)
+#pragma GCC push_options
+#pragma GCC target("avx2,bmi,bmi2,lzcnt,popcnt")
+#define KERNEL_BMI2
+    namespace avx2
+    {
+#include "my_kernels_impl.hpp"
+    }
+#pragma GCC pop_options
+#undef KERNEL_BMI2
+#endif
+
+    /** Kernels of one instruction set */
+    struct kernel_set
+    {
+        isa_level level;
+        size_t (*encode)(const encode_tables &, const uint8_t *, size_t, uint8_t *, size_t, size_t &, encode_state &);
+        size_t (*decode)(const decode_tables &, const uint8_t *, uint64_t, uint8_t *, size_t, decode_state &);
+    };
+
+    /** Best set CPU supports, or the one HW2_ISA asks if CPU supports it */
+    kernel_set select_kernels()
+    {
+        isa_level level = ISA_BASELINE;
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        // Codes depend on those before them, so wider vectors have nothing
+        // to work on, and AVX2 with BMI2 is the top set
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) {
+            level = ISA_AVX2;
+        }
+#endif
+
+        const char *wanted = getenv("HW2_ISA");
+        if (wanted != NULL) {
+            for (int i = ISA_BASELINE; i <= level; ++i) {
+                if (strcmp(wanted, isa_name(static_cast<isa_level>(i))) == 0) {
+                    level = static_cast<isa_level>(i);
+                    break;
+                }
+            }
+        }
+
+        switch (level) {
+#if defined(__x86_64__)
+        case ISA_AVX2:
+            return kernel_set { ISA_AVX2, avx2::encode, avx2::decode };
+#endif
+        default:
+            return kernel_set { ISA_BASELINE, baseline::encode, baseline::decode };
+        }
+    }
+
+    const kernel_set &kernels()
+    {
+        static const kernel_set selected = select_kernels();
+        return selected;
+    }
+}
+
+isa_level my_kernels::isa()
+{
+    return kernels().level;
+}
+
+const char *my_kernels::isa_name(isa_level level)
+{
+    switch (level) {
+    case ISA_AVX2:
+        return "avx2";
+    default:
+        return "baseline";
+    }
+}
+
+size_t my_kernels::encode(const encode_tables &tables, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap,
+    size_t &out_len, encode_state &state)
+{
+    return kernels().encode(tables, in, in_len, out, out_cap, out_len, state);
+}
+
+size_t my_kernels::decode(const decode_tables &tables, const uint8_t *in, uint64_t limit, uint8_t *out, size_t count,
+    decode_state &state)
+{
+    return kernels().decode(tables, in, limit, out, count, state);
+}
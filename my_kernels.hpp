@@ -0,0 +1,103 @@
+#ifndef __MY_KERNELS_HPP__
+#define __MY_KERNELS_HPP__
+
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * Inner loops of Huffman coding on blocks of memory. Each is built for
+ * several instruction sets, and the best one the CPU supports is picked at
+ * first use. Environment variable HW2_ISA (baseline or avx2) picks a lower
+ * one for testing.
+ */
+namespace my_kernels
+{
+    /** Instruction sets kernels are built for */
+    enum isa_level
+    {
+        ISA_BASELINE,
+        ISA_AVX2
+    };
+
+    /** Bits of codes looked up at once by decode() */
+    const unsigned int LOOKUP_BITS = 10;
+
+    /** Entries of lookup table of one code table */
+    const size_t LOOKUP_SIZE = static_cast<size_t>(1) << LOOKUP_BITS;
+
+    /** Bytes an encode() may write past the last byte it reports */
+    const size_t ENCODE_SLACK = 8;
+
+    /** Longest code of a 32-bit sized input, in bits */
+    const unsigned int MAX_CODE_LENGTH = 56;
+
+    /** Code tables for encode() */
+    struct encode_tables
+    {
+        /** Code of each char with first bit lowest, and its length, 256 of each table */
+        const uint64_t *codes;
+        const uint8_t *lengths;
+        /** Index in codes of table of each previous char */
+        const uint16_t *context_rows;
+    };
+
+    /** Bits not written yet and current code table */
+    struct encode_state
+    {
+        uint64_t bits;
+        unsigned int bit_count;
+        size_t row;
+    };
+
+    /** Code tables for decode() */
+    struct decode_tables
+    {
+        /**
+         * LOOKUP_SIZE entries of each table, by next LOOKUP_BITS bits: a char
+         * with its code length in the top 8 bits, or for longer codes an
+         * inner node of `nodes` reached after LOOKUP_BITS bits, length 0
+         */
+        const uint32_t *lookup;
+        /** Flattened trees, as huffman_decode has them */
+        const int32_t *nodes;
+        /** Index in lookup of table of each previous char */
+        const uint32_t *context_lookup;
+    };
+
+    /** Position in input and current code table */
+    struct decode_state
+    {
+        uint64_t bit;
+        uint32_t table;
+    };
+
+    /**
+     * Description: Instruction set kernels run with.
+     */
+    isa_level isa();
+
+    /**
+     * Description: Name of `level`, as HW2_ISA takes it.
+     */
+    const char *isa_name(isa_level level);
+
+    /**
+     * Description: Encode chars of `in` while `out` has room for a code,
+     *              appending whole bytes and keeping the rest in `state`.
+     *              Up to ENCODE_SLACK bytes beyond those are overwritten.
+     * Return: Chars encoded, and `out_len` is advanced by bytes written.
+     */
+    size_t encode(const encode_tables &tables, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap,
+        size_t &out_len, encode_state &state);
+
+    /**
+     * Description: Decode up to `count` chars into `out`, each starting
+     *              before bit `limit` of `in`. 8 bytes past `limit` must be
+     *              readable.
+     * Return: Chars decoded.
+     */
+    size_t decode(const decode_tables &tables, const uint8_t *in, uint64_t limit, uint8_t *out, size_t count,
+        decode_state &state);
+};
+
+#endif
@@ -0,0 +1,112 @@
+/**
+ * Bodies of kernels, included by my_kernels.cpp once for each instruction
+ * set inside its own namespace and target options, so the compiler builds
+ * each of them for that set. Holds no guard and includes nothing, as
+ * functions of headers would be built for one set and shared by all.
+ *
+ * KERNEL_BMI2 uses BMI2 instructions for bit fields explicitly.
+ */
+
+/** Read 8 bytes of little-endian bits */
+static inline uint64_t load_bits(const uint8_t *p)
+{
+    uint64_t bits;
+    memcpy(&bits, p, sizeof (bits));
+    return le64toh(bits);
+}
+
+/** Write 8 bytes of little-endian bits */
+static inline void store_bits(uint8_t *p, uint64_t bits)
+{
+    bits = htole64(bits);
+    memcpy(p, &bits, sizeof (bits));
+}
+
+/** Lowest `n` bits of `bits` */
+static inline uint64_t low_bits(uint64_t bits, unsigned int n)
+{
+#ifdef KERNEL_BMI2
+    return _bzhi_u64(bits, n);
+#else
+    return bits & ((static_cast<uint64_t>(1) << n) - 1);
+#endif
+}
+
+static size_t encode(const encode_tables &tables, const uint8_t *in, size_t in_len, uint8_t *out, size_t out_cap,
+    size_t &out_len, encode_state &state)
+{
+    const uint64_t *codes = tables.codes;
+    const uint8_t *lengths = tables.lengths;
+    const uint16_t *context_rows = tables.context_rows;
+
+    uint64_t bits = state.bits;
+    unsigned int bit_count = state.bit_count;
+    size_t row = state.row;
+    size_t n = out_len;
+
+    size_t i = 0;
+    for (; i < in_len && n + ENCODE_SLACK <= out_cap; ++i) {
+        // At most 7 bits are pending and codes are 56 bits at most, so all
+        // fit; whole bytes are stored at once and the rest kept
+        unsigned int c = in[i];
+        bits |= codes[row + c] << bit_count;
+        bit_count += lengths[row + c];
+        row = context_rows[c];
+
+        store_bits(out + n, bits);
+        unsigned int whole = bit_count & ~7u;
+        n += whole >> 3;
+        bits >>= whole;
+        bit_count -= whole;
+    }
+
+    state.bits = bits;
+    state.bit_count = bit_count;
+    state.row = row;
+    out_len = n;
+    return i;
+}
+
+static size_t decode(const decode_tables &tables, const uint8_t *in, uint64_t limit, uint8_t *out, size_t count,
+    decode_state &state)
+{
+    const uint32_t *lookup = tables.lookup;
+    const int32_t *nodes = tables.nodes;
+    const uint32_t *context_lookup = tables.context_lookup;
+
+    uint64_t bit = state.bit;
+    uint32_t table = state.table;
+
+    size_t i = 0;
+    for (; i < count && bit < limit; ++i) {
+        // 57 bits at least, enough for the longest code
+        uint64_t window = load_bits(in + (bit >> 3)) >> (bit & 7);
+        uint32_t entry = lookup[table + low_bits(window, LOOKUP_BITS)];
+        uint32_t length = entry >> 24;
+
+        unsigned int c;
+        if (length != 0) {
+            c = entry & 0xff;
+            bit += length;
+        }
+        else {
+            // Longer codes go on down the tree a bit at a time
+            int32_t node = static_cast<int32_t>(entry & 0xffffff);
+            window >>= LOOKUP_BITS;
+            bit += LOOKUP_BITS;
+            do {
+                node = nodes[2 * node + (window & 1)];
+                window >>= 1;
+                bit += 1;
+            } while (node >= 0);
+            c = static_cast<unsigned int>(-1 - node);
+        }
+
+        out[i] = static_cast<uint8_t>(c);
+        table = context_lookup[c];
+    }
+
+    state.bit = bit;
+    state.table = table;
+    return i;
+}
@@ -0,0 +1,297 @@
+#include <fstream>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "my_resume.hpp"
+
+using namespace my_resume;
+
+/** Suffixes of payload received so far, of its meta, and of meta being replaced */
+static const char PART_SUFFIX[] = ".part";
+static const char META_SUFFIX[] = ".meta";
+static const char TMP_SUFFIX[] = ".tmp";
+
+/** Longest transfer ID accepted */
+static const size_t MAX_ID_LEN = 32;
+
+/**
+ * Description: Check if `name` ends with `suffix`.
+ */
+static bool ends_with(const char *name, const char *suffix)
+{
+    size_t len = strlen(name);
+    size_t suffix_len = strlen(suffix);
+    return len > suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+std::string my_resume::make_id(const std::string &payload)
+{
+    // FNV-1a, with size mixed in, so a payload differing in a byte or its
+    // length never continues another
+    uint64_t hash = 14695981039346656037ULL ^ payload.size();
+    for (unsigned char c : payload) {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+
+    char id[32];
+    snprintf(id, sizeof (id), "%016llx", static_cast<unsigned long long>(hash));
+    return id;
+}
+
+bool my_resume::is_valid_id(const std::string &id)
+{
+    if (id.empty() || id.size() > MAX_ID_LEN) {
+        return false;
+    }
+    for (char c : id) {
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+partial_store::partial_store(const std::string &dir)
+: _dir(dir)
+{
+
+}
+
+int partial_store::init()
+{
+    if (mkdir(_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
+
+    DIR *dir = opendir(_dir.c_str());
+    if (dir == NULL) {
+        perror("opendir");
+        return -1;
+    }
+
+    // Uploads of earlier runs are kept to be resumed, unless abandoned
+    time_t now = time(NULL);
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (!ends_with(ent->d_name, PART_SUFFIX) && !ends_with(ent->d_name, META_SUFFIX) &&
+            !ends_with(ent->d_name, TMP_SUFFIX)) {
+            continue;
+        }
+
+        std::string path = _dir + "/" + ent->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0 && (ends_with(ent->d_name, TMP_SUFFIX) || now - st.st_mtime > PARTIAL_TTL)) {
+            unlink(path.c_str());
+        }
+    }
+    closedir(dir);
+
+    return 0;
+}
+
+std::string partial_store::_path(const std::string &id, const char *suffix) const
+{
+    return _dir + "/" + id + suffix;
+}
+
+int partial_store::_read_meta(const std::string &id, uint64_t &total, uint64_t &durable, std::string &filename) const
+{
+    // Meta is total and durable bytes, then file name to the end of line
+    std::ifstream meta(_path(id, META_SUFFIX));
+    if (!(meta >> total >> durable) || meta.get() != ' ' || !std::getline(meta, filename)) {
+        return -1;
+    }
+
+    // Part may have lost its tail in a crash, never what was synced
+    struct stat st;
+    if (stat(_path(id, PART_SUFFIX).c_str(), &st) < 0 || static_cast<uint64_t>(st.st_size) < durable ||
+        durable > total) {
+        return -1;
+    }
+    return 0;
+}
+
+int partial_store::_write_meta(const std::string &id, uint64_t total, uint64_t durable, const std::string &filename) const
+{
+    std::string path = _path(id, META_SUFFIX);
+    std::string tmp_path = path + TMP_SUFFIX;
+    std::string line = std::to_string(total) + " " + std::to_string(durable) + " " + filename + "\n";
+
+    // Synced and renamed, so meta after a crash is either old or new
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    bool ok = write(fd, line.data(), line.size()) == static_cast<ssize_t>(line.size()) && fsync(fd) == 0;
+    close(fd);
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) < 0) {
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+void partial_store::_remove(const std::string &id) const
+{
+    unlink(_path(id, META_SUFFIX).c_str());
+    unlink(_path(id, PART_SUFFIX).c_str());
+}
+
+bool partial_store::_claim(const std::string &id, int fd)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    auto it = _owners.find(id);
+    if (it != _owners.end() && it->second != fd) {
+        // Holder is left blocked on a link gone dead, most likely. Shut down
+        // its socket, so it fails, saves what it has and lets go.
+        shutdown(it->second, SHUT_RDWR);
+        bool released = _cond.wait_for(lock, std::chrono::seconds(TAKEOVER_SECONDS), [&]() {
+            return _owners.count(id) == 0;
+        });
+        if (!released) {
+            return false;
+        }
+    }
+
+    _owners[id] = fd;
+    return true;
+}
+
+void partial_store::_release(const std::string &id)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _owners.erase(id);
+    _cond.notify_all();
+}
+
+long long partial_store::offset(const std::string &id, uint64_t total, const std::string &filename, int fd)
+{
+    if (!_claim(id, fd)) {
+        return -1;
+    }
+
+    uint64_t meta_total, durable;
+    std::string meta_filename;
+    if (_read_meta(id, meta_total, durable, meta_filename) < 0 || meta_total != total || meta_filename != filename) {
+        _remove(id);
+        durable = 0;
+    }
+
+    _release(id);
+    return static_cast<long long>(durable);
+}
+
+partial_upload::partial_upload(partial_store &store)
+: _store(store), _fd(-1), _total(0), _written(0), _durable(0)
+{
+
+}
+
+partial_upload::~partial_upload()
+{
+    if (_fd >= 0) {
+        _sync();
+        close(_fd);
+    }
+    if (!_id.empty()) {
+        _store._release(_id);
+    }
+}
+
+int partial_upload::open(const std::string &id, uint64_t offset, uint64_t total, const std::string &filename, int fd)
+{
+    if (!_id.empty() || !_store._claim(id, fd)) {
+        return -1;
+    }
+    _id = id;
+    _filename = filename;
+    _total = total;
+
+    uint64_t meta_total, durable;
+    std::string meta_filename;
+    if (_store._read_meta(id, meta_total, durable, meta_filename) < 0 || meta_total != total ||
+        meta_filename != filename) {
+        _store._remove(id);
+        durable = 0;
+    }
+    if (offset != durable || offset > total) {
+        return -1;
+    }
+
+    // Bytes after durable ones may be torn, they are received again
+    _fd = ::open(_store._path(id, PART_SUFFIX).c_str(), O_RDWR | O_CREAT, 0644);
+    if (_fd < 0 || ftruncate(_fd, static_cast<off_t>(durable)) < 0) {
+        return -1;
+    }
+    _written = durable;
+    _durable = durable;
+
+    return _store._write_meta(_id, _total, _durable, _filename);
+}
+
+int partial_upload::write(const void *data, size_t len)
+{
+    if (_fd < 0 || _written + len > _total) {
+        return -1;
+    }
+
+    const char *p = static_cast<const char *>(data);
+    while (len > 0) {
+        ssize_t n = pwrite(_fd, p, len, static_cast<off_t>(_written));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= static_cast<size_t>(n);
+        _written += static_cast<uint64_t>(n);
+    }
+
+    if (_written - _durable >= SYNC_INTERVAL) {
+        return _sync();
+    }
+    return 0;
+}
+
+int partial_upload::_sync()
+{
+    if (_written == _durable) {
+        return 0;
+    }
+
+    // Data before meta, so meta never claims bytes that are not on disk
+    if (fdatasync(_fd) < 0) {
+        return -1;
+    }
+    _durable = _written;
+    return _store._write_meta(_id, _total, _durable, _filename);
+}
+
+int partial_upload::finish()
+{
+    if (_fd < 0 || _written != _total || lseek(_fd, 0, SEEK_SET) != 0) {
+        return -1;
+    }
+
+    // Payload is still open, so it outlives its files
+    _store._remove(_id);
+    _store._release(_id);
+    _id.clear();
+
+    int fd = _fd;
+    _fd = -1;
+    return fd;
+}
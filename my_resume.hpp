@@ -0,0 +1,153 @@
+#ifndef __MY_RESUME_HPP__
+#define __MY_RESUME_HPP__
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+/**
+ * Resumable uploads. Client names each upload by a transfer ID hashed from
+ * its payload, so the same payload sent again is the same upload. Server
+ * keeps what it has received as `<id>.part` in a directory of its own, with
+ * `<id>.meta` telling its total size, file name and how many bytes are
+ * durable. Bytes are synced every SYNC_INTERVAL and when the connection
+ * ends, so a new connection, or a restarted server, continues from there.
+ */
+namespace my_resume
+{
+    /** Bytes received between syncs to disk */
+    const uint64_t SYNC_INTERVAL = 4 << 20;
+
+    /** Seconds partial uploads not touched are kept, a week */
+    const long PARTIAL_TTL = 7 * 24 * 3600;
+
+    /** Seconds a connection waits for another to give an upload up */
+    const int TAKEOVER_SECONDS = 10;
+
+    /**
+     * Description: Transfer ID of upload of `payload`, 16 hex digits.
+     */
+    std::string make_id(const std::string &payload);
+
+    /**
+     * Description: Check if `id` is a transfer ID, safe to name files.
+     */
+    bool is_valid_id(const std::string &id);
+
+    class partial_upload;
+
+    /**
+     * Directory of partial uploads, and which connection is receiving each.
+     * A connection claiming an upload another one holds shuts that one down
+     * and waits for it to save what it has, as the other is most likely
+     * dead on a link that failed. Thread-safe.
+     */
+    class partial_store
+    {
+        friend class partial_upload;
+
+    private:
+        std::string _dir;
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        /** Sockets of connections receiving uploads, by ID */
+        std::map<std::string, int> _owners;
+
+        std::string _path(const std::string &id, const char *suffix) const;
+
+        /** Read meta of `id`, 0 if succeed or -1 if there is none */
+        int _read_meta(const std::string &id, uint64_t &total, uint64_t &durable, std::string &filename) const;
+
+        /** Replace meta of `id` at once, 0 if succeed or -1 if fail */
+        int _write_meta(const std::string &id, uint64_t total, uint64_t durable, const std::string &filename) const;
+
+        /** Remove files of `id` */
+        void _remove(const std::string &id) const;
+
+        /** Claim `id` for connection of socket `fd`, false if its holder does not let go */
+        bool _claim(const std::string &id, int fd);
+
+        /** Let go of `id` */
+        void _release(const std::string &id);
+
+    public:
+        explicit partial_store(const std::string &dir);
+
+        partial_store(const partial_store &) = delete;
+        partial_store &operator=(const partial_store &) = delete;
+
+        /**
+         * Description: Create directory, and remove partial uploads older
+         *              than PARTIAL_TTL.
+         * Return: 0 if succeed, or -1 if fail.
+         */
+        int init();
+
+        /**
+         * Description: Durable bytes of upload `id` of `total` bytes to
+         *              `filename`, taking it over from connection holding
+         *              it for socket `fd`. An upload of another total or
+         *              file starts over.
+         * Return: Bytes to continue from, or -1 if it is held still.
+         */
+        long long offset(const std::string &id, uint64_t total, const std::string &filename, int fd);
+    };
+
+    /**
+     * One connection receiving an upload, saving it as it goes.
+     *
+     * Usage:
+     *     partial_upload upload(store);
+     *     upload.open(id, offset, total, filename, fd);
+     *     upload.write(data, len);             // Until total bytes are written
+     *     int payload_fd = upload.finish();    // Complete payload, out of store
+     */
+    class partial_upload
+    {
+    private:
+        partial_store &_store;
+        std::string _id;
+        std::string _filename;
+        int _fd;
+        uint64_t _total;
+        uint64_t _written;
+        uint64_t _durable;
+
+        /** Sync bytes written and record them durable */
+        int _sync();
+
+    public:
+        explicit partial_upload(partial_store &store);
+
+        /** Saves bytes written so far */
+        ~partial_upload();
+
+        partial_upload(const partial_upload &) = delete;
+        partial_upload &operator=(const partial_upload &) = delete;
+
+        /**
+         * Description: Claim upload `id` of `total` bytes to `filename` for
+         *              connection of socket `fd`, to continue at `offset`.
+         * Return: 0 if succeed, or -1 if upload is held, or durable bytes
+         *         are not `offset`.
+         */
+        int open(const std::string &id, uint64_t offset, uint64_t total, const std::string &filename, int fd);
+
+        /**
+         * Description: Append `len` bytes of `data`.
+         * Return: 0 if succeed, or -1 if fail.
+         */
+        int write(const void *data, size_t len);
+
+        /**
+         * Description: Take complete payload out of store.
+         * Return: Descriptor of payload from its start, or -1 if not
+         *         complete.
+         */
+        int finish();
+    };
+};
+
+#endif
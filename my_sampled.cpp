@@ -0,0 +1,49 @@
+#include "my_sampled.hpp"
+
+using namespace my_sampled;
+
+void pair_counter::add(const uint8_t *data, size_t length)
+{
+    unsigned int prev = _prev;
+    for (size_t i = 0; i < length; ++i) {
+        _freq[(prev << 8) | data[i]] += 1;
+        prev = data[i];
+    }
+    _prev = static_cast<uint8_t>(prev);
+}
+
+bool my_sampled::is_sampled(int fd)
+{
+    uint32_t header[2];
+    my_io::pread_source source(fd, 0, sizeof (header));
+    return source.read(header, sizeof (header)) == sizeof (header) && ntohl(header[1]) == SAMPLED_MARK;
+}
+
+sampled_decode::sampled_decode()
+: _payload_size(0), _original_size(0), _segments(0)
+{
+
+}
+
+int sampled_decode::read_header(int fd, uint64_t payload_size)
+{
+    _payload_size = payload_size;
+    _original_size = 0;
+    _segments = 0;
+
+    uint32_t header[3];
+    my_io::pread_source source(fd, 0, payload_size);
+    if (source.read(header, sizeof (header)) != sizeof (header) || ntohl(header[1]) != SAMPLED_MARK) {
+        return -1;
+    }
+
+    // Every segment takes its length and a header at least
+    uint32_t segments = ntohl(header[2]);
+    if (segments > (payload_size - sizeof (header)) / (2 * sizeof (uint32_t))) {
+        return -1;
+    }
+
+    _original_size = ntohl(header[0]);
+    _segments = segments;
+    return 0;
+}
@@ -0,0 +1,326 @@
+#ifndef __MY_SAMPLED_HPP__
+#define __MY_SAMPLED_HPP__
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <arpa/inet.h>
+
+#include "my_huffman.hpp"
+#include "my_io.hpp"
+
+/**
+ * Single-pass encoding: code tables are built from a sample at the start of
+ * data, and the rest is coded as it is read, so data is read once and need
+ * not be rewound, as from a pipe. When data drifts away from its sample, a
+ * new segment starts with tables of a new sample.
+ *
+ * Payload (integers in network byte order):
+ *     u32 original size, u32 SAMPLED_MARK, u32 segment count
+ *     per segment: u32 length of its Huffman payload, Huffman payload
+ *
+ * Each Huffman payload tells original size of its segment. SAMPLED_MARK
+ * stands where a Huffman payload has its tree, so a huffman_decode refuses
+ * it as a broken header.
+ */
+namespace my_sampled
+{
+    /** Marks payload as sampled */
+    const uint32_t SAMPLED_MARK = 258;
+
+    /** Bytes at start of each segment its tables are built from */
+    const size_t SAMPLE_SIZE = 1048576;
+
+    /** Blocks coded this much worse than their sample count as drifted */
+    const double DRIFT_RATIO = 1.1;
+
+    /** Drifted blocks in a row that start a new segment */
+    const unsigned int DRIFT_BLOCKS = 4;
+
+    /** What single pass has cost, see encode() */
+    struct encode_report
+    {
+        uint64_t original_size;
+        uint32_t segments;
+        /** Bytes of payload */
+        uint64_t payload_size;
+        /** Bytes of payload tables of all data would make, as two passes do */
+        uint64_t two_pass_size;
+    };
+
+    /** Count of each char after each char, as huffman_encode::count_table() takes */
+    class pair_counter
+    {
+    private:
+        std::vector<uint32_t> _freq;
+        uint8_t _prev;
+
+    public:
+        pair_counter() : _freq(256 * 256, 0), _prev(0) {}
+
+        /** Count `length` chars of `data`, following chars counted before */
+        void add(const uint8_t *data, size_t length);
+
+        const std::vector<uint32_t> &freq() const
+        {
+            return _freq;
+        }
+    };
+
+    /**
+     * Source of one segment: its sample, then blocks of data until data ends
+     * or drifts. The block which drifts too far is kept for next sample.
+     */
+    template <typename Source>
+    class segment_source
+    {
+    private:
+        Source &_source;
+        const my_huffman::huffman_encode &_encode;
+        const std::vector<uint8_t> &_sample;
+        size_t _sample_pos;
+        /** Bits per char of sample by its own codes */
+        double _rate;
+        unsigned int _drifted;
+        uint8_t _prev;
+        bool _stopped;
+        bool _ended;
+        uint64_t _length;
+        pair_counter &_counter;
+        std::vector<uint8_t> _pending;
+
+    public:
+        segment_source(Source &source, const my_huffman::huffman_encode &encode, const std::vector<uint8_t> &sample,
+            pair_counter &counter)
+        : _source(source), _encode(encode), _sample(sample), _sample_pos(0), _rate(0), _drifted(0),
+          _prev(sample.empty() ? 0 : sample.back()), _stopped(false), _ended(false), _length(0), _counter(counter)
+        {
+            if (!sample.empty()) {
+                _rate = static_cast<double>(encode.code_bits(&sample.front(), sample.size(), 0)) / sample.size();
+            }
+        }
+
+        size_t read(void *dst, size_t len)
+        {
+            if (_sample_pos < _sample.size()) {
+                size_t n = (_sample.size() - _sample_pos < len) ? _sample.size() - _sample_pos : len;
+                memcpy(dst, &_sample[_sample_pos], n);
+                _sample_pos += n;
+                _length += n;
+                return n;
+            }
+            if (_stopped) {
+                return 0;
+            }
+
+            uint8_t *data = static_cast<uint8_t *>(dst);
+            size_t n = _source.read(data, len);
+            if (n == 0) {
+                _stopped = true;
+                _ended = true;
+                return 0;
+            }
+
+            // Only full blocks are judged, as a short last one says little
+            if (n == len && static_cast<double>(_encode.code_bits(data, n, _prev)) > _rate * DRIFT_RATIO * n) {
+                _drifted += 1;
+            }
+            else {
+                _drifted = 0;
+            }
+            if (_drifted >= DRIFT_BLOCKS) {
+                _pending.assign(data, data + n);
+                _stopped = true;
+                return 0;
+            }
+
+            _counter.add(data, n);
+            _prev = data[n - 1];
+            _length += n;
+            return n;
+        }
+
+        /** Chars read of segment */
+        uint64_t length() const
+        {
+            return _length;
+        }
+
+        /** Check if data has ended, rather than drifted */
+        bool ended() const
+        {
+            return _ended;
+        }
+
+        /** Block which has drifted, start of next sample */
+        std::vector<uint8_t> &pending()
+        {
+            return _pending;
+        }
+    };
+
+    /**
+     * Description: Check if payload at start of `fd` is sampled.
+     */
+    bool is_sampled(int fd);
+
+    /**
+     * Description: Encode `source` to its end into `payload` in one pass,
+     *              modelled by `order` as huffman_encode::set_order() takes,
+     *              and tell in `report` what it costs against two passes.
+     * Return: 0 if succeed, or -1 if fail or source is larger than 4 GB.
+     */
+    template <typename Source>
+    int encode(Source &source, unsigned int order, std::vector<uint8_t> &payload, encode_report &report)
+    {
+        using namespace std;
+
+        TRACE_SPAN("my_sampled::encode");
+
+        // Sizes are filled in when known
+        payload.assign(3 * sizeof (uint32_t), 0);
+        my_io::buffer_sink sink(payload);
+
+        pair_counter all;
+        vector<uint8_t> sample;
+        uint64_t total = 0;
+        uint32_t segments = 0;
+        bool ended = false;
+        uint8_t block[my_huffman::BLOCK_SIZE];
+
+        while (true) {
+            while (!ended && sample.size() < SAMPLE_SIZE) {
+                size_t n = source.read(block, sizeof (block));
+                if (n == 0) {
+                    ended = true;
+                    break;
+                }
+                sample.insert(sample.end(), block, block + n);
+            }
+            if (sample.empty()) {
+                break;
+            }
+            all.add(&sample.front(), sample.size());
+
+            pair_counter counter;
+            counter.add(&sample.front(), sample.size());
+            // A sample of all the rest is counted as two passes would
+            my_huffman::huffman_encode encoded;
+            encoded.set_order(order);
+            encoded.set_sampled(!ended);
+            encoded.count_table(counter.freq(), static_cast<uint32_t>(sample.size()));
+
+            size_t start = payload.size();
+            payload.resize(start + sizeof (uint32_t));
+            segment_source<Source> segment(source, encoded, sample, all);
+            if (encoded.encode(segment, sink) < 0) {
+                return -1;
+            }
+
+            total += segment.length();
+            if (total > UINT32_MAX) {
+                return -1;
+            }
+            uint32_t fields[2] = { htonl(static_cast<uint32_t>(payload.size() - start - sizeof (uint32_t))),
+                htonl(static_cast<uint32_t>(segment.length())) };
+            memcpy(&payload[start], fields, sizeof (fields));
+            segments += 1;
+
+            sample.swap(segment.pending());
+            ended = ended || segment.ended();
+        }
+
+        uint32_t header[3] = { htonl(static_cast<uint32_t>(total)), htonl(SAMPLED_MARK), htonl(segments) };
+        memcpy(&payload.front(), header, sizeof (header));
+
+        my_huffman::huffman_encode two_pass;
+        two_pass.set_order(order);
+        two_pass.count_table(all.freq(), static_cast<uint32_t>(total));
+
+        report.original_size = total;
+        report.segments = segments;
+        report.payload_size = payload.size();
+        report.two_pass_size = (total > 0) ? two_pass.estimate_size(all.freq()) : payload.size();
+        return 0;
+    }
+
+    /**
+     * sampled decode of payload in a file
+     *
+     * Usage:
+     *     sampled_decode decode;
+     *     decode.read_header(fd, payload_size);
+     *     decode.decode(fd, sink);
+     *     decode.segment_tables();    // Coding table of each segment
+     */
+    class sampled_decode
+    {
+    private:
+        uint64_t _payload_size;
+        uint32_t _original_size;
+        uint32_t _segments;
+        std::vector< std::vector< std::vector<uint8_t> > > _tables;
+
+    public:
+        sampled_decode();
+
+        /**
+         * Description: Read header of payload of `payload_size` bytes at
+         *              start of `fd`.
+         * Return: 0 if succeed, or -1 if it is not sampled or broken.
+         */
+        int read_header(int fd, uint64_t payload_size);
+
+        /** Size of original data, known once header is read */
+        uint32_t original_size() const
+        {
+            return _original_size;
+        }
+
+        /** Huffman coding table of each segment decoded, as huffman_decode::char_table */
+        const std::vector< std::vector< std::vector<uint8_t> > > &segment_tables() const
+        {
+            return _tables;
+        }
+
+        /**
+         * Description: Decode payload into `sink`, segment by segment, and
+         *              keep coding table of each.
+         * Return: 0 if succeed, or -1 if data is broken or sink fails.
+         */
+        template <typename Sink>
+        int decode(int fd, Sink &sink)
+        {
+            TRACE_SPAN("my_sampled::decode");
+
+            _tables.clear();
+            uint64_t offset = 3 * sizeof (uint32_t);
+            uint64_t done = 0;
+            for (uint32_t i = 0; i < _segments; ++i) {
+                uint32_t length;
+                my_io::pread_source source(fd, offset, _payload_size - offset);
+                if (source.read(&length, sizeof (length)) != sizeof (length)) {
+                    return -1;
+                }
+                length = ntohl(length);
+                if (length > _payload_size - offset - sizeof (length)) {
+                    return -1;
+                }
+
+                my_io::pread_source segment(fd, offset + sizeof (length), length);
+                my_huffman::huffman_decode decode;
+                if (decode.read_header(segment) < 0 || decode.original_size() > _original_size - done ||
+                    decode.decode(segment, sink) < 0) {
+                    return -1;
+                }
+                _tables.push_back(decode.char_table);
+                done += decode.original_size();
+                offset += sizeof (length) + length;
+            }
+
+            return (done == _original_size && offset == _payload_size) ? 0 : -1;
+        }
+    };
+};
+
+#endif
@@ -4,15 +4,109 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <errno.h>
 
 #include "my_send_recv.h"
 
-static uint8_t in_buf[1048576];
-static int in_buflen = 0;
+#define IN_BUF_SIZE 1048576
+/* Descriptors passed over a Unix socket, waiting for my_recv_fd() */
+#define MAX_PASSED_FDS 64
+
+/*
+ * Each thread serves its own connection, so it gets its own buffer. It is
+ * allocated on first use, as a static thread-local array would be zeroed for
+ * every thread, including workers that never receive.
+ */
+static __thread uint8_t *in_buf = NULL;
+static __thread int in_buflen = 0;
+/* Bytes asked of each recv(), see my_set_recv_size() */
+static int recv_size = IN_BUF_SIZE;
+/*
+ * Descriptors come with the byte they were sent with, whichever read takes
+ * that byte, so every read keeps them here in order of arrival
+ */
+static __thread int passed_fds[MAX_PASSED_FDS];
+static __thread int passed_count = 0;
+/* Told of bytes moved by this thread, see my_set_progress_hook() */
+static __thread void (*progress_hook)(void *, int) = NULL;
+static __thread void *progress_arg = NULL;
+
+static pthread_key_t in_buf_key;
+static pthread_once_t in_buf_once = PTHREAD_ONCE_INIT;
+
+/* Buffer is freed when its thread exits */
+static void make_in_buf_key()
+{
+    pthread_key_create(&in_buf_key, free);
+}
+
+static int alloc_in_buf()
+{
+    if (in_buf != NULL) {
+        return 0;
+    }
+
+    pthread_once(&in_buf_once, make_in_buf_key);
+    in_buf = (uint8_t *) malloc(IN_BUF_SIZE);
+    if (in_buf == NULL) {
+        return -1;
+    }
+    pthread_setspecific(in_buf_key, in_buf);
+
+    return 0;
+}
+
+/* recv() that keeps descriptors passed with the data */
+static int recv_passing(int fd, void *buf, int len, int flags)
+{
+    char control[CMSG_SPACE(sizeof (int) * 4)];
+    struct iovec iov = { buf, (size_t) len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof (control);
+
+    int received_val = recvmsg(fd, &msg, flags | MSG_CMSG_CLOEXEC);
+    if (received_val > 0 && progress_hook != NULL) {
+        progress_hook(progress_arg, received_val);
+    }
+    if (received_val <= 0 || msg.msg_controllen == 0) {
+        return received_val;
+    }
+
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int));
+        int i;
+        for (i = 0; i < count; ++i) {
+            int passed;
+            memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof (int), sizeof (passed));
+            if (passed_count < MAX_PASSED_FDS) {
+                passed_fds[passed_count++] = passed;
+            }
+            else {
+                close(passed);
+            }
+        }
+    }
+
+    return received_val;
+}
 
 static int my_recv(int fd, int flags)
 {
-    int received_val = recv(fd, in_buf, sizeof (in_buf), flags);
+    if (alloc_in_buf() < 0) {
+        in_buflen = 0;
+        return -1;
+    }
+
+    int received_val = recv_passing(fd, in_buf, recv_size, flags);
     if (received_val < 0) {
         in_buflen = 0;
         return received_val;
@@ -22,9 +116,44 @@ static int my_recv(int fd, int flags)
     return in_buflen;
 }
 
+/* Append received data to buffer instead of replacing it */
+static int my_recv_more(int fd, int flags)
+{
+    if (alloc_in_buf() < 0) {
+        return -1;
+    }
+
+    int len = IN_BUF_SIZE - in_buflen;
+    if (len > recv_size) {
+        len = recv_size;
+    }
+
+    int received_val = recv_passing(fd, in_buf + in_buflen, len, flags);
+    if (received_val < 0) {
+        return received_val;
+    }
+    in_buflen += received_val;
+
+    return received_val;
+}
+
 void my_clean_buf()
 {
     in_buflen = 0;
+    while (passed_count > 0) {
+        close(passed_fds[--passed_count]);
+    }
+}
+
+void my_set_recv_size(int size)
+{
+    recv_size = (size > 0 && size <= IN_BUF_SIZE) ? size : IN_BUF_SIZE;
+}
+
+void my_set_progress_hook(void (*hook)(void *arg, int bytes), void *arg)
+{
+    progress_hook = hook;
+    progress_arg = arg;
 }
 
 int my_send(int fd, const void *buf, int *buflen)
@@ -40,6 +169,9 @@ int my_send(int fd, const void *buf, int *buflen)
         }
 
         sent += send_val;
+        if (progress_hook != NULL) {
+            progress_hook(progress_arg, send_val);
+        }
     }
 
     *buflen = sent;
@@ -132,3 +264,83 @@ int my_recv_data(int fd, void *buf, int *buflen)
     *buflen = received;
     return 0;
 }
+
+int my_peek_data(int fd, int len, const void **data)
+{
+    if (len < 0 || len > IN_BUF_SIZE || alloc_in_buf() < 0) {
+        *data = NULL;
+        return -1;
+    }
+
+    while (in_buflen < len) {
+        int received_val = my_recv_more(fd, 0);
+        if (received_val <= 0) {
+            *data = NULL;
+            return (received_val == 0 ? 1 : -1);
+        }
+    }
+
+    *data = in_buf;
+    return 0;
+}
+
+void my_consume(int len)
+{
+    if (len >= in_buflen) {
+        in_buflen = 0;
+        return;
+    }
+
+    memmove(in_buf, in_buf + len, in_buflen - len);
+    in_buflen -= len;
+}
+int my_send_fd(int fd, int passed_fd)
+{
+    char byte = 0;
+    char control[CMSG_SPACE(sizeof (int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof (msg));
+    memset(control, 0, sizeof (control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof (control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+    memcpy(CMSG_DATA(cmsg), &passed_fd, sizeof (int));
+
+    int send_val;
+    do {
+        send_val = sendmsg(fd, &msg, 0);
+    } while (send_val < 0 && errno == EINTR);
+
+    return (send_val == 1) ? 0 : -1;
+}
+
+int my_recv_fd(int fd, int *passed_fd)
+{
+    *passed_fd = -1;
+
+    char byte;
+    int buflen = 1;
+    int status = my_recv_data(fd, &byte, &buflen);
+    if (status < 0) {
+        return -1;
+    }
+    if (buflen == 0) {
+        return 1;
+    }
+    if (passed_count == 0) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    *passed_fd = passed_fds[0];
+    memmove(passed_fds, passed_fds + 1, (passed_count - 1) * sizeof (int));
+    passed_count -= 1;
+    return 0;
+}
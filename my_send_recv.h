@@ -10,11 +10,44 @@
 int my_send(int fd, const void *buf, int *buflen);
 
 /**
- * Description: Clean internal buffer. Must be called if a client exited and
- *              another client accepted.
+ * Description: Pass descriptor `passed_fd` to peer of Unix socket `fd`, as
+ *              one byte of data carrying it.
+ * Return: -1 if fail, and errno set to appropriate value.
+ *         0 if succeed.
+ */
+int my_send_fd(int fd, int passed_fd);
+
+/**
+ * Description: Receive the byte my_send_fd() sends, and the descriptor it
+ *              carries into `passed_fd`, which caller must close.
+ * Return: -1 if fail, or the byte carries no descriptor.
+ *         0 if succeed.
+ *         1 if connection closed.
+ */
+int my_recv_fd(int fd, int *passed_fd);
+
+/**
+ * Description: Clean internal buffer, and close descriptors passed but not
+ *              received. Must be called if a client exited and
+ *              another client accepted. Buffer is per thread, so connections
+ *              served by different threads do not interfere.
  */
 void my_clean_buf();
 
+/**
+ * Description: Ask at most `size` bytes of each recv(), up to size of
+ *              internal buffer (1 MB). Applies to all threads, so set it
+ *              before connections start.
+ */
+void my_set_recv_size(int size);
+
+/**
+ * Description: Call `hook` with `arg` and the byte count after every send
+ *              and receive of calling thread that moves bytes, or stop if
+ *              `hook` is NULL. Per thread, like the internal buffer.
+ */
+void my_set_progress_hook(void (*hook)(void *arg, int bytes), void *arg);
+
 /**
  * Description: Try to read command from `fd` with a newline character ('\n').
  *              Read up to `buflen` bytes and write to `buf`.
@@ -35,4 +68,21 @@ int my_recv_cmd(int fd, char *buf, int *buflen);
  */
 int my_recv_data(int fd, void *buf, int *buflen);
 
+/**
+ * Description: Make sure at least `len` bytes are in internal buffer, and
+ *              point `data` to them without copying. The bytes stay in
+ *              buffer until my_consume() is called, so they can be parsed
+ *              in place.
+ * Return: -1 if fail, or `len` is larger than internal buffer.
+ *         0 if succeed.
+ *         1 if connection closed before `len` bytes received.
+ */
+int my_peek_data(int fd, int len, const void **data);
+
+/**
+ * Description: Drop first `len` bytes of internal buffer, which have been
+ *              parsed after my_peek_data().
+ */
+void my_consume(int len);
+
 #endif
\ No newline at end of file
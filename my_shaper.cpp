@@ -0,0 +1,292 @@
+#include <sstream>
+#include <thread>
+#include <cstdlib>
+
+#include "my_shaper.hpp"
+
+using namespace my_shaper;
+
+rates my_shaper::default_rates()
+{
+    rates r;
+    r.connection = 0;
+    r.address = 0;
+    r.global = 0;
+    r.decodes = 0;
+    return r;
+}
+
+long long my_shaper::parse_rate(const std::string &str)
+{
+    char *end;
+    long long rate = strtoll(str.c_str(), &end, 10);
+    if (end == str.c_str() || rate < 0) {
+        return -1;
+    }
+
+    if (*end == 'K' || *end == 'k') {
+        rate <<= 10;
+        end += 1;
+    }
+    else if (*end == 'M' || *end == 'm') {
+        rate <<= 20;
+        end += 1;
+    }
+    else if (*end == 'G' || *end == 'g') {
+        rate <<= 30;
+        end += 1;
+    }
+
+    return (*end == '\0') ? rate : -1;
+}
+
+int my_shaper::parse_rates(const std::string &spec, rates &parsed)
+{
+    using namespace std;
+
+    rates r = default_rates();
+
+    stringstream ss(spec);
+    string item;
+    while (getline(ss, item, ',')) {
+        size_t eq = item.find('=');
+        if (eq == string::npos) {
+            return -1;
+        }
+
+        string key = item.substr(0, eq);
+        long long value = parse_rate(item.substr(eq + 1));
+        if (value < 0) {
+            return -1;
+        }
+
+        if (key == "conn") {
+            r.connection = static_cast<uint64_t>(value);
+        }
+        else if (key == "addr") {
+            r.address = static_cast<uint64_t>(value);
+        }
+        else if (key == "global") {
+            r.global = static_cast<uint64_t>(value);
+        }
+        else if (key == "decodes" && value <= 1024) {
+            r.decodes = static_cast<unsigned int>(value);
+        }
+        else {
+            return -1;
+        }
+    }
+
+    parsed = r;
+    return 0;
+}
+
+token_bucket::token_bucket(uint64_t rate)
+: _rate(static_cast<double>(rate)), _burst(static_cast<double>(rate) * BURST_MS / 1000.0), _tokens(0),
+  _last(clock_type::now())
+{
+    _tokens = _burst;
+}
+
+void token_bucket::_refill(clock_type::time_point now)
+{
+    double seconds = std::chrono::duration<double>(now - _last).count();
+    _last = now;
+    _tokens += seconds * _rate;
+    if (_tokens > _burst) {
+        _tokens = _burst;
+    }
+}
+
+bool token_bucket::ready()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _refill(clock_type::now());
+    return _tokens >= 0;
+}
+
+uint64_t token_bucket::take(uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _refill(clock_type::now());
+    _tokens -= static_cast<double>(bytes);
+    return (_tokens < 0 && _rate > 0) ? static_cast<uint64_t>(-_tokens / _rate * 1e6) + 1 : 0;
+}
+
+uint64_t token_bucket::delay()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _refill(clock_type::now());
+    return (_tokens < 0 && _rate > 0) ? static_cast<uint64_t>(-_tokens / _rate * 1e6) + 1 : 0;
+}
+
+bool token_bucket::consume(uint64_t bytes)
+{
+    uint64_t wait = take(bytes);
+    if (wait == 0) {
+        return false;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(wait));
+    return true;
+}
+
+drr_queue::drr_queue(uint64_t quantum)
+: _quantum(quantum)
+{
+
+}
+
+void drr_queue::push(drr_flow &f, drr_request &r)
+{
+    r.granted = false;
+    f.pending.push_back(&r);
+    if (!f.active) {
+        f.active = true;
+        f.deficit = 0;
+        f.in_turn = false;
+        _active.push_back(&f);
+    }
+}
+
+void drr_queue::_skip_rounds()
+{
+    // Every flow has just ended its turn short, so each needs one round more
+    // at least; rounds before the first is granted would change nothing
+    uint64_t rounds = UINT64_MAX;
+    for (drr_flow *f : _active) {
+        uint64_t cost = f->pending.front()->cost;
+        uint64_t need = (cost > f->deficit) ? (cost - f->deficit + _quantum - 1) / _quantum : 1;
+        rounds = (need < rounds) ? need : rounds;
+    }
+
+    if (rounds > 1 && rounds != UINT64_MAX) {
+        for (drr_flow *f : _active) {
+            f->deficit += (rounds - 1) * _quantum;
+        }
+    }
+}
+
+shaper::shaper(const rates &r)
+: _rates(r), _global(r.global), _transfers(TRANSFER_QUANTUM), _decodes(DECODE_QUANTUM), _decoding(0)
+{
+
+}
+
+void shaper::_dispatch_transfers()
+{
+    size_t granted = _transfers.dispatch([this](uint64_t cost) {
+        if (!_global.ready()) {
+            return false;
+        }
+        _global.take(cost);
+        return true;
+    });
+    if (granted > 0) {
+        _cond.notify_all();
+    }
+}
+
+void shaper::_dispatch_decodes()
+{
+    size_t granted = _decodes.dispatch([this](uint64_t) {
+        if (_decoding >= _rates.decodes) {
+            return false;
+        }
+        _decoding += 1;
+        return true;
+    });
+    if (granted > 0) {
+        _cond.notify_all();
+    }
+}
+
+flow::flow(shaper &s, const std::string &address)
+: _shaper(s), _own(NULL)
+{
+    if (_shaper._rates.connection != 0) {
+        _own = new token_bucket(_shaper._rates.connection);
+    }
+
+    if (_shaper._rates.address != 0) {
+        std::lock_guard<std::mutex> lock(_shaper._mutex);
+        _address = _shaper._addresses.emplace(std::piecewise_construct, std::forward_as_tuple(address),
+            std::forward_as_tuple(_shaper._rates.address)).first;
+        _address->second.refs += 1;
+    }
+}
+
+flow::~flow()
+{
+    delete _own;
+
+    if (_shaper._rates.address != 0) {
+        std::lock_guard<std::mutex> lock(_shaper._mutex);
+        if (--_address->second.refs == 0) {
+            _shaper._addresses.erase(_address);
+        }
+    }
+}
+
+bool flow::transfer(uint64_t bytes)
+{
+    bool waited = false;
+
+    // Rates of connection and its address are its own to wait off
+    if (_own != NULL) {
+        waited = _own->consume(bytes) || waited;
+    }
+    if (_shaper._rates.address != 0) {
+        waited = _address->second.bucket.consume(bytes) || waited;
+    }
+    if (_shaper._rates.global == 0) {
+        return waited;
+    }
+
+    // Global rate goes round connections waiting for it. Whoever waits
+    // dispatches as the bucket refills, so no thread has to drive it.
+    std::unique_lock<std::mutex> lock(_shaper._mutex);
+    drr_request r = { bytes, false };
+    _shaper._transfers.push(_transfers, r);
+    _shaper._dispatch_transfers();
+    while (!r.granted) {
+        waited = true;
+        uint64_t wait = _shaper._global.delay();
+        _shaper._cond.wait_for(lock, std::chrono::microseconds((wait > 1000) ? wait : 1000));
+        if (!r.granted) {
+            _shaper._dispatch_transfers();
+        }
+    }
+    return waited;
+}
+
+decode_turn::decode_turn(flow &f, uint64_t cost)
+: _flow(f), _held(false), _waited(false)
+{
+    shaper &s = _flow._shaper;
+    if (s._rates.decodes == 0) {
+        return;
+    }
+
+    // Costs at least a byte, so empty files do not go ahead for free
+    std::unique_lock<std::mutex> lock(s._mutex);
+    drr_request r = { (cost > 0) ? cost : 1, false };
+    s._decodes.push(_flow._decodes, r);
+    s._dispatch_decodes();
+    while (!r.granted) {
+        _waited = true;
+        s._cond.wait(lock);
+    }
+    _held = true;
+}
+
+decode_turn::~decode_turn()
+{
+    if (!_held) {
+        return;
+    }
+
+    shaper &s = _flow._shaper;
+    std::lock_guard<std::mutex> lock(s._mutex);
+    s._decoding -= 1;
+    s._dispatch_decodes();
+}
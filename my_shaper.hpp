@@ -0,0 +1,318 @@
+#ifndef __MY_SHAPER_HPP__
+#define __MY_SHAPER_HPP__
+
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <string>
+#include <cstdint>
+
+/**
+ * Bandwidth shaping and fair scheduling. Token buckets cap the rate of each
+ * connection, of all connections from one address, and of all together.
+ * Bytes are charged once moved, and the mover sleeps off what it owes, so a
+ * connection over its rate simply stops reading its socket and TCP slows its
+ * sender down.
+ *
+ * Connections share the global rate and decode slots in deficit round
+ * robin: each turn a connection may take a quantum more, so a bulk upload
+ * gets no more than its share while others are waiting, and a small one is
+ * served within a round.
+ */
+namespace my_shaper
+{
+    /** Bytes each connection may take per turn of global rate, and of decodes */
+    const uint64_t TRANSFER_QUANTUM = 65536;
+    const uint64_t DECODE_QUANTUM = 1 << 20;
+
+    /** Milliseconds of rate a bucket holds when idle */
+    const unsigned int BURST_MS = 100;
+
+    /** Limits of server, 0 for none */
+    struct rates
+    {
+        /** Bytes per second of each connection, of each client address, and of all */
+        uint64_t connection;
+        uint64_t address;
+        uint64_t global;
+        /** Decodes running at once */
+        unsigned int decodes;
+    };
+
+    /**
+     * Description: Default rates, all unlimited.
+     */
+    rates default_rates();
+
+    /**
+     * Description: Parse a rate like "512K" or "10M", in bytes per second.
+     * Return: The rate, or -1 if invalid.
+     */
+    long long parse_rate(const std::string &str);
+
+    /**
+     * Description: Parse `spec` like "conn=1M,addr=4M,global=10M,decodes=2"
+     *              into `parsed`, starting from default rates.
+     * Return: 0 if succeed, or -1 if a key or value is invalid.
+     */
+    int parse_rates(const std::string &spec, rates &parsed);
+
+    /**
+     * Token bucket of a rate, filled up to BURST_MS of it. Taking more than
+     * it holds leaves it in debt, to be waited off before the next take.
+     * Thread-safe.
+     *
+     * Usage:
+     *     token_bucket bucket(1 << 20);
+     *     bucket.consume(n);            // After moving n bytes, sleeps if over rate
+     */
+    class token_bucket
+    {
+    private:
+        typedef std::chrono::steady_clock clock_type;
+
+        std::mutex _mutex;
+        double _rate;
+        double _burst;
+        double _tokens;
+        clock_type::time_point _last;
+
+        /** Add tokens of time passed, with lock held */
+        void _refill(clock_type::time_point now);
+
+    public:
+        explicit token_bucket(uint64_t rate);
+
+        token_bucket(const token_bucket &) = delete;
+        token_bucket &operator=(const token_bucket &) = delete;
+
+        /**
+         * Description: Check if bucket is out of debt, so it may be taken from.
+         */
+        bool ready();
+
+        /**
+         * Description: Take `bytes`, going in debt if short.
+         * Return: Microseconds until debt is paid, 0 if none.
+         */
+        uint64_t take(uint64_t bytes);
+
+        /**
+         * Description: Microseconds until debt is paid, 0 if none.
+         */
+        uint64_t delay();
+
+        /**
+         * Description: Take `bytes` and sleep until debt is paid.
+         * Return: true if it slept.
+         */
+        bool consume(uint64_t bytes);
+    };
+
+    /** Request waiting in a drr_queue, granted by dispatch() */
+    struct drr_request
+    {
+        uint64_t cost;
+        bool granted;
+    };
+
+    /** Requests of one connection in a drr_queue, and its deficit */
+    struct drr_flow
+    {
+        std::deque<drr_request *> pending;
+        uint64_t deficit;
+        /** Quantum of current turn is added */
+        bool in_turn;
+        bool active;
+
+        drr_flow() : deficit(0), in_turn(false), active(false) {}
+    };
+
+    /**
+     * Deficit round robin over flows with pending requests. The flow at
+     * front adds a quantum to its deficit as its turn starts, and is granted
+     * requests while they fit its deficit; then it goes to back. A flow
+     * left with nothing pending loses its deficit. Not thread-safe.
+     */
+    class drr_queue
+    {
+    private:
+        std::list<drr_flow *> _active;
+        uint64_t _quantum;
+
+        /** Start turns of all flows at once, as many rounds as none gets a request in */
+        void _skip_rounds();
+
+    public:
+        explicit drr_queue(uint64_t quantum);
+
+        /**
+         * Description: Queue `r` of flow `f`.
+         */
+        void push(drr_flow &f, drr_request &r);
+
+        /**
+         * Description: Grant requests in turn while `admit(cost)` takes
+         *              what they cost, and stop once it refuses.
+         * Return: Number of requests granted.
+         */
+        template <typename Admit>
+        size_t dispatch(Admit admit)
+        {
+            size_t granted = 0;
+            size_t missed = 0;
+            while (!_active.empty()) {
+                drr_flow &f = *_active.front();
+                if (!f.in_turn) {
+                    f.deficit += _quantum;
+                    f.in_turn = true;
+                }
+
+                drr_request &r = *f.pending.front();
+                if (r.cost <= f.deficit) {
+                    if (!admit(r.cost)) {
+                        break;
+                    }
+                    f.deficit -= r.cost;
+                    r.granted = true;
+                    f.pending.pop_front();
+                    granted += 1;
+                    missed = 0;
+
+                    if (f.pending.empty()) {
+                        f.deficit = 0;
+                        f.in_turn = false;
+                        f.active = false;
+                        _active.pop_front();
+                    }
+                    continue;
+                }
+
+                // Turn ends short of request, deficit is kept for next one
+                f.in_turn = false;
+                _active.splice(_active.end(), _active, _active.begin());
+                if (++missed >= _active.size()) {
+                    _skip_rounds();
+                    missed = 0;
+                }
+            }
+            return granted;
+        }
+    };
+
+    class flow;
+
+    /**
+     * Rates of a server and its fair queues, shared by flows of all
+     * connections.
+     */
+    class shaper
+    {
+        friend class flow;
+        friend class decode_turn;
+
+    private:
+        /** Bucket of a client address, kept while it has connections */
+        struct address_bucket
+        {
+            token_bucket bucket;
+            unsigned int refs;
+
+            explicit address_bucket(uint64_t rate) : bucket(rate), refs(0) {}
+        };
+
+        rates _rates;
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        token_bucket _global;
+        std::map<std::string, address_bucket> _addresses;
+        drr_queue _transfers;
+        drr_queue _decodes;
+        unsigned int _decoding;
+
+        /** Grant transfers the global rate has room for, with lock held */
+        void _dispatch_transfers();
+
+        /** Grant decodes there are slots for, with lock held */
+        void _dispatch_decodes();
+
+    public:
+        explicit shaper(const rates &r);
+
+        shaper(const shaper &) = delete;
+        shaper &operator=(const shaper &) = delete;
+
+        const rates &limits() const
+        {
+            return _rates;
+        }
+    };
+
+    /** Share of one connection in a shaper, from client `address` */
+    class flow
+    {
+        friend class decode_turn;
+
+    private:
+        shaper &_shaper;
+        /** Bucket of connection, NULL if unlimited */
+        token_bucket *_own;
+        /** Bucket of address, valid if address rate is set */
+        std::map<std::string, shaper::address_bucket>::iterator _address;
+        drr_flow _transfers;
+        drr_flow _decodes;
+
+    public:
+        flow(shaper &s, const std::string &address);
+
+        ~flow();
+
+        flow(const flow &) = delete;
+        flow &operator=(const flow &) = delete;
+
+        /**
+         * Description: Charge `bytes` just moved to rates of connection,
+         *              address and server, and wait until it is in rate of
+         *              all and its turn has come.
+         * Return: true if it waited.
+         */
+        bool transfer(uint64_t bytes);
+    };
+
+    /**
+     * A decode slot held while in scope, granted in turn among connections
+     * by bytes to decode.
+     *
+     * Usage:
+     *     decode_turn turn(flow, payload_size);     // Waits for a slot
+     *     ...                                      // Decode
+     */
+    class decode_turn
+    {
+    private:
+        flow &_flow;
+        bool _held;
+        bool _waited;
+
+    public:
+        decode_turn(flow &f, uint64_t cost);
+
+        ~decode_turn();
+
+        decode_turn(const decode_turn &) = delete;
+        decode_turn &operator=(const decode_turn &) = delete;
+
+        /**
+         * Description: Check if turn had to wait for others.
+         */
+        bool waited() const
+        {
+            return _waited;
+        }
+    };
+};
+
+#endif
@@ -0,0 +1,213 @@
+#include <sstream>
+#include <cstdlib>
+#include <climits>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "my_sockopt.hpp"
+
+using namespace my_sockopt;
+
+const std::vector<std::string> &my_sockopt::profile_names()
+{
+    static const std::vector<std::string> names = { "default", "lan", "wan" };
+    return names;
+}
+
+socket_tuning my_sockopt::default_tuning()
+{
+    socket_tuning tuning;
+    tuning.rcvbuf = 0;
+    tuning.sndbuf = 0;
+    tuning.nodelay = false;
+    tuning.cork = false;
+    tuning.notsent_lowat = 0;
+    tuning.busy_poll = 0;
+    tuning.chunk = 65536;
+    tuning.recv = MAX_CHUNK_SIZE;
+    return tuning;
+}
+
+/** Settings of profile `name` */
+static int load_profile(const std::string &name, socket_tuning &tuning)
+{
+    tuning = default_tuning();
+
+    if (name == "default") {
+        return 0;
+    }
+
+    if (name == "lan") {
+        // Short round trips: fixed buffers well above bandwidth-delay
+        // product, and replies leave at once
+        tuning.rcvbuf = 4 << 20;
+        tuning.sndbuf = 4 << 20;
+        tuning.nodelay = true;
+        tuning.cork = true;
+        tuning.chunk = 256 << 10;
+        return 0;
+    }
+
+    if (name == "wan") {
+        // Long round trips: buffers are left to autotuning, which grows past
+        // what SO_RCVBUF may set, and unsent data is kept short so a slow
+        // path does not pile up memory
+        tuning.cork = true;
+        tuning.notsent_lowat = 128 << 10;
+        tuning.chunk = MAX_CHUNK_SIZE;
+        return 0;
+    }
+
+    return -1;
+}
+
+/** Parse a size with optional K or M suffix, -1 if invalid */
+static long long parse_size(const std::string &str)
+{
+    char *end;
+    long long size = strtoll(str.c_str(), &end, 10);
+    if (end == str.c_str() || size < 0) {
+        return -1;
+    }
+
+    if (*end == 'K' || *end == 'k') {
+        size <<= 10;
+        end += 1;
+    }
+    else if (*end == 'M' || *end == 'm') {
+        size <<= 20;
+        end += 1;
+    }
+
+    return (*end == '\0' && size <= INT_MAX) ? size : -1;
+}
+
+int my_sockopt::parse_tuning(const std::string &spec, socket_tuning &tuning)
+{
+    using namespace std;
+
+    socket_tuning parsed = default_tuning();
+
+    stringstream ss(spec);
+    string item;
+    bool first = true;
+    while (getline(ss, item, ',')) {
+        size_t eq = item.find('=');
+
+        // Only the first item may name a profile
+        if (eq == string::npos) {
+            if (!first || load_profile(item, parsed) < 0) {
+                return -1;
+            }
+            first = false;
+            continue;
+        }
+        first = false;
+
+        string key = item.substr(0, eq);
+        long long value = parse_size(item.substr(eq + 1));
+        if (value < 0) {
+            return -1;
+        }
+
+        if (key == "rcvbuf") {
+            parsed.rcvbuf = static_cast<int>(value);
+        }
+        else if (key == "sndbuf") {
+            parsed.sndbuf = static_cast<int>(value);
+        }
+        else if (key == "nodelay" && value <= 1) {
+            parsed.nodelay = (value == 1);
+        }
+        else if (key == "cork" && value <= 1) {
+            parsed.cork = (value == 1);
+        }
+        else if (key == "lowat") {
+            parsed.notsent_lowat = static_cast<int>(value);
+        }
+        else if (key == "busy_poll") {
+            parsed.busy_poll = static_cast<int>(value);
+        }
+        else if (key == "chunk" && value > 0 && value <= MAX_CHUNK_SIZE) {
+            parsed.chunk = static_cast<int>(value);
+        }
+        else if (key == "recv" && value > 0 && value <= MAX_CHUNK_SIZE) {
+            parsed.recv = static_cast<int>(value);
+        }
+        else {
+            return -1;
+        }
+    }
+
+    if (first) {
+        return -1;
+    }
+
+    tuning = parsed;
+    return 0;
+}
+
+std::string my_sockopt::format_tuning(const socket_tuning &tuning)
+{
+    std::ostringstream ss;
+    ss << "rcvbuf=" << tuning.rcvbuf << ",sndbuf=" << tuning.sndbuf << ",nodelay=" << tuning.nodelay <<
+    ",cork=" << tuning.cork << ",lowat=" << tuning.notsent_lowat << ",busy_poll=" << tuning.busy_poll <<
+    ",chunk=" << tuning.chunk << ",recv=" << tuning.recv;
+    return ss.str();
+}
+
+int my_sockopt::apply_buffers(int fd, const socket_tuning &tuning)
+{
+    int status = 0;
+
+    if (tuning.rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &tuning.rcvbuf, sizeof (tuning.rcvbuf)) < 0) {
+        status = -1;
+    }
+    if (tuning.sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &tuning.sndbuf, sizeof (tuning.sndbuf)) < 0) {
+        status = -1;
+    }
+
+    return status;
+}
+
+int my_sockopt::apply(int fd, const socket_tuning &tuning)
+{
+    int status = apply_buffers(fd, tuning);
+
+    int nodelay = tuning.nodelay ? 1 : 0;
+    if (nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof (nodelay)) < 0) {
+        status = -1;
+    }
+
+    if (tuning.notsent_lowat > 0 &&
+        setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &tuning.notsent_lowat, sizeof (tuning.notsent_lowat)) < 0) {
+        status = -1;
+    }
+
+    if (tuning.busy_poll > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &tuning.busy_poll, sizeof (tuning.busy_poll)) < 0) {
+        status = -1;
+    }
+
+    return status;
+}
+
+cork_guard::cork_guard(int fd, const socket_tuning &tuning)
+: _fd(fd), _corked(false)
+{
+    int on = 1;
+    if (tuning.cork && setsockopt(_fd, IPPROTO_TCP, TCP_CORK, &on, sizeof (on)) == 0) {
+        _corked = true;
+    }
+}
+
+cork_guard::~cork_guard()
+{
+    // Uncorking sends what is held back at once
+    int off = 0;
+    if (_corked) {
+        setsockopt(_fd, IPPROTO_TCP, TCP_CORK, &off, sizeof (off));
+    }
+}
@@ -0,0 +1,103 @@
+#ifndef __MY_SOCKOPT_HPP__
+#define __MY_SOCKOPT_HPP__
+
+#include <string>
+#include <vector>
+
+/**
+ * Socket settings for a kind of network, picked by name of a profile and
+ * changed option by option, e.g. "lan", "wan,cork=0" or "rcvbuf=4M,nodelay=1".
+ */
+namespace my_sockopt
+{
+    /** Largest read chunk and recv size, which is receive buffer of my_send_recv.c */
+    const int MAX_CHUNK_SIZE = 1048576;
+
+    /** Settings of a socket. Zero leaves the system default. */
+    struct socket_tuning
+    {
+        /** SO_RCVBUF and SO_SNDBUF in bytes, zero keeps kernel autotuning */
+        int rcvbuf;
+        int sndbuf;
+        /** TCP_NODELAY, send small writes at once */
+        bool nodelay;
+        /** TCP_CORK around header and payload, so they leave in full segments */
+        bool cork;
+        /** TCP_NOTSENT_LOWAT in bytes, limit of data queued but not sent yet */
+        int notsent_lowat;
+        /** SO_BUSY_POLL in microseconds */
+        int busy_poll;
+        /** Bytes of payload copied out of receive buffer at a time */
+        int chunk;
+        /** Bytes asked of each recv() */
+        int recv;
+    };
+
+    /**
+     * Description: Names of built-in profiles: "default" keeps system
+     *              defaults, "lan" is for fast networks of low latency, and
+     *              "wan" for networks of high latency.
+     */
+    const std::vector<std::string> &profile_names();
+
+    /**
+     * Description: Settings of system defaults, same as "default" profile.
+     */
+    socket_tuning default_tuning();
+
+    /**
+     * Description: Parse `spec`, a profile name, option=value pairs, or a
+     *              profile name followed by pairs, separated by commas. Sizes
+     *              may end with K or M. Options are rcvbuf, sndbuf, nodelay,
+     *              cork, lowat, busy_poll, chunk and recv.
+     * Return: 0 if succeed, or -1 if `spec` is invalid.
+     */
+    int parse_tuning(const std::string &spec, socket_tuning &tuning);
+
+    /**
+     * Description: Format `tuning` as option=value pairs, which
+     *              parse_tuning() reads back.
+     */
+    std::string format_tuning(const socket_tuning &tuning);
+
+    /**
+     * Description: Set buffer sizes of `fd`. Must be called before connect()
+     *              or listen(), as TCP window scale is fixed then.
+     * Return: 0 if succeed, or -1 if an option cannot be set.
+     */
+    int apply_buffers(int fd, const socket_tuning &tuning);
+
+    /**
+     * Description: Set all options of connected socket `fd`. Every option is
+     *              tried even if one fails, e.g. SO_BUSY_POLL beyond
+     *              net.core.busy_read needs CAP_NET_ADMIN.
+     * Return: 0 if succeed, or -1 if an option cannot be set.
+     */
+    int apply(int fd, const socket_tuning &tuning);
+
+    /**
+     * Hold back partial segments of a socket while a header and its payload
+     * are sent, if tuning asks for it. Sent when out of scope.
+     *
+     * Usage:
+     *     cork_guard cork(fd, tuning);
+     *     my_send(fd, header, ...);
+     *     my_send(fd, payload, ...);
+     */
+    class cork_guard
+    {
+    private:
+        int _fd;
+        bool _corked;
+
+    public:
+        cork_guard(int fd, const socket_tuning &tuning);
+
+        ~cork_guard();
+
+        cork_guard(const cork_guard &) = delete;
+        cork_guard &operator=(const cork_guard &) = delete;
+    };
+};
+
+#endif
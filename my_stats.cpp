@@ -0,0 +1,163 @@
+#include <sstream>
+#include <fstream>
+#include <thread>
+#include <cstdio>
+
+#include "my_stats.hpp"
+
+using namespace my_stats;
+
+/** Counters of one worker, on its own cache lines to avoid false sharing */
+struct alignas(64) worker_slot
+{
+    std::atomic<uint64_t> counters[COUNTER_COUNT];
+    std::atomic<uint64_t> buckets[PHASE_COUNT][BUCKET_COUNT];
+    std::atomic<uint64_t> phase_ns[PHASE_COUNT];
+    std::atomic<uint64_t> phase_count[PHASE_COUNT];
+};
+
+static worker_slot slots[SLOT_COUNT];
+static std::atomic<int> next_slot(0);
+static std::atomic<int64_t> active_connections(0);
+static std::atomic<uint64_t> memory_charged(0);
+
+static const char *phase_names[PHASE_COUNT] = { "receive", "decode", "write" };
+
+/** Slot of calling thread, assigned on first use */
+static worker_slot &my_slot()
+{
+    static thread_local int index = next_slot.fetch_add(1, std::memory_order_relaxed) % SLOT_COUNT;
+    return slots[index];
+}
+
+void my_stats::add(counter c, uint64_t value)
+{
+    my_slot().counters[c].fetch_add(value, std::memory_order_relaxed);
+}
+
+void my_stats::record(phase p, uint64_t ns)
+{
+    worker_slot &slot = my_slot();
+
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+    while (bucket < BUCKET_COUNT - 1 && (1ULL << bucket) <= us) {
+        bucket += 1;
+    }
+
+    slot.buckets[p][bucket].fetch_add(1, std::memory_order_relaxed);
+    slot.phase_ns[p].fetch_add(ns, std::memory_order_relaxed);
+    slot.phase_count[p].fetch_add(1, std::memory_order_relaxed);
+}
+
+void my_stats::add_active(int delta)
+{
+    active_connections.fetch_add(delta, std::memory_order_relaxed);
+}
+
+void my_stats::set_memory(uint64_t bytes)
+{
+    memory_charged.store(bytes, std::memory_order_relaxed);
+}
+
+static uint64_t sum_counter(counter c)
+{
+    uint64_t sum = 0;
+    for (auto &slot : slots) {
+        sum += slot.counters[c].load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
+static void render_counter(std::ostream &out, const char *name, const char *help, uint64_t value)
+{
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " counter\n";
+    out << name << " " << value << "\n";
+}
+
+std::string my_stats::render()
+{
+    using namespace std;
+
+    ostringstream out;
+
+    render_counter(out, "hw2_connections_total", "Connections accepted.", sum_counter(CONNECTIONS));
+    render_counter(out, "hw2_connections_failed_total", "Connections terminated by error.", sum_counter(CONNECTIONS_FAILED));
+    render_counter(out, "hw2_connections_timed_out_total", "Connections shut down for passing a deadline.",
+        sum_counter(CONNECTIONS_TIMED_OUT));
+    render_counter(out, "hw2_received_bytes_total", "Payload bytes received.", sum_counter(BYTES_RECEIVED));
+    render_counter(out, "hw2_files_total", "Files decoded.", sum_counter(FILES));
+    render_counter(out, "hw2_compressed_bytes_total", "Compressed bytes of decoded files.", sum_counter(COMPRESSED_BYTES));
+    render_counter(out, "hw2_original_bytes_total", "Original bytes of decoded files.", sum_counter(ORIGINAL_BYTES));
+    render_counter(out, "hw2_downloads_total", "Files downloaded.", sum_counter(DOWNLOADS));
+    render_counter(out, "hw2_cache_hits_total", "Downloads served from cache of encoded files.", sum_counter(CACHE_HITS));
+    render_counter(out, "hw2_sent_bytes_total", "Encoded bytes sent.", sum_counter(BYTES_SENT));
+    render_counter(out, "hw2_budget_waits_total", "Times a connection waited for memory budget.", sum_counter(BUDGET_WAITS));
+    render_counter(out, "hw2_shaper_waits_total", "Times a transfer waited for its rates or a decode for its turn.",
+        sum_counter(SHAPER_WAITS));
+
+    out << "# HELP hw2_active_connections Connections being served.\n";
+    out << "# TYPE hw2_active_connections gauge\n";
+    out << "hw2_active_connections " << active_connections.load(memory_order_relaxed) << "\n";
+
+    out << "# HELP hw2_memory_charged_bytes Bytes charged to memory budget.\n";
+    out << "# TYPE hw2_memory_charged_bytes gauge\n";
+    out << "hw2_memory_charged_bytes " << memory_charged.load(memory_order_relaxed) << "\n";
+
+    out << "# HELP hw2_phase_seconds Time spent in each phase of transfers.\n";
+    out << "# TYPE hw2_phase_seconds histogram\n";
+
+    uint64_t decode_ns = 0;
+    for (int p = 0; p < PHASE_COUNT; ++p) {
+        uint64_t cumulative = 0;
+        uint64_t ns = 0;
+        uint64_t count = 0;
+        for (int b = 0; b < BUCKET_COUNT; ++b) {
+            for (auto &slot : slots) {
+                cumulative += slot.buckets[p][b].load(memory_order_relaxed);
+            }
+            // Last bucket is unbounded
+            if (b < BUCKET_COUNT - 1) {
+                out << "hw2_phase_seconds_bucket{phase=\"" << phase_names[p] << "\",le=\"" <<
+                static_cast<double>(1ULL << b) / 1e6 << "\"} " << cumulative << "\n";
+            }
+        }
+        for (auto &slot : slots) {
+            ns += slot.phase_ns[p].load(memory_order_relaxed);
+            count += slot.phase_count[p].load(memory_order_relaxed);
+        }
+        out << "hw2_phase_seconds_bucket{phase=\"" << phase_names[p] << "\",le=\"+Inf\"} " << cumulative << "\n";
+        out << "hw2_phase_seconds_sum{phase=\"" << phase_names[p] << "\"} " << static_cast<double>(ns) / 1e9 << "\n";
+        out << "hw2_phase_seconds_count{phase=\"" << phase_names[p] << "\"} " << count << "\n";
+
+        if (p == PHASE_DECODE) {
+            decode_ns = ns;
+        }
+    }
+
+    out << "# HELP hw2_decode_bytes_per_second Original bytes decoded per second of decode phase.\n";
+    out << "# TYPE hw2_decode_bytes_per_second gauge\n";
+    out << "hw2_decode_bytes_per_second " <<
+    (decode_ns > 0 ? static_cast<double>(sum_counter(ORIGINAL_BYTES)) * 1e9 / static_cast<double>(decode_ns) : 0.0) << "\n";
+
+    return out.str();
+}
+
+void my_stats::start_writer(const std::string &path, int interval)
+{
+    std::thread([path, interval]() {
+        std::string tmp_path = path + ".tmp";
+        while (true) {
+            {
+                std::ofstream file(tmp_path, std::ofstream::out | std::ofstream::trunc);
+                file << render();
+            }
+            // Readers never see a partial file
+            if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+                perror("rename");
+            }
+            std::this_thread::sleep_for(std::chrono::seconds(interval));
+        }
+    }).detach();
+}
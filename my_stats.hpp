@@ -0,0 +1,113 @@
+#ifndef __MY_STATS_HPP__
+#define __MY_STATS_HPP__
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstdint>
+
+namespace my_stats
+{
+    /** Counters */
+    enum counter
+    {
+        /** Connections accepted */
+        CONNECTIONS,
+        /** Connections terminated because of an error */
+        CONNECTIONS_FAILED,
+        /** Connections shut down for passing a deadline */
+        CONNECTIONS_TIMED_OUT,
+        /** Payload bytes received from clients */
+        BYTES_RECEIVED,
+        /** Files (or stripes) decoded */
+        FILES,
+        /** Compressed bytes of decoded files */
+        COMPRESSED_BYTES,
+        /** Original bytes of decoded files */
+        ORIGINAL_BYTES,
+        /** Files downloaded by clients */
+        DOWNLOADS,
+        /** Downloads served from cache of encoded files */
+        CACHE_HITS,
+        /** Encoded bytes sent to clients */
+        BYTES_SENT,
+        /** Times a connection stopped reading to wait for memory budget */
+        BUDGET_WAITS,
+        /** Times a transfer waited for its rates, or a decode for its turn */
+        SHAPER_WAITS,
+        COUNTER_COUNT
+    };
+
+    /** Phases of handling a transfer */
+    enum phase
+    {
+        /** Receiving payload from network */
+        PHASE_RECEIVE,
+        /** Rebuilding tree and decoding */
+        PHASE_DECODE,
+        /** Flushing output and writing code table */
+        PHASE_WRITE,
+        PHASE_COUNT
+    };
+
+    /** Latency histogram buckets, bucket i counts latency < 2^i microseconds */
+    const int BUCKET_COUNT = 32;
+
+    /** Max number of worker slots. Threads share slots beyond that */
+    const int SLOT_COUNT = 64;
+
+    /**
+     * Description: Add `value` to `c` in slot of calling thread.
+     */
+    void add(counter c, uint64_t value = 1);
+
+    /**
+     * Description: Record `ns` nanoseconds spent in phase `p`.
+     */
+    void record(phase p, uint64_t ns);
+
+    /**
+     * Description: Change number of active connections by `delta`.
+     */
+    void add_active(int delta);
+
+    /**
+     * Description: Set bytes charged to memory budget.
+     */
+    void set_memory(uint64_t bytes);
+
+    /**
+     * Description: Render all metrics in Prometheus text format.
+     * Return: Metrics text.
+     */
+    std::string render();
+
+    /**
+     * Description: Write metrics to `path` every `interval` seconds, in a
+     *              background thread. File is replaced atomically.
+     */
+    void start_writer(const std::string &path, int interval);
+
+    /** Record time spent in a phase when going out of scope */
+    class phase_timer
+    {
+    private:
+        phase _phase;
+        std::chrono::steady_clock::time_point _start;
+
+    public:
+        explicit phase_timer(phase p)
+        : _phase(p), _start(std::chrono::steady_clock::now())
+        {
+
+        }
+
+        ~phase_timer()
+        {
+            auto elapsed = std::chrono::steady_clock::now() - _start;
+            record(_phase, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+        }
+    };
+};
+
+#endif
@@ -0,0 +1,350 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "my_storage.hpp"
+
+using namespace my_storage;
+
+/** Tells apart concurrent writers of the same file */
+static std::atomic<unsigned long> next_part_id(0);
+
+int my_storage::parse_mode(const std::string &name, write_mode &mode)
+{
+    if (name == "buffered") {
+        mode = WRITE_BUFFERED;
+    }
+    else if (name == "direct") {
+        mode = WRITE_DIRECT;
+    }
+    else if (name == "mmap") {
+        mode = WRITE_MMAP;
+    }
+    else {
+        return -1;
+    }
+
+    return 0;
+}
+
+std::string my_storage::part_path(const std::string &path)
+{
+    return path + "." + std::to_string(next_part_id++) + ".part";
+}
+
+storage_writer::storage_writer(const std::string &path, write_mode mode)
+: _path(path), _part_path(part_path(path)), _mode(mode), _fd(-1),
+  _committed(false), _failed(false), _offset(0), _map(NULL), _map_size(0), _current(NULL), _stop(false), _writing(false)
+{
+    int flags = O_RDWR | O_CREAT | O_TRUNC;
+    if (_mode == WRITE_DIRECT) {
+        _fd = open(_part_path.c_str(), flags | O_DIRECT, 0644);
+        // Some file systems (e.g. tmpfs) do not support O_DIRECT
+        if (_fd < 0 && errno == EINVAL) {
+            _mode = WRITE_BUFFERED;
+        }
+    }
+    if (_fd < 0) {
+        _fd = open(_part_path.c_str(), flags, 0644);
+    }
+    if (_fd < 0) {
+        perror("open");
+        return;
+    }
+
+    for (size_t i = 0; i < BUFFER_COUNT; ++i) {
+        void *buf;
+        if (posix_memalign(&buf, ALIGNMENT, BUFFER_SIZE) != 0) {
+            break;
+        }
+        _buffers.push_back(static_cast<char *>(buf));
+        _free.push_back(static_cast<char *>(buf));
+    }
+    if (_free.empty()) {
+        close(_fd);
+        _fd = -1;
+        unlink(_part_path.c_str());
+        return;
+    }
+
+    _current = _free.back();
+    _free.pop_back();
+    setp(_current, _current + BUFFER_SIZE);
+
+    _thread = std::thread(&storage_writer::_write_behind, this);
+}
+
+storage_writer::~storage_writer()
+{
+    if (_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cond.notify_all();
+        _thread.join();
+    }
+
+    if (_map != NULL) {
+        munmap(_map, _map_size);
+    }
+    if (_fd >= 0) {
+        close(_fd);
+    }
+    if (!_committed) {
+        unlink(_part_path.c_str());
+    }
+
+    for (auto buf : _buffers) {
+        free(buf);
+    }
+}
+
+bool storage_writer::is_open() const
+{
+    return _fd >= 0 && _current != NULL;
+}
+
+int storage_writer::reserve(uint64_t size)
+{
+    if (size == 0 || _offset > 0 || pptr() != pbase()) {
+        return 0;
+    }
+
+    int err = posix_fallocate(_fd, 0, static_cast<off_t>(size));
+    // Not every file system supports preallocation, which is only a hint
+    if (err != 0 && err != EOPNOTSUPP && err != EINVAL) {
+        errno = err;
+        perror("posix_fallocate");
+        return -1;
+    }
+
+    if (_mode == WRITE_MMAP) {
+        void *map = mmap(NULL, static_cast<size_t>(size), PROT_WRITE, MAP_SHARED, _fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            return -1;
+        }
+        madvise(map, static_cast<size_t>(size), MADV_SEQUENTIAL);
+
+        _map = static_cast<char *>(map);
+        _map_size = static_cast<size_t>(size);
+        setp(_map, _map + _map_size);
+    }
+
+    return 0;
+}
+
+uint64_t storage_writer::size() const
+{
+    return _offset + static_cast<uint64_t>(pptr() - pbase());
+}
+
+storage_writer::int_type storage_writer::overflow(int_type c)
+{
+    // Mapped file is as large as reserved, and cannot grow
+    if (_map != NULL || _flush_current() < 0) {
+        return traits_type::eof();
+    }
+
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+
+    return traits_type::not_eof(c);
+}
+
+int storage_writer::_flush_current()
+{
+    size_t len = static_cast<size_t>(pptr() - pbase());
+    if (len == 0) {
+        return 0;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_failed) {
+        return -1;
+    }
+
+    _full.push_back(std::make_pair(_current, len));
+    _offset += len;
+    _cond.notify_all();
+
+    // Wait for a free buffer, so a slow disk holds back decoding
+    _cond.wait(lock, [this]() { return !_free.empty() || _failed; });
+    if (_failed) {
+        setp(NULL, NULL);
+        return -1;
+    }
+
+    _current = _free.back();
+    _free.pop_back();
+    setp(_current, _current + BUFFER_SIZE);
+    return 0;
+}
+
+void storage_writer::_write_behind()
+{
+    uint64_t offset = 0;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+        _cond.wait(lock, [this]() { return !_full.empty() || _stop; });
+        if (_full.empty()) {
+            break;
+        }
+
+        std::pair<char *, size_t> buf = _full.front();
+        _full.pop_front();
+        _writing = true;
+        bool failed = _failed;
+
+        lock.unlock();
+        if (!failed && _write_at(buf.first, buf.second, offset) < 0) {
+            failed = true;
+        }
+        offset += buf.second;
+        lock.lock();
+
+        _failed = _failed || failed;
+        _writing = false;
+        _free.push_back(buf.first);
+        _cond.notify_all();
+    }
+}
+
+int storage_writer::_write_at(const char *buf, size_t len, uint64_t offset)
+{
+    // O_DIRECT needs whole blocks. File is trimmed to real size by commit()
+    if (_mode == WRITE_DIRECT && len % ALIGNMENT != 0) {
+        size_t padded = (len / ALIGNMENT + 1) * ALIGNMENT;
+        memset(const_cast<char *>(buf) + len, 0, padded - len);
+        len = padded;
+    }
+
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = pwrite(_fd, buf + written, len - written, static_cast<off_t>(offset + written));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pwrite");
+            return -1;
+        }
+        written += static_cast<size_t>(n);
+    }
+
+    return 0;
+}
+
+int storage_writer::_drain()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cond.wait(lock, [this]() { return (_full.empty() && !_writing) || _failed; });
+    return _failed ? -1 : 0;
+}
+
+int storage_writer::commit()
+{
+    if (_committed) {
+        return 0;
+    }
+    if (!is_open()) {
+        return -1;
+    }
+
+    uint64_t total;
+    if (_map != NULL) {
+        total = size();
+        munmap(_map, _map_size);
+        _map = NULL;
+        setp(NULL, NULL);
+    }
+    else {
+        if (_flush_current() < 0 || _drain() < 0) {
+            return -1;
+        }
+        total = _offset;
+    }
+
+    // Drop preallocated space or O_DIRECT padding beyond data
+    if (ftruncate(_fd, static_cast<off_t>(total)) < 0) {
+        perror("ftruncate");
+        return -1;
+    }
+
+    close(_fd);
+    _fd = -1;
+
+    if (rename(_part_path.c_str(), _path.c_str()) < 0) {
+        perror("rename");
+        unlink(_part_path.c_str());
+        return -1;
+    }
+
+    _offset = total;
+    _committed = true;
+    return 0;
+}
+
+range_writer::range_writer(int fd, uint64_t offset, uint64_t length)
+: _fd(fd), _offset(offset), _end(offset + length), _start(offset), _buffer(BUFFER_SIZE), _failed(false)
+{
+    setp(_buffer.data(), _buffer.data() + _buffer.size());
+}
+
+range_writer::int_type range_writer::overflow(int_type c)
+{
+    if (flush() < 0) {
+        return traits_type::eof();
+    }
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+int range_writer::sync()
+{
+    return flush();
+}
+
+uint64_t range_writer::size() const
+{
+    return _offset - _start + static_cast<uint64_t>(pptr() - pbase());
+}
+
+int range_writer::flush()
+{
+    size_t len = static_cast<size_t>(pptr() - pbase());
+    if (_failed || len > _end - _offset) {
+        _failed = true;
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(_fd, pbase() + done, len - done, static_cast<off_t>(_offset + done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("pwrite");
+            _failed = true;
+            return -1;
+        }
+        done += static_cast<size_t>(n);
+    }
+
+    _offset += len;
+    setp(_buffer.data(), _buffer.data() + _buffer.size());
+    return 0;
+}
@@ -0,0 +1,183 @@
+#ifndef __MY_STORAGE_HPP__
+#define __MY_STORAGE_HPP__
+
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+namespace my_storage
+{
+    /** How file data reaches disk */
+    enum write_mode
+    {
+        /** Page cache, written by a write-behind thread */
+        WRITE_BUFFERED,
+        /** O_DIRECT, bypassing page cache. Falls back to buffered if unsupported */
+        WRITE_DIRECT,
+        /** Mapped output file. Falls back to buffered if size is unknown */
+        WRITE_MMAP
+    };
+
+    /** Size of each write buffer */
+    const size_t BUFFER_SIZE = 1 << 20;
+
+    /** Number of write buffers, full ones wait for the write-behind thread */
+    const size_t BUFFER_COUNT = 4;
+
+    /** Alignment of buffers, offsets and lengths required by O_DIRECT */
+    const size_t ALIGNMENT = 4096;
+
+    /**
+     * Description: Parse write mode name (buffered, direct or mmap) into `mode`.
+     * Return: 0 if succeed, or -1 if name is unknown.
+     */
+    int parse_mode(const std::string &name, write_mode &mode);
+
+    /**
+     * Description: Path `<path>.<n>.part` to write a new file of `path` at,
+     *              told apart from those of other writers of `path`.
+     */
+    std::string part_path(const std::string &path);
+
+    /**
+     * Stream buffer writing a new file at `<path>.<n>.part`, which is renamed
+     * to `path` by commit(). File is removed if not committed. Concurrent
+     * writers of the same path do not disturb each other, and the last commit
+     * wins.
+     *
+     * Usage:
+     *     storage_writer writer(path, mode);
+     *     std::ostream output(&writer);
+     *     writer.reserve(size);  // Optional
+     *     output << ...;
+     *     writer.commit();
+     */
+    class storage_writer : public std::streambuf
+    {
+    private:
+        std::string _path;
+        std::string _part_path;
+        write_mode _mode;
+        int _fd;
+        bool _committed;
+        /** Set when a write failed, all later writes fail */
+        bool _failed;
+        /** Bytes handed to write-behind thread */
+        uint64_t _offset;
+
+        /** Mapped file in mmap mode */
+        char *_map;
+        size_t _map_size;
+
+        /** Buffer being filled */
+        char *_current;
+        std::vector<char *> _buffers;
+
+        std::mutex _mutex;
+        std::condition_variable _cond;
+        /** Full buffers and their lengths, to be written in order */
+        std::deque< std::pair<char *, size_t> > _full;
+        std::vector<char *> _free;
+        bool _stop;
+        /** Write-behind thread is writing a buffer */
+        bool _writing;
+        std::thread _thread;
+
+        /** Body of write-behind thread */
+        void _write_behind();
+
+        /** Hand current buffer to write-behind thread and get a free one */
+        int _flush_current();
+
+        /** Write `len` bytes of `buf` at `offset`, padding to ALIGNMENT for O_DIRECT */
+        int _write_at(const char *buf, size_t len, uint64_t offset);
+
+        /** Wait for write-behind thread to finish all full buffers */
+        int _drain();
+
+    protected:
+        virtual int_type overflow(int_type c);
+
+    public:
+        storage_writer(const std::string &path, write_mode mode = WRITE_BUFFERED);
+
+        ~storage_writer();
+
+        /**
+         * Description: Check if file has been opened.
+         * Return: true if opened.
+         */
+        bool is_open() const;
+
+        /**
+         * Description: Preallocate `size` bytes of file, and map it in mmap
+         *              mode. Call before writing anything.
+         * Return: 0 if succeed, or -1 if fail.
+         */
+        int reserve(uint64_t size);
+
+        /**
+         * Description: Bytes written so far.
+         */
+        uint64_t size() const;
+
+        /**
+         * Description: Write out all buffered data, trim file to size written
+         *              and rename it into place.
+         * Return: 0 if succeed, or -1 if fail.
+         */
+        int commit();
+    };
+
+    /**
+     * Stream buffer writing a range of `length` bytes of an open file from
+     * `offset` by pwrite(), so writers of other ranges of the same file go
+     * on at once. Writing past the range fails, and nothing of it is written.
+     *
+     * Usage:
+     *     range_writer writer(fd, offset, length);
+     *     std::ostream output(&writer);
+     *     output << ...;
+     *     writer.flush();                  // Then size() == length if complete
+     */
+    class range_writer : public std::streambuf
+    {
+    private:
+        int _fd;
+        /** Offset of next write, and end of range */
+        uint64_t _offset;
+        uint64_t _end;
+        uint64_t _start;
+        std::vector<char> _buffer;
+        bool _failed;
+
+    protected:
+        virtual int_type overflow(int_type c);
+
+        virtual int sync();
+
+    public:
+        range_writer(int fd, uint64_t offset, uint64_t length);
+
+        range_writer(const range_writer &) = delete;
+        range_writer &operator=(const range_writer &) = delete;
+
+        /**
+         * Description: Bytes written so far, buffered ones included.
+         */
+        uint64_t size() const;
+
+        /**
+         * Description: Write out buffered bytes.
+         * Return: 0 if succeed, or -1 if a write failed or went past range.
+         */
+        int flush();
+    };
+};
+
+#endif
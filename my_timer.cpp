@@ -0,0 +1,104 @@
+#include <chrono>
+
+#include "my_timer.hpp"
+
+using namespace my_timer;
+
+uint64_t my_timer::current_tick()
+{
+    using namespace std::chrono;
+
+    auto ms = duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+    return static_cast<uint64_t>(ms) / TICK_MS;
+}
+
+timer_wheel::timer_wheel(uint64_t now)
+: _next(now), _count(0)
+{
+    for (unsigned int level = 0; level < LEVELS; ++level) {
+        for (unsigned int index = 0; index < SLOTS; ++index) {
+            _slots[level][index].prev = &_slots[level][index];
+            _slots[level][index].next = &_slots[level][index];
+        }
+    }
+}
+
+void timer_wheel::_insert(timer &t)
+{
+    // Passed ones run at next tick, and those too far wait in the farthest
+    // slot, to be placed again as it comes up
+    uint64_t expires = (t.expires < _next) ? _next : t.expires;
+    if (expires - _next > MAX_AHEAD) {
+        expires = _next + MAX_AHEAD;
+    }
+
+    // Level L takes timers due within 64^(L+1) ticks
+    uint64_t ahead = expires - _next;
+    unsigned int level = 0;
+    while (level < LEVELS - 1 && ahead >= (static_cast<uint64_t>(1) << (SLOT_BITS * (level + 1)))) {
+        level += 1;
+    }
+
+    timer &head = _slots[level][(expires >> (SLOT_BITS * level)) & (SLOTS - 1)];
+    t.prev = head.prev;
+    t.next = &head;
+    head.prev->next = &t;
+    head.prev = &t;
+}
+
+void timer_wheel::_cascade(unsigned int level, unsigned int index)
+{
+    timer &head = _slots[level][index];
+    timer *t = head.next;
+    head.prev = &head;
+    head.next = &head;
+
+    while (t != &head) {
+        timer *next = t->next;
+        _insert(*t);
+        t = next;
+    }
+}
+
+void timer_wheel::schedule(timer &t, uint64_t expires)
+{
+    cancel(t);
+    t.expires = expires;
+    _insert(t);
+    _count += 1;
+}
+
+void timer_wheel::cancel(timer &t)
+{
+    if (!t.armed()) {
+        return;
+    }
+
+    t.prev->next = t.next;
+    t.next->prev = t.prev;
+    t.prev = NULL;
+    t.next = NULL;
+    _count -= 1;
+}
+
+void timer_wheel::advance(uint64_t now, std::vector<timer *> &expired)
+{
+    while (_next <= now) {
+        // Start of a span of a level brings its timers down, and likewise
+        // the start of a span of the level above
+        unsigned int index = _next & (SLOTS - 1);
+        for (unsigned int level = 1; index == 0 && level < LEVELS; ++level) {
+            index = (_next >> (SLOT_BITS * level)) & (SLOTS - 1);
+            _cascade(level, index);
+        }
+
+        timer &head = _slots[0][_next & (SLOTS - 1)];
+        while (head.next != &head) {
+            timer *t = head.next;
+            cancel(*t);
+            expired.push_back(t);
+        }
+
+        _next += 1;
+    }
+}
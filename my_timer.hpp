@@ -0,0 +1,105 @@
+#ifndef __MY_TIMER_HPP__
+#define __MY_TIMER_HPP__
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace my_timer
+{
+    /** Milliseconds of a tick, the resolution of timers */
+    const unsigned int TICK_MS = 100;
+
+    /** Slots of each level of wheel, as bits, and number of levels */
+    const unsigned int SLOT_BITS = 6;
+    const unsigned int SLOTS = 1u << SLOT_BITS;
+    const unsigned int LEVELS = 4;
+
+    /** Ticks ahead a timer can be placed at once, about 19 days */
+    const uint64_t MAX_AHEAD = (static_cast<uint64_t>(1) << (SLOT_BITS * LEVELS)) - 1;
+
+    /**
+     * Description: Current tick of monotonic clock.
+     */
+    uint64_t current_tick();
+
+    /** Entry of a wheel, kept inside what it times so no memory is allocated */
+    struct timer
+    {
+        timer *prev;
+        timer *next;
+        /** Tick it expires at */
+        uint64_t expires;
+        /** What it times, for its owner */
+        void *data;
+
+        timer() : prev(NULL), next(NULL), expires(0), data(NULL) {}
+
+        /** Check if timer is in a wheel */
+        bool armed() const
+        {
+            return next != NULL;
+        }
+    };
+
+    /**
+     * Hierarchical timer wheel. Level 0 has a slot for each of the next 64
+     * ticks, level 1 a slot for each of the next 64 spans of 64 ticks, and so
+     * on. As a span comes up, timers of its slot move down to lower levels,
+     * so each timer moves at most LEVELS - 1 times. Scheduling and cancelling
+     * are O(1), whatever the number of timers. Not thread-safe.
+     *
+     * Usage:
+     *     timer_wheel wheel(current_tick());
+     *     wheel.schedule(t, current_tick() + 50);
+     *     wheel.advance(current_tick(), expired);  // Fills expired with t once due
+     */
+    class timer_wheel
+    {
+    private:
+        /** Heads of circular lists of timers of each slot */
+        timer _slots[LEVELS][SLOTS];
+        /** Next tick to run */
+        uint64_t _next;
+        size_t _count;
+
+        /** Put `t` into the slot its expiry falls into */
+        void _insert(timer &t);
+
+        /** Move timers of slot `index` of `level` down to where they are due */
+        void _cascade(unsigned int level, unsigned int index);
+
+    public:
+        explicit timer_wheel(uint64_t now);
+
+        timer_wheel(const timer_wheel &) = delete;
+        timer_wheel &operator=(const timer_wheel &) = delete;
+
+        /**
+         * Description: Arm `t` to expire at tick `expires`, or at next tick if
+         *              that has passed. An armed timer is moved.
+         */
+        void schedule(timer &t, uint64_t expires);
+
+        /**
+         * Description: Disarm `t` if it is armed.
+         */
+        void cancel(timer &t);
+
+        /**
+         * Description: Run ticks up to `now`, disarming timers due and
+         *              appending them to `expired`.
+         */
+        void advance(uint64_t now, std::vector<timer *> &expired);
+
+        /**
+         * Description: Number of timers armed.
+         */
+        size_t size() const
+        {
+            return _count;
+        }
+    };
+};
+
+#endif
@@ -0,0 +1,122 @@
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "my_trace.hpp"
+
+using namespace my_trace;
+
+/** One finished span */
+struct trace_event
+{
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+    uint32_t tid;
+};
+
+/** Events of one thread. Written by its owner only */
+struct trace_ring
+{
+    trace_event events[RING_SIZE];
+    /** Number of events ever written, the latest is at (head - 1) % RING_SIZE */
+    std::atomic<uint64_t> head;
+    /** Ring of exited threads is reused by new threads */
+    std::atomic<bool> in_use;
+
+    trace_ring() : head(0), in_use(true) {}
+};
+
+/** Ring of calling thread, released when thread exits */
+struct ring_holder
+{
+    trace_ring *ring;
+    uint32_t tid;
+
+    ring_holder();
+    ~ring_holder();
+};
+
+static std::mutex rings_mutex;
+static std::vector< std::unique_ptr<trace_ring> > rings;
+
+/** Reference points to convert ticks to microseconds */
+static const uint64_t origin_ticks = now();
+static const std::chrono::steady_clock::time_point origin_time = std::chrono::steady_clock::now();
+
+ring_holder::ring_holder()
+: ring(NULL), tid(static_cast<uint32_t>(syscall(SYS_gettid)))
+{
+    std::lock_guard<std::mutex> lock(rings_mutex);
+
+    for (auto &r : rings) {
+        bool expected = false;
+        if (r->in_use.compare_exchange_strong(expected, true)) {
+            ring = r.get();
+            return;
+        }
+    }
+
+    rings.push_back(std::unique_ptr<trace_ring>(new trace_ring()));
+    ring = rings.back().get();
+}
+
+ring_holder::~ring_holder()
+{
+    ring->in_use.store(false, std::memory_order_release);
+}
+
+void my_trace::record(const char *name, uint64_t start, uint64_t end)
+{
+    static thread_local ring_holder holder;
+
+    trace_ring *ring = holder.ring;
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    trace_event &event = ring->events[head % RING_SIZE];
+    event.name = name;
+    event.start = start;
+    event.end = end;
+    event.tid = holder.tid;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+void my_trace::dump(std::ostream &output)
+{
+    using namespace std;
+
+    // Ticks per microsecond, measured since program started
+    double elapsed_us = chrono::duration<double, micro>(chrono::steady_clock::now() - origin_time).count();
+    uint64_t elapsed_ticks = now() - origin_ticks;
+    double ticks_per_us = (elapsed_us > 0 && elapsed_ticks > 0) ? elapsed_ticks / elapsed_us : 1.0;
+
+    int pid = static_cast<int>(getpid());
+    bool first = true;
+
+    output << "{\"traceEvents\":[";
+
+    lock_guard<mutex> lock(rings_mutex);
+    for (auto &ring : rings) {
+        uint64_t head = ring->head.load(memory_order_acquire);
+        uint64_t begin = (head > RING_SIZE) ? head - RING_SIZE : 0;
+
+        for (uint64_t i = begin; i < head; ++i) {
+            const trace_event &event = ring->events[i % RING_SIZE];
+            if (event.start < origin_ticks) {
+                continue;
+            }
+
+            output << (first ? "" : ",") << "\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"ts\":" <<
+            static_cast<double>(event.start - origin_ticks) / ticks_per_us << ",\"dur\":" <<
+            static_cast<double>(event.end - event.start) / ticks_per_us << ",\"pid\":" << pid <<
+            ",\"tid\":" << event.tid << "}";
+            first = false;
+        }
+    }
+
+    output << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
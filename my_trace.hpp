@@ -0,0 +1,77 @@
+#ifndef __MY_TRACE_HPP__
+#define __MY_TRACE_HPP__
+
+#include <iostream>
+#include <cstdint>
+#include <ctime>
+
+/**
+ * Trace spans, enabled by building with -DMY_TRACE (`make TRACE=1`).
+ * Without it TRACE_SPAN() expands to nothing, and dump() writes an empty
+ * trace.
+ *
+ * Usage: TRACE_SPAN("phase name"); records from here to end of scope.
+ * Name must be a string literal, since only the pointer is kept.
+ */
+#ifdef MY_TRACE
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SPAN(name) my_trace::span TRACE_CONCAT(_trace_span_, __LINE__)(name)
+#else
+#define TRACE_SPAN(name) do {} while (0)
+#endif
+
+namespace my_trace
+{
+    /** Events kept per thread, older ones are overwritten */
+    const size_t RING_SIZE = 8192;
+
+    /**
+     * Description: Read timestamp counter (or monotonic clock where there is
+     *              no TSC).
+     * Return: Timestamp in ticks.
+     */
+    inline uint64_t now()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_ia32_rdtsc();
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+#endif
+    }
+
+    /**
+     * Description: Record a finished span in ring buffer of calling thread.
+     */
+    void record(const char *name, uint64_t start, uint64_t end);
+
+    /**
+     * Description: Write spans of all threads to `output` as Chrome trace
+     *              JSON, which can be opened by chrome://tracing or Perfetto.
+     */
+    void dump(std::ostream &output);
+
+    /** Record time from construction to destruction */
+    class span
+    {
+    private:
+        const char *_name;
+        uint64_t _start;
+
+    public:
+        explicit span(const char *name)
+        : _name(name), _start(now())
+        {
+
+        }
+
+        ~span()
+        {
+            record(_name, _start, now());
+        }
+    };
+};
+
+#endif
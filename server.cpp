@@ -1,32 +1,227 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <exception>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <map>
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <climits>
 
 #include "commons.hpp"
 #include "my_huffman.hpp"
+#include "my_delta.hpp"
+#include "my_stats.hpp"
+#include "my_trace.hpp"
+#include "my_storage.hpp"
+#include "my_cache.hpp"
+#include "my_archive.hpp"
+#include "my_budget.hpp"
+#include "my_sockopt.hpp"
+#include "my_bwt.hpp"
+#include "my_kernels.hpp"
+#include "my_sampled.hpp"
+#include "my_adaptive.hpp"
+#include "my_deadline.hpp"
+#include "my_shaper.hpp"
+#include "my_resume.hpp"
 
 extern "C" {
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <poll.h>
 #include <signal.h>
 #include <errno.h>
+#include <getopt.h>
 
 #include "my_send_recv.h"
+#include "my_frame.h"
 }
 
 #define LISTEN_PORT 1732
-#define BUFLEN 65536
+#define LISTEN_BACKLOG 64
+#define MAX_PIPELINE 64
+/** Most threads of a parallel decode */
+#define DECODE_THREADS 4
+/**
+ * Memory of a decode: write buffers of storage_writer, blocks of codec, and
+ * partitions of parallel decode or one block of block-sorted decode
+ */
+#define DECODE_MEMORY (my_storage::BUFFER_COUNT * my_storage::BUFFER_SIZE + 2 * my_huffman::BLOCK_SIZE + \
+    std::max(DECODE_THREADS * my_huffman::PARTITION_SIZE, my_bwt::BLOCK_MEMORY))
+/** Default memory budget of all connections, and quota of each, in MB */
+#define MEMORY_BUDGET_MB 1024
+#define CONNECTION_QUOTA_MB 64
+/** Seconds a striped transfer waits for its missing stripes while none is being received */
+#define STRIPE_IDLE_SECONDS 30
+/** Most stripes of a striped transfer */
+#define MAX_STRIPES 64
+
+typedef std::vector< std::vector<uint8_t> > code_table;
+
+/** Kinds of payload, by the code tables they have */
+enum payload_codec
+{
+    /** One Huffman coding table */
+    CODEC_HUFFMAN,
+    /** A table of each block, coding symbols rather than chars */
+    CODEC_BLOCK_SORTED,
+    /** A Huffman coding table of each segment */
+    CODEC_SAMPLED,
+    /** No table, tree is rebuilt as data is decoded */
+    CODEC_ADAPTIVE,
+    /** No table, as no bytes are coded, like a delta without literals */
+    CODEC_NONE
+};
+
+/** Code tables of a decoded payload */
+struct payload_tables
+{
+    payload_codec codec;
+    /** Huffman coding table of Huffman payload */
+    code_table table;
+    /** Huffman coding table of each segment of sampled payload */
+    std::vector<code_table> segments;
+    /** Bytes of each block of block-sorted payload */
+    uint32_t block_size;
+
+    payload_tables() : codec(CODEC_HUFFMAN), block_size(0) {}
+};
+
+/** State of a connected client */
+struct client_conn
+{
+    /** Client socket */
+    int fd;
+    /** Connected by Unix socket, so payloads come as memfd */
+    bool local;
+    /** Protocol version, 1 for text commands or FRAME_VERSION for frames */
+    int proto;
+    /** Serialize responses to client, since pipelined workers reply on their own */
+    std::mutex send_mutex;
+    /** Decode workers of pipelined send commands */
+    std::vector<std::thread> workers;
+    /** Memory quota, charged for buffers of connection and its decodes */
+    my_budget::quota *quota;
+    /** Deadline of current phase, shutting connection down once passed */
+    my_deadline::connection_deadline *deadline;
+    /** Share of rates and decode slots */
+    my_shaper::flow *flow;
+};
+
+/** State of a striped transfer, shared by connections of its stripes */
+struct stripe_transfer
+{
+    std::string id;
+    std::string filename;
+    int count;
+    long long total;
+    /** Stripes arrived by index, each may come once */
+    std::vector<bool> arrived;
+    /** Ranges of original file taken by stripes, as offset and length */
+    std::vector< std::pair<long long, long long> > ranges;
+    /** Number of stripes being received or decoded */
+    int active;
+    /** Number of stripes finished, either succeeded or failed */
+    int done;
+    bool failed;
+    /** Compressed bytes received of all stripes */
+    long long received;
+    /** Huffman coding table of each stripe */
+    std::vector<code_table> tables;
+    /** File stripes are decoded into, renamed to filename once all are done */
+    std::string part_path;
+    int part_fd;
+    /** Drops transfer once idle too long, armed while no stripe is active */
+    my_timer::timer idle;
+};
 
 int sockfd = 0;
-int clientfd = 0;
-char welcome_msg[] = "Welcome to my netprog hw2 FTP server\n";
+/** Unix socket listening for clients on the same host, and its path */
+int localfd = -1;
+std::string local_path;
+/**
+ * Tags at end of welcome message tell clients binary frames are supported,
+ * and partial uploads are kept to be resumed
+ */
+char welcome_msg[] = "Welcome to my netprog hw2 FTP server [proto 2] [resume]\n";
+
+/** Serialize messages printed by connections and workers */
+std::mutex log_mutex;
+
+/** Tells apart payloads of pipelined requests in flight for the same file */
+std::atomic<unsigned long> next_payload_id(0);
+
+/** Striped transfers in progress, indexed by transfer ID, and their idle timers */
+std::map<std::string, stripe_transfer> transfers;
+std::mutex transfers_mutex;
+my_timer::timer_wheel *transfer_wheel = NULL;
+
+/** How received files are written to disk */
+my_storage::write_mode storage_mode = my_storage::WRITE_BUFFERED;
+
+/** Memory shared by all connections, created in main() */
+my_budget::budget *memory_budget = NULL;
+/** Memory quota of each connection, in bytes */
+uint64_t connection_quota = static_cast<uint64_t>(CONNECTION_QUOTA_MB) << 20;
+/** Memory of a connection: receive buffer of my_send_recv.c and of receive_payload() */
+uint64_t connection_memory = 0;
+
+/** Options of listening and client sockets */
+my_sockopt::socket_tuning server_tuning = my_sockopt::default_tuning();
+
+/** Threads of each parallel decode, at most DECODE_THREADS */
+unsigned int decode_threads = 1;
+
+/** Encoded files for download, created in main() */
+my_cache::object_cache *encoded_cache = NULL;
+
+/** Limits of phases of connections, and their wheel, created in main() */
+my_deadline::limits deadline_limits = my_deadline::default_limits();
+my_deadline::reaper *connection_reaper = NULL;
+
+/** Rates of connections and decode slots, and their fair queues, created in main() */
+my_shaper::rates shaper_rates = my_shaper::default_rates();
+my_shaper::shaper *traffic_shaper = NULL;
+
+/** Partial uploads kept to be resumed, created in main() */
+my_resume::partial_store *partial_uploads = NULL;
+
+/** Print to cout in one piece, holding log_mutex until end of statement */
+class locked_cout
+{
+private:
+    std::lock_guard<std::mutex> _lock;
+
+public:
+    locked_cout() : _lock(log_mutex) {}
+
+    template <typename T>
+    locked_cout &operator<<(const T &value)
+    {
+        std::cout << value;
+        return *this;
+    }
+
+    locked_cout &operator<<(std::ostream &(*manip)(std::ostream &))
+    {
+        std::cout << manip;
+        return *this;
+    }
+};
 
 /**
  * Descrption: Clean exit when SIGINT received.
@@ -46,30 +241,294 @@ static const void *get_in_addr(const struct sockaddr &sa);
 static uint16_t get_in_port(const struct sockaddr &sa);
 
 /**
- * Descrption: Start server and listening to clients.
+ * Descrption: Start server and listening to clients. Buffer sizes of
+ *             `server_tuning` are set before listening, so accepted sockets
+ *             inherit them.
  * Return: 0 if succeed, or -1 if fail.
  */
 static int start_server();
 
+/**
+ * Descrption: Start listening to clients on the same host at Unix socket
+ *             `local_path`, replacing a stale socket left there.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int start_local_server();
+
 /**
  * Descrption: Print client info and send welcome message to client.
  * Return: 0 if succeed, or -1 if fail.
  */
-static int welcome(const struct sockaddr &client_addr);
+static int welcome(client_conn &conn, const struct sockaddr &client_addr);
+
+/**
+ * Descrption: Send response `msg` to client. Safe to be called by workers.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int send_response(client_conn &conn, const std::string &msg);
+
+/**
+ * Descrption: Send response frame to client. Safe to be called by workers.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int send_frame_response(client_conn &conn, uint8_t type, uint32_t id, uint64_t length, const std::string &msg);
+
+/**
+ * Descrption: Receive `filesize` bytes of payload from client and save it to
+ *             `codefilename`. On a local connection it comes as a memfd,
+ *             which is handed to `payload_fd` if given instead of saved.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int receive_payload(client_conn &conn, const std::string &codefilename, long long filesize,
+    int *payload_fd = NULL);
+
+/**
+ * Descrption: Receive memfd of `filesize` bytes from local connection, and
+ *             hand it to `payload_fd` if given and sealed against change,
+ *             else copy it to `codefilename` within kernel and set
+ *             `payload_fd` to -1.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int receive_local_payload(client_conn &conn, const std::string &codefilename, long long filesize,
+    int *payload_fd);
+
+/**
+ * Descrption: Decode `codefilename`, or `payload_fd` if given which is
+ *             closed, into `output`, and copy its code tables to `tables`.
+ *             Space of original size is reserved in `storage` if given.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int decode_payload(const std::string &codefilename, std::ostream &output, payload_tables &tables,
+    my_storage::storage_writer *storage = NULL, int payload_fd = -1);
+
+/**
+ * Descrption: Decode block-sorted payload of `payload_size` bytes in `fd`
+ *             into `sink`, on as many threads as memory budget has room for,
+ *             and tell its block size in `tables`. Space of original size is
+ *             reserved in `storage` if given.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int decode_block_sorted(int fd, uint64_t payload_size, my_io::stream_sink &sink,
+    my_storage::storage_writer *storage, payload_tables &tables);
+
+/**
+ * Descrption: Write Huffman coding `table` to `output` in text form.
+ */
+static void write_code_table(std::ostream &output, const code_table &table);
+
+/**
+ * Descrption: Save code `tables` of a decoded payload in `codefilename`, or
+ *             remove it if they tell nothing of chars, and write what is
+ *             saved to `log`.
+ */
+static void save_code_tables(const std::string &codefilename, const payload_tables &tables, std::ostream &log);
+
+/**
+ * Descrption: Decode `codefilename`, or `payload_fd` if given which is
+ *             closed, into `filename`, then save Huffman coding table in
+ *             `codefilename`. Messages are written to `log`.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int decode_file(const std::string &filename, const std::string &codefilename, long long filesize, std::ostream &log,
+    int payload_fd = -1);
 
 /**
  * Descrption: Receive file sent from client.
  * Return: 0 if succeed, or -1 if fail.
  */
-static int receive_file(std::vector<std::string> &cmd, const char *orig_cmd);
+static int receive_file(client_conn &conn, std::vector<std::string> &cmd, const char *orig_cmd);
+
+/**
+ * Descrption: Receive `filesize` bytes of file `filename`, reply in text or
+ *             `binary` frame, then decode it.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int store_file(client_conn &conn, const std::string &filename, long long filesize, bool binary);
+
+/**
+ * Descrption: Acknowledge payload of `filesize` bytes of file `filename`,
+ *             received into `filename`.code or `payload_fd` if not negative,
+ *             and decode it.
+ * Return: 0 if succeed, or -1 if connection should be closed.
+ */
+static int decode_received(client_conn &conn, const std::string &filename, long long filesize, bool binary,
+    int payload_fd);
+
+/**
+ * Descrption: Receive file of pipelined send command, and decode it in a
+ *             worker which acknowledges client when finished.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int receive_pipelined(client_conn &conn, std::vector<std::string> &cmd, const char *orig_cmd);
+
+/**
+ * Descrption: Receive `filesize` bytes of file `filename` for pipelined
+ *             request `id`, and decode it in a worker which acknowledges
+ *             client in text or `binary` frame when finished.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int store_pipelined(client_conn &conn, const std::string &id, const std::string &filename, long long filesize, bool binary);
+
+/**
+ * Descrption: Receive one stripe of a striped transfer and decode it into
+ *             the part file of the transfer at its offset. The last finished
+ *             stripe renames it into place and saves Huffman coding tables of
+ *             all stripes.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int receive_stripe(client_conn &conn, std::vector<std::string> &cmd, const char *orig_cmd);
+
+/**
+ * Descrption: Take range of `length` bytes from `offset` of original file
+ *             for a stripe of `xfer`, with transfers_mutex held.
+ * Return: 0 if succeed, or -1 if it is past total or overlaps another.
+ */
+static int claim_stripe_range(stripe_transfer &xfer, long long offset, long long length);
+
+/**
+ * Descrption: Record the result of a stripe, and finish the striped transfer
+ *             if all of its stripes are done.
+ */
+static void finish_stripe(const std::string &xfer_id, int index, bool succeed, long long filesize, code_table &table);
+
+/**
+ * Descrption: Drop a striped transfer, removing its part file, with
+ *             transfers_mutex held.
+ */
+static void drop_transfer(std::map<std::string, stripe_transfer>::iterator it);
+
+/**
+ * Descrption: Drop striped transfers idle for STRIPE_IDLE_SECONDS, whose
+ *             missing stripes never came.
+ * Return: Milliseconds until next check, or -1 if none is idle.
+ */
+static int expire_transfers();
+
+/**
+ * Descrption: Send block signatures of the server copy of a file, so client
+ *             can send delta against it.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int send_signatures(client_conn &conn, std::vector<std::string> &cmd, const char *orig_cmd);
+
+/**
+ * Descrption: Receive delta of a file and rebuild the file from its server
+ *             copy.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int receive_delta(client_conn &conn, std::vector<std::string> &cmd, const char *orig_cmd);
+
+/**
+ * Descrption: Rebuild `filename` from its old copy and the delta saved in
+ *             `deltafilename`, charging decoded literals to `quota`.
+ *             Messages are written to `log`.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int apply_delta_file(const std::string &filename, const std::string &deltafilename, long long filesize,
+    std::ostream &log, my_budget::quota &quota);
+
+/**
+ * Descrption: Check and parse archive command, receive an archive of several
+ *             files and unpack it into current directory.
+ * Return: 0 if succeed, or -1 if connection should be closed.
+ */
+static int receive_archive(client_conn &conn, std::vector<std::string> &cmd, const char *orig_cmd);
+
+/**
+ * Descrption: Decode archive in `codefilename` of `filesize` bytes, writing
+ *             each file as soon as it is decoded, then save its code table
+ *             in place of it.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int unpack_archive(const std::string &codefilename, long long filesize, std::ostream &log);
+
+/**
+ * Descrption: Reply bytes of a resumable upload server has durably, from
+ *             which client is to continue, taking it over from connection
+ *             left holding it.
+ * Return: 0 if succeed, or -1 if connection should be closed.
+ */
+static int send_resume_offset(client_conn &conn, std::vector<std::string> &cmd, const char *orig_cmd);
+
+/**
+ * Descrption: Receive rest of a resumable upload from offset client was
+ *             told, saving it as it comes, and decode it once complete.
+ * Return: 0 if succeed, or -1 if connection should be closed.
+ */
+static int receive_resumable(client_conn &conn, std::vector<std::string> &cmd, const char *orig_cmd);
+
+/**
+ * Descrption: Wait for all pipelined workers of `conn` to finish.
+ */
+static void join_workers(client_conn &conn);
+
+/**
+ * Descrption: Send metrics of server to client.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int send_stats(client_conn &conn);
+
+/**
+ * Descrption: Send Huffman-encoded file to client, from cache of encoded
+ *             files if up to date.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int send_encoded(client_conn &conn, const char *orig_cmd);
+
+/**
+ * Descrption: Send the part of encoded file needed to decode a byte range of
+ *             it, found by checkpoint index of the encoded file, so neither
+ *             side decodes the whole file.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int send_range(client_conn &conn, std::vector<std::string> &cmd, const char *orig_cmd);
+
+/**
+ * Descrption: Send `length` bytes of file `fd` from `offset` to client,
+ *             from page cache without copying.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int sendfile_all(client_conn &conn, int fd, off_t offset, uint64_t length);
+
+/**
+ * Descrption: Send trace spans recorded by server to client, as Chrome trace
+ *             JSON.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int send_trace(client_conn &conn);
+
+/**
+ * Descrption: Switch connection to protocol version requested by client.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int negotiate_protocol(client_conn &conn, std::vector<std::string> &cmd);
+
+/**
+ * Descrption: Parse and run a text command.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int dispatch_command(client_conn &conn, char *orig_cmd);
+
+/**
+ * Descrption: Run a received frame.
+ * Return: 0 if succeed, or -1 if fail.
+ */
+static int dispatch_frame(client_conn &conn, struct my_frame &frame);
 
 /**
  * Descrption: Read and serve client.
  * Return: 0 if succeed, or -1 if fail.
  */
-static int serve_client();
+static int serve_client(client_conn &conn);
+
+/**
+ * Descrption: Serve a connection from accepting to closing. Runs in its own
+ *             thread.
+ */
+static void serve_connection(int clientfd, struct sockaddr_storage client_addr,
+    my_deadline::connection_deadline *deadline);
 
-int main()
+int main(int argc, char *argv[])
 {
     // Handle SIGINT
     struct sigaction sa;
@@ -79,8 +538,129 @@ int main()
 
     sigaction(SIGINT, &sa, NULL);
 
+    // Writing to a connection closed by peer must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
     using namespace std;
 
+    string metrics_path;
+    int metrics_interval = 10;
+    string cache_dir = ".hw2cache";
+    string partial_dir = ".hw2partial";
+    long long cache_mb = 256;
+    long long budget_mb = MEMORY_BUDGET_MB;
+    long long quota_mb = CONNECTION_QUOTA_MB;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:i:w:c:C:M:Q:t:u:T:R:P:")) != -1) {
+        switch (opt) {
+        case 'm':
+            metrics_path = optarg;
+            break;
+        case 'i':
+            metrics_interval = atoi(optarg);
+            break;
+        case 'w':
+            if (my_storage::parse_mode(optarg, storage_mode) < 0) {
+                cerr << "Write mode must be buffered, direct or mmap." << endl;
+                exit(1);
+            }
+            break;
+        case 'c':
+            cache_dir = optarg;
+            break;
+        case 'C':
+            cache_mb = atoll(optarg);
+            break;
+        case 'M':
+            budget_mb = atoll(optarg);
+            break;
+        case 'Q':
+            quota_mb = atoll(optarg);
+            break;
+        case 't':
+            if (my_sockopt::parse_tuning(optarg, server_tuning) < 0) {
+                cerr << "Invalid socket tuning " << optarg << "." << endl;
+                exit(1);
+            }
+            break;
+        case 'u':
+            local_path = optarg;
+            break;
+        case 'T':
+            if (my_deadline::parse_limits(optarg, deadline_limits) < 0) {
+                cerr << "Invalid connection deadlines " << optarg << "." << endl;
+                exit(1);
+            }
+            break;
+        case 'R':
+            if (my_shaper::parse_rates(optarg, shaper_rates) < 0) {
+                cerr << "Invalid rates " << optarg << "." << endl;
+                exit(1);
+            }
+            break;
+        case 'P':
+            partial_dir = optarg;
+            break;
+        default:
+            cerr << "Usage: " << argv[0] << " [-m metrics_file] [-i interval_seconds] [-w write_mode]" <<
+            " [-c cache_dir] [-C cache_megabytes] [-M memory_megabytes] [-Q connection_megabytes]" <<
+            " [-t socket_tuning] [-u unix_socket_path] [-T deadlines] [-R rates] [-P partial_dir]" << endl;
+            exit(1);
+        }
+    }
+
+    if (metrics_interval <= 0) {
+        cerr << "Metrics interval must be a positive number." << endl;
+        exit(1);
+    }
+
+    if (cache_mb < 0) {
+        cerr << "Cache size must not be negative." << endl;
+        exit(1);
+    }
+
+    my_set_recv_size(server_tuning.recv);
+
+    decode_threads = thread::hardware_concurrency();
+    if (decode_threads < 1 || decode_threads > DECODE_THREADS) {
+        decode_threads = (decode_threads < 1) ? 1 : DECODE_THREADS;
+    }
+
+    // A connection needs room for its buffers and one decode
+    connection_memory = my_sockopt::MAX_CHUNK_SIZE + static_cast<uint64_t>(server_tuning.chunk);
+    connection_quota = static_cast<uint64_t>(quota_mb) << 20;
+    if (quota_mb <= 0 || connection_quota < connection_memory + DECODE_MEMORY || budget_mb < quota_mb) {
+        cerr << "Connection quota must be at least " << ((connection_memory + DECODE_MEMORY) >> 20) + 1 <<
+        " MB, and memory budget at least the quota." << endl;
+        exit(1);
+    }
+    memory_budget = new my_budget::budget(static_cast<uint64_t>(budget_mb) << 20);
+    connection_reaper = new my_deadline::reaper(deadline_limits);
+    transfer_wheel = new my_timer::timer_wheel(my_timer::current_tick());
+
+    // A connection held below minimum rate of transfers would be reaped
+    uint64_t rate_floor = (deadline_limits.transfer != 0) ? deadline_limits.min_rate : 0;
+    if ((shaper_rates.connection != 0 && shaper_rates.connection < rate_floor) ||
+        (shaper_rates.address != 0 && shaper_rates.address < rate_floor) ||
+        (shaper_rates.global != 0 && shaper_rates.global < rate_floor)) {
+        cerr << "Rates must be at least the minimum rate of transfers, " << rate_floor << " bytes per second." << endl;
+        exit(1);
+    }
+    traffic_shaper = new my_shaper::shaper(shaper_rates);
+
+    encoded_cache = new my_cache::object_cache(cache_dir, static_cast<uint64_t>(cache_mb) << 20);
+    if (encoded_cache->init() < 0) {
+        cerr << "Fail to create cache directory " << cache_dir << "." << endl;
+        exit(1);
+    }
+
+    partial_uploads = new my_resume::partial_store(partial_dir);
+    if (partial_uploads->init() < 0) {
+        cerr << "Fail to create directory of partial uploads " << partial_dir << "." << endl;
+        exit(1);
+    }
+
     // Start server
     int status = start_server();
     if (status != 0) {
@@ -90,42 +670,85 @@ int main()
         cerr << "Fail to start server." << endl;
         exit(1);
     }
-    
-    struct sockaddr_storage client_addr = {};
-    socklen_t client_addr_size = sizeof (client_addr);
+    if (!local_path.empty() && start_local_server() < 0) {
+        close(sockfd);
+        cerr << "Fail to listen at " << local_path << "." << endl;
+        exit(1);
+    }
+
+    if (!metrics_path.empty()) {
+        my_stats::start_writer(metrics_path, metrics_interval);
+        cout << "Writing metrics to " << metrics_path << " every " << metrics_interval << " seconds." << endl;
+    }
+
+    // Accept client connecting on either socket, and serve each of them in
+    // its own thread. Between accepts, connections past their deadlines are
+    // shut down, and idle striped transfers dropped, every tick while any is
+    // open.
+    struct pollfd listeners[2] = { { sockfd, POLLIN, 0 }, { localfd, POLLIN, 0 } };
+    nfds_t listener_count = (localfd >= 0) ? 2 : 1;
+    while (true) {
+        int timeout = connection_reaper->run();
+        int idle_timeout = expire_transfers();
+        if (idle_timeout >= 0 && (timeout < 0 || idle_timeout < timeout)) {
+            timeout = idle_timeout;
+        }
+        if (poll(listeners, listener_count, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
 
-    // Accept client connecting.
-    clientfd = accept(sockfd, reinterpret_cast<struct sockaddr *>(&client_addr), &client_addr_size);
-    while (clientfd > 0) {
-        welcome(reinterpret_cast<struct sockaddr &>(client_addr));
+        bool failed = false;
+        for (nfds_t i = 0; i < listener_count; ++i) {
+            if (listeners[i].revents == 0) {
+                continue;
+            }
 
-        serve_client();
+            struct sockaddr_storage client_addr = {};
+            socklen_t client_addr_size = sizeof (client_addr);
 
-        close(clientfd);
-        my_clean_buf(); // See my_send_recv.h
-        cout << "Connection terminated." << endl;
+            int clientfd = accept4(listeners[i].fd, reinterpret_cast<struct sockaddr *>(&client_addr), &client_addr_size,
+                SOCK_CLOEXEC);
+            if (clientfd < 0) {
+                if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+                    failed = true;
+                }
+                continue;
+            }
 
-        clientfd = accept(sockfd, reinterpret_cast<struct sockaddr *>(&client_addr), &client_addr_size);
+            // Armed before its thread starts, so wheel runs while it is open
+            my_deadline::connection_deadline *deadline = new my_deadline::connection_deadline(*connection_reaper, clientfd);
+            connection_reaper->arm(*deadline);
+            thread(serve_connection, clientfd, client_addr, deadline).detach();
+        }
+        if (failed) {
+            break;
+        }
     }
 
     // Abnormal exit.
-    if (clientfd < 0) {
-        perror("accept");
-    }
+    perror("accept");
 
     close(sockfd);
-    
+    if (localfd >= 0) {
+        close(localfd);
+        unlink(local_path.c_str());
+    }
+
     return 1;
 }
 
 static void sigint_safe_exit(int sig)
 {
-    if (clientfd > 2) {
-        close(clientfd);
-    }
     if (sockfd > 2) {
         close(sockfd);
     }
+    if (localfd >= 0) {
+        close(localfd);
+        unlink(local_path.c_str());
+    }
     std::cerr << "Interrupt." << std::endl;
     exit(1);
 }
@@ -180,6 +803,16 @@ static int start_server()
         }
     }
 
+    // Restart at once, while connections of last run are in TIME_WAIT
+    int yes = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof (yes)) != 0) {
+        perror("setsockopt");
+    }
+
+    if (my_sockopt::apply_buffers(sockfd, server_tuning) != 0) {
+        perror("setsockopt");
+    }
+
     if (addr_family == AF_INET6) {
         struct sockaddr_in6 any_addr = {};
         any_addr.sin6_family = AF_INET6;
@@ -194,25 +827,75 @@ static int start_server()
 
         status = bind(sockfd, reinterpret_cast<const struct sockaddr *>(&any_addr), sizeof (any_addr));
     }
-    
+
     if (status < 0) {
         perror("bind");
         return -1;
     }
 
-    status = listen(sockfd, 1);
+    status = listen(sockfd, LISTEN_BACKLOG);
     if (status < 0) {
         perror("listen");
         return -1;
     }
 
     std::cout << "Start listening at port " << LISTEN_PORT << "." << std::endl;
+    std::cout << "Socket tuning: " << my_sockopt::format_tuning(server_tuning) << "." << std::endl;
+    std::cout << "Codec kernels: " << my_kernels::isa_name(my_kernels::isa()) << "." << std::endl;
+
+    return 0;
+}
+
+static int start_local_server()
+{
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (local_path.size() >= sizeof (addr.sun_path)) {
+        std::cout << "Socket path " << local_path << " is too long." << std::endl;
+        return -1;
+    }
+    strcpy(addr.sun_path, local_path.c_str());
+
+    localfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (localfd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // Socket of a server gone without cleaning up refuses connections; a
+    // file that is not a socket is left alone and bind() fails on it
+    struct stat st;
+    if (lstat(local_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(local_path.c_str());
+    }
+
+    if (bind(localfd, reinterpret_cast<struct sockaddr *>(&addr), sizeof (addr)) < 0) {
+        perror("bind");
+        close(localfd);
+        localfd = -1;
+        return -1;
+    }
 
+    if (listen(localfd, LISTEN_BACKLOG) < 0) {
+        perror("listen");
+        close(localfd);
+        localfd = -1;
+        unlink(local_path.c_str());
+        return -1;
+    }
+
+    std::cout << "Start listening at " << local_path << "." << std::endl;
     return 0;
 }
 
-static int welcome(const struct sockaddr &client_addr)
+static int welcome(client_conn &conn, const struct sockaddr &client_addr)
 {
+    // Clients of Unix socket are mostly unnamed
+    if (client_addr.sa_family == AF_UNIX) {
+        locked_cout() << "Connection from local socket " << local_path << " accepted." << std::endl;
+        return send_response(conn, welcome_msg);
+    }
+
     char client_addr_p[INET6_ADDRSTRLEN] = {};
     if (inet_ntop(client_addr.sa_family, get_in_addr(client_addr),
     client_addr_p, sizeof (client_addr_p)) == NULL) {
@@ -223,160 +906,1783 @@ static int welcome(const struct sockaddr &client_addr)
     // Extract address from IPv4-mapped IPv6 address.
     int offset = (memcmp(client_addr_p, "::ffff:", 7) == 0) ? 7 : 0;
 
-    std::cout << "Connection from " << (client_addr_p + offset) << " port " <<
+    locked_cout() << "Connection from " << (client_addr_p + offset) << " port " <<
     get_in_port(client_addr) << " protocol SOCK_STREAM(TCP) accepted." << std::endl;
-    
-    int msglen = (int) strlen(welcome_msg);
-    return my_send(clientfd, welcome_msg, &msglen);
+
+    return send_response(conn, welcome_msg);
 }
 
-static int receive_file(std::vector<std::string> &cmd, const char *orig_cmd)
+static int send_response(client_conn &conn, const std::string &msg)
 {
-    using namespace std;
+    std::lock_guard<std::mutex> lock(conn.send_mutex);
 
-    if (cmd.size() < 3) {
-        cout << "Invalid command received. Terminating connection..." << endl;
-        return -1;
-    }
+    int msglen = static_cast<int>(msg.size());
+    return my_send(conn.fd, msg.c_str(), &msglen);
+}
 
-    int filesize;
-    try {
-        filesize = stoi(cmd[1]);
-    }
-    catch (exception &e) {
-        cout << "Invalid command received. Terminating connection..." << endl;
-        return -1;
-    }
+static int send_frame_response(client_conn &conn, uint8_t type, uint32_t id, uint64_t length, const std::string &msg)
+{
+    std::lock_guard<std::mutex> lock(conn.send_mutex);
 
-    // Extract filename
-    const char *filename_c_str = strstr(orig_cmd, cmd[2].c_str());
-    if (filename_c_str == NULL) {
-        cout << "Invalid command received. Terminating connection..." << endl;
-        return -1;
+    return my_send_frame(conn.fd, type, id, length, msg.c_str(), msg.size());
+}
+
+static int receive_payload(client_conn &conn, const std::string &codefilename, long long filesize,
+    int *payload_fd)
+{
+    using namespace std;
+
+    // Payload must keep coming at minimum rate
+    my_deadline::phase_scope transfer(*conn.deadline, my_deadline::PHASE_TRANSFER);
+
+    if (conn.local) {
+        return receive_local_payload(conn, codefilename, filesize, payload_fd);
+    }
+    if (payload_fd != NULL) {
+        *payload_fd = -1;
     }
-    string filename = filename_c_str;
-    string codefilename = filename + ".code";
 
     fstream codefile(codefilename, fstream::out | fstream::binary | fstream::trunc);
     if (!codefile.is_open()) {
-        cout << "Failed to open file " << codefilename << "." << endl;
-        cout << "An error has occurred. Terminating connection..." << endl;
+        locked_cout() << "Failed to open file " << codefilename << "." << endl;
         return -1;
     }
 
-    cout << "Receiving " << filename << " ..." << endl;
+    my_stats::phase_timer timer(my_stats::PHASE_RECEIVE);
 
     // Write header and compressed data into codefile
-    int status = -1;
-    int received = 0;
+    int status = 0;
+    long long received = 0;
+    std::vector<uint8_t> buf(static_cast<size_t>(server_tuning.chunk));
     while (received < filesize) {
-        uint8_t buf[BUFLEN];
-        int buflen = (filesize - received < BUFLEN) ? (filesize - received) : BUFLEN;
-        status = my_recv_data(clientfd, buf, &buflen);
+        int chunk = server_tuning.chunk;
+        int buflen = (filesize - received < chunk) ? static_cast<int>(filesize - received) : chunk;
+        {
+            TRACE_SPAN("recv");
+            status = my_recv_data(conn.fd, buf.data(), &buflen);
+        }
         if (status < 0) {
             perror("my_recv_data");
             break;
         }
 
         if (buflen == 0) {
-            cout << "Connection closed by peer." << endl;
+            locked_cout() << "Connection closed by peer." << endl;
             status = -1;
             break;
         }
 
         received += buflen;
-        codefile.write(reinterpret_cast<const char *>(&buf), static_cast<streamsize>(buflen));
+        my_stats::add(my_stats::BYTES_RECEIVED, static_cast<uint64_t>(buflen));
+
+        {
+            TRACE_SPAN("write_code");
+            codefile.write(reinterpret_cast<const char *>(buf.data()), static_cast<streamsize>(buflen));
+        }
+
+        // Socket is not read again until connection is within its rates
+        if (conn.flow->transfer(static_cast<uint64_t>(buflen))) {
+            my_stats::add(my_stats::SHAPER_WAITS);
+        }
     }
 
-    if (status < 0) {
-        cout << "An error has occurred. Terminating connection..." << endl;
+    return (status < 0) ? -1 : 0;
+}
+
+static int receive_local_payload(client_conn &conn, const std::string &codefilename, long long filesize,
+    int *payload_fd)
+{
+    using namespace std;
+
+    my_stats::phase_timer timer(my_stats::PHASE_RECEIVE);
+
+    int fd;
+    int status;
+    {
+        TRACE_SPAN("recv_fd");
+        status = my_recv_fd(conn.fd, &fd);
+    }
+    if (status != 0) {
+        if (status > 0) {
+            locked_cout() << "Connection closed by peer." << endl;
+        }
+        else {
+            perror("my_recv_fd");
+        }
         return -1;
     }
 
-    string response = "OK " + to_string(filesize) + " bytes received.\n";
-    int reslen = static_cast<int>(response.size());
-    status = my_send(clientfd, response.c_str(), &reslen);
+    // Anything but a regular file of the size told could block or cut
+    // decoding short. Its offset is shared with client, who wrote it.
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size != filesize || lseek(fd, 0, SEEK_SET) != 0) {
+        locked_cout() << "Payload passed is not a file of " << filesize << " bytes." << endl;
+        close(fd);
+        return -1;
+    }
+    my_stats::add(my_stats::BYTES_RECEIVED, static_cast<uint64_t>(filesize));
+
+    // Decoders read it in parallel, so it is only decoded in place if client
+    // cannot change it any more. Any other file is copied first.
+    int seals = fcntl(fd, F_GET_SEALS);
+    bool sealed = seals >= 0 && (seals & (F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW)) ==
+        (F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW);
+    if (payload_fd != NULL) {
+        if (sealed) {
+            *payload_fd = fd;
+            return 0;
+        }
+        *payload_fd = -1;
+    }
+
+    int codefd = open(codefilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (codefd < 0) {
+        locked_cout() << "Failed to open file " << codefilename << "." << endl;
+        close(fd);
+        return -1;
+    }
+
+    TRACE_SPAN("write_code");
+    off_t offset = 0;
+    while (offset < filesize) {
+        ssize_t len = sendfile(codefd, fd, &offset, static_cast<size_t>(filesize - offset));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            perror("sendfile");
+            break;
+        }
+    }
+    close(codefd);
+    close(fd);
+
+    return (offset == filesize) ? 0 : -1;
+}
+
+static int decode_payload(const std::string &codefilename, std::ostream &output, payload_tables &tables,
+    my_storage::storage_writer *storage, int payload_fd)
+{
+    using namespace std;
+
+    int fd = (payload_fd >= 0) ? payload_fd : open(codefilename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    my_stats::phase_timer timer(my_stats::PHASE_DECODE);
+
+    // Read codefile by blocks straight from its descriptor
+    my_io::fd_source source(fd);
+    my_io::stream_sink sink(output);
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Block-sorted payload has no single code table
+    if (my_bwt::is_block_sorted(fd)) {
+        int status = decode_block_sorted(fd, static_cast<uint64_t>(st.st_size), sink, storage, tables);
+        close(fd);
+        return status;
+    }
+
+    // Sampled payload has a code table in each segment
+    if (my_sampled::is_sampled(fd)) {
+        my_sampled::sampled_decode decode;
+        int status = decode.read_header(fd, static_cast<uint64_t>(st.st_size));
+        if (status == 0 && storage != NULL) {
+            status = storage->reserve(decode.original_size());
+        }
+        if (status == 0) {
+            status = decode.decode(fd, sink);
+        }
+        close(fd);
+        tables.codec = CODEC_SAMPLED;
+        tables.table.clear();
+        tables.segments = decode.segment_tables();
+        return status;
+    }
+
+    // Adaptive payload has no code table, its tree is rebuilt as it decodes
+    if (my_adaptive::is_adaptive(fd)) {
+        my_adaptive::adaptive_decode decode;
+        int status = decode.read_header(source);
+        if (status == 0 && storage != NULL) {
+            status = storage->reserve(decode.original_size());
+        }
+        if (status == 0) {
+            status = decode.decode(source, sink);
+        }
+        close(fd);
+        tables.codec = CODEC_ADAPTIVE;
+        tables.table.clear();
+        return status;
+    }
+
+    my_huffman::huffman_decode decode;
+    int status = decode.read_header(source);
+    if (status == 0 && storage != NULL) {
+        status = storage->reserve(decode.original_size());
+    }
+    if (status == 0) {
+        // Split across threads at checkpoints if payload has an index
+        decode.read_index(fd, static_cast<uint64_t>(st.st_size));
+        status = decode.decode_parallel(fd, sink, decode_threads);
+    }
+    close(fd);
+
     if (status < 0) {
-        perror("my_send");
-        cout << "An error has occurred. Terminating connection..." << endl;
         return -1;
     }
 
-    cout << response;
+    tables.codec = CODEC_HUFFMAN;
+    tables.table = decode.char_table;
+    return 0;
+}
+
+static int decode_block_sorted(int fd, uint64_t payload_size, my_io::stream_sink &sink,
+    my_storage::storage_writer *storage, payload_tables &tables)
+{
+    using namespace std;
 
-    fstream file(filename, fstream::out | fstream::binary | fstream::trunc);
-    if (!file.is_open()) {
-        cout << "Failed to open file " << filename << "." << endl;
-        cout << "An error has occurred. Terminating connection..." << endl;
+    my_bwt::bwt_decode decode;
+    if (decode.read_header(fd, payload_size) < 0 ||
+        (storage != NULL && storage->reserve(decode.original_size()) < 0)) {
         return -1;
     }
+    tables.codec = CODEC_BLOCK_SORTED;
+    tables.block_size = decode.block_size();
+    tables.table.clear();
 
-    // Decode file
-    codefile.close();
-    codefile.open(codefilename, fstream::in | fstream::binary);
-    my_huffman::huffman_decode decode(codefile);
-    decode.write(file);
-
-    // Write code table to codefile
-    codefile.close();
-    codefile.open(codefilename, fstream::out | fstream::binary | fstream::trunc);
+    // One block is charged with the decode, more threads only if memory
+    // is free now, so decodes never wait for each other
+    unsigned int threads = 1;
+    while (threads < decode_threads && memory_budget->try_acquire(my_bwt::BLOCK_MEMORY)) {
+        threads += 1;
+    }
+
+    int status = decode.decode(fd, sink, threads);
+    if (threads > 1) {
+        memory_budget->release((threads - 1) * my_bwt::BLOCK_MEMORY);
+    }
+    return status;
+}
+
+static void write_code_table(std::ostream &output, const code_table &table)
+{
+    using namespace std;
+
+    TRACE_SPAN("write_code_table");
+
+    // Tables of order 1 follow one another, 256 chars each
     int char_code = 0;
-    for (auto &code : decode.char_table) {
+    for (auto &code : table) {
+        if (table.size() > 256 && char_code % 256 == 0) {
+            output << "table " << char_code / 256 << ":\n";
+        }
         string s(code.size(), '0');
         for (unsigned int i = 0; i < code.size(); ++i) {
             if (code[i]) {
                 s[i] = '1';
             }
         }
-        codefile << char_code++ << ": " << s << endl;
+        output << char_code++ % 256 << ": " << s << '\n';
     }
+}
 
-    cout << "Uncompressed file size: " << file.tellp() << " bytes. ";
-    cout.precision(2);
-    cout.setf(ios::fixed);
-    cout << "Compression ratio: " << static_cast<double>(filesize) * 100.0 / static_cast<double>(file.tellp()) << "%." << endl;
-    cout << "Huffman coding table is saved in " << codefilename << " ." << endl;
-    return 0;
+static void save_code_tables(const std::string &codefilename, const payload_tables &tables, std::ostream &log)
+{
+    using namespace std;
+
+    my_stats::phase_timer timer(my_stats::PHASE_WRITE);
+
+    // Tables of block-sorted payload code symbols of its transform, which
+    // mean nothing as chars, so there is no table to save
+    if (tables.codec == CODEC_BLOCK_SORTED) {
+        remove(codefilename.c_str());
+        log << "Block-sorted in blocks of " << tables.block_size << " bytes, each with a code table of its own. "
+        "No coding table is saved." << endl;
+        return;
+    }
+    if (tables.codec == CODEC_ADAPTIVE) {
+        remove(codefilename.c_str());
+        log << "Adaptive Huffman coded, with no coding table to save." << endl;
+        return;
+    }
+    if (tables.codec == CODEC_NONE) {
+        remove(codefilename.c_str());
+        log << "No bytes are Huffman coded, no coding table is saved." << endl;
+        return;
+    }
+
+    fstream codefile(codefilename, fstream::out | fstream::binary | fstream::trunc);
+
+    // Segments follow one another, as stripes do
+    if (tables.codec == CODEC_SAMPLED) {
+        for (size_t i = 0; i < tables.segments.size(); ++i) {
+            codefile << "Segment " << i << ":\n";
+            write_code_table(codefile, tables.segments[i]);
+        }
+        log << "Huffman coding tables of " << tables.segments.size() << " segments are saved in " << codefilename << " ." << endl;
+        return;
+    }
+
+    write_code_table(codefile, tables.table);
+    log << "Huffman coding table is saved in " << codefilename << " ." << endl;
 }
 
-static int serve_client()
+static int decode_file(const std::string &filename, const std::string &codefilename, long long filesize, std::ostream &log,
+    int payload_fd)
 {
     using namespace std;
 
-    while (true) {
-        char orig_cmd[MAX_CMD];
-        int cmdlen = MAX_CMD;
-        int status = my_recv_cmd(clientfd, orig_cmd, &cmdlen);
-        if (status > 0) {
-            if (cmdlen == 0) {
-                // cmdlen == 0 means connection closed by peer.
-                break;
-            }
-            cout << "Invalid command received. Terminating connection..." << endl;
-            return -1;
+    // Decoded into <filename>.<n>.part, which replaces file when complete
+    my_storage::storage_writer writer(filename, storage_mode);
+    if (!writer.is_open()) {
+        log << "Failed to open file " << filename << "." << endl;
+        if (payload_fd >= 0) {
+            close(payload_fd);
         }
-        else if (status < 0) {
-            perror("my_recv_cmd");
+        return -1;
+    }
+    ostream file(&writer);
+
+    // Decode file
+    payload_tables tables;
+    if (decode_payload(codefilename, file, tables, &writer, payload_fd) < 0) {
+        log << "Failed to decode file " << filename << "." << endl;
+        return -1;
+    }
+
+    {
+        my_stats::phase_timer timer(my_stats::PHASE_WRITE);
+
+        if (writer.commit() < 0) {
+            log << "Failed to write file " << filename << "." << endl;
             return -1;
         }
+    }
 
-        orig_cmd[cmdlen - 1] = '\0';
+    long long original_size = static_cast<long long>(writer.size());
+    my_stats::add(my_stats::FILES);
+    my_stats::add(my_stats::COMPRESSED_BYTES, static_cast<uint64_t>(filesize));
+    my_stats::add(my_stats::ORIGINAL_BYTES, static_cast<uint64_t>(original_size));
 
-        vector<string> cmd = parse_command(orig_cmd);
-        if (cmd.size() == 0) {
-            continue;
+    log << "Uncompressed file size: " << original_size << " bytes. ";
+    log.precision(2);
+    log.setf(ios::fixed);
+    log << "Compression ratio: " << static_cast<double>(filesize) * 100.0 / static_cast<double>(original_size) << "%." << endl;
+
+    // Write code tables to codefile
+    save_code_tables(codefilename, tables, log);
+    return 0;
+}
+
+static int receive_file(client_conn &conn, std::vector<std::string> &cmd, const char *orig_cmd)
+{
+    using namespace std;
+
+    if (cmd.size() < 3) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    long long filesize;
+    try {
+        filesize = stoll(cmd[1]);
+    }
+    catch (exception &e) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    // Filename is the rest of command
+    string filename = command_tail(orig_cmd, 2);
+
+    return store_file(conn, filename, filesize, false);
+}
+
+static int store_file(client_conn &conn, const std::string &filename, long long filesize, bool binary)
+{
+    using namespace std;
+
+    if (filename.empty() || filesize < 0) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    string codefilename = filename + ".code";
+
+    locked_cout() << "Receiving " << filename << " ..." << endl;
+
+    // Payload of a local connection is decoded from memfd it comes in
+    int payload_fd;
+    if (receive_payload(conn, codefilename, filesize, &payload_fd) < 0) {
+        locked_cout() << "An error has occurred. Terminating connection..." << endl;
+        return -1;
+    }
+
+    return decode_received(conn, filename, filesize, binary, payload_fd);
+}
+
+static int decode_received(client_conn &conn, const std::string &filename, long long filesize, bool binary,
+    int payload_fd)
+{
+    using namespace std;
+
+    string codefilename = filename + ".code";
+    string response = "OK " + to_string(filesize) + " bytes received.\n";
+    int status;
+    if (binary) {
+        status = send_frame_response(conn, FRAME_OK, 0, static_cast<uint64_t>(filesize), "");
+    }
+    else {
+        status = send_response(conn, response);
+    }
+    if (status < 0) {
+        perror("my_send");
+        locked_cout() << "An error has occurred. Terminating connection..." << endl;
+        if (payload_fd >= 0) {
+            close(payload_fd);
         }
+        return -1;
+    }
 
-        if (cmd[0] == "send") {
-            if (receive_file(cmd, orig_cmd) < 0) {
-                return -1;
+    ostringstream log;
+    {
+        // Client is not read from while waiting for memory, or its turn
+        my_budget::charge decode_memory(*conn.quota, DECODE_MEMORY);
+        if (!decode_memory.is_charged()) {
+            log << "Decode does not fit into memory quota." << endl;
+            if (payload_fd >= 0) {
+                close(payload_fd);
             }
+            status = -1;
         }
         else {
-            cout << "Invalid command received. Terminating connection..." << endl;
+            my_shaper::decode_turn turn(*conn.flow, static_cast<uint64_t>(filesize));
+            if (turn.waited()) {
+                my_stats::add(my_stats::SHAPER_WAITS);
+            }
+            status = decode_file(filename, codefilename, filesize, log, payload_fd);
+        }
+    }
+
+    locked_cout() << response << log.str();
+    if (status < 0) {
+        locked_cout() << "An error has occurred. Terminating connection..." << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int receive_pipelined(client_conn &conn, std::vector<std::string> &cmd, const char *orig_cmd)
+{
+    using namespace std;
+
+    if (cmd.size() < 4) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    long long filesize;
+    try {
+        filesize = stoll(cmd[2]);
+    }
+    catch (exception &e) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    // Filename is the rest of command after request ID and length
+    string filename = command_tail(orig_cmd, 3);
+
+    return store_pipelined(conn, cmd[1], filename, filesize, false);
+}
+
+static int store_pipelined(client_conn &conn, const std::string &id, const std::string &filename, long long filesize, bool binary)
+{
+    using namespace std;
+
+    if (filename.empty() || filesize < 0) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    string codefilename = filename + ".code";
+
+    locked_cout() << "Receiving " << filename << " (request " << id << ") ..." << endl;
+
+    // Each request gets a payload file of its own, opened here and unlinked,
+    // so a later request of the same file, or the code table written by an
+    // earlier one, cannot touch it while its worker decodes
+    string payloadfilename = filename + "." + to_string(next_payload_id++) + ".code";
+    int payload_fd;
+    if (receive_payload(conn, payloadfilename, filesize, &payload_fd) < 0) {
+        remove(payloadfilename.c_str());
+        locked_cout() << "An error has occurred. Terminating connection..." << endl;
+        return -1;
+    }
+    if (payload_fd < 0) {
+        payload_fd = open(payloadfilename.c_str(), O_RDONLY | O_CLOEXEC);
+        remove(payloadfilename.c_str());
+        if (payload_fd < 0) {
+            locked_cout() << "Failed to open file " << payloadfilename << ". Terminating connection..." << endl;
             return -1;
         }
     }
 
+    // Bound the number of decodes in flight
+    if (conn.workers.size() >= MAX_PIPELINE) {
+        join_workers(conn);
+    }
+
+    // Client is not read from while waiting for memory, so a flood of
+    // uploads is held back by TCP instead of piling up decodes
+    shared_ptr<my_budget::charge> decode_memory(new my_budget::charge(*conn.quota, DECODE_MEMORY));
+
+    client_conn *conn_p = &conn;
+    conn.workers.push_back(thread([conn_p, id, filename, codefilename, filesize, binary, decode_memory, payload_fd]() mutable {
+        ostringstream log;
+        int status;
+        if (!decode_memory->is_charged()) {
+            log << "Decode does not fit into memory quota." << endl;
+            close(payload_fd);
+            status = -1;
+        }
+        else {
+            // Decodes of a connection wait their turns as those of others
+            my_shaper::decode_turn turn(*conn_p->flow, static_cast<uint64_t>(filesize));
+            if (turn.waited()) {
+                my_stats::add(my_stats::SHAPER_WAITS);
+            }
+            status = decode_file(filename, codefilename, filesize, log, payload_fd);
+        }
+        decode_memory.reset();
+
+        string response;
+        if (status < 0) {
+            response = "ERR " + id + " Failed to decode " + filename + ".\n";
+        }
+        else {
+            response = "ACK " + id + " " + to_string(filesize) + " bytes received.\n";
+        }
+
+        if (binary) {
+            uint32_t frame_id = static_cast<uint32_t>(strtoul(id.c_str(), NULL, 10));
+            if (status < 0) {
+                status = send_frame_response(*conn_p, FRAME_ERR, frame_id, 0, "Failed to decode " + filename + ".");
+            }
+            else {
+                status = send_frame_response(*conn_p, FRAME_ACK, frame_id, static_cast<uint64_t>(filesize), "");
+            }
+        }
+        else {
+            status = send_response(*conn_p, response);
+        }
+        if (status < 0) {
+            log << "Failed to acknowledge request " << id << "." << endl;
+        }
+
+        locked_cout() << response << log.str();
+    }));
+
     return 0;
 }
+
+static int receive_stripe(client_conn &conn, std::vector<std::string> &cmd, const char *orig_cmd)
+{
+    using namespace std;
+
+    // stripe <xfer-id> <count> <index> <offset> <total> <length> <filename>
+    if (cmd.size() < 8) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    string xfer_id = cmd[1];
+    int count, index;
+    long long offset, total, filesize;
+    try {
+        count = stoi(cmd[2]);
+        index = stoi(cmd[3]);
+        offset = stoll(cmd[4]);
+        total = stoll(cmd[5]);
+        filesize = stoll(cmd[6]);
+    }
+    catch (exception &e) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    // Transfer ID names payload files of stripes, so it is checked as resumable ones are
+    if (!my_resume::is_valid_id(xfer_id) || count <= 0 || count > MAX_STRIPES || index < 0 || index >= count ||
+        offset < 0 || offset > total || filesize < 0) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    // Filename is the rest of command after length
+    string filename = command_tail(orig_cmd, 7);
+    if (filename.empty()) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    // Join the transfer, or start it if this is the first stripe arrived
+    {
+        lock_guard<mutex> lock(transfers_mutex);
+
+        auto it = transfers.find(xfer_id);
+        if (it == transfers.end()) {
+            // Target is left as it is until every stripe is decoded
+            string part_path = my_storage::part_path(filename);
+            int part_fd = open(part_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (part_fd < 0) {
+                locked_cout() << "Failed to open file " << part_path << "." << endl;
+                locked_cout() << "An error has occurred. Terminating connection..." << endl;
+                return -1;
+            }
+
+            stripe_transfer &xfer = transfers[xfer_id];
+            xfer.id = xfer_id;
+            xfer.filename = filename;
+            xfer.count = count;
+            xfer.total = total;
+            xfer.arrived.assign(count, false);
+            xfer.active = 0;
+            xfer.done = 0;
+            xfer.failed = false;
+            xfer.received = 0;
+            xfer.tables.resize(count);
+            xfer.part_path = part_path;
+            xfer.part_fd = part_fd;
+            xfer.idle.data = &xfer;
+            it = transfers.find(xfer_id);
+
+            locked_cout() << "Receiving " << filename << " in " << count << " stripes (transfer " << xfer_id << ") ..." << endl;
+        }
+        else if (it->second.filename != filename || it->second.count != count || it->second.total != total) {
+            locked_cout() << "Stripe does not match transfer " << xfer_id << ". Terminating connection..." << endl;
+            return -1;
+        }
+        else if (it->second.arrived[index]) {
+            locked_cout() << "Stripe " << index << " of transfer " << xfer_id << " has arrived already. Terminating connection..." << endl;
+            return -1;
+        }
+
+        it->second.arrived[index] = true;
+        it->second.active += 1;
+        transfer_wheel->cancel(it->second.idle);
+    }
+
+    string codefilename = filename + "." + xfer_id + "." + to_string(index) + ".code";
+    payload_tables tables;
+
+    if (receive_payload(conn, codefilename, filesize) < 0) {
+        remove(codefilename.c_str());
+        finish_stripe(xfer_id, index, false, filesize, tables.table);
+        locked_cout() << "An error has occurred. Terminating connection..." << endl;
+        return -1;
+    }
+
+    string response = "OK " + to_string(filesize) + " bytes received.\n";
+    if (send_response(conn, response) < 0) {
+        perror("my_send");
+    }
+
+    // Stripe covers as many bytes as its payload begins with, which must be
+    // within the file and clear of other stripes
+    int status = -1;
+    int part_fd = -1;
+    uint32_t length = 0;
+    int codefd = open(codefilename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (codefd >= 0) {
+        my_io::pread_source header(codefd, 0, sizeof (length));
+        if (header.read(&length, sizeof (length)) == sizeof (length)) {
+            length = ntohl(length);
+            lock_guard<mutex> lock(transfers_mutex);
+            auto it = transfers.find(xfer_id);
+            if (it != transfers.end() && claim_stripe_range(it->second, offset, length) == 0) {
+                part_fd = it->second.part_fd;
+            }
+        }
+        close(codefd);
+    }
+    if (part_fd < 0) {
+        locked_cout() << "Stripe " << index << " of " << filename << " is out of its range." << endl;
+    }
+
+    // Decode stripe into its range of part file, which it cannot write past
+    if (part_fd >= 0) {
+        my_storage::range_writer range(part_fd, static_cast<uint64_t>(offset), length);
+        ostream file(&range);
+        {
+            my_budget::charge decode_memory(*conn.quota, DECODE_MEMORY);
+            if (!decode_memory.is_charged()) {
+                status = -1;
+            }
+            else {
+                my_shaper::decode_turn turn(*conn.flow, static_cast<uint64_t>(filesize));
+                if (turn.waited()) {
+                    my_stats::add(my_stats::SHAPER_WAITS);
+                }
+                status = decode_payload(codefilename, file, tables);
+            }
+        }
+        if (status == 0 && (range.flush() < 0 || range.size() != length)) {
+            status = -1;
+        }
+        if (status < 0) {
+            locked_cout() << "Failed to decode stripe " << index << " of " << filename << "." << endl;
+        }
+    }
+    remove(codefilename.c_str());
+
+    finish_stripe(xfer_id, index, status == 0, filesize, tables.table);
+    return status;
+}
+
+static int claim_stripe_range(stripe_transfer &xfer, long long offset, long long length)
+{
+    if (offset + length > xfer.total) {
+        return -1;
+    }
+
+    for (auto &range : xfer.ranges) {
+        if (offset < range.first + range.second && range.first < offset + length) {
+            return -1;
+        }
+    }
+
+    xfer.ranges.push_back(std::make_pair(offset, length));
+    return 0;
+}
+
+static void finish_stripe(const std::string &xfer_id, int index, bool succeed, long long filesize, code_table &table)
+{
+    using namespace std;
+
+    lock_guard<mutex> lock(transfers_mutex);
+
+    auto it = transfers.find(xfer_id);
+    if (it == transfers.end()) {
+        return;
+    }
+
+    stripe_transfer &xfer = it->second;
+    xfer.active -= 1;
+    xfer.done += 1;
+    xfer.received += filesize;
+    if (!succeed) {
+        xfer.failed = true;
+    }
+    else {
+        xfer.tables[index].swap(table);
+    }
+
+    // Stripes still to come may never do, if client has gone
+    if (xfer.done < xfer.count) {
+        if (xfer.active == 0) {
+            transfer_wheel->schedule(xfer.idle, my_timer::current_tick() +
+                STRIPE_IDLE_SECONDS * 1000 / my_timer::TICK_MS);
+        }
+        return;
+    }
+
+    // Every index has arrived once, and ranges do not overlap, so they cover
+    // the file if their lengths add up to it
+    long long covered = 0;
+    for (auto &range : xfer.ranges) {
+        covered += range.second;
+    }
+    if (!xfer.failed && covered != xfer.total) {
+        locked_cout() << "Stripes of " << xfer.filename << " cover " << covered << " of " << xfer.total << " bytes." << endl;
+        xfer.failed = true;
+    }
+
+    if (!xfer.failed && (close(xfer.part_fd) < 0 || rename(xfer.part_path.c_str(), xfer.filename.c_str()) < 0)) {
+        perror("rename");
+        xfer.failed = true;
+    }
+    else if (!xfer.failed) {
+        xfer.part_fd = -1;
+    }
+
+    if (xfer.failed) {
+        locked_cout() << "Striped transfer of " << xfer.filename << " failed." << endl;
+        drop_transfer(it);
+        return;
+    }
+
+    // Write code tables of all stripes to codefile
+    string codefilename = xfer.filename + ".code";
+    {
+        my_stats::phase_timer timer(my_stats::PHASE_WRITE);
+
+        fstream codefile(codefilename, fstream::out | fstream::binary | fstream::trunc);
+        for (int i = 0; i < xfer.count; ++i) {
+            codefile << "Stripe " << i << ":\n";
+            write_code_table(codefile, xfer.tables[i]);
+        }
+    }
+
+    my_stats::add(my_stats::FILES);
+    my_stats::add(my_stats::COMPRESSED_BYTES, static_cast<uint64_t>(xfer.received));
+    my_stats::add(my_stats::ORIGINAL_BYTES, static_cast<uint64_t>(xfer.total));
+
+    ostringstream log;
+    log << "OK " << xfer.received << " bytes received in " << xfer.count << " stripes." << endl;
+    log << "Uncompressed file size: " << xfer.total << " bytes. ";
+    log.precision(2);
+    log.setf(ios::fixed);
+    log << "Compression ratio: " << static_cast<double>(xfer.received) * 100.0 / static_cast<double>(xfer.total) << "%." << endl;
+    log << "Huffman coding table is saved in " << codefilename << " ." << endl;
+    locked_cout() << log.str();
+
+    drop_transfer(it);
+}
+
+static void drop_transfer(std::map<std::string, stripe_transfer>::iterator it)
+{
+    stripe_transfer &xfer = it->second;
+    transfer_wheel->cancel(xfer.idle);
+    if (xfer.part_fd >= 0) {
+        close(xfer.part_fd);
+        unlink(xfer.part_path.c_str());
+    }
+    transfers.erase(it);
+}
+
+static int expire_transfers()
+{
+    using namespace std;
+
+    lock_guard<mutex> lock(transfers_mutex);
+
+    vector<my_timer::timer *> expired;
+    transfer_wheel->advance(my_timer::current_tick(), expired);
+    for (my_timer::timer *t : expired) {
+        stripe_transfer &xfer = *static_cast<stripe_transfer *>(t->data);
+        locked_cout() << "Striped transfer of " << xfer.filename << " expired with " << xfer.done << " of " <<
+        xfer.count << " stripes." << endl;
+        drop_transfer(transfers.find(xfer.id));
+    }
+
+    return (transfer_wheel->size() > 0) ? static_cast<int>(my_timer::TICK_MS) : -1;
+}
+
+static int send_signatures(client_conn &conn, std::vector<std::string> &cmd, const char *orig_cmd)
+{
+    using namespace std;
+
+    if (cmd.size() < 2) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    // Filename is the rest of command
+    string filename = command_tail(orig_cmd, 1);
+
+    // No signatures if server does not have the file
+    uint32_t block_size = 0;
+    vector<my_delta::block_signature> sigs;
+
+    ifstream file(filename, fstream::in | fstream::binary);
+    if (file.is_open()) {
+        file.seekg(0, file.end);
+        block_size = my_delta::choose_block_size(static_cast<uint64_t>(file.tellg()));
+        file.seekg(0);
+        if (my_delta::make_signatures(file, block_size, sigs) < 0) {
+            sigs.clear();
+        }
+    }
+
+    string response = "SIG " + to_string(block_size) + " " + to_string(sigs.size()) + "\n";
+    my_delta::pack_signatures(sigs, response);
+
+    if (send_response(conn, response) < 0) {
+        perror("my_send");
+        locked_cout() << "An error has occurred. Terminating connection..." << endl;
+        return -1;
+    }
+
+    locked_cout() << "Sent " << sigs.size() << " block signatures of " << filename << "." << endl;
+    return 0;
+}
+
+static int receive_delta(client_conn &conn, std::vector<std::string> &cmd, const char *orig_cmd)
+{
+    using namespace std;
+
+    if (cmd.size() < 3) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    long long filesize;
+    try {
+        filesize = stoll(cmd[1]);
+    }
+    catch (exception &e) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    // Filename is the rest of command after length
+    string filename = command_tail(orig_cmd, 2);
+    if (filename.empty() || filesize < 0) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+    string deltafilename = filename + ".delta";
+
+    locked_cout() << "Receiving delta of " << filename << " ..." << endl;
+
+    if (receive_payload(conn, deltafilename, filesize) < 0) {
+        remove(deltafilename.c_str());
+        locked_cout() << "An error has occurred. Terminating connection..." << endl;
+        return -1;
+    }
+
+    ostringstream log;
+    int status;
+    {
+        my_shaper::decode_turn turn(*conn.flow, static_cast<uint64_t>(filesize));
+        if (turn.waited()) {
+            my_stats::add(my_stats::SHAPER_WAITS);
+        }
+        status = apply_delta_file(filename, deltafilename, filesize, log, *conn.quota);
+    }
+    remove(deltafilename.c_str());
+
+    // Failure to apply is not fatal, client may send the whole file instead
+    string response;
+    if (status < 0) {
+        response = "ERR Failed to apply delta of " + filename + ".\n";
+    }
+    else {
+        response = "OK " + to_string(filesize) + " bytes received.\n";
+    }
+
+    locked_cout() << response << log.str();
+
+    if (send_response(conn, response) < 0) {
+        perror("my_send");
+        locked_cout() << "An error has occurred. Terminating connection..." << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int apply_delta_file(const std::string &filename, const std::string &deltafilename, long long filesize,
+    std::ostream &log, my_budget::quota &quota)
+{
+    using namespace std;
+
+    fstream deltafile(deltafilename, fstream::in | fstream::binary);
+    if (!deltafile.is_open()) {
+        log << "Failed to open file " << deltafilename << "." << endl;
+        return -1;
+    }
+
+    my_delta::delta_header header;
+    vector<my_delta::delta_op> ops;
+    if (my_delta::unpack_delta(deltafile, header, ops) < 0) {
+        log << "Invalid delta." << endl;
+        return -1;
+    }
+
+    uint64_t literal_size = 0;
+    for (auto &op : ops) {
+        if (op.type == my_delta::OP_LITERAL) {
+            literal_size += op.a;
+        }
+    }
+
+    my_budget::charge decode_memory(quota, DECODE_MEMORY);
+    if (!decode_memory.is_charged()) {
+        log << "Decode does not fit into memory quota." << endl;
+        return -1;
+    }
+
+    // Literals are Huffman coded, right after delta operations. They are
+    // decoded into a file of their own, unlinked once open, and read back a
+    // block at a time, so memory does not grow with them.
+    string literalfilename = deltafilename + ".literal";
+    fstream literals(literalfilename, fstream::in | fstream::out | fstream::binary | fstream::trunc);
+    remove(literalfilename.c_str());
+    if (!literals.is_open()) {
+        log << "Failed to open file " << literalfilename << "." << endl;
+        return -1;
+    }
+
+    // Literals have a Huffman coding table, a delta of none has no table
+    payload_tables tables;
+    tables.codec = CODEC_NONE;
+    if (literal_size > 0) {
+        my_huffman::huffman_decode decode(deltafile);
+        if (decode.original_size() != literal_size) {
+            log << "Invalid delta." << endl;
+            return -1;
+        }
+        if (decode.write(literals) < 0 || !literals.flush()) {
+            log << "Failed to decode literals." << endl;
+            return -1;
+        }
+        tables.codec = CODEC_HUFFMAN;
+        tables.table = decode.char_table;
+    }
+
+    if (static_cast<uint64_t>(literals.tellp()) != literal_size) {
+        log << "Invalid delta." << endl;
+        return -1;
+    }
+    literals.seekg(0);
+
+    ifstream old_file(filename, fstream::in | fstream::binary);
+    if (!old_file.is_open()) {
+        log << "Failed to open file " << filename << "." << endl;
+        return -1;
+    }
+    old_file.seekg(0, old_file.end);
+    uint32_t block_count = static_cast<uint32_t>(static_cast<uint64_t>(old_file.tellg()) / header.block_size);
+
+    // Rebuild into <filename>.<n>.part, and replace the old copy when verified
+    my_storage::storage_writer writer(filename, storage_mode);
+    if (!writer.is_open() || writer.reserve(header.file_size) < 0) {
+        log << "Failed to open file " << filename << "." << endl;
+        return -1;
+    }
+    ostream tmpfile(&writer);
+
+    uint64_t file_hash = 0;
+    int64_t written = my_delta::apply_delta(old_file, block_count, header.block_size, ops, literals, tmpfile, file_hash);
+    old_file.close();
+
+    if (written < 0 || static_cast<uint64_t>(written) != header.file_size || file_hash != header.file_hash) {
+        log << "Rebuilt file does not match." << endl;
+        return -1;
+    }
+
+    if (writer.commit() < 0) {
+        log << "Failed to replace file " << filename << "." << endl;
+        return -1;
+    }
+
+    my_stats::add(my_stats::FILES);
+    my_stats::add(my_stats::COMPRESSED_BYTES, static_cast<uint64_t>(filesize));
+    my_stats::add(my_stats::ORIGINAL_BYTES, static_cast<uint64_t>(written));
+
+    log << "Rebuilt file size: " << written << " bytes, " << (written - static_cast<int64_t>(literal_size)) <<
+    " bytes reused, " << literal_size << " bytes literal. ";
+    log.precision(2);
+    log.setf(ios::fixed);
+    log << "Transfer ratio: " << static_cast<double>(filesize) * 100.0 / static_cast<double>(written > 0 ? written : 1) << "%." << endl;
+    save_code_tables(filename + ".code", tables, log);
+    return 0;
+}
+
+static int receive_archive(client_conn &conn, std::vector<std::string> &cmd, const char *orig_cmd)
+{
+    using namespace std;
+
+    if (cmd.size() < 3) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    long long filesize;
+    try {
+        filesize = stoll(cmd[1]);
+    }
+    catch (exception &e) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    // Name of archive only names its code table, files carry their own paths
+    string name = command_tail(orig_cmd, 2);
+    if (filesize < 0 || !my_archive::is_safe_path(name) || name.find('/') != string::npos) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+    string codefilename = name + ".code";
+
+    locked_cout() << "Receiving archive " << name << " ..." << endl;
+
+    if (receive_payload(conn, codefilename, filesize) < 0) {
+        remove(codefilename.c_str());
+        locked_cout() << "An error has occurred. Terminating connection..." << endl;
+        return -1;
+    }
+
+    ostringstream log;
+    int status;
+    {
+        my_budget::charge decode_memory(*conn.quota, DECODE_MEMORY);
+        if (!decode_memory.is_charged()) {
+            log << "Decode does not fit into memory quota." << endl;
+            status = -1;
+        }
+        else {
+            my_shaper::decode_turn turn(*conn.flow, static_cast<uint64_t>(filesize));
+            if (turn.waited()) {
+                my_stats::add(my_stats::SHAPER_WAITS);
+            }
+            status = unpack_archive(codefilename, filesize, log);
+        }
+    }
+    if (status < 0) {
+        remove(codefilename.c_str());
+    }
+
+    // Files before a broken one are kept, client may send archive again
+    string response;
+    if (status < 0) {
+        response = "ERR Failed to unpack " + name + ".\n";
+    }
+    else {
+        response = "OK " + to_string(filesize) + " bytes received.\n";
+    }
+
+    locked_cout() << response << log.str();
+
+    if (send_response(conn, response) < 0) {
+        perror("my_send");
+        locked_cout() << "An error has occurred. Terminating connection..." << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int unpack_archive(const std::string &codefilename, long long filesize, std::ostream &log)
+{
+    using namespace std;
+
+    my_archive::archive_writer writer(storage_mode);
+    ostream output(&writer);
+
+    payload_tables tables;
+    int status = decode_payload(codefilename, output, tables);
+    if (writer.finish() < 0) {
+        log << writer.error() << endl;
+        return -1;
+    }
+    if (status < 0) {
+        log << "Failed to decode archive." << endl;
+        return -1;
+    }
+
+    long long original_size = static_cast<long long>(writer.bytes());
+    my_stats::add(my_stats::FILES, writer.count());
+    my_stats::add(my_stats::COMPRESSED_BYTES, static_cast<uint64_t>(filesize));
+    my_stats::add(my_stats::ORIGINAL_BYTES, static_cast<uint64_t>(original_size));
+
+    log << "Unpacked " << writer.count() << " files, " << original_size << " bytes. ";
+    log.precision(2);
+    log.setf(ios::fixed);
+    log << "Compression ratio: " << static_cast<double>(filesize) * 100.0 / static_cast<double>(original_size ? original_size : 1) << "%." << endl;
+
+    save_code_tables(codefilename, tables, log);
+    return 0;
+}
+
+static int send_resume_offset(client_conn &conn, std::vector<std::string> &cmd, const char *orig_cmd)
+{
+    using namespace std;
+
+    // Payloads of local connections are never cut short by a link
+    if (cmd.size() < 4 || conn.local) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    long long total;
+    try {
+        total = stoll(cmd[2]);
+    }
+    catch (exception &e) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    // Filename is the rest of command after total
+    string id = cmd[1];
+    string filename = command_tail(orig_cmd, 3);
+    if (!my_resume::is_valid_id(id) || filename.empty() || total < 0) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    long long offset = partial_uploads->offset(id, static_cast<uint64_t>(total), filename, conn.fd);
+    string response;
+    if (offset < 0) {
+        response = "ERR Upload " + id + " is busy.\n";
+    }
+    else {
+        response = "OFFSET " + to_string(offset) + "\n";
+        locked_cout() << "Upload " << id << " of " << filename << " has " << offset << " of " << total << " bytes." << endl;
+    }
+
+    if (send_response(conn, response) < 0) {
+        perror("my_send");
+        locked_cout() << "An error has occurred. Terminating connection..." << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int receive_resumable(client_conn &conn, std::vector<std::string> &cmd, const char *orig_cmd)
+{
+    using namespace std;
+
+    if (cmd.size() < 5 || conn.local) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    long long offset, total;
+    try {
+        offset = stoll(cmd[2]);
+        total = stoll(cmd[3]);
+    }
+    catch (exception &e) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    // Filename is the rest of command after total
+    string id = cmd[1];
+    string filename = command_tail(orig_cmd, 4);
+    if (!my_resume::is_valid_id(id) || filename.empty() || offset < 0 || total < offset) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    // Payload follows command, so an offset server does not have can only be
+    // refused by closing; client asks for it again on a new connection
+    my_resume::partial_upload upload(*partial_uploads);
+    if (upload.open(id, static_cast<uint64_t>(offset), static_cast<uint64_t>(total), filename, conn.fd) < 0) {
+        locked_cout() << "Upload " << id << " can not continue from " << offset << ". Terminating connection..." << endl;
+        return -1;
+    }
+
+    locked_cout() << "Receiving " << filename << " from " << offset << " of " << total << " bytes ..." << endl;
+
+    int status = 0;
+    {
+        my_deadline::phase_scope transfer(*conn.deadline, my_deadline::PHASE_TRANSFER);
+        my_stats::phase_timer timer(my_stats::PHASE_RECEIVE);
+
+        long long received = offset;
+        vector<uint8_t> buf(static_cast<size_t>(server_tuning.chunk));
+        while (received < total) {
+            int chunk = server_tuning.chunk;
+            int buflen = (total - received < chunk) ? static_cast<int>(total - received) : chunk;
+            {
+                TRACE_SPAN("recv");
+                status = my_recv_data(conn.fd, buf.data(), &buflen);
+            }
+            if (status < 0) {
+                perror("my_recv_data");
+                break;
+            }
+
+            if (buflen == 0) {
+                locked_cout() << "Connection closed by peer." << endl;
+                status = -1;
+                break;
+            }
+
+            received += buflen;
+            my_stats::add(my_stats::BYTES_RECEIVED, static_cast<uint64_t>(buflen));
+
+            {
+                TRACE_SPAN("write_code");
+                status = upload.write(buf.data(), static_cast<size_t>(buflen));
+            }
+            if (status < 0) {
+                locked_cout() << "Failed to save upload " << id << "." << endl;
+                break;
+            }
+
+            if (conn.flow->transfer(static_cast<uint64_t>(buflen))) {
+                my_stats::add(my_stats::SHAPER_WAITS);
+            }
+        }
+    }
+
+    // What was received is synced as upload goes out of scope
+    int payload_fd = (status < 0) ? -1 : upload.finish();
+    if (payload_fd < 0) {
+        locked_cout() << "An error has occurred. Terminating connection..." << endl;
+        return -1;
+    }
+
+    return decode_received(conn, filename, total, false, payload_fd);
+}
+
+static void join_workers(client_conn &conn)
+{
+    for (auto &worker : conn.workers) {
+        worker.join();
+    }
+    conn.workers.clear();
+}
+
+static int send_stats(client_conn &conn)
+{
+    std::string metrics = my_stats::render();
+
+    if (send_response(conn, "STATS " + std::to_string(metrics.size()) + "\n" + metrics) < 0) {
+        perror("my_send");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int send_encoded(client_conn &conn, const char *orig_cmd)
+{
+    using namespace std;
+
+    // Filename is the rest of command, and only files in server directory
+    string filename = command_tail(orig_cmd, 1);
+    bool valid = !filename.empty() && filename.find('/') == string::npos && filename != "." && filename != "..";
+
+    bool hit = false;
+    shared_ptr<my_cache::cache_object> object;
+    if (valid) {
+        object = encoded_cache->get(filename, hit);
+    }
+
+    int fd = (object != NULL) ? open(object->path.c_str(), O_RDONLY) : -1;
+    if (fd < 0) {
+        locked_cout() << "Failed to read file " << filename << "." << endl;
+        if (send_response(conn, "ERR No such file " + filename + ".\n") < 0) {
+            perror("my_send");
+            return -1;
+        }
+        return 0;
+    }
+
+    int status = 0;
+    {
+        lock_guard<mutex> lock(conn.send_mutex);
+        my_sockopt::cork_guard cork(conn.fd, server_tuning);
+
+        my_deadline::phase_scope transfer(*conn.deadline, my_deadline::PHASE_TRANSFER);
+
+        string header = "GET " + to_string(object->size) + "\n";
+        int sendlen = static_cast<int>(header.size());
+        status = my_send(conn.fd, header.c_str(), &sendlen);
+        if (status == 0) {
+            status = sendfile_all(conn, fd, 0, object->size);
+        }
+    }
+    close(fd);
+
+    if (status < 0) {
+        perror("sendfile");
+        locked_cout() << "An error has occurred. Terminating connection..." << endl;
+        return -1;
+    }
+
+    my_stats::add(my_stats::DOWNLOADS);
+    my_stats::add(my_stats::BYTES_SENT, object->size);
+    if (hit) {
+        my_stats::add(my_stats::CACHE_HITS);
+    }
+
+    locked_cout() << "Sent " << filename << " (" << object->size << " bytes encoded, cache " <<
+    (hit ? "hit" : "miss") << ")." << endl;
+    return 0;
+}
+
+static int send_range(client_conn &conn, std::vector<std::string> &cmd, const char *orig_cmd)
+{
+    using namespace std;
+
+    // range <offset> <length> <filename>
+    long long offset = -1, length = -1;
+    if (cmd.size() >= 4) {
+        try {
+            offset = stoll(cmd[1]);
+            length = stoll(cmd[2]);
+        }
+        catch (exception &e) {
+            offset = -1;
+        }
+    }
+    if (offset < 0 || length < 0) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+
+    // Filename is the rest of command, and only files in server directory
+    string filename = command_tail(orig_cmd, 3);
+    bool valid = !filename.empty() && filename.find('/') == string::npos && filename != "." && filename != "..";
+
+    bool hit = false;
+    shared_ptr<my_cache::cache_object> object;
+    if (valid) {
+        object = encoded_cache->get(filename, hit);
+    }
+
+    int fd = (object != NULL) ? open(object->path.c_str(), O_RDONLY) : -1;
+
+    // Cached files have an index, so only the checkpoints around range are read
+    my_huffman::huffman_decode decode;
+    my_huffman::range_location location;
+    string error;
+    if (fd < 0) {
+        error = "No such file " + filename + ".";
+    }
+    else {
+        my_io::fd_source source(fd);
+        if (decode.read_header(source) < 0) {
+            error = "Failed to read file " + filename + ".";
+        }
+        else {
+            decode.read_index(fd, object->size);
+            if (static_cast<unsigned long long>(offset) > decode.original_size()) {
+                error = "Range is beyond end of " + filename + ".";
+            }
+            else {
+                uint64_t rest = decode.original_size() - static_cast<uint64_t>(offset);
+                if (static_cast<unsigned long long>(length) > rest) {
+                    length = static_cast<long long>(rest);
+                }
+                decode.locate(static_cast<uint64_t>(offset), static_cast<uint64_t>(length), location);
+            }
+        }
+    }
+
+    if (!error.empty()) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        locked_cout() << error << endl;
+        if (send_response(conn, "ERR " + error + "\n") < 0) {
+            perror("my_send");
+            return -1;
+        }
+        return 0;
+    }
+
+    // RANGE <offset> <length> <skip bits> <skip chars> <bytes> [<context>],
+    // followed by header and the encoded data covering range
+    uint64_t bytes = decode.header_size() + (location.end - location.begin);
+    int status = 0;
+    {
+        lock_guard<mutex> lock(conn.send_mutex);
+        my_sockopt::cork_guard cork(conn.fd, server_tuning);
+        my_deadline::phase_scope transfer(*conn.deadline, my_deadline::PHASE_TRANSFER);
+
+        string header = "RANGE " + to_string(offset) + " " + to_string(length) + " " + to_string(location.skip_bits) +
+            " " + to_string(location.skip) + " " + to_string(bytes) +
+            ((decode.table_count() > 1) ? " " + to_string(location.context) : string()) + "\n";
+        int sendlen = static_cast<int>(header.size());
+        status = my_send(conn.fd, header.c_str(), &sendlen);
+        if (status == 0) {
+            status = sendfile_all(conn, fd, 0, decode.header_size());
+        }
+        if (status == 0) {
+            status = sendfile_all(conn, fd, static_cast<off_t>(location.begin), location.end - location.begin);
+        }
+    }
+    close(fd);
+
+    if (status < 0) {
+        perror("sendfile");
+        locked_cout() << "An error has occurred. Terminating connection..." << endl;
+        return -1;
+    }
+
+    my_stats::add(my_stats::DOWNLOADS);
+    my_stats::add(my_stats::BYTES_SENT, bytes);
+    if (hit) {
+        my_stats::add(my_stats::CACHE_HITS);
+    }
+
+    locked_cout() << "Sent " << length << " bytes from " << offset << " of " << filename << " (" << bytes <<
+    " of " << object->size << " bytes encoded, cache " << (hit ? "hit" : "miss") << ")." << endl;
+    return 0;
+}
+
+static int sendfile_all(client_conn &conn, int fd, off_t offset, uint64_t length)
+{
+    off_t end = offset + static_cast<off_t>(length);
+    while (offset < end) {
+        ssize_t sent = sendfile(conn.fd, fd, &offset, static_cast<size_t>(end - offset));
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        conn.deadline->progress(static_cast<int>(sent));
+    }
+
+    return 0;
+}
+
+static int send_trace(client_conn &conn)
+{
+    std::ostringstream trace;
+    my_trace::dump(trace);
+
+    if (send_response(conn, "TRACE " + std::to_string(trace.str().size()) + "\n" + trace.str()) < 0) {
+        perror("my_send");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int negotiate_protocol(client_conn &conn, std::vector<std::string> &cmd)
+{
+    using namespace std;
+
+    int version = 0;
+    if (cmd.size() >= 2) {
+        version = atoi(cmd[1].c_str());
+    }
+
+    if (version != 1 && version != FRAME_VERSION) {
+        locked_cout() << "Unsupported protocol version requested. Terminating connection..." << endl;
+        return -1;
+    }
+
+    if (send_response(conn, "OK proto " + to_string(version) + "\n") < 0) {
+        perror("my_send");
+        return -1;
+    }
+
+    conn.proto = version;
+    return 0;
+}
+
+static int dispatch_command(client_conn &conn, char *orig_cmd)
+{
+    using namespace std;
+
+    vector<string> cmd = parse_command(orig_cmd);
+    if (cmd.size() == 0) {
+        return 0;
+    }
+
+    if (cmd[0] == "send") {
+        join_workers(conn);
+        return receive_file(conn, cmd, orig_cmd);
+    }
+    else if (cmd[0] == "psend") {
+        return receive_pipelined(conn, cmd, orig_cmd);
+    }
+    else if (cmd[0] == "sig") {
+        join_workers(conn);
+        return send_signatures(conn, cmd, orig_cmd);
+    }
+    else if (cmd[0] == "delta") {
+        join_workers(conn);
+        return receive_delta(conn, cmd, orig_cmd);
+    }
+    else if (cmd[0] == "archive") {
+        join_workers(conn);
+        return receive_archive(conn, cmd, orig_cmd);
+    }
+    else if (cmd[0] == "stripe") {
+        join_workers(conn);
+        return receive_stripe(conn, cmd, orig_cmd);
+    }
+    else if (cmd[0] == "resume") {
+        join_workers(conn);
+        return send_resume_offset(conn, cmd, orig_cmd);
+    }
+    else if (cmd[0] == "usend") {
+        join_workers(conn);
+        return receive_resumable(conn, cmd, orig_cmd);
+    }
+    else if (cmd[0] == "stats") {
+        return send_stats(conn);
+    }
+    else if (cmd[0] == "get") {
+        join_workers(conn);
+        return send_encoded(conn, orig_cmd);
+    }
+    else if (cmd[0] == "range") {
+        join_workers(conn);
+        return send_range(conn, cmd, orig_cmd);
+    }
+    else if (cmd[0] == "trace") {
+        return send_trace(conn);
+    }
+    else if (cmd[0] == "proto" && conn.proto == 1) {
+        join_workers(conn);
+        return negotiate_protocol(conn, cmd);
+    }
+
+    locked_cout() << "Invalid command received. Terminating connection..." << endl;
+    return -1;
+}
+
+static int dispatch_frame(client_conn &conn, struct my_frame &frame)
+{
+    using namespace std;
+
+    // Copy name out of receive buffer before payload is read into it
+    char name[FRAME_MAX_NAME + 1];
+    memcpy(name, frame.name, frame.name_len);
+    name[frame.name_len] = '\0';
+    my_frame_done(&frame);
+
+    if (frame.length > static_cast<uint64_t>(LLONG_MAX)) {
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+    long long filesize = static_cast<long long>(frame.length);
+
+    switch (frame.type) {
+    case FRAME_SEND:
+        join_workers(conn);
+        return store_file(conn, name, filesize, true);
+
+    case FRAME_PSEND:
+        return store_pipelined(conn, to_string(frame.id), name, filesize, true);
+
+    case FRAME_TEXT:
+        // Legacy commands keep their text replies
+        return dispatch_command(conn, name);
+
+    default:
+        locked_cout() << "Invalid command received. Terminating connection..." << endl;
+        return -1;
+    }
+}
+
+static int serve_client(client_conn &conn)
+{
+    using namespace std;
+
+    int status = 0;
+    bool first = true;
+    while (status == 0) {
+        // Handshake lasts until first command, idle between the others
+        if (!first) {
+            conn.deadline->enter(my_deadline::PHASE_IDLE);
+        }
+        first = false;
+
+        if (conn.proto == FRAME_VERSION) {
+            struct my_frame frame;
+            status = my_recv_frame(conn.fd, &frame);
+            if (status > 0) {
+                // Connection closed by peer.
+                status = 0;
+                break;
+            }
+            else if (status < 0) {
+                locked_cout() << "Invalid frame received. Terminating connection..." << endl;
+                break;
+            }
+
+            conn.deadline->enter(my_deadline::PHASE_BUSY);
+            status = dispatch_frame(conn, frame);
+            continue;
+        }
+
+        char orig_cmd[MAX_CMD];
+        int cmdlen = MAX_CMD;
+        status = my_recv_cmd(conn.fd, orig_cmd, &cmdlen);
+        if (status > 0) {
+            if (cmdlen == 0) {
+                // cmdlen == 0 means connection closed by peer.
+                status = 0;
+                break;
+            }
+            locked_cout() << "Invalid command received. Terminating connection..." << endl;
+            status = -1;
+            break;
+        }
+        else if (status < 0) {
+            perror("my_recv_cmd");
+            break;
+        }
+
+        orig_cmd[cmdlen - 1] = '\0';
+
+        conn.deadline->enter(my_deadline::PHASE_BUSY);
+        status = dispatch_command(conn, orig_cmd);
+    }
+
+    join_workers(conn);
+    return status;
+}
+
+static void serve_connection(int clientfd, struct sockaddr_storage client_addr,
+    my_deadline::connection_deadline *deadline)
+{
+    client_conn conn;
+    conn.fd = clientfd;
+    conn.local = (client_addr.ss_family == AF_UNIX);
+    conn.proto = 1;
+    conn.deadline = deadline;
+
+    // Connections of one host share rate of its address, local ones all of them
+    char host[NI_MAXHOST] = "local";
+    if (!conn.local) {
+        getnameinfo(reinterpret_cast<struct sockaddr *>(&client_addr), sizeof (client_addr), host, sizeof (host), NULL, 0,
+            NI_NUMERICHOST);
+    }
+    my_shaper::flow flow(*traffic_shaper, host);
+    conn.flow = &flow;
+    my_set_progress_hook(my_deadline::progress_hook, deadline);
+
+    my_stats::add(my_stats::CONNECTIONS);
+    my_stats::add_active(1);
+
+    // Options of tuning are of TCP
+    if (!conn.local && my_sockopt::apply(clientfd, server_tuning) != 0) {
+        perror("setsockopt");
+    }
+
+    if (welcome(conn, reinterpret_cast<struct sockaddr &>(client_addr)) == 0) {
+        // Client is not read from until its buffers and a decode fit into
+        // memory budget, and keeps them until it leaves. Waiting for budget
+        // is not the fault of client, so handshake starts over afterwards.
+        deadline->enter(my_deadline::PHASE_BUSY);
+        my_budget::quota quota(*memory_budget, connection_quota, connection_memory, DECODE_MEMORY);
+        conn.quota = &quota;
+        deadline->enter(my_deadline::PHASE_HANDSHAKE);
+
+        if (!quota.is_admitted()) {
+            locked_cout() << "Connection quota does not fit into memory budget." << std::endl;
+            my_stats::add(my_stats::CONNECTIONS_FAILED);
+        }
+        else if (serve_client(conn) < 0) {
+            my_stats::add(my_stats::CONNECTIONS_FAILED);
+        }
+    }
+
+    my_stats::add_active(-1);
+
+    // Descriptor must not be shut down once it may be reused
+    my_set_progress_hook(NULL, NULL);
+    connection_reaper->disarm(*deadline);
+    if (deadline->expired()) {
+        locked_cout() << "Connection timed out in " << my_deadline::phase_name(deadline->current()) << "." << std::endl;
+    }
+    delete deadline;
+
+    close(clientfd);
+    my_clean_buf(); // See my_send_recv.h
+    locked_cout() << "Connection terminated." << std::endl;
+}